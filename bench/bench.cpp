@@ -0,0 +1,666 @@
+#include "bench.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <iomanip>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+BenchOptions::BenchOptions()                          = default;
+BenchOptions::BenchOptions(const BenchOptions& other) = default;
+BenchOptions::BenchOptions(BenchOptions&& other)      = default;
+BenchOptions::~BenchOptions()                         = default;
+
+BenchOptions& BenchOptions::operator=(const BenchOptions& other) = default;
+BenchOptions& BenchOptions::operator=(BenchOptions&& other)      = default;
+
+
+BenchOptions GetDefaultBenchOptions() {
+    BenchOptions options = {};
+    options.n_warmup    = 1;
+    options.min_reps    = 3;
+    options.max_reps    = 11;
+    options.max_seconds = 5.0;
+
+    options.max_regression = 0.1;
+
+    return options;
+}
+
+
+bool ParseBenchArgs(int argc, char** argv, BenchOptions* options) {
+    assert(options);
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << argv[i] << "\n";
+            return false;
+        }
+
+        const char* flag  = argv[i];
+        const char* value = argv[++i];
+
+        if (strcmp(flag, "--reps") == 0) {
+            options->min_reps = std::max(1ul, std::stoul(value));
+            options->max_reps = options->min_reps;
+        } else if (strcmp(flag, "--max-time") == 0) {
+            options->max_seconds = std::stod(value);
+        } else if (strcmp(flag, "--warmup") == 0) {
+            options->n_warmup = std::stoul(value);
+        } else if (strcmp(flag, "--json") == 0) {
+            options->json_file = value;
+        } else if (strcmp(flag, "--filter") == 0) {
+            options->filter = value;
+        } else if (strcmp(flag, "--baseline") == 0) {
+            options->baseline_file = value;
+        } else if (strcmp(flag, "--max-regression") == 0) {
+            options->max_regression = std::stod(value);
+        } else {
+            std::cerr << "Unknown flag " << flag << "\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+std::vector<double> BenchTime(const std::function<void()>& func, const BenchOptions& options) {
+    for (std::size_t i = 0; i < options.n_warmup; i++) {
+        func();
+    }
+
+    std::vector<double> times;
+    double total = 0.0;
+
+    while (times.size() < options.max_reps &&
+           (times.size() < options.min_reps || total < options.max_seconds)) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto end   = std::chrono::steady_clock::now();
+
+        double time = std::chrono::duration<double>(end - start).count();
+        times.push_back(time);
+        total += time;
+    }
+
+    std::sort(times.begin(), times.end());
+    return times;
+}
+
+
+double GetMedian(const std::vector<double>& sorted) {
+    return GetPercentile(sorted, 50.0);
+}
+
+
+// Linear interpolation between the closest ranks.
+double GetPercentile(const std::vector<double>& sorted, double percentile) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+
+    double      rank  = percentile / 100.0 * static_cast<double>(sorted.size() - 1);
+    std::size_t lower = static_cast<std::size_t>(std::floor(rank));
+    std::size_t upper = std::min(lower + 1, sorted.size() - 1);
+    double      frac  = rank - static_cast<double>(lower);
+
+    return sorted[lower] + (sorted[upper] - sorted[lower]) * frac;
+}
+
+
+std::size_t GetPeakRss() {
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024; // Linux reports KiB
+}
+
+
+static bool WriteAll(int fd, const void* data, std::size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n_written = write(fd, bytes, size);
+        if (n_written <= 0) {
+            return false;
+        }
+        bytes += n_written;
+        size  -= static_cast<std::size_t>(n_written);
+    }
+
+    return true;
+}
+
+
+// The child sends the values over a pipe and leaves with _exit(), so that
+// nothing buffered before the fork is flushed twice.
+bool RunInChild(const std::function<std::vector<double>()>& func,
+                std::vector<double>* values, std::size_t* peak_rss) {
+    assert(values);
+    assert(peak_rss);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        std::cerr << "Can't create a pipe: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Can't fork: " << strerror(errno) << "\n";
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+
+        std::vector<double> results = func();
+        bool ok = WriteAll(fds[1], results.data(), results.size() * sizeof(double));
+
+        fflush(stdout);
+        fflush(stderr);
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+
+    std::string bytes;
+    char        buffer[4096];
+    ssize_t     n_read = 0;
+    while ((n_read = read(fds[0], buffer, sizeof(buffer))) != 0) {
+        if (n_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        bytes.append(buffer, static_cast<std::size_t>(n_read));
+    }
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage = {};
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            std::cerr << "Can't wait for the child: " << strerror(errno) << "\n";
+            return false;
+        }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || n_read < 0 ||
+        bytes.size() % sizeof(double) != 0) {
+        std::cerr << "The benchmark child failed\n";
+        return false;
+    }
+
+    values->resize(bytes.size() / sizeof(double));
+    memcpy(values->data(), bytes.data(), bytes.size());
+
+    *peak_rss = static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+    return true;
+}
+
+//================================== JsonValue =================================
+
+JsonValue::JsonValue()                       = default;
+JsonValue::JsonValue(const JsonValue& other) = default;
+JsonValue::JsonValue(JsonValue&& other)      = default;
+JsonValue::~JsonValue()                      = default;
+
+JsonValue& JsonValue::operator=(const JsonValue& other) = default;
+JsonValue& JsonValue::operator=(JsonValue&& other)      = default;
+
+
+const JsonValue* JsonValue::Find(const char* key) const {
+    assert(key);
+
+    for (const auto& item : object) {
+        if (item.first == key) {
+            return &item.second;
+        }
+    }
+
+    return nullptr;
+}
+
+
+static void SkipJsonSpaces(const std::string& text, std::size_t* pos) {
+    while (*pos < text.size() && isspace(static_cast<unsigned char>(text[*pos]))) {
+        (*pos)++;
+    }
+}
+
+
+// Escapes are kept as far as our writer produces them: \uXXXX only for
+// control characters, so it is decoded to a single byte.
+static bool ParseJsonString(const std::string& text, std::size_t* pos, std::string* str) {
+    if (text[*pos] != '"') {
+        return false;
+    }
+    (*pos)++;
+
+    str->clear();
+    while (*pos < text.size() && text[*pos] != '"') {
+        char c = text[(*pos)++];
+        if (c != '\\') {
+            str->push_back(c);
+            continue;
+        }
+
+        if (*pos >= text.size()) {
+            return false;
+        }
+
+        char escaped = text[(*pos)++];
+        switch (escaped) {
+            case 'n': str->push_back('\n'); break;
+            case 't': str->push_back('\t'); break;
+            case 'r': str->push_back('\r'); break;
+            case 'b': str->push_back('\b'); break;
+            case 'f': str->push_back('\f'); break;
+            case 'u':
+                if (*pos + 4 > text.size()) {
+                    return false;
+                }
+                str->push_back(static_cast<char>(std::stoul(text.substr(*pos, 4), nullptr, 16)));
+                *pos += 4;
+                break;
+            default:  str->push_back(escaped); break;
+        }
+    }
+
+    if (*pos >= text.size()) {
+        return false;
+    }
+    (*pos)++;
+
+    return true;
+}
+
+
+static bool ParseJsonValue(const std::string& text, std::size_t* pos, JsonValue* value) {
+    SkipJsonSpaces(text, pos);
+    if (*pos >= text.size()) {
+        return false;
+    }
+
+    char c = text[*pos];
+
+    if (c == '{') {
+        value->type = JsonValue::Type::Object;
+        (*pos)++;
+
+        SkipJsonSpaces(text, pos);
+        if (*pos < text.size() && text[*pos] == '}') {
+            (*pos)++;
+            return true;
+        }
+
+        while (true) {
+            std::pair<std::string, JsonValue> item;
+
+            SkipJsonSpaces(text, pos);
+            if (*pos >= text.size() || !ParseJsonString(text, pos, &item.first)) {
+                return false;
+            }
+
+            SkipJsonSpaces(text, pos);
+            if (*pos >= text.size() || text[*pos] != ':') {
+                return false;
+            }
+            (*pos)++;
+
+            if (!ParseJsonValue(text, pos, &item.second)) {
+                return false;
+            }
+            value->object.push_back(std::move(item));
+
+            SkipJsonSpaces(text, pos);
+            if (*pos < text.size() && text[*pos] == ',') {
+                (*pos)++;
+                continue;
+            }
+            if (*pos < text.size() && text[*pos] == '}') {
+                (*pos)++;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    if (c == '[') {
+        value->type = JsonValue::Type::Array;
+        (*pos)++;
+
+        SkipJsonSpaces(text, pos);
+        if (*pos < text.size() && text[*pos] == ']') {
+            (*pos)++;
+            return true;
+        }
+
+        while (true) {
+            JsonValue item;
+            if (!ParseJsonValue(text, pos, &item)) {
+                return false;
+            }
+            value->array.push_back(std::move(item));
+
+            SkipJsonSpaces(text, pos);
+            if (*pos < text.size() && text[*pos] == ',') {
+                (*pos)++;
+                continue;
+            }
+            if (*pos < text.size() && text[*pos] == ']') {
+                (*pos)++;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    if (c == '"') {
+        value->type = JsonValue::Type::String;
+        return ParseJsonString(text, pos, &value->string);
+    }
+
+    if (text.compare(*pos, 4, "true") == 0) {
+        value->type    = JsonValue::Type::Bool;
+        value->boolean = true;
+        *pos += 4;
+        return true;
+    }
+    if (text.compare(*pos, 5, "false") == 0) {
+        value->type    = JsonValue::Type::Bool;
+        value->boolean = false;
+        *pos += 5;
+        return true;
+    }
+    if (text.compare(*pos, 4, "null") == 0) {
+        value->type = JsonValue::Type::Null;
+        *pos += 4;
+        return true;
+    }
+
+    const char* begin = text.c_str() + *pos;
+    char*       end   = nullptr;
+    value->type   = JsonValue::Type::Number;
+    value->number = strtod(begin, &end);
+    if (end == begin) {
+        return false;
+    }
+    *pos += static_cast<std::size_t>(end - begin);
+
+    return true;
+}
+
+
+bool ParseJson(const std::string& text, JsonValue* value) {
+    assert(value);
+
+    *value = JsonValue();
+
+    std::size_t pos = 0;
+    if (!ParseJsonValue(text, &pos, value)) {
+        return false;
+    }
+
+    SkipJsonSpaces(text, &pos);
+    return pos == text.size();
+}
+
+//============================== Baseline compare ==============================
+
+static const JsonValue* FindResult(const JsonValue& report, const std::string& name) {
+    const JsonValue* results = report.Find("results");
+    if (!results) {
+        return nullptr;
+    }
+
+    for (const JsonValue& result : results->array) {
+        const JsonValue* result_name = result.Find("name");
+        if (result_name && result_name->string == name) {
+            return &result;
+        }
+    }
+
+    return nullptr;
+}
+
+
+bool CompareWithBaseline(const JsonValue& report, const JsonValue& baseline,
+                         const std::vector<BenchMetric>& metrics, double max_regression) {
+    const JsonValue* results = report.Find("results");
+    if (!results) {
+        return true;
+    }
+
+    bool passed = true;
+
+    printf("\n%-40s %-18s %14s %14s %9s\n", "name", "metric", "baseline", "current", "change");
+
+    for (const JsonValue& result : results->array) {
+        const JsonValue* name = result.Find("name");
+        if (!name) {
+            continue;
+        }
+
+        const JsonValue* base_result = FindResult(baseline, name->string);
+        if (!base_result) {
+            printf("%-40s (not in baseline)\n", name->string.c_str());
+            continue;
+        }
+
+        for (const BenchMetric& metric : metrics) {
+            const JsonValue* current = result.Find(metric.key);
+            const JsonValue* base    = base_result->Find(metric.key);
+            if (!current || !base || current->type != JsonValue::Type::Number ||
+                                     base   ->type != JsonValue::Type::Number ||
+                                     !(base->number > 0.0)) {
+                continue;
+            }
+
+            // Positive change is always an improvement.
+            double change = (current->number - base->number) / base->number;
+            if (!metric.higher_is_better) {
+                change = -change;
+            }
+
+            bool regressed = change < -max_regression;
+            passed = passed && !regressed;
+
+            printf("%-40s %-18s %14.4g %14.4g %+8.1f%%%s\n", name->string.c_str(), metric.key,
+                   base->number, current->number, change * 100.0, regressed ? "  REGRESSION" : "");
+        }
+    }
+
+    return passed;
+}
+
+
+int FinishReport(const std::string& report, const BenchOptions& options,
+                 const std::vector<BenchMetric>& metrics) {
+    if (!options.json_file.empty()) {
+        std::ofstream out(options.json_file);
+        if (!out) {
+            std::cerr << "Can't open " << options.json_file << "\n";
+            return 1;
+        }
+        out << report;
+    }
+
+    if (options.baseline_file.empty()) {
+        return 0;
+    }
+
+    std::ifstream in(options.baseline_file);
+    if (!in) {
+        std::cerr << "Can't open baseline " << options.baseline_file << "\n";
+        return 1;
+    }
+    std::stringstream baseline_text;
+    baseline_text << in.rdbuf();
+
+    JsonValue current;
+    JsonValue baseline;
+    if (!ParseJson(report, &current) || !ParseJson(baseline_text.str(), &baseline)) {
+        std::cerr << "Can't parse " << options.baseline_file << "\n";
+        return 1;
+    }
+
+    if (!CompareWithBaseline(current, baseline, metrics, options.max_regression)) {
+        std::cerr << "Regressed by more than " << options.max_regression * 100.0
+                  << "% against " << options.baseline_file << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+//================================= JsonWriter =================================
+
+JsonWriter::JsonWriter(std::ostream& out)
+    : out_      (out),
+      after_key_(false) {}
+
+
+JsonWriter::~JsonWriter() {
+    assert(has_items_.empty());
+    out_ << "\n";
+}
+
+
+void JsonWriter::BeginItem_() {
+    if (after_key_) {
+        after_key_ = false;
+        return;
+    }
+
+    if (!has_items_.empty()) {
+        if (has_items_.back()) {
+            out_ << ",";
+        }
+        has_items_.back() = true;
+        out_ << "\n" << std::string(2 * has_items_.size(), ' ');
+    }
+}
+
+
+void JsonWriter::BeginObject() {
+    BeginItem_();
+    out_ << "{";
+    has_items_.push_back(false);
+}
+
+
+void JsonWriter::EndObject() {
+    assert(!has_items_.empty());
+
+    bool had_items = has_items_.back();
+    has_items_.pop_back();
+    if (had_items) {
+        out_ << "\n" << std::string(2 * has_items_.size(), ' ');
+    }
+    out_ << "}";
+}
+
+
+void JsonWriter::BeginArray() {
+    BeginItem_();
+    out_ << "[";
+    has_items_.push_back(false);
+}
+
+
+void JsonWriter::EndArray() {
+    assert(!has_items_.empty());
+
+    bool had_items = has_items_.back();
+    has_items_.pop_back();
+    if (had_items) {
+        out_ << "\n" << std::string(2 * has_items_.size(), ' ');
+    }
+    out_ << "]";
+}
+
+
+void JsonWriter::Key(const char* key) {
+    BeginItem_();
+    WriteString_(key);
+    out_ << ": ";
+    after_key_ = true;
+}
+
+
+void JsonWriter::Value(const char* value) {
+    BeginItem_();
+    WriteString_(value);
+}
+
+
+void JsonWriter::Value(const std::string& value) {
+    Value(value.c_str());
+}
+
+
+void JsonWriter::Value(double value) {
+    BeginItem_();
+
+    if (std::isfinite(value)) {
+        out_ << std::setprecision(9) << value;
+    } else {
+        out_ << "null";
+    }
+}
+
+
+void JsonWriter::Value(std::size_t value) {
+    BeginItem_();
+    out_ << value;
+}
+
+
+void JsonWriter::Value(bool value) {
+    BeginItem_();
+    out_ << (value ? "true" : "false");
+}
+
+
+void JsonWriter::WriteString_(const char* str) {
+    out_ << '"';
+    for (; *str; str++) {
+        unsigned char c = static_cast<unsigned char>(*str);
+
+        switch (c) {
+            case '"':  out_ << "\\\""; break;
+            case '\\': out_ << "\\\\"; break;
+            case '\n': out_ << "\\n";  break;
+            case '\t': out_ << "\\t";  break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8] = {};
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out_ << escaped;
+                } else {
+                    out_ << static_cast<char>(c);
+                }
+                break;
+        }
+    }
+    out_ << '"';
+}
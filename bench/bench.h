@@ -0,0 +1,139 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Shared pieces of the benchmark drivers: timing loop, order statistics and
+// a minimal JSON writer for the machine-readable reports.
+
+// The special members of this and of JsonValue are defined in bench.cpp:
+// inline they are too big for -Winline.
+struct BenchOptions {
+    std::size_t n_warmup    = 0; // Untimed runs before measuring
+    std::size_t min_reps    = 0; // Timed runs that are always done...
+    std::size_t max_reps    = 0; // ...and the most done while under max_seconds
+    double      max_seconds = 0.0;
+
+    std::string json_file;
+    std::string filter;
+    std::string baseline_file;
+    double      max_regression = 0.0; // Allowed slowdown against the baseline, 0.1 is 10%
+
+    BenchOptions();
+    BenchOptions(const BenchOptions& other);
+    BenchOptions(BenchOptions&& other);
+    ~BenchOptions();
+
+    BenchOptions& operator=(const BenchOptions& other);
+    BenchOptions& operator=(BenchOptions&& other);
+};
+
+BenchOptions GetDefaultBenchOptions();
+
+// Parses the flags shared by all drivers: --reps N, --max-time SECONDS,
+// --warmup N, --json FILE, --filter SUBSTRING, --baseline FILE and
+// --max-regression FRACTION. Anything else is an error.
+bool ParseBenchArgs(int argc, char** argv, BenchOptions* options);
+
+// Seconds per run, sorted ascending.
+std::vector<double> BenchTime(const std::function<void()>& func, const BenchOptions& options);
+
+double GetMedian    (const std::vector<double>& sorted);
+double GetPercentile(const std::vector<double>& sorted, double percentile);
+
+// Peak resident set size of this process, in bytes.
+std::size_t GetPeakRss();
+
+// Runs func in a forked child and hands back the values it returned, along
+// with the child's own peak RSS: GetPeakRss() would report the largest of
+// everything this process ran so far. Fork before anything starts threads
+// (e.g. the shared pool), the child only has the calling one. Fails if the
+// child does not exit normally.
+bool RunInChild(const std::function<std::vector<double>()>& func,
+                std::vector<double>* values, std::size_t* peak_rss);
+
+// Parsed JSON document, only what reading back our own reports needs.
+struct JsonValue {
+    enum class Type {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object,
+    };
+
+    Type                                           type    = Type::Null;
+    bool                                           boolean = false;
+    double                                         number  = 0.0;
+    std::string                                    string;
+    std::vector<JsonValue>                         array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    JsonValue();
+    JsonValue(const JsonValue& other);
+    JsonValue(JsonValue&& other);
+    ~JsonValue();
+
+    JsonValue& operator=(const JsonValue& other);
+    JsonValue& operator=(JsonValue&& other);
+
+    // nullptr if this is not an object or has no such key.
+    const JsonValue* Find(const char* key) const;
+};
+
+bool ParseJson(const std::string& text, JsonValue* value);
+
+struct BenchMetric {
+    const char* key;
+    bool        higher_is_better;
+};
+
+// Reports have a "results" array of objects, each with a unique "name".
+// Every metric of every result is checked against the same-named result of
+// the baseline; prints the comparison and returns false if any got worse by
+// more than max_regression. Results missing from the baseline are skipped.
+bool CompareWithBaseline(const JsonValue& report, const JsonValue& baseline,
+                         const std::vector<BenchMetric>& metrics, double max_regression);
+
+// Saves the report to options.json_file and compares it with
+// options.baseline_file, whichever are set. Returns the exit code.
+int FinishReport(const std::string& report, const BenchOptions& options,
+                 const std::vector<BenchMetric>& metrics);
+
+class JsonWriter {
+    public:
+        explicit JsonWriter(std::ostream& out);
+        ~JsonWriter();
+
+        JsonWriter(const JsonWriter& other)            = delete;
+        JsonWriter& operator=(const JsonWriter& other) = delete;
+
+        void BeginObject();
+        void EndObject();
+        void BeginArray();
+        void EndArray();
+
+        void Key(const char* key);
+
+        void Value(const char*        value);
+        void Value(const std::string& value);
+        void Value(double             value);
+        void Value(std::size_t        value);
+        void Value(bool               value);
+
+    private:
+        std::ostream&     out_;
+        std::vector<bool> has_items_; // Per open scope: comma needed before the next item
+        bool              after_key_;
+
+        void BeginItem_();
+        void WriteString_(const char* str);
+};
+
+#endif // BENCH_H_
@@ -0,0 +1,211 @@
+#include "bench.h"
+#include "../chubarov_lib/chubarov.h"
+
+#include <cstdio>
+#include <sstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef CHUBAROV_BACKEND
+#define CHUBAROV_BACKEND "unknown"
+#endif
+
+// Sweeps the chubarov kernels over the shapes the network runs them on.
+//
+// Shapes use the SmartMatrix::Mul notation: (N x L) * (L x M) = (N x M).
+// Bytes count one read of every input and one write of the output (a read
+// and a write for the accumulated gradients), i.e. the least traffic the
+// kernel can do, so GB/s is comparable to the machine's memory bandwidth.
+
+struct KernelShape {
+    const char* name;
+    std::size_t N;
+    std::size_t L;
+    std::size_t M;
+};
+
+static const KernelShape kShapes[] = {
+    {"mnist_layer1_full",    60000, 784,   16},
+    {"mnist_layer1_single",      1, 784,   16},
+    {"mnist_layer1_batch",     256, 784,   16},
+    {"mnist_hidden_full",    60000,  16,   16},
+    {"mnist_output_full",    60000,  16,   10},
+    {"square_1024",            256, 1024, 1024},
+};
+
+enum class Kernel {
+    Mul,
+    EvalGradLMul,
+    EvalGradRMul,
+};
+
+// Special members out of line, see BenchOptions.
+struct KernelResult {
+    std::string         kernel;
+    KernelShape         shape = {};
+    std::vector<double> times;
+    double              flops = 0.0;
+    double              bytes = 0.0;
+
+    KernelResult();
+    KernelResult(const KernelResult& other);
+    KernelResult(KernelResult&& other);
+    ~KernelResult();
+
+    KernelResult& operator=(const KernelResult& other);
+    KernelResult& operator=(KernelResult&& other);
+};
+
+KernelResult::KernelResult()                          = default;
+KernelResult::KernelResult(const KernelResult& other) = default;
+KernelResult::KernelResult(KernelResult&& other)      = default;
+KernelResult::~KernelResult()                         = default;
+
+KernelResult& KernelResult::operator=(const KernelResult& other) = default;
+KernelResult& KernelResult::operator=(KernelResult&& other)      = default;
+
+static const char* GetKernelName(Kernel kernel) {
+    switch (kernel) {
+        case Kernel::Mul:          return "Chubarov_Mul";
+        case Kernel::EvalGradLMul: return "Chubarov_EvalGradLMul";
+        case Kernel::EvalGradRMul: return "Chubarov_EvalGradRMul";
+        default:                   return "?";
+    }
+}
+
+
+static double GetKernelBytes(Kernel kernel, const KernelShape& shape) {
+    double NL = static_cast<double>(shape.N * shape.L);
+    double LM = static_cast<double>(shape.L * shape.M);
+    double NM = static_cast<double>(shape.N * shape.M);
+
+    switch (kernel) {
+        case Kernel::Mul:          return (NL + LM + NM)     * sizeof(float);
+        case Kernel::EvalGradLMul: return (2 * NL + LM + NM) * sizeof(float);
+        case Kernel::EvalGradRMul: return (NL + 2 * LM + NM) * sizeof(float);
+        default:                   return 0.0;
+    }
+}
+
+
+static KernelResult RunKernel(Kernel kernel, const KernelShape& shape, const BenchOptions& options) {
+    const std::size_t N = shape.N;
+    const std::size_t L = shape.L;
+    const std::size_t M = shape.M;
+
+    std::mt19937 gen(42);
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    auto fill = [&](std::vector<float>* data) {
+        for (float& value : *data) {
+            value = dis(gen);
+        }
+    };
+
+    // Buffers named after SmartMatrix::Mul's operands and their gradients.
+    std::vector<float> first (N * L);
+    std::vector<float> second(L * M);
+    std::vector<float> output(N * M);
+    fill(&first);
+    fill(&second);
+    fill(&output);
+
+    std::function<void()> func;
+    switch (kernel) {
+        case Kernel::Mul:
+            func = [&] { Chubarov_Mul(N, M, L, output.data(), first.data(), second.data()); };
+            break;
+        case Kernel::EvalGradLMul:
+            func = [&] { Chubarov_EvalGradLMul(N, M, L, first.data(), second.data(), output.data()); };
+            break;
+        case Kernel::EvalGradRMul:
+            func = [&] { Chubarov_EvalGradRMul(N, M, L, second.data(), first.data(), output.data()); };
+            break;
+        default:
+            break;
+    }
+
+    KernelResult result = {};
+    result.kernel = GetKernelName(kernel);
+    result.shape  = shape;
+    result.times  = BenchTime(func, options);
+    result.flops  = 2.0 * static_cast<double>(N) * static_cast<double>(L) * static_cast<double>(M);
+    result.bytes  = GetKernelBytes(kernel, shape);
+
+    return result;
+}
+
+
+static std::string GetResultName(const KernelResult& result) {
+    return result.kernel + "/" + result.shape.name;
+}
+
+
+static void WriteJson(std::ostream& out, const std::vector<KernelResult>& results) {
+    JsonWriter json(out);
+
+    json.BeginObject();
+    json.Key("benchmark"); json.Value("chubarov_kernels");
+    json.Key("backend");   json.Value(CHUBAROV_BACKEND);
+    json.Key("results");
+    json.BeginArray();
+
+    for (const KernelResult& result : results) {
+        double median = GetMedian(result.times);
+
+        json.BeginObject();
+        json.Key("name");      json.Value(GetResultName(result));
+        json.Key("kernel");    json.Value(result.kernel);
+        json.Key("shape");     json.Value(result.shape.name);
+        json.Key("N");         json.Value(result.shape.N);
+        json.Key("L");         json.Value(result.shape.L);
+        json.Key("M");         json.Value(result.shape.M);
+        json.Key("reps");      json.Value(result.times.size());
+        json.Key("median_ms"); json.Value(median * 1e3);
+        json.Key("min_ms");    json.Value(result.times.front() * 1e3);
+        json.Key("max_ms");    json.Value(result.times.back()  * 1e3);
+        json.Key("gflops");    json.Value(result.flops / median * 1e-9);
+        json.Key("gbps");      json.Value(result.bytes / median * 1e-9);
+        json.EndObject();
+    }
+
+    json.EndArray();
+    json.EndObject();
+}
+
+
+int main(int argc, char** argv) {
+    BenchOptions options = GetDefaultBenchOptions();
+    if (!ParseBenchArgs(argc, argv, &options)) {
+        return 1;
+    }
+
+    const Kernel kKernels[] = {Kernel::Mul, Kernel::EvalGradLMul, Kernel::EvalGradRMul};
+
+    printf("%-22s %-20s %12s %10s %10s\n", "kernel", "shape", "median, ms", "GFLOP/s", "GB/s");
+
+    std::vector<KernelResult> results;
+    for (Kernel kernel : kKernels) {
+        for (const KernelShape& shape : kShapes) {
+            std::string name = std::string(GetKernelName(kernel)) + "/" + shape.name;
+            if (name.find(options.filter) == std::string::npos) {
+                continue;
+            }
+
+            KernelResult result = RunKernel(kernel, shape, options);
+            double median = GetMedian(result.times);
+
+            printf("%-22s %-20s %12.3f %10.2f %10.2f\n", result.kernel.c_str(), shape.name,
+                   median * 1e3, result.flops / median * 1e-9, result.bytes / median * 1e-9);
+            fflush(stdout);
+
+            results.push_back(result);
+        }
+    }
+
+    std::ostringstream report;
+    WriteJson(report, results);
+
+    return FinishReport(report.str(), options, {{"median_ms", false}});
+}
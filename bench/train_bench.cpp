@@ -0,0 +1,587 @@
+#include "bench.h"
+#include "../mnist/mnist.h"
+#include "../include/MLP.h"
+#include "../include/optimizer.h"
+#include "../include/static_mlp.h"
+#include "../include/inference.h"
+#include "../include/inference_cache.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// End-to-end numbers of the Mnist pipeline: training steps over the whole
+// dataset (the pipeline trains full-batch) and forward-only inference at
+// several batch sizes. Each training scenario runs in a child process for
+// its own peak RSS; its epoch time is projected from the step rate. Runs
+// on a synthetic IDX dataset written to a temporary directory, so no
+// download is needed. Batch-1 inference is also
+// timed on StaticMLP, loaded from a checkpoint of the layers, on several
+// threads sharing one InferenceModel, incrementally, a few pixels changed
+// at a time, and as a repeated request answered by an InferenceCache.
+
+const std::size_t kImageRows    = 28;
+const std::size_t kImageCols    = 28;
+const std::size_t kImageSize    = kImageRows * kImageCols;
+const std::size_t kClasses      = 10;
+const std::size_t kHiddenLayers = 2;
+const std::size_t kMnistEpoch   = 60000; // Examples in the real training set
+
+struct TrainScenario {
+    std::size_t n_examples;
+    std::size_t n_hidden_neurons;
+};
+
+struct InferScenario {
+    std::size_t batch;
+    std::size_t n_hidden_neurons;
+};
+
+static const TrainScenario kTrainScenarios[] = {
+    { 1000, 16},
+    { 1000, 64},
+    {10000, 16},
+    {10000, 64},
+};
+
+const std::size_t kSharedInferRequests = 256; // Forward passes per thread and run
+
+static const std::size_t kSharedInferThreads[] = {1, 2, 4, 8};
+
+static const std::size_t kIncrementalChangedPixels[] = {1, 8, 64};
+
+static const InferScenario kInferScenarios[] = {
+    {   1, 16},
+    {  64, 16},
+    {1000, 16},
+    {   1, 64},
+    {  64, 64},
+    {1000, 64},
+};
+
+static void WriteBigEndian(FILE* file, uint32_t value) {
+    fputc(static_cast<int>((value >> 24) & 0xff), file);
+    fputc(static_cast<int>((value >> 16) & 0xff), file);
+    fputc(static_cast<int>((value >>  8) & 0xff), file);
+    fputc(static_cast<int>((value >>  0) & 0xff), file);
+}
+
+
+// Pixels are noise around a per-class pattern, so that training has
+// something to learn and the loss moves like on real digits.
+static bool WriteSyntheticIdx(const std::string& images_path, const std::string& labels_path,
+                              std::size_t n_examples, std::vector<uint8_t>* images) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> noise(0, 63);
+
+    std::vector<uint8_t> labels(n_examples);
+    images->resize(n_examples * kImageSize);
+
+    for (std::size_t example = 0; example < n_examples; example++) {
+        labels[example] = static_cast<uint8_t>(gen() % kClasses);
+
+        for (std::size_t pixel = 0; pixel < kImageSize; pixel++) {
+            bool lit = (pixel * 7 + labels[example] * 13) % 29 < 6;
+            (*images)[example * kImageSize + pixel] = static_cast<uint8_t>((lit ? 192 : 0) + noise(gen));
+        }
+    }
+
+    FILE* images_file = fopen(images_path.c_str(), "wb");
+    FILE* labels_file = fopen(labels_path.c_str(), "wb");
+    if (!images_file || !labels_file) {
+        if (images_file) fclose(images_file);
+        if (labels_file) fclose(labels_file);
+        return false;
+    }
+
+    WriteBigEndian(images_file, 2051);
+    WriteBigEndian(images_file, static_cast<uint32_t>(n_examples));
+    WriteBigEndian(images_file, kImageRows);
+    WriteBigEndian(images_file, kImageCols);
+    fwrite(images->data(), 1, images->size(), images_file);
+
+    WriteBigEndian(labels_file, 2049);
+    WriteBigEndian(labels_file, static_cast<uint32_t>(n_examples));
+    fwrite(labels.data(), 1, labels.size(), labels_file);
+
+    bool ok = !ferror(images_file) && !ferror(labels_file);
+    ok = (fclose(images_file) == 0) && ok;
+    ok = (fclose(labels_file) == 0) && ok;
+
+    return ok;
+}
+
+
+static void WriteTimes(JsonWriter* json, const std::vector<double>& times) {
+    json->Key("reps");   json->Value(times.size());
+    json->Key("p50_ms"); json->Value(GetMedian(times) * 1e3);
+    json->Key("p99_ms"); json->Value(GetPercentile(times, 99.0) * 1e3);
+    json->Key("min_ms"); json->Value(times.front() * 1e3);
+}
+
+
+static bool RunTrainScenario(const TrainScenario& scenario, const std::string& dir,
+                             const BenchOptions& options, JsonWriter* json) {
+    std::string name = "train/n" + std::to_string(scenario.n_examples) +
+                       "/h" + std::to_string(scenario.n_hidden_neurons);
+    if (name.find(options.filter) == std::string::npos) {
+        return true;
+    }
+
+    std::string images_path = dir + "/train-images.idx3-ubyte";
+    std::string labels_path = dir + "/train-labels.idx1-ubyte";
+    std::vector<uint8_t> images;
+    if (!WriteSyntheticIdx(images_path, labels_path, scenario.n_examples, &images)) {
+        std::cerr << "Can't write the synthetic dataset to " << dir << "\n";
+        return false;
+    }
+
+    // Each scenario in its own process, so that the peak RSS is its own.
+    // The child sends back the loss, then the sorted times.
+    std::vector<double> results;
+    std::size_t         peak_rss = 0;
+    bool ok = RunInChild([&] {
+        Mnist mnist(images_path.c_str(), labels_path.c_str(), dir.c_str(),
+                    kHiddenLayers, scenario.n_hidden_neurons);
+
+        Adam optimizer(1e-3f);
+        mnist.AddParamsToOptimizer(&optimizer);
+
+        float loss = 0.0f;
+        std::vector<double> child_times = BenchTime([&] {
+            loss = mnist.Eval();
+            optimizer.Step();
+        }, options);
+
+        child_times.insert(child_times.begin(), static_cast<double>(loss));
+        return child_times;
+    }, &results, &peak_rss);
+
+    if (!ok || results.size() < 2) {
+        std::cerr << name << ": the training run failed\n";
+        return false;
+    }
+
+    float               loss = static_cast<float>(results.front());
+    std::vector<double> times(results.begin() + 1, results.end());
+
+    // Full-batch steps on n_examples, not a timed pass over kMnistEpoch.
+    double median            = GetMedian(times);
+    double examples_per_sec  = static_cast<double>(scenario.n_examples) / median;
+    double projected_epoch_s = static_cast<double>(kMnistEpoch) / examples_per_sec;
+    double peak_rss_mb       = static_cast<double>(peak_rss) / (1024.0 * 1024.0);
+
+    printf("%-24s %10.3f %14.0f %14.2f %10.1f %10.4f\n", name.c_str(), median * 1e3,
+           examples_per_sec, projected_epoch_s, peak_rss_mb, loss);
+    fflush(stdout);
+
+    json->BeginObject();
+    json->Key("name");              json->Value(name);
+    json->Key("kind");              json->Value("train");
+    json->Key("examples");          json->Value(scenario.n_examples);
+    json->Key("hidden_neurons");    json->Value(scenario.n_hidden_neurons);
+    WriteTimes(json, times);
+    json->Key("examples_per_sec");  json->Value(examples_per_sec);
+    json->Key("projected_epoch_s"); json->Value(projected_epoch_s);
+    json->Key("peak_rss_mb");       json->Value(peak_rss_mb);
+    json->Key("loss");              json->Value(static_cast<double>(loss));
+    json->EndObject();
+
+    return true;
+}
+
+
+// The layers of the Mnist pipeline with random parameters, fed the same
+// random images in every scenario. The layers point to each other, so the
+// network stays where it was built.
+struct InferNetwork {
+    InputLayer         input_layer;
+    MiddleLayer        middle_layer1;
+    MiddleLayer        middle_layer2;
+    OutputLayerDiscret output_layer;
+    std::vector<float> images; // batch x kImageSize
+
+    InferNetwork(std::size_t batch, std::size_t n_hidden_neurons);
+    ~InferNetwork();
+
+    InferNetwork(const InferNetwork& other)            = delete;
+    InferNetwork& operator=(const InferNetwork& other) = delete;
+
+    void Eval();
+};
+
+
+InferNetwork::InferNetwork(std::size_t batch, std::size_t n_hidden_neurons)
+    : input_layer  (kImageSize, batch),
+      middle_layer1(&input_layer,   n_hidden_neurons),
+      middle_layer2(&middle_layer1, n_hidden_neurons),
+      output_layer (&middle_layer2, kClasses),
+      images       (batch * kImageSize) {
+
+    middle_layer1.SetNormalRand();
+    middle_layer2.SetNormalRand();
+    output_layer .SetNormalRand();
+
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+    for (std::size_t example = 0; example < batch; example++) {
+        for (std::size_t i = 0; i < kImageSize; i++) {
+            images[example * kImageSize + i] = pixel(gen);
+            input_layer.SetValue(example, i, images[example * kImageSize + i]);
+        }
+    }
+}
+
+
+InferNetwork::~InferNetwork() = default;
+
+
+void InferNetwork::Eval() {
+    middle_layer1.Eval();
+    middle_layer2.Eval();
+    output_layer .Eval();
+}
+
+
+// Latencies need far more samples than the training steps.
+static std::vector<double> BenchLatency(const std::function<void()>& func, const BenchOptions& options) {
+    BenchOptions latency_options = options;
+    latency_options.min_reps = std::max<std::size_t>(options.min_reps, 20);
+    latency_options.max_reps = std::max<std::size_t>(options.max_reps, 2000);
+
+    return BenchTime(func, latency_options);
+}
+
+
+// Prints the row of a scenario timed by BenchLatency() with batch images per
+// run and writes its result. extra_keys writes the keys only it has.
+static void ReportLatency(const std::string& name, std::size_t batch, std::size_t n_hidden_neurons,
+                          const std::vector<double>& times, JsonWriter* json,
+                          const std::function<void()>& extra_keys = nullptr) {
+    double median         = GetMedian(times);
+    double images_per_sec = static_cast<double>(batch) / median;
+
+    printf("%-24s %10.3f %10.3f %14.0f\n", name.c_str(), median * 1e3,
+           GetPercentile(times, 99.0) * 1e3, images_per_sec);
+    fflush(stdout);
+
+    json->BeginObject();
+    json->Key("name");           json->Value(name);
+    json->Key("kind");           json->Value("infer");
+    json->Key("batch");          json->Value(batch);
+    json->Key("hidden_neurons"); json->Value(n_hidden_neurons);
+    if (extra_keys) {
+        extra_keys();
+    }
+    WriteTimes(json, times);
+    json->Key("images_per_sec"); json->Value(images_per_sec);
+    json->EndObject();
+}
+
+
+// The layers the Mnist pipeline is made of, evaluated forward only.
+static void RunInferScenario(const InferScenario& scenario, const BenchOptions& options,
+                             JsonWriter* json) {
+    std::string name = "infer/b" + std::to_string(scenario.batch) +
+                       "/h" + std::to_string(scenario.n_hidden_neurons);
+    if (name.find(options.filter) == std::string::npos) {
+        return;
+    }
+
+    InferNetwork network(scenario.batch, scenario.n_hidden_neurons);
+
+    std::vector<double> times = BenchLatency([&] {
+        network.Eval();
+    }, options);
+
+    ReportLatency(name, scenario.batch, scenario.n_hidden_neurons, times, json);
+}
+
+
+// The StaticMLP of the same shape, with the parameters of a checkpoint the
+// layers wrote. Its outputs are checked against those of the layers.
+template <std::size_t Hidden>
+static bool RunStaticInferScenario(const std::string& dir, const BenchOptions& options,
+                                   JsonWriter* json) {
+    std::string name = "infer_static/b1/h" + std::to_string(Hidden);
+    if (name.find(options.filter) == std::string::npos) {
+        return true;
+    }
+
+    InferNetwork network(1, Hidden);
+
+    std::string checkpoint_name = dir + "/static.ckpt";
+
+    CheckpointWriter writer;
+    network.middle_layer1.SaveParamsToCheckpoint(&writer);
+    network.middle_layer2.SaveParamsToCheckpoint(&writer);
+    network.output_layer .SaveParamsToCheckpoint(&writer);
+    CheckpointError error = writer.Write(checkpoint_name.c_str());
+
+    // Too big for the stack with the wide hidden layers.
+    static StaticMLP<kImageSize, Hidden, Hidden, kClasses> mlp;
+    if (error == CheckpointError::Ok) {
+        error = mlp.LoadCheckpoint(checkpoint_name.c_str());
+    }
+
+    unlink(checkpoint_name.c_str());
+
+    if (error != CheckpointError::Ok) {
+        std::cerr << "Can't load the StaticMLP: " << CheckpointErrorString(error) << "\n";
+        return false;
+    }
+
+    float outputs[kClasses];
+    mlp.Forward(network.images.data(), outputs);
+    network.Eval();
+
+    double max_error = 0.0;
+    for (std::size_t i = 0; i < kClasses; i++) {
+        max_error = std::max(max_error, std::fabs(static_cast<double>(outputs[i]) -
+                                                  network.output_layer.GetNormOutput(0, i)));
+    }
+    if (max_error > 1e-4) {
+        std::cerr << name << ": outputs differ from the layers' by " << max_error << "\n";
+        return false;
+    }
+
+    std::vector<double> times = BenchLatency([&] {
+        mlp.Forward(network.images.data(), outputs);
+    }, options);
+
+    ReportLatency(name, 1, Hidden, times, json);
+    return true;
+}
+
+
+// Batch-1 requests on n_threads threads at once, each with its own
+// InferenceContext on one shared InferenceModel. The outputs must be those
+// of the layers the model was copied from. The latency column is the mean
+// time of a request in the median run.
+static bool RunSharedInferScenario(std::size_t n_threads, std::size_t n_hidden_neurons,
+                                   const BenchOptions& options, JsonWriter* json) {
+    std::string name = "infer_shared/b1/h" + std::to_string(n_hidden_neurons) +
+                       "/t" + std::to_string(n_threads);
+    if (name.find(options.filter) == std::string::npos) {
+        return true;
+    }
+
+    InferNetwork network(1, n_hidden_neurons);
+    network.Eval();
+
+    const InferenceModel model(&network.output_layer);
+
+    std::vector<std::unique_ptr<InferenceContext>> contexts;
+    for (std::size_t thread = 0; thread < n_threads; thread++) {
+        contexts.push_back(std::make_unique<InferenceContext>(&model));
+    }
+
+    std::vector<double> times = BenchTime([&] {
+        std::vector<std::thread> threads;
+        for (std::size_t thread = 0; thread < n_threads; thread++) {
+            threads.emplace_back([&, thread] {
+                for (std::size_t request = 0; request < kSharedInferRequests; request++) {
+                    contexts[thread]->Eval(network.images.data());
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }, options);
+
+    // Same kernels on the same weights: the outputs must match bit for bit.
+    float expected[kClasses];
+    for (std::size_t i = 0; i < kClasses; i++) {
+        expected[i] = network.output_layer.GetNormOutput(0, i);
+    }
+    for (const std::unique_ptr<InferenceContext>& context : contexts) {
+        if (memcmp(context->GetOutputs(), expected, sizeof(expected)) != 0) {
+            std::cerr << name << ": outputs differ from the layers'\n";
+            return false;
+        }
+    }
+
+    double median         = GetMedian(times);
+    double images_per_sec = static_cast<double>(n_threads * kSharedInferRequests) / median;
+
+    printf("%-24s %10.3f %10s %14.0f\n", name.c_str(),
+           median * 1e3 / static_cast<double>(kSharedInferRequests), "", images_per_sec);
+    fflush(stdout);
+
+    json->BeginObject();
+    json->Key("name");           json->Value(name);
+    json->Key("kind");           json->Value("infer");
+    json->Key("batch");          json->Value(static_cast<std::size_t>(1));
+    json->Key("hidden_neurons"); json->Value(n_hidden_neurons);
+    json->Key("threads");        json->Value(n_threads);
+    WriteTimes(json, times);
+    json->Key("images_per_sec"); json->Value(images_per_sec);
+    json->EndObject();
+
+    return true;
+}
+
+
+// IncrementalInference fed n_changed pixels at a time, the way a drawing
+// grows, against a full forward pass of the same image in the end.
+static bool RunIncrementalInferScenario(std::size_t n_changed, std::size_t n_hidden_neurons,
+                                        const BenchOptions& options, JsonWriter* json) {
+    std::string name = "infer_incremental/h" + std::to_string(n_hidden_neurons) +
+                       "/k" + std::to_string(n_changed);
+    if (name.find(options.filter) == std::string::npos) {
+        return true;
+    }
+
+    InferNetwork network(1, n_hidden_neurons);
+
+    const InferenceModel model(&network.output_layer);
+    IncrementalInference session(&model);
+
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<std::size_t> position(0, kImageSize - 1);
+    std::uniform_real_distribution<float>      pixel(0.0f, 1.0f);
+
+    std::vector<std::size_t> indices(n_changed);
+    std::vector<float>       values (n_changed);
+
+    std::vector<double> times = BenchLatency([&] {
+        for (std::size_t k = 0; k < n_changed; k++) {
+            indices[k] = position(gen);
+            values [k] = pixel(gen);
+        }
+        session.Update(indices.data(), values.data(), n_changed);
+    }, options);
+
+    InferenceContext context(&model);
+    context.Eval(session.GetInputs());
+
+    double max_error = 0.0;
+    for (std::size_t i = 0; i < kClasses; i++) {
+        max_error = std::max(max_error, std::fabs(static_cast<double>(session.GetOutput(i)) -
+                                                  context.GetOutput(0, i)));
+    }
+    if (max_error > 1e-4) {
+        std::cerr << name << ": outputs differ from a full pass by " << max_error << "\n";
+        return false;
+    }
+
+    ReportLatency(name, 1, n_hidden_neurons, times, json, [&] {
+        json->Key("changed_pixels"); json->Value(n_changed);
+    });
+    return true;
+}
+
+
+// A repeated batch-1 request: the InferenceCache lookup that replaces its
+// forward pass, hashing and comparing the image included.
+static bool RunCachedInferScenario(std::size_t n_hidden_neurons, const BenchOptions& options,
+                                   JsonWriter* json) {
+    std::string name = "infer_cached/b1/h" + std::to_string(n_hidden_neurons);
+    if (name.find(options.filter) == std::string::npos) {
+        return true;
+    }
+
+    InferNetwork network(1, n_hidden_neurons);
+    const float* image = network.images.data();
+
+    const InferenceModel model(&network.output_layer);
+    InferenceContext     context(&model);
+    InferenceCache       cache(kImageSize, kClasses, 1024);
+
+    context.Eval(image);
+    cache.Insert(model.GetVersion(), image, context.GetOutputs());
+
+    float outputs[kClasses] = {};
+    bool  hit = true;
+
+    std::vector<double> times = BenchLatency([&] {
+        hit = cache.Lookup(model.GetVersion(), image, outputs) && hit;
+    }, options);
+
+    if (!hit || !std::equal(outputs, outputs + kClasses, context.GetOutputs())) {
+        std::cerr << name << ": the cache did not return the outputs\n";
+        return false;
+    }
+
+    ReportLatency(name, 1, n_hidden_neurons, times, json);
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    BenchOptions options = GetDefaultBenchOptions();
+    if (!ParseBenchArgs(argc, argv, &options)) {
+        return 1;
+    }
+
+    char dir_template[] = "/tmp/kgpt_bench_XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        std::cerr << "Can't create a temporary directory\n";
+        return 1;
+    }
+    std::string dir = dir_template;
+
+    std::ostringstream report;
+    bool ok = true;
+    {
+        JsonWriter json(report);
+        json.BeginObject();
+        json.Key("benchmark"); json.Value("end_to_end");
+        json.Key("results");
+        json.BeginArray();
+
+        // Training runs first: its children must be forked before anything
+        // starts the shared thread pool.
+        printf("%-24s %10s %14s %14s %10s %10s\n",
+               "training", "step, ms", "examples/sec", "proj. epoch, s", "rss, MiB", "loss");
+        for (const TrainScenario& scenario : kTrainScenarios) {
+            ok = ok && RunTrainScenario(scenario, dir, options, &json);
+        }
+
+        printf("\n%-24s %10s %10s %14s\n", "inference", "p50, ms", "p99, ms", "images/sec");
+        for (const InferScenario& scenario : kInferScenarios) {
+            RunInferScenario(scenario, options, &json);
+        }
+        ok = ok && RunStaticInferScenario<16>(dir, options, &json);
+        ok = ok && RunStaticInferScenario<64>(dir, options, &json);
+        for (std::size_t n_threads : kSharedInferThreads) {
+            ok = ok && RunSharedInferScenario(n_threads, 16, options, &json);
+        }
+        for (std::size_t n_changed : kIncrementalChangedPixels) {
+            ok = ok && RunIncrementalInferScenario(n_changed, 16, options, &json);
+        }
+        ok = ok && RunCachedInferScenario(16, options, &json);
+
+        json.EndArray();
+        json.EndObject();
+    }
+
+    unlink((dir + "/train-images.idx3-ubyte").c_str());
+    unlink((dir + "/train-labels.idx1-ubyte").c_str());
+    rmdir(dir.c_str());
+
+    if (!ok) {
+        return 1;
+    }
+
+    return FinishReport(report.str(), options, {
+        {"examples_per_sec", true},
+        {"images_per_sec",   true},
+        {"p50_ms",           false},
+        {"p99_ms",           false},
+        {"peak_rss_mb",      false},
+    });
+}
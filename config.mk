@@ -17,7 +17,19 @@ CFLAGS = -O3 -g -Wall \
 
 CFLAGS += -D DEBUG
 CFLAGS += -D LOG
-NFLAGS = -lcuda -O3
+CFLAGS += -pthread
+
+# make PROFILE=1 compiles the per-op profiler in (include/profiler.h)
+ifeq ($(PROFILE),1)
+	CFLAGS += -D PROFILE
+endif
+
+# make PERF=1 compiles the hardware counter regions in (include/perf_counters.h)
+ifeq ($(PERF),1)
+	CFLAGS += -D PERF_COUNTERS
+endif
+LFLAGS = -pthread
+NFLAGS = -lcuda -lpthread -O3
 
 export CFLAGS
 
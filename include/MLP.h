@@ -2,54 +2,77 @@
 #define MLP_H_
 
 #include <cstddef>
+#include <cstdint>
+#include <vector>
 #include "smart_matrix.h"
+#include "checkpoint.h"
 
-class Layer {
+// The layers are templates on the element type of their matrices, see
+// scalar.h. Layer, MiddleLayer, ... are the float networks; the parameter
+// files and checkpoints store float whatever T is.
+
+template <typename T>
+class LayerT {
     public:
-        Layer(std::size_t rows, std::size_t cols, Layer* input_layer);
-        virtual ~Layer();
+        using Compute = typename ScalarTraits<T>::Compute;
+
+        LayerT(std::size_t rows, std::size_t cols, LayerT* input_layer);
+        virtual ~LayerT();
 
-        Layer(const Layer& other);
-        Layer& operator=(const Layer& other);
-        Layer(Layer&& other);
-        Layer& operator=(Layer&& other);
+        LayerT(const LayerT& other);
+        LayerT& operator=(const LayerT& other);
+        LayerT(LayerT&& other);
+        LayerT& operator=(LayerT&& other);
 
-        virtual SmartMatrix* GetOutput() = 0;
-        virtual void        ResetGrads() = 0;
-        std::size_t          GetOutputRows() const;
-        std::size_t          GetOutputCols() const;
-        Layer*               GetInputLayer() const;
+        virtual SmartMatrixT<T>* GetOutput() = 0;
+        virtual void             ResetGrads() = 0;
+        std::size_t              GetOutputRows() const;
+        std::size_t              GetOutputCols() const;
+        LayerT*                  GetInputLayer() const;
 
-        void                 SetInputLayer(Layer* layer);
+        void                     SetInputLayer(LayerT* layer);
 
-        virtual void EvalRecursive()                    = 0;
-        virtual void ResetGradsRecursive()              = 0;
-        virtual void BackpropagateRecursive(float step) = 0;
+        // Names the layer's buffers in the MemoryTracker accounting.
+        virtual void SetMemoryTag(const char* tag) = 0;
+
+        virtual void EvalRecursive()                      = 0;
+        virtual void ResetGradsRecursive()                = 0;
+        virtual void BackpropagateRecursive(Compute step) = 0;
+        // Appends trainable matrices, input side first.
+        virtual void CollectParamsRecursive(std::vector<SmartMatrixT<T>*>* params) = 0;
 
     protected:
-        Layer* input_layer_;
-        SmartMatrix output_;
+        // Only the shape: the output matrix is whichever one GetOutput() of
+        // the derived layer returns.
+        LayerT*     input_layer_;
+        std::size_t output_rows_;
+        std::size_t output_cols_;
 };
 
-class InputLayer : public Layer {
+template <typename T>
+class InputLayerT : public LayerT<T> {
     public:
-        InputLayer(std::size_t n_inputs, std::size_t n_examples = 1);
-        ~InputLayer();
+        using Compute = typename LayerT<T>::Compute;
+
+        InputLayerT(std::size_t n_inputs, std::size_t n_examples = 1);
+        ~InputLayerT();
 
-        InputLayer(const InputLayer& other);
-        InputLayer& operator=(const InputLayer& other);
-        InputLayer(InputLayer&& other);
-        InputLayer& operator=(InputLayer&& other);
+        InputLayerT(const InputLayerT& other);
+        InputLayerT& operator=(const InputLayerT& other);
+        InputLayerT(InputLayerT&& other);
+        InputLayerT& operator=(InputLayerT&& other);
 
-        void SetValue(std::size_t i, std::size_t j, float value);
+        void SetValue(std::size_t i, std::size_t j, Compute value);
 
+        void SetMemoryTag(const char* tag) override;
         void ResetGrads() override;
 
-        SmartMatrix* GetOutput() override;
+        SmartMatrixT<T>* GetOutput() override;
 
-        void EvalRecursive()                    override;
-        void ResetGradsRecursive()              override;
-        void BackpropagateRecursive(float step) override;
+        void EvalRecursive()                      override;
+        void ResetGradsRecursive()                override;
+        void BackpropagateRecursive(Compute step) override;
+        void CollectParamsRecursive(std::vector<SmartMatrixT<T>*>* params) override;
 
         std::size_t GetCols() const;
         std::size_t GetRows() const;
@@ -57,98 +80,200 @@ class InputLayer : public Layer {
     private:
         const std::size_t n_inputs_;
         const std::size_t n_examples_;
+
+        SmartMatrixT<T> output_;
 };
 
-class MiddleLayer : public Layer {
+template <typename T>
+class MiddleLayerT : public LayerT<T> {
     public:
-        MiddleLayer(Layer* input_layer, std::size_t n_outputs);
-        ~MiddleLayer();
+        using Compute = typename LayerT<T>::Compute;
+
+        MiddleLayerT(LayerT<T>* input_layer, std::size_t n_outputs);
+        ~MiddleLayerT();
 
-        MiddleLayer(const MiddleLayer& other);
-        MiddleLayer& operator=(const MiddleLayer& other);
-        MiddleLayer(MiddleLayer&& other);
-        MiddleLayer& operator=(MiddleLayer&& other);
+        MiddleLayerT(const MiddleLayerT& other);
+        MiddleLayerT& operator=(const MiddleLayerT& other);
+        MiddleLayerT(MiddleLayerT&& other);
+        MiddleLayerT& operator=(MiddleLayerT&& other);
 
         void SetNormalRand();
+        void SetMemoryTag(const char* tag) override;
         virtual void Eval();
-        void Backpropagate(float step);
+        void Backpropagate(Compute step);
         void ResetGrads() override;
-        void SaveParamsToFile  (const char* file_name);
-        void LoadParamsFromFile(const char* file_name);
+        void            SaveParamsToFile  (const char* file_name);
+        CheckpointError LoadParamsFromFile(const char* file_name);
+
+        // The checkpoint members exist for float only, see below the class.
+        virtual CheckpointLayerType GetCheckpointType() const;
+        void            SaveParamsToCheckpoint(CheckpointWriter* writer) const;
+        CheckpointError CheckCheckpointParams (const CheckpointReader& reader,
+                                               std::size_t layer) const;
+        // Weights and biases point straight into the reader's mapping.
+        CheckpointError MapCheckpointParams   (const CheckpointReader& reader,
+                                               std::size_t layer);
 
-        void EvalRecursive()                    override;
-        void ResetGradsRecursive()              override;
-        void BackpropagateRecursive(float step) override;
+        void EvalRecursive()                      override;
+        void ResetGradsRecursive()                override;
+        void BackpropagateRecursive(Compute step) override;
+        void CollectParamsRecursive(std::vector<SmartMatrixT<T>*>* params) override;
 
-        SmartMatrix* GetOutput() override;
+        SmartMatrixT<T>* GetOutput() override;
 
     protected:
+        using LayerT<T>::input_layer_;
+
         const std::size_t n_input_rows_;
         const std::size_t n_input_cols_;
         const std::size_t n_output_cols_;
 
-        SmartMatrix weights_;
-        SmartMatrix biases_;
-        SmartMatrix unbiased_output_;
-        SmartMatrix norm_output_;
+        SmartMatrixT<T> weights_;
+        SmartMatrixT<T> biases_;
+        SmartMatrixT<T> unbiased_output_;
+        SmartMatrixT<T> norm_output_;
 };
 
-class OutputLayer : public MiddleLayer {
+// A checkpoint holds float tensors and is mapped without a copy, so only
+// the float layers read and write it.
+template <>
+void MiddleLayerT<float>::SaveParamsToCheckpoint(CheckpointWriter* writer) const;
+template <>
+CheckpointError MiddleLayerT<float>::CheckCheckpointParams(const CheckpointReader& reader,
+                                                           std::size_t layer) const;
+template <>
+CheckpointError MiddleLayerT<float>::MapCheckpointParams(const CheckpointReader& reader,
+                                                         std::size_t layer);
+
+template <typename T>
+class OutputLayerT : public MiddleLayerT<T> {
 
     public:
-        OutputLayer(Layer* input_layer, std::size_t n_outputs);
-        ~OutputLayer();
+        using Compute = typename LayerT<T>::Compute;
+
+        OutputLayerT(LayerT<T>* input_layer, std::size_t n_outputs);
+        ~OutputLayerT();
 
-        OutputLayer           (const OutputLayer&  other);
-        OutputLayer& operator=(const OutputLayer&  other);
-        OutputLayer                 (OutputLayer&& other);
-        OutputLayer& operator=      (OutputLayer&& other);
+        OutputLayerT           (const OutputLayerT&  other);
+        OutputLayerT& operator=(const OutputLayerT&  other);
+        OutputLayerT                 (OutputLayerT&& other);
+        OutputLayerT& operator=      (OutputLayerT&& other);
 
-        float GetLoss() const;
-        virtual float EvalLoss() = 0;
+        Compute GetLoss() const;
+        virtual Compute EvalLoss() = 0;
+        void SetMemoryTag(const char* tag) override;
         void Dump();
         void ResetGrads() override;
-        float GetNormOutput(std::size_t example, std::size_t output);
-        float GetProbOutput(std::size_t example, std::size_t output);
+        Compute GetNormOutput(std::size_t example, std::size_t output);
+        Compute GetProbOutput(std::size_t example, std::size_t output);
 
-        void  SetExpectedValue(std::size_t example, std::size_t output, float value);
-        float GetExpectedValue(std::size_t example, std::size_t output);
+        virtual void    SetExpectedValue(std::size_t example, std::size_t output, Compute value) = 0;
+        virtual Compute GetExpectedValue(std::size_t example, std::size_t output) = 0;
 
-        void EvalRecursive()                    override;
-        void ResetGradsRecursive()              override;
-        void BackpropagateRecursive(float step) override;
+        void EvalRecursive()                      override;
+        void ResetGradsRecursive()                override;
+        void BackpropagateRecursive(Compute step) override;
+
+        // Runs the backward pass on the scheduler's threads. Not owned,
+        // nullptr (the default) keeps it on the calling thread.
+        void SetScheduler(TaskScheduler* scheduler);
 
     protected:
-        SmartMatrix loss_;
-        SmartMatrix expected_output_;
+        using MiddleLayerT<T>::input_layer_;
+        using MiddleLayerT<T>::n_output_cols_;
+        using MiddleLayerT<T>::weights_;
+        using MiddleLayerT<T>::biases_;
+        using MiddleLayerT<T>::unbiased_output_;
+        using MiddleLayerT<T>::norm_output_;
+
+        SmartMatrixT<T> loss_;
+        TaskScheduler*  scheduler_;
+
+        void EvalLossGrad_();
 };
 
-class OutputLayerDiscret : public OutputLayer {
+template <typename T>
+class OutputLayerDiscretT : public OutputLayerT<T> {
     public:
-        OutputLayerDiscret(Layer* input_layer, std::size_t n_outputs);
-        ~OutputLayerDiscret();
+        using Compute = typename LayerT<T>::Compute;
 
-        OutputLayerDiscret           (const OutputLayerDiscret&  other);
-        OutputLayerDiscret& operator=(const OutputLayerDiscret&  other);
-        OutputLayerDiscret                 (OutputLayerDiscret&& other);
-        OutputLayerDiscret& operator=      (OutputLayerDiscret&& other);
+        OutputLayerDiscretT(LayerT<T>* input_layer, std::size_t n_outputs);
+        ~OutputLayerDiscretT();
 
-        void  Eval()     override;
-        float EvalLoss() override;
+        OutputLayerDiscretT           (const OutputLayerDiscretT&  other);
+        OutputLayerDiscretT& operator=(const OutputLayerDiscretT&  other);
+        OutputLayerDiscretT                 (OutputLayerDiscretT&& other);
+        OutputLayerDiscretT& operator=      (OutputLayerDiscretT&& other);
+
+        void    Eval()     override;
+        Compute EvalLoss() override;
+        void    ResetGrads() override;
+        void    SetMemoryTag(const char* tag) override;
+
+        CheckpointLayerType GetCheckpointType() const override;
+
+        // Targets are stored as one class index per example instead of a
+        // dense one-hot matrix. SetExpectedValue() keeps the one-hot
+        // interface working: a value above 0.5 selects the class.
+        void    SetExpectedValue(std::size_t example, std::size_t output, Compute value) override;
+        Compute GetExpectedValue(std::size_t example, std::size_t output) override;
+
+        void     SetLabel (std::size_t example, uint32_t label);
+        void     SetLabels(const uint8_t* labels);
+        uint32_t GetLabel (std::size_t example) const;
+
+    private:
+        using OutputLayerT<T>::input_layer_;
+        using OutputLayerT<T>::n_output_cols_;
+        using OutputLayerT<T>::weights_;
+        using OutputLayerT<T>::biases_;
+        using OutputLayerT<T>::unbiased_output_;
+        using OutputLayerT<T>::norm_output_;
+        using OutputLayerT<T>::loss_;
+
+        SmartMatrixT<T>       output_; // Before the softmax
+        std::vector<uint32_t> labels_;
 };
 
-class OutputLayerContinuos : public OutputLayer {
+template <typename T>
+class OutputLayerContinuosT : public OutputLayerT<T> {
     public:
-        OutputLayerContinuos(Layer* input_layer, std::size_t n_outputs);
-        ~OutputLayerContinuos();
+        using Compute = typename LayerT<T>::Compute;
 
-        OutputLayerContinuos           (const OutputLayerContinuos&  other);
-        OutputLayerContinuos& operator=(const OutputLayerContinuos&  other);
-        OutputLayerContinuos                 (OutputLayerContinuos&& other);
-        OutputLayerContinuos& operator=      (OutputLayerContinuos&& other);
+        OutputLayerContinuosT(LayerT<T>* input_layer, std::size_t n_outputs);
+        ~OutputLayerContinuosT();
 
-        void  Eval()     override;
-        float EvalLoss() override;
+        OutputLayerContinuosT           (const OutputLayerContinuosT&  other);
+        OutputLayerContinuosT& operator=(const OutputLayerContinuosT&  other);
+        OutputLayerContinuosT                 (OutputLayerContinuosT&& other);
+        OutputLayerContinuosT& operator=      (OutputLayerContinuosT&& other);
+
+        void    Eval()     override;
+        Compute EvalLoss() override;
+        void    ResetGrads() override;
+        void    SetMemoryTag(const char* tag) override;
+
+        CheckpointLayerType GetCheckpointType() const override;
+
+        void    SetExpectedValue(std::size_t example, std::size_t output, Compute value) override;
+        Compute GetExpectedValue(std::size_t example, std::size_t output) override;
+
+    private:
+        using OutputLayerT<T>::input_layer_;
+        using OutputLayerT<T>::weights_;
+        using OutputLayerT<T>::biases_;
+        using OutputLayerT<T>::unbiased_output_;
+        using OutputLayerT<T>::norm_output_;
+        using OutputLayerT<T>::loss_;
+
+        SmartMatrixT<T> expected_output_;
 };
 
+using Layer                = LayerT               <float>;
+using InputLayer           = InputLayerT          <float>;
+using MiddleLayer          = MiddleLayerT         <float>;
+using OutputLayer          = OutputLayerT         <float>;
+using OutputLayerDiscret   = OutputLayerDiscretT  <float>;
+using OutputLayerContinuos = OutputLayerContinuosT<float>;
+
 #endif
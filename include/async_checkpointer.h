@@ -0,0 +1,48 @@
+#ifndef ASYNC_CHECKPOINTER_H_
+#define ASYNC_CHECKPOINTER_H_
+
+#include "checkpoint.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Writes checkpoints on a background thread.
+//
+// Save() only copies the parameters into a spare snapshot buffer, the
+// serialization, fsync and rename happen on the writer thread. There is at
+// most one write in flight: a snapshot saved while the previous one is still
+// being written waits in the spare buffer, and a newer one replaces it.
+class AsyncCheckpointer {
+    public:
+        explicit AsyncCheckpointer(const char* file_name);
+        ~AsyncCheckpointer();
+
+        AsyncCheckpointer(const AsyncCheckpointer& other)            = delete;
+        AsyncCheckpointer& operator=(const AsyncCheckpointer& other) = delete;
+
+        void Save(const CheckpointWriter& writer);
+
+        // Blocks until every saved snapshot is on disk.
+        CheckpointError Flush();
+
+    private:
+        const std::string file_name_;
+
+        CheckpointWriter pending_;
+        CheckpointWriter writing_;
+        bool has_pending_;
+        bool is_writing_;
+        bool stop_;
+        CheckpointError last_error_;
+
+        std::mutex              mutex_;
+        std::condition_variable wake_writer_;
+        std::condition_variable wake_flush_;
+        std::thread             writer_;
+
+        void WriterLoop_();
+};
+
+#endif // ASYNC_CHECKPOINTER_H_
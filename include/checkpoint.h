@@ -0,0 +1,145 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Single-file model checkpoint.
+//
+// Layout (host byte order):
+//   CheckpointHeader
+//   CheckpointLayerInfo [n_layers]
+//   CheckpointTensorInfo[n_tensors]
+//   tensor sections, each one starting at a kCheckpointAlignment boundary
+//
+// The layer and tensor tables are covered by CheckpointHeader::table_checksum,
+// every tensor section by its own CheckpointTensorInfo::checksum. Sections are
+// aligned so that a reader can mmap the file and use them in place.
+
+const std::size_t kCheckpointAlignment = 64;
+const uint32_t    kCheckpointVersion   = 1;
+
+enum class CheckpointError {
+    Ok,
+    OpenFailed,
+    WriteFailed,
+    MapFailed,
+    BadMagic,
+    BadVersion,
+    Truncated,
+    ChecksumMismatch,
+    ShapeMismatch,
+};
+
+enum class CheckpointLayerType : uint32_t {
+    Middle,
+    OutputDiscret,
+    OutputContinuos,
+};
+
+enum class CheckpointRole : uint32_t {
+    Weights,
+    Biases,
+};
+
+struct CheckpointHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t n_layers;
+    uint32_t n_tensors;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t table_checksum;
+};
+
+struct CheckpointLayerInfo {
+    uint32_t type; // CheckpointLayerType
+    uint32_t reserved;
+    uint64_t n_inputs;
+    uint64_t n_outputs;
+};
+
+struct CheckpointTensorInfo {
+    uint32_t layer;
+    uint32_t role; // CheckpointRole
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t offset;
+    uint64_t checksum;
+};
+
+const char* CheckpointErrorString(CheckpointError error);
+
+uint64_t CheckpointChecksum(const void* data, std::size_t size);
+
+class CheckpointWriter {
+    public:
+        CheckpointWriter();
+        ~CheckpointWriter();
+
+        CheckpointWriter(const CheckpointWriter& other)            = delete;
+        CheckpointWriter& operator=(const CheckpointWriter& other) = delete;
+        CheckpointWriter(CheckpointWriter&& other);
+        CheckpointWriter& operator=(CheckpointWriter&& other);
+
+        void AddLayer(CheckpointLayerType type, std::size_t n_inputs, std::size_t n_outputs);
+
+        // Attaches a tensor to the last added layer. The values are not
+        // copied and must stay alive until Write() returns.
+        void AddTensor(CheckpointRole role, std::size_t rows, std::size_t cols,
+                       const float* values);
+
+        // Copies other's tables and the tensors it points to into storage
+        // owned by this writer. The storage is reused between snapshots.
+        void Snapshot(const CheckpointWriter& other);
+        void Clear();
+
+        // With sync set the data is fsync'ed before the file replaces the
+        // old one, so a crash leaves either the old or the new checkpoint.
+        CheckpointError Write(const char* file_name, bool sync = false) const;
+
+    private:
+        std::vector<CheckpointLayerInfo>  layers_;
+        std::vector<CheckpointTensorInfo> tensors_;
+        std::vector<const float*>         values_;
+        std::vector<float>                storage_;
+
+        std::size_t LayoutTensors_(std::vector<CheckpointTensorInfo>* tensors) const;
+        bool        IsContiguous_ (const std::vector<CheckpointTensorInfo>& tensors) const;
+};
+
+class CheckpointReader {
+    public:
+        CheckpointReader();
+        ~CheckpointReader();
+
+        CheckpointReader(const CheckpointReader& other)            = delete;
+        CheckpointReader& operator=(const CheckpointReader& other) = delete;
+
+        // Maps the file privately: tensors can be written to (e.g. by further
+        // training), the pages are then copied on write and the file is left
+        // untouched. Section checksums cost a full pass over the data, so
+        // they can be skipped for a cold start that is bound by page faults.
+        CheckpointError Open(const char* file_name, bool verify_checksums = true);
+        void Close();
+
+        std::size_t GetFileSize() const;
+        std::size_t GetLayersCount() const;
+        const CheckpointLayerInfo& GetLayer(std::size_t layer) const;
+
+        std::size_t GetTensorsCount() const;
+        const CheckpointTensorInfo* GetTensor(std::size_t tensor) const;
+        const CheckpointTensorInfo* FindTensor(std::size_t layer, CheckpointRole role) const;
+        float* GetTensorData(const CheckpointTensorInfo* info) const;
+
+    private:
+        uint8_t*    map_;
+        std::size_t map_size_;
+
+        const CheckpointHeader*     header_;
+        const CheckpointLayerInfo*  layers_;
+        const CheckpointTensorInfo* tensors_;
+};
+
+#endif // CHECKPOINT_H_
@@ -0,0 +1,107 @@
+#ifndef COMMUNICATOR_H_
+#define COMMUNICATOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Point-to-point link of a rank to its ring neighbours, with a ring
+// all-reduce on top of it. Every rank sends to (rank + 1) % size and
+// receives from (rank - 1) % size.
+class Communicator {
+    public:
+        Communicator(std::size_t rank, std::size_t size);
+        virtual ~Communicator();
+
+        Communicator(const Communicator& other)            = delete;
+        Communicator& operator=(const Communicator& other) = delete;
+
+        std::size_t GetRank() const;
+        std::size_t GetSize() const;
+
+        // Sums data over all ranks in place: reduce-scatter followed by
+        // all-gather, 2 * (size - 1) steps of n / size floats each. The
+        // summation order only depends on the rank count, so the result
+        // is reproducible.
+        bool AllReduce(float* data, std::size_t n);
+
+        // Blocks until every rank has reached it.
+        bool Barrier();
+
+    protected:
+        const std::size_t rank_;
+        const std::size_t size_;
+
+        // Sends send_size bytes to the right neighbour while receiving
+        // recv_size bytes from the left one, without deadlocking when both
+        // sides send first.
+        virtual bool SendRecv(const void* send, std::size_t send_size,
+                              void* recv,       std::size_t recv_size) = 0;
+
+    private:
+        std::vector<float> recv_buffer_;
+};
+
+// Ranks of one host exchanging data through single-producer single-consumer
+// ring buffers in POSIX shared memory. The segment is created once by the
+// launcher with Create() and opened by every rank.
+//
+// The segment also holds an abort word. A rank sets it when a transfer
+// fails, and the launcher sets it with Abort(name) when a rank dies, so
+// that the others fail their transfers instead of waiting for it forever.
+// A transfer that makes no progress for timeout fails as well.
+class ShmCommunicator : public Communicator {
+    public:
+        ShmCommunicator(const char* name, std::size_t rank, std::size_t size,
+                        std::chrono::milliseconds timeout = std::chrono::seconds(60));
+        ~ShmCommunicator();
+
+        bool IsOpen() const;
+
+        // Makes every pending and later transfer of every rank fail.
+        void Abort();
+
+        static bool Create(const char* name, std::size_t size);
+        static bool Abort (const char* name, std::size_t size);
+        static void Unlink(const char* name);
+
+    protected:
+        bool SendRecv(const void* send, std::size_t send_size,
+                      void* recv,       std::size_t recv_size) override;
+
+    private:
+        struct Control;
+        struct Channel;
+
+        const std::chrono::milliseconds timeout_;
+
+        uint8_t*    map_;
+        std::size_t map_size_;
+        Control*    control_;
+        Channel*    out_;
+        Channel*    in_;
+};
+
+// Same ring over TCP: rank r listens on base_port + r on the given host and
+// connects to its right neighbour. Loopback stands in for a real network.
+class TcpCommunicator : public Communicator {
+    public:
+        TcpCommunicator(const char* host, uint16_t base_port,
+                        std::size_t rank, std::size_t size);
+        ~TcpCommunicator();
+
+        bool IsOpen() const;
+
+    protected:
+        bool SendRecv(const void* send, std::size_t send_size,
+                      void* recv,       std::size_t recv_size) override;
+
+    private:
+        int out_fd_;
+        int in_fd_;
+};
+
+#endif // COMMUNICATOR_H_
@@ -0,0 +1,69 @@
+#ifndef CONFORMANCE_H_
+#define CONFORMANCE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <random>
+#include <string>
+
+template <typename T> class SmartMatrixT;
+using SmartMatrix = SmartMatrixT<float>;
+
+// Checks the linked kernels against double-precision references.
+//
+// The Chubarov kernels are called directly, every SmartMatrix op forward and
+// backward through a small graph. Shapes cover 1xK and Kx1, prime sizes,
+// zero-sized dimensions, sizes that the thread pool splits into several
+// chunks and random ones, each with aligned storage and with storage shifted
+// by one float. Errors are measured in ULPs for single roundings and in
+// epsilons of the sum of absolute terms for reductions, where the bound
+// grows with the reduction length.
+//
+// Then every OperationType's gradient is compared with central finite
+// differences of the loss. Finally a layer step in float and in Half is
+// compared with the same step in double.
+class ConformanceSuite {
+    public:
+        ConformanceSuite(uint64_t seed, std::ostream& out, bool verbose = false);
+
+        ConformanceSuite(const ConformanceSuite& other)            = delete;
+        ConformanceSuite& operator=(const ConformanceSuite& other) = delete;
+
+        // Prints the failed checks (every check if verbose) and a summary.
+        // Returns the number of failed checks.
+        std::size_t Run();
+
+        std::size_t GetChecksCount()   const;
+        std::size_t GetFailuresCount() const;
+
+    private:
+        std::mt19937_64 gen_;
+        const uint64_t  seed_;
+        std::ostream&   out_;
+        const bool      verbose_;
+
+        std::size_t n_checks_;
+        std::size_t n_failures_;
+
+        void CheckMulKernels_  (std::size_t N, std::size_t M, std::size_t L, bool shifted);
+        void CheckElementwise_ (std::size_t rows, std::size_t cols, bool shifted);
+        void CheckLosses_      (std::size_t rows, std::size_t cols, bool shifted);
+        void CheckGradients_   (std::size_t rows, std::size_t inner, std::size_t cols);
+        void CheckElementTypes_(std::size_t rows, std::size_t inner, std::size_t cols);
+
+        // Compares the gradient EvalGrad() leaves in input with the finite
+        // differences of the loss forward() builds, times grad_scale.
+        template <typename Forward>
+        void CheckGradient_(const char* operation, const std::string& shape,
+                            SmartMatrix* input, Forward forward, float step,
+                            float grad_scale = 1.0f);
+
+        void FillRandom_(SmartMatrix* matrix, float min, float max);
+        void FillRandomGrads_(SmartMatrix* matrix);
+        float GetRandom_(float min, float max);
+
+        void Expect_(const char* kernel, const std::string& shape, double error, double bound);
+};
+
+#endif // CONFORMANCE_H_
@@ -0,0 +1,88 @@
+#ifndef DATA_PARALLEL_H_
+#define DATA_PARALLEL_H_
+
+#include <cstddef>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "MLP.h"
+#include "optimizer.h"
+#include "parameter_buffer.h"
+#include "thread_pool.h"
+
+struct HogwildStats {
+    std::size_t n_updates;
+    std::size_t max_staleness;
+    double      mean_staleness;
+};
+
+// Synchronous data-parallel training of an MLP with a discrete output.
+//
+// The batch is split row-wise into one shard per replica. Every replica has
+// its own layer stack and gradients, but all of them share the weights of
+// replica 0. A step runs forward/backward of all shards in parallel, sums
+// the gradients into replica 0 with a fixed-order tree reduction and applies
+// one optimizer step. For a fixed number of replicas the result is bitwise
+// reproducible, whatever the thread scheduling.
+class DataParallelTrainer {
+    public:
+        DataParallelTrainer(std::size_t n_inputs,
+                            std::size_t n_hidden_layers,
+                            std::size_t n_hidden_layer_neurons,
+                            std::size_t n_outputs,
+                            std::size_t n_examples,
+                            std::size_t n_replicas);
+        ~DataParallelTrainer();
+
+        DataParallelTrainer(const DataParallelTrainer& other)            = delete;
+        DataParallelTrainer& operator=(const DataParallelTrainer& other) = delete;
+
+        void SetInput (std::size_t example, std::size_t input, float value);
+        void SetLabel (std::size_t example, uint32_t label);
+        void SetLabels(const uint8_t* labels);
+
+        // Shared weights and the reduced gradients, register GetFlat() of it
+        // with the optimizer.
+        ParameterBuffer* GetParams();
+
+        // Evaluates the loss over the whole batch and its gradients, without
+        // touching the weights.
+        float EvalGrads();
+        float Step(Optimizer* optimizer);
+
+        // Asynchronous mode: every replica repeatedly runs forward/backward
+        // on its own shard and applies plain SGD to the shared weights with
+        // no locking at all, so updates race and may be computed from stale
+        // weights. Staleness of an update is the number of other updates
+        // that landed between reading the weights and writing them back.
+        // Returns the full-batch loss after training; per-replica stats go
+        // to stats if it is not null.
+        float RunHogwild(float step, std::size_t n_iterations,
+                         std::vector<HogwildStats>* stats = nullptr);
+
+        std::size_t GetReplicasCount() const;
+
+    private:
+        struct Replica {
+            std::unique_ptr<InputLayer>         input_layer;
+            std::vector<MiddleLayer>            middle_layers;
+            std::unique_ptr<OutputLayerDiscret> output_layer;
+            std::unique_ptr<ParameterBuffer>    params;
+            std::size_t                         first_example;
+            std::size_t                         n_examples;
+        };
+
+        const std::size_t n_examples_;
+        std::vector<Replica> replicas_;
+        ThreadPool pool_;
+
+        std::vector<float> losses_;
+
+        std::atomic<std::size_t> n_hogwild_updates_;
+
+        Replica* FindReplica_(std::size_t example, std::size_t* row);
+        void ReduceGrads_();
+};
+
+#endif // DATA_PARALLEL_H_
@@ -0,0 +1,85 @@
+#ifndef DISTRIBUTED_TRAINER_H_
+#define DISTRIBUTED_TRAINER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "MLP.h"
+#include "communicator.h"
+#include "optimizer.h"
+#include "parameter_buffer.h"
+
+// One worker process of multi-process data-parallel training.
+//
+// Every rank holds a full copy of the weights and a shard of the examples.
+// Gradients are all-reduced per layer on a communication thread: EvalGrad()
+// finishes the parameters of the last layer first, and each layer's slice of
+// the flat gradient buffer is handed over as soon as its weights and biases
+// are complete, while the backward pass goes on into the earlier layers.
+class DistributedTrainer : public GradReadyHook {
+    public:
+        DistributedTrainer(Communicator* communicator,
+                           std::size_t n_inputs,
+                           std::size_t n_hidden_layers,
+                           std::size_t n_hidden_layer_neurons,
+                           std::size_t n_outputs,
+                           std::size_t n_examples);
+        ~DistributedTrainer();
+
+        void SetInput (std::size_t example, std::size_t input, float value);
+        void SetLabels(const uint8_t* labels);
+
+        ParameterBuffer* GetParams();
+
+        // Makes every rank start from the weights of rank 0.
+        bool BroadcastParams();
+
+        // Step() scales the reduced gradients down to max_norm if their norm
+        // is above it. 0, the default, leaves them as they are.
+        void SetMaxGradNorm(float max_norm);
+
+        // Writes the loss over the examples of all ranks to loss. Fails,
+        // without stepping the optimizer, if an all-reduce failed: the
+        // gradients are then not those of all ranks.
+        bool Step(Optimizer* optimizer, float* loss);
+
+        void OnGradReady(SmartMatrix* matrix) override;
+
+    private:
+        struct Bucket {
+            std::size_t begin;
+            std::size_t end;
+            std::size_t n_params;
+            std::size_t n_ready;
+        };
+
+        Communicator* communicator_;
+
+        std::unique_ptr<InputLayer>         input_layer_;
+        std::vector<MiddleLayer>            middle_layers_;
+        std::unique_ptr<OutputLayerDiscret> output_layer_;
+        std::unique_ptr<ParameterBuffer>    params_;
+        float                               max_grad_norm_;
+
+        std::vector<Bucket>                     buckets_;
+        std::unordered_map<SmartMatrix*, std::size_t> param_buckets_;
+
+        std::mutex              mutex_;
+        std::condition_variable wake_comm_;
+        std::condition_variable wake_step_;
+        std::deque<std::size_t> ready_buckets_;
+        std::size_t             n_reduced_;
+        bool                    comm_failed_;
+        bool                    stop_;
+        std::thread             comm_thread_;
+
+        void CommLoop_();
+};
+
+#endif // DISTRIBUTED_TRAINER_H_
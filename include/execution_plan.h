@@ -0,0 +1,108 @@
+#ifndef EXECUTION_PLAN_H_
+#define EXECUTION_PLAN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+template <typename T> class SmartMatrixT;
+template <typename T> class FusedExpression;
+class TaskScheduler;
+
+using SmartMatrix = SmartMatrixT<float>;
+
+// A training or inference step traced into a flat list of SmartMatrix ops.
+//
+// Record() runs the step once and notes every op it issues on the calling
+// thread: gradient resets, forward ops, the backward pass node by node in
+// EvalGrad() order, AdjustValues(). Replay() then runs the same ops in one
+// loop, without the Layer virtual calls and the recursive walks over the
+// layers and the graph.
+//
+// The step must issue the same ops every time: branches on data are not
+// traced. Anything else it does (loading inputs, an Optimizer::Step()) is not
+// recorded and belongs around Replay(). The plan keeps pointers to the
+// matrices and the labels, which must outlive it; their storage may be
+// swapped (e.g. by mapping a checkpoint). A backward pass run on a
+// TaskScheduler is replayed as a whole on the same scheduler. Only float
+// matrices are traced, the ops of the other element types are not seen.
+class ExecutionPlan {
+    template <typename T> friend class SmartMatrixT;
+
+    public:
+        ExecutionPlan();
+        ~ExecutionPlan();
+
+        ExecutionPlan(const ExecutionPlan& other)            = delete;
+        ExecutionPlan& operator=(const ExecutionPlan& other) = delete;
+
+        // Replaces the recorded steps.
+        void Record(const std::function<void()>& step);
+        void Replay() const;
+
+        bool        IsEmpty()         const;
+        std::size_t GetStepsCount()   const;
+        void        Clear();
+
+    private:
+        enum class StepType {
+            ResetGrad,
+            Add,
+            AddVectorToMatrix,
+            Sub,
+            Mul,
+            SquaredErrorLoss,
+            CrossEntropyLoss,
+            CrossEntropyLossLabels,
+            Sigm,
+            Softmax,
+            Fused,
+            SeedGrad,       // dx/dx = 1 at the root of a backward pass
+            EvalGradNode,
+            EvalGradParallel,
+            AdjustValues,
+        };
+
+        struct Step {
+            StepType        type;
+            SmartMatrix*    output;
+            SmartMatrix*    first;
+            SmartMatrix*    second;
+            const uint32_t* labels;
+            TaskScheduler*  scheduler;
+            float           value;
+            std::shared_ptr<const FusedExpression<float>> fused;
+        };
+
+        std::vector<Step> steps_;
+
+        // Called by SmartMatrixT on every op, records it if the calling
+        // thread is inside Record(). Compiles to nothing for the element
+        // types other than float.
+        template <typename T, typename... Args>
+        static void RecordStep_(StepType type, SmartMatrixT<T>* output, Args... args) {
+            if constexpr (std::is_same<T, float>::value) {
+                RecordFloatStep_(type, output, args...);
+            }
+        }
+
+        template <typename T>
+        static void RecordFusedStep_(SmartMatrixT<T>* output,
+                                     const std::shared_ptr<const FusedExpression<T>>& expr) {
+            if constexpr (std::is_same<T, float>::value) {
+                RecordFloatFusedStep_(output, expr);
+            }
+        }
+
+        static void RecordFloatStep_(StepType type, SmartMatrix* output,
+                                     SmartMatrix* first = nullptr, SmartMatrix* second = nullptr,
+                                     const uint32_t* labels = nullptr, TaskScheduler* scheduler = nullptr,
+                                     float value = 0.0f);
+        static void RecordFloatFusedStep_(SmartMatrix* output,
+                                          std::shared_ptr<const FusedExpression<float>> expr);
+};
+
+#endif // EXECUTION_PLAN_H_
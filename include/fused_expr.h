@@ -0,0 +1,354 @@
+#ifndef FUSED_EXPR_H_
+#define FUSED_EXPR_H_
+
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "smart_matrix.h"
+#include "parallel.h"
+
+// Lazy elementwise expressions over matrices.
+//
+//     Assign(&output, Sigm(Expr(&unbiased) + Expr(&biases)));
+//
+// builds the expression tree at compile time and evaluates it on Assign() in
+// a single pass over the output, without intermediate matrices. A 1 x cols
+// operand is broadcast over the rows of the output, every other operand must
+// have the output's shape. The output becomes one node of the autograd
+// graph with the distinct matrices of the expression as its children; their
+// gradients are again computed in one pass each. All matrices of an
+// expression have the same element type, the arithmetic is done in its
+// compute type.
+//
+// Only elementwise ops are lazy: a product of matrices is done with
+// SmartMatrix::Mul() first and used as an operand.
+
+// The part of an expression the graph needs, with the type erased.
+template <typename T>
+class FusedExpression {
+    public:
+        virtual ~FusedExpression();
+
+        virtual void Forward(T* values, std::size_t rows, std::size_t cols) const = 0;
+        // Adds grads times d output / d leaf to leaf_grads.
+        virtual void Backward(const SmartMatrixT<T>* leaf, T* leaf_grads,
+                              const T* grads, std::size_t rows, std::size_t cols) const = 0;
+
+        // Distinct matrices of the expression, in order of appearance.
+        const std::vector<SmartMatrixT<T>*>& GetLeaves() const;
+
+    protected:
+        std::vector<SmartMatrixT<T>*> leaves_;
+};
+
+// Same chunking as the SmartMatrix ops.
+const std::size_t kFusedElemsGrain = 1 << 14;
+
+inline std::size_t GetFusedRowsGrain(std::size_t n_cols) {
+    return std::max<std::size_t>(1, kFusedElemsGrain / std::max<std::size_t>(1, n_cols));
+}
+
+//================================ Nodes ======================================
+//
+// Every node provides:
+//   Bind(rows, cols)      - resolves the storage for an output of that shape
+//   SelectLeaf(leaf)      - Derivative() is then taken with respect to leaf
+//   CollectLeaves(leaves) - appends the matrices not in leaves yet
+//   Value(row, col), Derivative(row, col)
+
+template <typename Derived>
+class ExprBase {
+    public:
+        const Derived& Self() const { return static_cast<const Derived&>(*this); }
+};
+
+template <typename T>
+class MatrixExpr : public ExprBase<MatrixExpr<T>> {
+    public:
+        using Compute = typename ScalarTraits<T>::Compute;
+
+        explicit MatrixExpr(SmartMatrixT<T>* matrix)
+            : matrix_(matrix), values_(nullptr), row_stride_(0), weight_(0) {
+            assert(matrix);
+        }
+
+        void Bind(std::size_t rows, std::size_t cols) {
+            assert(matrix_->GetCols() == cols);
+            assert(matrix_->GetRows() == rows || matrix_->GetRows() == 1);
+
+            values_     = matrix_->GetValues();
+            row_stride_ = matrix_->GetRows() == rows ? cols : 0;
+        }
+
+        void SelectLeaf(const SmartMatrixT<T>* leaf) {
+            weight_ = matrix_ == leaf ? 1 : 0;
+        }
+
+        void CollectLeaves(std::vector<SmartMatrixT<T>*>* leaves) const {
+            if (std::find(leaves->begin(), leaves->end(), matrix_) == leaves->end()) {
+                leaves->push_back(matrix_);
+            }
+        }
+
+        Compute Value(std::size_t row, std::size_t col) const {
+            return values_[row * row_stride_ + col];
+        }
+
+        Compute Derivative(std::size_t /*row*/, std::size_t /*col*/) const {
+            return weight_;
+        }
+
+    private:
+        SmartMatrixT<T>* matrix_;
+        const T*         values_;
+        std::size_t      row_stride_;
+        Compute          weight_;
+};
+
+class ScalarExpr : public ExprBase<ScalarExpr> {
+    public:
+        explicit ScalarExpr(float value) : value_(value) {}
+
+        void Bind(std::size_t /*rows*/, std::size_t /*cols*/) {}
+        template <typename T> void SelectLeaf(const SmartMatrixT<T>* /*leaf*/) {}
+        template <typename T> void CollectLeaves(std::vector<SmartMatrixT<T>*>* /*leaves*/) const {}
+
+        float Value     (std::size_t /*row*/, std::size_t /*col*/) const { return value_; }
+        float Derivative(std::size_t /*row*/, std::size_t /*col*/) const { return 0.0f;   }
+
+    private:
+        float value_;
+};
+
+template <typename Left, typename Right, typename Op>
+class BinaryExpr : public ExprBase<BinaryExpr<Left, Right, Op>> {
+    public:
+        BinaryExpr(const Left& left, const Right& right) : left_(left), right_(right) {}
+
+        void Bind(std::size_t rows, std::size_t cols) {
+            left_ .Bind(rows, cols);
+            right_.Bind(rows, cols);
+        }
+
+        template <typename T>
+        void SelectLeaf(const SmartMatrixT<T>* leaf) {
+            left_ .SelectLeaf(leaf);
+            right_.SelectLeaf(leaf);
+        }
+
+        template <typename T>
+        void CollectLeaves(std::vector<SmartMatrixT<T>*>* leaves) const {
+            left_ .CollectLeaves(leaves);
+            right_.CollectLeaves(leaves);
+        }
+
+        auto Value(std::size_t row, std::size_t col) const {
+            return Op::Value(left_.Value(row, col), right_.Value(row, col));
+        }
+
+        auto Derivative(std::size_t row, std::size_t col) const {
+            return Op::Derivative(left_ .Value(row, col), left_ .Derivative(row, col),
+                                  right_.Value(row, col), right_.Derivative(row, col));
+        }
+
+    private:
+        Left  left_;
+        Right right_;
+};
+
+template <typename Arg, typename Op>
+class UnaryExpr : public ExprBase<UnaryExpr<Arg, Op>> {
+    public:
+        explicit UnaryExpr(const Arg& arg) : arg_(arg) {}
+
+        void Bind(std::size_t rows, std::size_t cols) { arg_.Bind(rows, cols); }
+
+        template <typename T>
+        void SelectLeaf(const SmartMatrixT<T>* leaf) { arg_.SelectLeaf(leaf); }
+
+        template <typename T>
+        void CollectLeaves(std::vector<SmartMatrixT<T>*>* leaves) const { arg_.CollectLeaves(leaves); }
+
+        auto Value(std::size_t row, std::size_t col) const {
+            return Op::Value(arg_.Value(row, col));
+        }
+
+        auto Derivative(std::size_t row, std::size_t col) const {
+            return Op::Derivative(arg_.Value(row, col), arg_.Derivative(row, col));
+        }
+
+    private:
+        Arg arg_;
+};
+
+// Operands are the compute types of the two sides (float or double), the
+// result is their common type.
+struct AddOp {
+    template <typename L, typename R>
+    static auto Value(L left, R right) { return left + right; }
+    template <typename L, typename R>
+    static auto Derivative(L, L d_left, R, R d_right) { return d_left + d_right; }
+};
+
+struct SubOp {
+    template <typename L, typename R>
+    static auto Value(L left, R right) { return left - right; }
+    template <typename L, typename R>
+    static auto Derivative(L, L d_left, R, R d_right) { return d_left - d_right; }
+};
+
+struct HadamardOp {
+    template <typename L, typename R>
+    static auto Value(L left, R right) { return left * right; }
+    template <typename L, typename R>
+    static auto Derivative(L left, L d_left, R right, R d_right) {
+        return d_left * right + left * d_right;
+    }
+};
+
+// Same formulas as SmartMatrixT::Sigm() and its gradient, so that a fused
+// chain gives the same values as the ops one by one.
+struct SigmOp {
+    template <typename A>
+    static A Value(A arg) { return 1 / (1 + std::exp(-arg)); }
+    template <typename A>
+    static A Derivative(A arg, A d_arg) {
+        A value = Value(arg);
+        return value * (1 - value) * d_arg;
+    }
+};
+
+//================================ Front end ==================================
+
+template <typename T>
+MatrixExpr<T> Expr(SmartMatrixT<T>* matrix) { return MatrixExpr<T>(matrix); }
+
+template <typename Left, typename Right>
+BinaryExpr<Left, Right, AddOp> operator+(const ExprBase<Left>& left, const ExprBase<Right>& right) {
+    return BinaryExpr<Left, Right, AddOp>(left.Self(), right.Self());
+}
+
+template <typename Left, typename Right>
+BinaryExpr<Left, Right, SubOp> operator-(const ExprBase<Left>& left, const ExprBase<Right>& right) {
+    return BinaryExpr<Left, Right, SubOp>(left.Self(), right.Self());
+}
+
+template <typename Left, typename Right>
+BinaryExpr<Left, Right, HadamardOp> Hadamard(const ExprBase<Left>& left, const ExprBase<Right>& right) {
+    return BinaryExpr<Left, Right, HadamardOp>(left.Self(), right.Self());
+}
+
+template <typename Arg>
+UnaryExpr<Arg, SigmOp> Sigm(const ExprBase<Arg>& arg) {
+    return UnaryExpr<Arg, SigmOp>(arg.Self());
+}
+
+template <typename Arg>
+BinaryExpr<Arg, ScalarExpr, AddOp> operator+(const ExprBase<Arg>& arg, float value) {
+    return BinaryExpr<Arg, ScalarExpr, AddOp>(arg.Self(), ScalarExpr(value));
+}
+
+template <typename Arg>
+BinaryExpr<ScalarExpr, Arg, AddOp> operator+(float value, const ExprBase<Arg>& arg) {
+    return BinaryExpr<ScalarExpr, Arg, AddOp>(ScalarExpr(value), arg.Self());
+}
+
+template <typename Arg>
+BinaryExpr<Arg, ScalarExpr, SubOp> operator-(const ExprBase<Arg>& arg, float value) {
+    return BinaryExpr<Arg, ScalarExpr, SubOp>(arg.Self(), ScalarExpr(value));
+}
+
+template <typename Arg>
+BinaryExpr<ScalarExpr, Arg, SubOp> operator-(float value, const ExprBase<Arg>& arg) {
+    return BinaryExpr<ScalarExpr, Arg, SubOp>(ScalarExpr(value), arg.Self());
+}
+
+template <typename Arg>
+BinaryExpr<ScalarExpr, Arg, HadamardOp> operator*(float value, const ExprBase<Arg>& arg) {
+    return BinaryExpr<ScalarExpr, Arg, HadamardOp>(ScalarExpr(value), arg.Self());
+}
+
+template <typename Arg>
+BinaryExpr<Arg, ScalarExpr, HadamardOp> operator*(const ExprBase<Arg>& arg, float value) {
+    return BinaryExpr<Arg, ScalarExpr, HadamardOp>(arg.Self(), ScalarExpr(value));
+}
+
+template <typename Arg>
+BinaryExpr<ScalarExpr, Arg, SubOp> operator-(const ExprBase<Arg>& arg) {
+    return BinaryExpr<ScalarExpr, Arg, SubOp>(ScalarExpr(0.0f), arg.Self());
+}
+
+//================================ Evaluation =================================
+
+template <typename T, typename E>
+class FusedExpressionT : public FusedExpression<T> {
+    public:
+        using Compute = typename ScalarTraits<T>::Compute;
+
+        explicit FusedExpressionT(const E& expr) : expr_(expr) {
+            expr_.CollectLeaves(&this->leaves_);
+        }
+
+        void Forward(T* values, std::size_t rows, std::size_t cols) const override {
+            E expr = expr_;
+            expr.Bind(rows, cols);
+
+            ParallelFor(rows, GetFusedRowsGrain(cols), [&](std::size_t begin, std::size_t end) {
+                for (std::size_t row = begin; row < end; row++) {
+                    for (std::size_t col = 0; col < cols; col++) {
+                        values[row * cols + col] = static_cast<Compute>(expr.Value(row, col));
+                    }
+                }
+            });
+        }
+
+        // A broadcast leaf sums its gradient over the rows, split between the
+        // threads as SmartMatrixT::EvalGradAddVector_() does.
+        void Backward(const SmartMatrixT<T>* leaf, T* leaf_grads,
+                      const T* grads, std::size_t rows, std::size_t cols) const override {
+            E expr = expr_;
+            expr.Bind(rows, cols);
+            expr.SelectLeaf(leaf);
+
+            if (leaf->GetRows() == rows) {
+                ParallelFor(rows, GetFusedRowsGrain(cols), [&](std::size_t begin, std::size_t end) {
+                    for (std::size_t row = begin; row < end; row++) {
+                        for (std::size_t col = 0; col < cols; col++) {
+                            std::size_t i = row * cols + col;
+                            leaf_grads[i] += static_cast<Compute>(grads[i] * expr.Derivative(row, col));
+                        }
+                    }
+                });
+                return;
+            }
+
+            std::vector<Compute> sums(cols);
+            ParallelReduce(rows, GetFusedRowsGrain(cols), cols, sums.data(),
+                           [&](std::size_t begin, std::size_t end, Compute* partial) {
+                for (std::size_t row = begin; row < end; row++) {
+                    for (std::size_t col = 0; col < cols; col++) {
+                        partial[col] += static_cast<Compute>(grads[row * cols + col] *
+                                                             expr.Derivative(row, col));
+                    }
+                }
+            });
+
+            for (std::size_t col = 0; col < cols; col++) {
+                leaf_grads[col] += sums[col];
+            }
+        }
+
+    private:
+        E expr_;
+};
+
+template <typename T, typename E>
+void Assign(SmartMatrixT<T>* output, const ExprBase<E>& expr) {
+    assert(output);
+    output->Fused(std::make_shared<FusedExpressionT<T, E>>(expr.Self()));
+}
+
+#endif // FUSED_EXPR_H_
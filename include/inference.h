@@ -0,0 +1,187 @@
+#ifndef INFERENCE_H_
+#define INFERENCE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "MLP.h"
+#include "checkpoint.h"
+
+// Forward passes from many threads against one set of weights.
+//
+// A SmartMatrix is a node of the autograd graph: every op writes the links
+// of its operands next to its own activations, so one network can only be
+// evaluated by one thread at a time. Here the parameters live in an
+// InferenceModel, which is never written after it is built and can be
+// shared by any number of threads. Each thread evaluates in its own
+// InferenceContext, which holds the graph nodes and the activations:
+//
+//     InferenceModel model(output_layer);
+//     ...
+//     InferenceContext context(&model);   // one per serving thread
+//     context.Eval(image);
+//     std::size_t label = context.GetLabel(0);
+//
+// Memory is the weights once plus the activations of every context.
+
+//=============================== InferenceModel ===============================
+
+class InferenceModel {
+    public:
+        // An empty model, to be filled by LoadCheckpoint().
+        InferenceModel();
+        // Copies the parameters of output_layer and of the layers under it.
+        explicit InferenceModel(OutputLayer* output_layer);
+        ~InferenceModel();
+
+        InferenceModel(const InferenceModel& other)            = delete;
+        InferenceModel& operator=(const InferenceModel& other) = delete;
+
+        // Copies the parameters of a checkpoint of MiddleLayer::
+        // SaveParamsToCheckpoint()s. The model is left empty on failure.
+        // Not thread-safe: load first, then share.
+        CheckpointError LoadCheckpoint(const CheckpointReader& reader);
+
+        bool                IsEmpty()         const;
+        std::size_t         GetInputsCount()  const;
+        std::size_t         GetOutputsCount() const;
+        // Dense layers, the output one included.
+        std::size_t         GetLayersCount()  const;
+        CheckpointLayerType GetOutputType()   const;
+        // Unique to these parameters within the process: every model built
+        // or loaded gets a new one, an empty model has 0. Caches of outputs
+        // key on it.
+        uint64_t            GetVersion()      const;
+
+        std::size_t  GetLayerInputsCount (std::size_t layer) const;
+        std::size_t  GetLayerOutputsCount(std::size_t layer) const;
+        const float* GetWeights(std::size_t layer) const;
+        const float* GetBiases (std::size_t layer) const;
+
+        // Gradient storage large enough for any parameter. The contexts'
+        // parameter nodes point their grads at it instead of owning them;
+        // forward passes never touch it.
+        float* GetSharedGrads() const;
+
+    private:
+        struct LayerShape {
+            std::size_t n_inputs;
+            std::size_t n_outputs;
+            std::size_t weights_offset;
+            std::size_t biases_offset;
+        };
+
+        std::vector<LayerShape> layers_;
+        CheckpointLayerType     output_type_;
+        uint64_t                version_;
+
+        std::vector<float>         params_;
+        mutable std::vector<float> shared_grads_;
+
+        void Clear_();
+        void AddLayer_(std::size_t n_inputs, std::size_t n_outputs,
+                       const float* weights, const float* biases);
+        void RegisterMemory_();
+};
+
+//============================== InferenceContext ==============================
+
+class InferenceContext {
+    public:
+        // Evaluates n_examples inputs at once. The model must outlive the
+        // context.
+        explicit InferenceContext(const InferenceModel* model, std::size_t n_examples = 1);
+        ~InferenceContext();
+
+        InferenceContext(const InferenceContext& other)            = delete;
+        InferenceContext& operator=(const InferenceContext& other) = delete;
+
+        // inputs is n_examples x GetInputsCount() of the model, row-major.
+        void Eval(const float* inputs);
+        // Eval() from the first layer's product onwards: first_product is
+        // n_examples x GetLayerOutputsCount(0), the inputs times the first
+        // weights, before the biases.
+        void EvalFromFirstProduct(const float* first_product);
+
+        // n_examples x GetOutputsCount(): the class probabilities for a
+        // discrete output layer, the sigmoid outputs otherwise.
+        const float* GetOutputs() const;
+        float        GetOutput(std::size_t example, std::size_t output) const;
+        std::size_t  GetLabel (std::size_t example) const;
+
+        std::size_t  GetExamplesCount() const;
+        const InferenceModel* GetModel() const;
+
+    private:
+        // Same nodes as MiddleLayer. The parameters are views into the model.
+        struct DenseNodes {
+            DenseNodes(std::size_t n_examples, std::size_t n_inputs, std::size_t n_outputs);
+            ~DenseNodes();
+
+            SmartMatrix weights;
+            SmartMatrix biases;
+            SmartMatrix unbiased_output;
+            SmartMatrix output;
+        };
+
+        const InferenceModel* model_;
+        const std::size_t     n_examples_;
+
+        SmartMatrix             input_;
+        std::vector<DenseNodes> layers_;
+        // Logits of a discrete output layer, softmax goes into its output.
+        SmartMatrix             biased_output_;
+
+        void EvalFromFirstProduct_();
+};
+
+//============================ IncrementalInference ============================
+
+// One example evaluated again and again with a few inputs changed in
+// between, e.g. a drawing after every stroke. The product of the inputs
+// and the first weights, n_inputs x n_hidden multiply-adds and by far the
+// largest layer, is kept: changing input i by d adds d times row i of the
+// weights to it, n_hidden multiply-adds. The layers after it are evaluated
+// in full, they are small.
+//
+// Rounding errors of the updates accumulate, so the product is computed
+// anew once as many rows have been added as it has inputs, which keeps the
+// amortized cost at most that of Eval() from scratch.
+class IncrementalInference {
+    public:
+        // Starts from all-zero inputs. The model must outlive the session.
+        explicit IncrementalInference(const InferenceModel* model);
+        ~IncrementalInference();
+
+        IncrementalInference(const IncrementalInference& other)            = delete;
+        IncrementalInference& operator=(const IncrementalInference& other) = delete;
+
+        // Evaluates inputs, updating the product with the inputs that
+        // differ from the previous ones. Comparing costs n_inputs reads.
+        void Eval(const float* inputs);
+        // Sets inputs[indices[i]] = values[i], then evaluates.
+        void Update(const std::size_t* indices, const float* values, std::size_t n_changed);
+        // Evaluates inputs with the product computed from scratch.
+        void Reset(const float* inputs);
+
+        const float* GetInputs()  const;
+        const float* GetOutputs() const;
+        float        GetOutput(std::size_t output) const;
+        std::size_t  GetLabel() const;
+
+        // Rows of the first weights added since the last full product.
+        std::size_t  GetUpdatedRowsCount() const;
+
+    private:
+        const InferenceModel*    model_;
+        InferenceContext         context_;
+        std::vector<float>       inputs_;
+        std::vector<float>       first_product_;
+        std::size_t              n_updated_rows_;
+        std::vector<std::size_t> changed_;
+        std::vector<float>       changed_values_;
+
+        void ComputeFirstProduct_();
+};
+
+#endif // INFERENCE_H_
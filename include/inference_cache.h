@@ -0,0 +1,79 @@
+#ifndef INFERENCE_CACHE_H_
+#define INFERENCE_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Outputs of recent inputs, so that a repeated request skips the forward
+// pass. Entries are keyed by a hash of the input bytes and the version of
+// the model that computed them (InferenceModel::GetVersion()): loading new
+// weights makes a new version, and the old entries can no longer be found;
+// the LRU order then evicts them.
+//
+// A hit is confirmed by comparing the whole input, so a hash collision
+// costs a miss, never a wrong answer. The capacity is split between
+// stripes, each with its own lock and LRU list, picked by the hash; the
+// memory used is bounded by capacity * (n_inputs + n_outputs) floats plus
+// the bookkeeping.
+
+//=============================== InferenceCache ===============================
+
+class InferenceCache {
+    public:
+        // capacity is rounded up to a multiple of n_stripes.
+        InferenceCache(std::size_t n_inputs, std::size_t n_outputs,
+                       std::size_t capacity, std::size_t n_stripes = 16);
+        ~InferenceCache();
+
+        InferenceCache(const InferenceCache& other)            = delete;
+        InferenceCache& operator=(const InferenceCache& other) = delete;
+
+        // Copies the cached outputs of inputs into outputs and returns true,
+        // or returns false. All methods are thread-safe.
+        bool Lookup(uint64_t model_version, const float* inputs, float* outputs);
+        // Replaces the least recently used entry of the stripe when full.
+        void Insert(uint64_t model_version, const float* inputs, const float* outputs);
+        void Clear();
+
+        std::size_t GetInputsCount()  const;
+        std::size_t GetOutputsCount() const;
+        std::size_t GetCapacity()     const;
+        std::size_t GetSize()         const;
+        uint64_t    GetHitsCount()    const;
+        uint64_t    GetMissesCount()  const;
+
+    private:
+        struct Entry {
+            uint64_t           key;
+            uint64_t           model_version;
+            std::vector<float> values; // Inputs, then outputs
+        };
+
+        // Most recently used first.
+        struct alignas(64) Stripe {
+            Stripe();
+            ~Stripe();
+
+            mutable std::mutex                                       mutex;
+            std::list<Entry>                                         entries;
+            std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+            uint64_t                                                 n_hits;
+            uint64_t                                                 n_misses;
+        };
+
+        const std::size_t n_inputs_;
+        const std::size_t n_outputs_;
+        const std::size_t stripe_capacity_;
+
+        std::vector<std::unique_ptr<Stripe>> stripes_;
+
+        uint64_t GetKey_(uint64_t model_version, const float* inputs) const;
+        Stripe&  GetStripe_(uint64_t key);
+};
+
+#endif // INFERENCE_CACHE_H_
@@ -0,0 +1,128 @@
+#ifndef INFERENCE_RING_H_
+#define INFERENCE_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "inference.h"
+
+// Predictions through a memory-mapped file shared with the producers.
+//
+// The file is a header followed by n_slots slots, each holding one image and
+// the probabilities computed for it. A producer claims a free slot, writes
+// the pixels into it and marks it ready; the engine evaluates the image
+// straight from the slot, writes the outputs next to it and marks it done;
+// the producer reads them and frees the slot. Every step is a store into
+// the mapping, so a round trip costs no system call while both sides are
+// awake.
+//
+// A side with nothing to do spins for a while, then sleeps on a futex after
+// raising a flag in the mapping. The other side only issues FUTEX_WAKE when
+// it sees that flag, i.e. when the sleeper could not be reached otherwise.
+//
+//   Slot state: Free -> Writing (producer) -> Ready -> Done (engine) -> Free
+//
+// Byte layout, host byte order (mnist/draw.py mirrors it):
+//
+//   0   InferenceRingHeader              64 bytes
+//   64  slot 0: InferenceRingSlotHeader  64 bytes
+//           n_inputs  floats
+//           n_outputs floats, padded to slot_size
+//   ... slot i at 64 + i * slot_size
+
+enum class InferenceSlotState : uint32_t {
+    Free,
+    Writing,
+    Ready,
+    Done,
+};
+
+struct InferenceRingHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t n_slots;
+    uint32_t n_inputs;
+    uint32_t n_outputs;
+    uint32_t slot_size;
+    // 1 while an engine serves the ring.
+    std::atomic<uint32_t> running;
+    // 1 while the engine sleeps on doorbell, which producers bump on every
+    // request that they mark ready.
+    std::atomic<uint32_t> engine_sleeping;
+    std::atomic<uint32_t> doorbell;
+    uint8_t  reserved[24];
+};
+
+struct InferenceRingSlotHeader {
+    std::atomic<uint32_t> state;    // InferenceSlotState
+    // 1 while the producer sleeps on state, waiting for Done.
+    std::atomic<uint32_t> producer_sleeping;
+    uint8_t  reserved[56];
+};
+
+//============================ InferenceRingServer =============================
+
+class InferenceRingServer {
+    public:
+        // Creates (or resets) the ring file for the model's shapes; put it
+        // on tmpfs (/dev/shm) so that the pages never go to disk. The model
+        // must outlive the server.
+        InferenceRingServer(const InferenceModel* model, const char* file_name, std::size_t n_slots);
+        ~InferenceRingServer();
+
+        InferenceRingServer(const InferenceRingServer& other)            = delete;
+        InferenceRingServer& operator=(const InferenceRingServer& other) = delete;
+
+        bool IsOpen() const;
+
+        // Evaluates ready slots until Stop().
+        void Serve();
+        // Callable from any thread.
+        void Stop();
+
+        std::size_t GetServedCount() const;
+
+    private:
+        const InferenceModel*    model_;
+        const std::string        file_name_;
+        uint8_t*                 map_;
+        std::size_t              map_size_;
+        // One per slot: a producer that reuses its slot, like draw.py
+        // while drawing, only pays for the pixels it changed.
+        std::vector<std::unique_ptr<IncrementalInference>> sessions_;
+        std::atomic<bool>        stopping_;
+        std::atomic<std::size_t> n_served_;
+
+        // Serves every ready slot once, returns how many there were.
+        std::size_t ServeReadySlots_();
+};
+
+//============================ InferenceRingClient =============================
+
+// A producer in C++, e.g. for benchmarks. Thread-safe: concurrent Predict()
+// calls claim different slots.
+class InferenceRingClient {
+    public:
+        explicit InferenceRingClient(const char* file_name);
+        ~InferenceRingClient();
+
+        InferenceRingClient(const InferenceRingClient& other)            = delete;
+        InferenceRingClient& operator=(const InferenceRingClient& other) = delete;
+
+        bool IsOpen() const;
+
+        std::size_t GetInputsCount()  const;
+        std::size_t GetOutputsCount() const;
+
+        // Fails if no engine serves the ring, or stops before answering.
+        bool Predict(const float* inputs, float* outputs);
+
+    private:
+        uint8_t*    map_;
+        std::size_t map_size_;
+};
+
+#endif // INFERENCE_RING_H_
@@ -0,0 +1,203 @@
+#ifndef INFERENCE_SERVER_H_
+#define INFERENCE_SERVER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "inference.h"
+#include "inference_cache.h"
+
+// Long-running inference over a Unix domain socket.
+//
+// Every connection is served by its own thread, which reads one request at a
+// time and waits for its answer. The requests of all connections meet in one
+// queue; a batching thread takes up to max_batch of them, evaluates them as
+// one batch (one matrix product per layer) and hands the outputs back. A
+// batch starts once it is full or once its oldest request has waited
+// max_delay, so the delay bounds what batching adds to the latency. With a
+// cache, a request whose inputs were seen before is answered by the
+// connection thread without queueing, and is left out of the latencies.
+//
+// Wire format, host byte order since both ends are on one machine: a request
+// is an InferenceRequestHeader followed by n_values floats, the response an
+// InferenceResponseHeader followed by n_values floats.
+//
+//   Predict: the model's inputs in, its outputs (class probabilities) out.
+//   Stats:   no values in; out, an InferenceStatsCounters between the header
+//            and the values, then p50, p90, p99 and max in microseconds.
+//            The counters are integers so they stay exact past 2^24.
+//
+// Any other type or n_values is answered with BadRequest and no values, and
+// the connection is closed without reading the payload.
+
+enum class InferenceRequestType : uint32_t {
+    Predict,
+    Stats,
+};
+
+enum class InferenceStatus : uint32_t {
+    Ok,
+    BadRequest,
+};
+
+struct InferenceRequestHeader {
+    uint32_t type; // InferenceRequestType
+    uint32_t n_values;
+};
+
+struct InferenceResponseHeader {
+    uint32_t status; // InferenceStatus
+    uint32_t n_values;
+};
+
+struct InferenceStatsCounters {
+    uint64_t n_requests;
+    uint64_t n_batches;
+};
+
+const std::size_t kLatencySummaryValues = 4;
+
+// Latencies from a request's arrival to its answer, over the last requests.
+struct LatencySummary {
+    std::size_t n_requests; // Since the start, not only the window
+    std::size_t n_batches;
+    double      p50;        // Seconds
+    double      p90;
+    double      p99;
+    double      max;
+    double      mean_batch; // Requests per evaluated batch
+};
+
+//================================ LatencyStats ================================
+
+class LatencyStats {
+    public:
+        explicit LatencyStats(std::size_t window = 1 << 16);
+        ~LatencyStats();
+
+        LatencyStats(const LatencyStats& other)            = delete;
+        LatencyStats& operator=(const LatencyStats& other) = delete;
+
+        void AddBatch(const double* latencies, std::size_t n_requests);
+
+        LatencySummary GetSummary() const;
+
+    private:
+        mutable std::mutex  mutex_;
+        std::vector<double> window_;
+        std::size_t         n_requests_;
+        std::size_t         n_batches_;
+};
+
+//============================== InferenceServer ===============================
+
+class InferenceServer {
+    public:
+        // Listens on socket_path, replacing a stale socket file. The model
+        // must outlive the server. cache_capacity 0 disables the cache.
+        InferenceServer(const InferenceModel* model, const char* socket_path,
+                        std::size_t max_batch, std::chrono::microseconds max_delay,
+                        std::size_t cache_capacity = 0);
+        ~InferenceServer();
+
+        InferenceServer(const InferenceServer& other)            = delete;
+        InferenceServer& operator=(const InferenceServer& other) = delete;
+
+        bool IsOpen() const;
+
+        // Accepts and serves connections until Stop(), then closes them and
+        // returns once every thread has finished.
+        void Serve();
+        // Callable from any thread, e.g. one waiting for SIGTERM.
+        void Stop();
+
+        LatencySummary GetLatencySummary() const;
+        // nullptr without a cache.
+        const InferenceCache* GetCache() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        // Lives on the stack of its connection thread until done.
+        struct Request {
+            const float*      inputs;
+            float*            outputs;
+            Clock::time_point arrival;
+            bool              done;
+        };
+
+        struct Connection {
+            int               fd;
+            std::thread       thread;
+            std::atomic<bool> finished;
+        };
+
+        const InferenceModel*      model_;
+        const std::string          socket_path_;
+        const std::size_t          max_batch_;
+        const Clock::duration      max_delay_;
+        int                        listen_fd_;
+        std::atomic<bool>          stopping_;
+
+        std::mutex                 queue_mutex_;
+        std::condition_variable    queue_changed_;
+        std::condition_variable    requests_done_;
+        std::deque<Request*>       queue_;
+
+        // One context per batch size: powers of two below max_batch and
+        // max_batch itself. A batch runs in the smallest one it fits.
+        std::vector<std::unique_ptr<InferenceContext>> contexts_;
+        std::vector<float>                             batch_inputs_;
+
+        std::list<Connection>           connections_;
+        LatencyStats                    stats_;
+        std::unique_ptr<InferenceCache> cache_;
+
+        void BatchLoop_();
+        void EvalBatch_(Request* const* requests, std::size_t n_requests);
+        void ServeConnection_(Connection* connection);
+        void ReapConnections_(bool all);
+
+        // Queues the request and waits for the batching thread to answer it.
+        void Predict_(const float* inputs, float* outputs);
+};
+
+//============================== InferenceClient ===============================
+
+// Blocking client of an InferenceServer, one request at a time.
+class InferenceClient {
+    public:
+        explicit InferenceClient(const char* socket_path);
+        ~InferenceClient();
+
+        InferenceClient(const InferenceClient& other)            = delete;
+        InferenceClient& operator=(const InferenceClient& other) = delete;
+
+        bool IsOpen() const;
+
+        // outputs receives n_outputs values. Fails on a closed connection
+        // or if the server rejects the shapes.
+        bool Predict(const float* inputs, std::size_t n_inputs,
+                     float* outputs, std::size_t n_outputs);
+        bool GetStats(LatencySummary* summary);
+
+    private:
+        int fd_;
+
+        // counters, if given, receives the InferenceStatsCounters that
+        // precede the results of a successful Stats request.
+        bool Call_(InferenceRequestType type, const float* values, std::size_t n_values,
+                   float* results, std::size_t n_results,
+                   InferenceStatsCounters* counters = nullptr);
+};
+
+#endif // INFERENCE_SERVER_H_
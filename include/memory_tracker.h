@@ -0,0 +1,103 @@
+#ifndef MEMORY_TRACKER_H_
+#define MEMORY_TRACKER_H_
+
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+
+// Accounting of the large buffers: matrix values and gradients, the flat
+// parameter buffer, optimizer state. Every buffer is registered under a tag
+// (the owning layer, e.g. "middle1") and a role, so current and peak bytes
+// can be broken down at any time.
+
+enum class MemoryRole {
+    Weights,
+    Activation,
+    Grad,
+    Target,
+    OptimizerState,
+    Other,
+};
+
+const std::size_t kMemoryRolesCount = 6;
+
+const char* MemoryRoleString(MemoryRole role);
+
+struct MemoryUsage {
+    std::size_t current_bytes;
+    std::size_t peak_bytes;
+    std::size_t n_buffers;
+};
+
+class MemoryTracker {
+    public:
+        // Called instead of the allocation that would take the total over the
+        // budget. The allocation goes ahead if the hook returns.
+        using BudgetHook = std::function<void(std::size_t requested_bytes,
+                                              std::size_t current_bytes,
+                                              std::size_t budget_bytes)>;
+
+        // Zero-initialized, registered buffer of n elements. Free() also
+        // accepts buffers allocated with new[] and registered with Register().
+        template <typename T>
+        static T*   Allocate(std::size_t n, const char* tag, MemoryRole role);
+        template <typename T>
+        static void Free(T* data);
+
+        // For buffers allocated elsewhere. The tag is copied. Runs the budget
+        // check for what the buffer adds before counting it; the memory is
+        // already taken by then, so allocate through Allocate() where
+        // possible.
+        static void Register  (const void* data, std::size_t bytes, const char* tag, MemoryRole role);
+        static void Unregister(const void* data);
+        static void Retag     (const void* data, const char* tag, MemoryRole role);
+
+        // Returns a copy of the tag that lives as long as the process.
+        static const char* InternTag(const char* tag);
+
+        static MemoryUsage GetTotalUsage();
+        static MemoryUsage GetRoleUsage(MemoryRole role);
+        static MemoryUsage GetTagUsage (const char* tag);
+        // Peaks start over from the current usage.
+        static void ResetPeaks();
+
+        // 0 disables the budget. Without a hook, going over it prints the
+        // dump and aborts.
+        static void SetBudget(std::size_t budget_bytes, BudgetHook hook = nullptr);
+
+        // Live buffers per tag and role, then current and peak bytes per
+        // role and in total.
+        static void Dump(std::ostream& out);
+
+        // Runs the budget check for an allocation of that many bytes.
+        static void CheckBudget(std::size_t bytes);
+
+    private:
+        // Register() without the budget check, which Allocate() ran already.
+        static void RegisterChecked_(const void* data, std::size_t bytes, const char* tag, MemoryRole role);
+};
+
+
+template <typename T>
+T* MemoryTracker::Allocate(std::size_t n, const char* tag, MemoryRole role) {
+    CheckBudget(n * sizeof(T));
+
+    T* data = new T[n]{};
+    RegisterChecked_(data, n * sizeof(T), tag, role);
+
+    return data;
+}
+
+
+template <typename T>
+void MemoryTracker::Free(T* data) {
+    if (!data) {
+        return;
+    }
+
+    Unregister(data);
+    delete[] data;
+}
+
+#endif // MEMORY_TRACKER_H_
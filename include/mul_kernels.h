@@ -0,0 +1,83 @@
+#ifndef MUL_KERNELS_H_
+#define MUL_KERNELS_H_
+
+#include <cstddef>
+#include "scalar.h"
+#include "../chubarov_lib/chubarov.h"
+
+// The matrix product kernels of SmartMatrixT, chosen by the element type at
+// compile time. float goes to the chubarov backend (CPU or CUDA), the other
+// types to the reference loops below, which do the arithmetic in the type's
+// compute precision.
+//
+// Local notation: (NxL) * (LxM) = (NxM).
+
+template <typename T>
+struct MulKernels {
+    using Compute = typename ScalarTraits<T>::Compute;
+
+    static void Mul(std::size_t N, std::size_t M, std::size_t L,
+                    T* output, const T* first, const T* second) {
+        for (std::size_t n = 0; n < N; n++) {
+            for (std::size_t m = 0; m < M; m++) {
+                Compute value = 0;
+
+                for (std::size_t l = 0; l < L; l++) {
+                    value += Compute(first[n * L + l]) * Compute(second[l * M + m]);
+                }
+
+                output[n * M + m] = value;
+            }
+        }
+    }
+
+    static void EvalGradLMul(std::size_t N, std::size_t M, std::size_t L,
+                             T* grads, const T* sibling_values, const T* parent_grads) {
+        for (std::size_t n = 0; n < N; n++) {
+            for (std::size_t l = 0; l < L; l++) {
+                Compute grad = grads[n * L + l];
+
+                for (std::size_t m = 0; m < M; m++) {
+                    grad += Compute(sibling_values[l * M + m]) * Compute(parent_grads[n * M + m]);
+                }
+
+                grads[n * L + l] = grad;
+            }
+        }
+    }
+
+    static void EvalGradRMul(std::size_t N, std::size_t M, std::size_t L,
+                             T* grads, const T* sibling_values, const T* parent_grads) {
+        for (std::size_t l = 0; l < L; l++) {
+            for (std::size_t m = 0; m < M; m++) {
+                Compute grad = grads[l * M + m];
+
+                for (std::size_t n = 0; n < N; n++) {
+                    grad += Compute(sibling_values[n * L + l]) * Compute(parent_grads[n * M + m]);
+                }
+
+                grads[l * M + m] = grad;
+            }
+        }
+    }
+};
+
+template <>
+struct MulKernels<float> {
+    static void Mul(std::size_t N, std::size_t M, std::size_t L,
+                    float* output, const float* first, const float* second) {
+        Chubarov_Mul(N, M, L, output, first, second);
+    }
+
+    static void EvalGradLMul(std::size_t N, std::size_t M, std::size_t L,
+                             float* grads, const float* sibling_values, const float* parent_grads) {
+        Chubarov_EvalGradLMul(N, M, L, grads, sibling_values, parent_grads);
+    }
+
+    static void EvalGradRMul(std::size_t N, std::size_t M, std::size_t L,
+                             float* grads, const float* sibling_values, const float* parent_grads) {
+        Chubarov_EvalGradRMul(N, M, L, grads, sibling_values, parent_grads);
+    }
+};
+
+#endif // MUL_KERNELS_H_
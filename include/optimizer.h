@@ -0,0 +1,99 @@
+#ifndef OPTIMIZER_H_
+#define OPTIMIZER_H_
+
+#include <cstddef>
+#include <vector>
+#include "smart_matrix.h"
+
+// Optimizers own the per-parameter state (momentum, second moments) and
+// update each parameter with one fused pass that reads the gradient, the
+// state and the value once per element.
+class Optimizer {
+    public:
+        explicit Optimizer(float learning_rate);
+        virtual ~Optimizer();
+
+        Optimizer(const Optimizer& other)            = delete;
+        Optimizer& operator=(const Optimizer& other) = delete;
+
+        // The matrix must outlive the optimizer. Its storage may be swapped
+        // (e.g. by loading a checkpoint), the state is kept per element.
+        void AddParam(SmartMatrix* param);
+        void Step();
+
+        void  SetLearningRate(float learning_rate);
+        float GetLearningRate() const;
+        std::size_t GetStepsCount() const;
+
+    protected:
+        float       learning_rate_;
+        std::size_t n_steps_;
+
+        virtual std::size_t GetStatesCount() const = 0;
+
+        // Called once per step before the per-parameter updates.
+        virtual void BeginStep();
+
+        // states holds GetStatesCount() arrays of n_elems floats each.
+        virtual void Update(std::size_t n_elems, float* values, const float* grads,
+                            float* const* states) = 0;
+
+    private:
+        std::vector<SmartMatrix*>        params_;
+        std::vector<std::vector<float>>  states_;
+        std::vector<float*>              state_ptrs_;
+};
+
+// Plain SGD when momentum is zero, heavy ball or Nesterov momentum otherwise.
+// weight_decay is added to the gradient (L2 regularization).
+class SGD : public Optimizer {
+    public:
+        explicit SGD(float learning_rate, float momentum = 0.0f,
+                     bool nesterov = false, float weight_decay = 0.0f);
+        ~SGD();
+
+    protected:
+        std::size_t GetStatesCount() const override;
+        void Update(std::size_t n_elems, float* values, const float* grads,
+                    float* const* states) override;
+
+    private:
+        const float momentum_;
+        const bool  nesterov_;
+        const float weight_decay_;
+};
+
+// Adam; with decoupled_weight_decay set it is AdamW, otherwise weight_decay
+// is added to the gradient.
+class Adam : public Optimizer {
+    public:
+        explicit Adam(float learning_rate, float beta1 = 0.9f, float beta2 = 0.999f,
+                      float epsilon = 1e-8f, float weight_decay = 0.0f,
+                      bool decoupled_weight_decay = false);
+        ~Adam();
+
+    protected:
+        std::size_t GetStatesCount() const override;
+        void BeginStep() override;
+        void Update(std::size_t n_elems, float* values, const float* grads,
+                    float* const* states) override;
+
+    private:
+        const float beta1_;
+        const float beta2_;
+        const float epsilon_;
+        const float weight_decay_;
+        const bool  decoupled_weight_decay_;
+
+        float step_size_;
+        float bias_correction2_sqrt_;
+};
+
+class AdamW : public Adam {
+    public:
+        explicit AdamW(float learning_rate, float weight_decay = 1e-2f,
+                       float beta1 = 0.9f, float beta2 = 0.999f, float epsilon = 1e-8f);
+        ~AdamW();
+};
+
+#endif // OPTIMIZER_H_
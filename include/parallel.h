@@ -0,0 +1,31 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <cstddef>
+#include <functional>
+#include "thread_pool.h"
+
+// Loops over [0, n) split into chunks of grain iterations, run on a
+// process-wide pool with one thread per core. The chunks depend only on n
+// and grain, never on the threads count, so results are the same on any
+// machine. Ranges of at most grain iterations run inline on the caller, and
+// so do calls made from inside another pool's task.
+
+ThreadPool* GetSharedThreadPool();
+
+void ParallelFor(std::size_t n, std::size_t grain,
+                 const std::function<void(std::size_t begin, std::size_t end)>& body);
+
+template <typename T>
+struct ReduceBody {
+    using Type = std::function<void(std::size_t begin, std::size_t end, T* partial)>;
+};
+
+// Every chunk accumulates into its own zeroed partial of width values, the
+// partials are then summed pairwise (chunk 0 + 1, 2 + 3, ..., then the
+// pairs) into result. Instantiated for float and double.
+template <typename T>
+void ParallelReduce(std::size_t n, std::size_t grain, std::size_t width, T* result,
+                    const typename ReduceBody<T>::Type& body);
+
+#endif // PARALLEL_H_
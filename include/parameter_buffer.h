@@ -0,0 +1,66 @@
+#ifndef PARAMETER_BUFFER_H_
+#define PARAMETER_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "smart_matrix.h"
+#include "checkpoint.h"
+
+// All trainable parameters of a network in one contiguous buffer.
+//
+// Every parameter matrix becomes a view into the buffer, for both values and
+// grads, so optimizer steps, norms and clipping are single passes over it and
+// the gradients can be exchanged as one transfer. Each parameter starts at a
+// kCheckpointAlignment boundary, which is exactly the checkpoint section
+// layout: a checkpoint written from the views is the buffer plus headers and
+// can be mapped back as a whole.
+class ParameterBuffer {
+    public:
+        explicit ParameterBuffer(const std::vector<SmartMatrix*>& params);
+        ~ParameterBuffer();
+
+        ParameterBuffer(const ParameterBuffer& other)            = delete;
+        ParameterBuffer& operator=(const ParameterBuffer& other) = delete;
+
+        // 1 x GetSize() matrix over the whole buffer, e.g. for an Optimizer.
+        SmartMatrix* GetFlat();
+
+        std::size_t  GetSize() const;
+        std::size_t  GetParamsCount() const;
+        std::size_t  GetParamOffset(std::size_t param) const;
+        float*       GetValues();
+        float*       GetGrads();
+        // Changes whenever the values change through the flat matrix or any
+        // parameter, see SmartMatrix::GetValuesGeneration().
+        uint64_t     GetGeneration() const;
+
+        void  ResetGrads();
+        float GetGradNorm() const;
+        // Scales the gradients down to max_norm if their norm is above it.
+        // Returns the norm before clipping.
+        float ClipGradNorm(float max_norm);
+
+        // Points the whole buffer at the reader's mapping. Fails if the
+        // tensors are not laid out as this buffer is.
+        CheckpointError MapCheckpoint(const CheckpointReader& reader);
+
+        // Shares values laid out like this buffer, e.g. another replica's.
+        // The grads stay private.
+        void MapValues(float* values);
+
+    private:
+        std::vector<SmartMatrix*> params_;
+        std::vector<std::size_t>  offsets_;
+        std::size_t               size_;
+
+        std::vector<float> values_storage_;
+        std::vector<float> grads_storage_;
+        float*             values_;
+
+        SmartMatrix flat_;
+
+        void MapParams_();
+};
+
+#endif // PARAMETER_BUFFER_H_
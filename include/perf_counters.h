@@ -0,0 +1,107 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Hardware counters around code regions, compiled in with -D PERF_COUNTERS
+// (make PERF=1).
+//
+// PERF_REGION() reads the calling thread's perf_event_open counters when the
+// enclosing block starts and ends and adds the difference, the wall time and
+// the given FLOPs and bytes to the region's totals. The counters are opened
+// on a thread's first read and count that thread only.
+//
+// PERF_REGION_THREADS() is for a block whose work runs on n_threads threads
+// of a pool or a scheduler. It reads a second set of counters that the
+// threads started later inherit: read them (IsAvailable()) before starting
+// the pool. Every region is compared with the roofs measured on its thread
+// count. Counters the kernel or the CPU does not offer (containers,
+// perf_event_paranoid, virtual machines) are skipped and reported as n/a,
+// the rest of the report still works.
+//
+// FLOPs come from the caller: there is no portable FP-ops event, so they
+// are counted analytically from the shapes, as in the kernel benchmark.
+
+enum class PerfEvent {
+    Cycles,
+    Instructions,
+    L1dAccesses,
+    L1dMisses,
+    LlcReferences,
+    LlcMisses,
+};
+
+const std::size_t kPerfEventsCount = 6;
+
+struct RooflinePeaks {
+    std::size_t n_threads; // Threads the roofs were measured on
+    double      gflops;    // Compute roof
+    double      gbps;      // Memory roof
+};
+
+class PerfMonitor {
+    public:
+        // Whether this thread could open at least one counter. Opens both
+        // of its counter sets.
+        static bool IsAvailable();
+
+        // Counter values of the calling thread, or of it and the threads it
+        // started after its first read if inherited, scaled for
+        // multiplexing. Unavailable events read as -1.
+        static void ReadCounters(double counters[kPerfEventsCount], bool inherited = false);
+
+        static void AddSample(const char* region, std::size_t n_threads, double seconds,
+                              const double begin[kPerfEventsCount],
+                              const double end  [kPerfEventsCount],
+                              double flops, double bytes);
+        static void Reset();
+
+        // Roofs of this host on n_threads threads at once, measured with a
+        // multiply-add loop and a streaming read; takes about a second.
+        static RooflinePeaks MeasurePeaks(std::size_t n_threads = 1);
+
+        // Per region: IPC, L1d and LLC miss rates, achieved FLOP/s against
+        // the roof at the region's arithmetic intensity, and which roof it
+        // is under. The roofs are those of peaks measured on the region's
+        // thread count; a region without them is reported without a roof.
+        static void PrintRoofline(std::ostream& out, const std::vector<RooflinePeaks>& peaks);
+};
+
+class PerfRegion {
+    public:
+        PerfRegion(const char* name, std::size_t n_threads, bool inherited,
+                   double flops, double bytes);
+        ~PerfRegion();
+
+        PerfRegion(const PerfRegion& other)            = delete;
+        PerfRegion& operator=(const PerfRegion& other) = delete;
+
+    private:
+        const char* name_;
+        std::size_t n_threads_;
+        bool        inherited_;
+        double      flops_;
+        double      bytes_;
+        double      begin_time_;
+        double      begin_[kPerfEventsCount];
+};
+
+#define PERF_CONCAT_IMPL_(a, b) a##b
+#define PERF_CONCAT_(a, b)      PERF_CONCAT_IMPL_(a, b)
+
+#ifdef PERF_COUNTERS
+#define PERF_REGION(name, flops, bytes) \
+    PerfRegion PERF_CONCAT_(perf_region_, __LINE__)(name, 1, false, \
+                                                   static_cast<double>(flops), static_cast<double>(bytes))
+#define PERF_REGION_THREADS(name, n_threads, flops, bytes) \
+    PerfRegion PERF_CONCAT_(perf_region_, __LINE__)(name, n_threads, true, \
+                                                   static_cast<double>(flops), static_cast<double>(bytes))
+#else
+#define PERF_REGION(name, flops, bytes)                    do {} while (0)
+#define PERF_REGION_THREADS(name, n_threads, flops, bytes) do {} while (0)
+#endif
+
+#endif // PERF_COUNTERS_H_
@@ -0,0 +1,71 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Per-op instrumentation, compiled in with -D PROFILE (make PROFILE=1).
+//
+// PROFILE_SCOPE() times the rest of the enclosing block and records it with
+// its shape, FLOPs and bytes moved. Every thread appends to its own ring
+// buffer without locks, the oldest events are overwritten once it is full.
+// Without PROFILE the macro expands to nothing and its arguments are not
+// evaluated.
+
+struct ProfileEvent {
+    const char* name;     // Static string
+    const char* category; // "forward", "backward", ...
+    uint64_t    begin_ns;
+    uint64_t    end_ns;
+    uint64_t    rows;
+    uint64_t    cols;
+    double      flops;
+    double      bytes;
+};
+
+class Profiler {
+    public:
+        static const std::size_t kRingSize = 1 << 16;
+
+        static uint64_t GetTimeNs();
+        static void     Record(const ProfileEvent& event);
+
+        // The readers below must not race with threads that are recording,
+        // call them between steps.
+        static std::vector<ProfileEvent> GetEvents(std::vector<std::size_t>* thread_ids);
+        static void Reset();
+
+        // Chrome trace event format, open in chrome://tracing or Perfetto.
+        static bool WriteChromeTrace(const char* file_name);
+        // Time per op name, sorted by total time.
+        static void PrintSummary(std::ostream& out);
+};
+
+class ProfileScope {
+    public:
+        ProfileScope(const char* name, const char* category,
+                     std::size_t rows, std::size_t cols, double flops, double bytes);
+        ~ProfileScope();
+
+        ProfileScope(const ProfileScope& other)            = delete;
+        ProfileScope& operator=(const ProfileScope& other) = delete;
+
+    private:
+        ProfileEvent event_;
+};
+
+#define PROFILE_CONCAT_IMPL_(a, b) a##b
+#define PROFILE_CONCAT_(a, b)      PROFILE_CONCAT_IMPL_(a, b)
+
+#ifdef PROFILE
+#define PROFILE_SCOPE(name, category, rows, cols, flops, bytes)                         \
+    ProfileScope PROFILE_CONCAT_(profile_scope_, __LINE__)(                             \
+        name, category, rows, cols, static_cast<double>(flops), static_cast<double>(bytes))
+#else
+#define PROFILE_SCOPE(name, category, rows, cols, flops, bytes) do {} while (0)
+#endif
+
+#endif // PROFILER_H_
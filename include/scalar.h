@@ -0,0 +1,108 @@
+#ifndef SCALAR_H_
+#define SCALAR_H_
+
+#include <cstdint>
+#include <cstring>
+
+// Element types of SmartMatrixT and the layers.
+//
+// Every type has a compute type, the precision its ops do the arithmetic
+// in: a matrix stores T, its loops load Compute, work in it and store T
+// back. float and double are their own compute type. Half is a storage
+// type only, it is computed in float.
+
+// IEEE 754 binary16. Converts to and from float, rounding to nearest even.
+class Half {
+    public:
+        Half() : bits_(0) {}
+        Half(float value) : bits_(FromFloat_(value)) {}
+
+        operator float() const { return ToFloat_(bits_); }
+
+        Half& operator+=(float value) { return *this = Half(float(*this) + value); }
+        Half& operator-=(float value) { return *this = Half(float(*this) - value); }
+
+        uint16_t GetBits() const { return bits_; }
+
+    private:
+        uint16_t bits_;
+
+        static float BitsToFloat_(uint32_t bits) {
+            float value = 0.0f;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        static uint32_t FloatToBits_(float value) {
+            uint32_t bits = 0;
+            memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+        // Subnormal halves and the rounding of small floats go through the
+        // float adder with a magic constant instead of a loop over the bits.
+        static float ToFloat_(uint16_t half) {
+            const uint32_t kShiftedExp = 0x7c00u << 13;
+
+            uint32_t bits = (half & 0x7fffu) << 13;
+            uint32_t exp  = bits & kShiftedExp;
+            bits += (127u - 15u) << 23;
+
+            if (exp == kShiftedExp) {        // Inf or NaN
+                bits += (128u - 16u) << 23;
+            } else if (exp == 0) {           // Zero or subnormal
+                bits += 1u << 23;
+                bits  = FloatToBits_(BitsToFloat_(bits) - BitsToFloat_(113u << 23));
+            }
+
+            return BitsToFloat_(bits | static_cast<uint32_t>(half & 0x8000u) << 16);
+        }
+
+        static uint16_t FromFloat_(float value) {
+            const uint32_t kInfinity  = 255u << 23;
+            const uint32_t kHalfMax   = (127u + 16u) << 23;
+            const uint32_t kDenormMagic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+            uint32_t bits = FloatToBits_(value);
+            uint32_t sign = bits & 0x80000000u;
+            bits ^= sign;
+
+            uint32_t half = 0;
+            if (bits >= kHalfMax) {          // Overflow, Inf or NaN
+                half = bits > kInfinity ? 0x7e00u : 0x7c00u;
+            } else if (bits < (113u << 23)) { // Subnormal or zero
+                bits = FloatToBits_(BitsToFloat_(bits) + BitsToFloat_(kDenormMagic));
+                half = bits - kDenormMagic;
+            } else {
+                uint32_t mantissa_odd = (bits >> 13) & 1u;
+                bits += ((15u - 127u) << 23) + 0xfffu;
+                bits += mantissa_odd;
+                half  = bits >> 13;
+            }
+
+            return static_cast<uint16_t>(half | sign >> 16);
+        }
+};
+
+template <typename T>
+struct ScalarTraits;
+
+template <>
+struct ScalarTraits<float> {
+    using Compute = float;
+    static const char* GetName() { return "float"; }
+};
+
+template <>
+struct ScalarTraits<double> {
+    using Compute = double;
+    static const char* GetName() { return "double"; }
+};
+
+template <>
+struct ScalarTraits<Half> {
+    using Compute = float;
+    static const char* GetName() { return "half"; }
+};
+
+#endif // SCALAR_H_
@@ -2,46 +2,95 @@
 #define SMART_MATRIX_H_
 
 #include <cstddef>
+#include <cstdint>
 #include <fstream>
-#include "../chubarov_lib/chubarov.h"
+#include <memory>
+#include "scalar.h"
+#include "memory_tracker.h"
 
-class SmartMatrix {
+template <typename T> class SmartMatrixT;
+template <typename T> class FusedExpression;
+class TaskScheduler;
 
+// The network's default precision.
+using SmartMatrix = SmartMatrixT<float>;
+
+// Notified by EvalGrad() as soon as a matrix's gradient is complete. With
+// a scheduler it may be called from several threads at once.
+template <typename T>
+class GradReadyHookT {
     public:
-        SmartMatrix(std::size_t n_rows, std::size_t n_cols);
-        SmartMatrix(const SmartMatrix& other);
-        SmartMatrix(SmartMatrix&& other);
-        SmartMatrix& operator=(const SmartMatrix& other);
-        SmartMatrix& operator=(SmartMatrix&& other);
-        ~SmartMatrix();
-
-        void Add              (SmartMatrix* first,  SmartMatrix* second);
-        void AddVectorToMatrix(SmartMatrix* matrix, SmartMatrix* vector);
-        void Sub              (SmartMatrix* first,  SmartMatrix* second);
-        void Mul              (SmartMatrix* first,  SmartMatrix* second);
-        void SquaredErrorLoss (SmartMatrix* src,    SmartMatrix* ref);
-        void CrossEntropyLoss (SmartMatrix* src,    SmartMatrix* ref);
-        void Sigm             (SmartMatrix* first);
-        void Softmax          (SmartMatrix* matrix);
-
-        float GetValue(std::size_t row, std::size_t col) const;
-        float GetGrad (std::size_t row, std::size_t col) const;
+        virtual ~GradReadyHookT();
+        virtual void OnGradReady(SmartMatrixT<T>* matrix) = 0;
+};
+
+using GradReadyHook = GradReadyHookT<float>;
+
+// A matrix and its gradient, a node of the autograd graph. T is the element
+// type (float, double or Half, see scalar.h); values are taken and returned
+// in its compute type. The ops are instantiated in smart_matrix.cpp.
+template <typename T>
+class SmartMatrixT {
+    friend class ExecutionPlan;
+
+    public:
+        using Compute = typename ScalarTraits<T>::Compute;
+
+        SmartMatrixT(std::size_t n_rows, std::size_t n_cols);
+        SmartMatrixT(const SmartMatrixT& other);
+        SmartMatrixT(SmartMatrixT&& other);
+        SmartMatrixT& operator=(const SmartMatrixT& other);
+        SmartMatrixT& operator=(SmartMatrixT&& other);
+        ~SmartMatrixT();
+
+        void Add              (SmartMatrixT* first,  SmartMatrixT* second);
+        void AddVectorToMatrix(SmartMatrixT* matrix, SmartMatrixT* vector);
+        void Sub              (SmartMatrixT* first,  SmartMatrixT* second);
+        void Mul              (SmartMatrixT* first,  SmartMatrixT* second);
+        void SquaredErrorLoss (SmartMatrixT* src,    SmartMatrixT* ref);
+        void CrossEntropyLoss (SmartMatrixT* src,    SmartMatrixT* ref);
+        void CrossEntropyLoss (SmartMatrixT* src,    const uint32_t* labels);
+        void Sigm             (SmartMatrixT* first);
+        void Softmax          (SmartMatrixT* matrix);
+        // Elementwise expression in one pass, see Assign() in fused_expr.h.
+        void Fused            (std::shared_ptr<const FusedExpression<T>> expr);
+
+        Compute GetValue(std::size_t row, std::size_t col) const;
+        Compute GetGrad (std::size_t row, std::size_t col) const;
         std::size_t GetRows() const;
         std::size_t GetCols() const;
 
-        void SetMatrixValue(float value);
+        void SetMatrixValue(Compute value);
         void SetMatrixNormRand();
-        void SetMatrixGrad(float value);
-        void SetValue(std::size_t row, std::size_t col, float value);
-        void SetGrad (std::size_t row, std::size_t col, float value);
-        void AddGrad (std::size_t row, std::size_t col, float value);
-
-        const float* GetValues() const;
-        void SetValues(float* values);
+        void SetMatrixGrad(Compute value);
+        void SetValue(std::size_t row, std::size_t col, Compute value);
+        void SetGrad (std::size_t row, std::size_t col, Compute value);
+        void AddGrad (std::size_t row, std::size_t col, Compute value);
+
+        const T* GetValues() const;
+        T*       GetMutableValues();
+        const T* GetGrads() const;
+        void SetValues(T* values);
+        // Points the matrix at storage it does not own (e.g. a mapped
+        // checkpoint). The storage must outlive the matrix or be replaced.
+        void MapValues(T* values);
+        void MapGrads (T* grads);
+        // Owned gradients are accounted as MemoryRole::Grad under the same tag.
+        void SetMemoryTag(const char* tag, MemoryRole role);
+
+        // Counts the changes of the values other than by evaluating an op:
+        // the setters, MapValues(), AdjustValues(). Code writing through
+        // GetMutableValues() calls MarkValuesChanged() itself.
+        uint64_t GetValuesGeneration() const;
+        void     MarkValuesChanged();
 
         void EvalGrad();
+        // Same gradients, with independent subgraphs (e.g. the weights and
+        // the input of a Mul) evaluated concurrently.
+        void EvalGrad(TaskScheduler* scheduler);
+        void SetGradReadyHook(GradReadyHookT<T>* hook);
         void ResetGrad();
-        void AdjustValues(float step);
+        void AdjustValues(Compute step);
 
         void Dump() const;
 
@@ -61,29 +110,42 @@ class SmartMatrix {
             SquaredErrorLossRef,
             CrossEntropyLossSrc,
             CrossEntropyLossRef,
+            CrossEntropyLossLabels,
+            Fused,
         };
 
-        float* values_;
-        float* grads_;
+        T* values_;
+        T* grads_;
+        bool owns_values_;
+        bool owns_grads_;
         const std::size_t n_rows_;
         const std::size_t n_cols_;
         const std::size_t n_elems_;
         OperationType parent_oper_;
-        SmartMatrix* sibling_;
-        SmartMatrix* parent_;
-        SmartMatrix* child1_;
-        SmartMatrix* child2_;
-
-        void SetBinaryFamily(SmartMatrix* first, SmartMatrix* second,
+        SmartMatrixT* sibling_;
+        SmartMatrixT* parent_;
+        SmartMatrixT* child1_;
+        SmartMatrixT* child2_;
+        const uint32_t*     labels_; // Not owned, one class index per row of child1_
+        GradReadyHookT<T>*  grad_ready_hook_;
+        std::shared_ptr<const FusedExpression<T>> fused_; // Set if this is the output of Fused()
+        const char*     memory_tag_; // Interned by MemoryTracker
+        MemoryRole      memory_role_;
+        uint64_t        values_generation_;
+
+        void SetBinaryFamily(SmartMatrixT* first, SmartMatrixT* second,
                              OperationType type_first, OperationType type_second);
-        void SetBinaryFamily(SmartMatrix* first, SmartMatrix* second,
+        void SetBinaryFamily(SmartMatrixT* first, SmartMatrixT* second,
                              OperationType type);
-        void SetUnaryFamily(SmartMatrix* first, OperationType type);
+        void SetUnaryFamily(SmartMatrixT* first, OperationType type);
+        void SetFusedFamily(std::shared_ptr<const FusedExpression<T>> expr);
 
         void DumpMatrix_   (                std::ofstream& out) const;
         void DumpRecursive_(bool isSibling, std::ofstream& out) const;
 
         void EvalGradRecursive_();
+        void EvalGradNode_();
+        void SpawnChildrenGrads_(TaskScheduler* scheduler);
         void EvalGradRSub_();
         void EvalGradAddMatrixLSubAdd_();
         void EvalGradLMul_();
@@ -92,10 +154,15 @@ class SmartMatrix {
         void EvalGradSoftmax_();
         void EvalGradSquaredErrorLossSrc_();
         void EvalGradCrossEntropyLossSrc_();
+        void EvalGradCrossEntropyLossLabels_();
         void EvalGradAddVector_();
+        void EvalGradFused_();
 
-        const float crossEntropyLossEpsilon = 1e-10f;
+        const Compute crossEntropyLossEpsilon = Compute(1e-10f);
 };
 
+using SmartMatrixD = SmartMatrixT<double>;
+using SmartMatrixH = SmartMatrixT<Half>;
+
 #endif // SMART_MATRIX_H_
 
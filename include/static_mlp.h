@@ -0,0 +1,309 @@
+#ifndef STATIC_MLP_H_
+#define STATIC_MLP_H_
+
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+// Inference-only network with the shape fixed at compile time:
+//
+//     static StaticMLP<784, 16, 16, 10> mlp;
+//     mlp.LoadCheckpoint("mnist/mnist_weights/model.ckpt");
+//     mlp.Forward(image, probabilities);
+//
+// The dimensions are template parameters, so every loop has a constant trip
+// count and the compiler unrolls the neuron loops into a few vector registers.
+// Same network as MiddleLayer...OutputLayerDiscret: sigmoid on the hidden
+// layers, softmax on the output. Parameters and activations live inside the
+// object and nothing is allocated, the loaders copy into it.
+
+//============================== StaticDenseLayer ==============================
+
+template <std::size_t Inputs, std::size_t Outputs>
+class StaticDenseLayer {
+    public:
+        static_assert(Inputs > 0 && Outputs > 0, "empty layer");
+
+        static const std::size_t kWeightsCount = Inputs * Outputs;
+
+        // outputs = inputs * weights + biases, weights are Inputs x Outputs
+        // row-major as in SmartMatrix.
+        void Forward(const float* inputs, float* outputs) const {
+            alignas(64) float sums[Outputs] = {};
+
+            for (std::size_t i = 0; i < Inputs; i++) {
+                const float  input = inputs[i];
+                const float* row   = weights_ + i * Outputs;
+
+                for (std::size_t j = 0; j < Outputs; j++) {
+                    sums[j] += input * row[j];
+                }
+            }
+
+            for (std::size_t j = 0; j < Outputs; j++) {
+                outputs[j] = sums[j] + biases_[j];
+            }
+        }
+
+        // The format of MiddleLayer::SaveParamsToFile(): size_t count and the
+        // weights, size_t count and the biases.
+        CheckpointError LoadParamsFromFile(const char* file_name) {
+            int fd = open(file_name, O_RDONLY);
+            if (fd < 0) {
+                return CheckpointError::OpenFailed;
+            }
+
+            CheckpointError error = ReadTensor_(fd, weights_, kWeightsCount);
+            if (error == CheckpointError::Ok) {
+                error = ReadTensor_(fd, biases_, Outputs);
+            }
+
+            close(fd);
+            return error;
+        }
+
+        // Same checks as MiddleLayer::CheckCheckpointParams().
+        static CheckpointError CheckCheckpointParams(const CheckpointReader& reader, std::size_t layer,
+                                                     CheckpointLayerType type) {
+            if (layer >= reader.GetLayersCount()) {
+                return CheckpointError::ShapeMismatch;
+            }
+
+            const CheckpointLayerInfo& info = reader.GetLayer(layer);
+            if (info.type      != static_cast<uint32_t>(type) ||
+                info.n_inputs  != Inputs ||
+                info.n_outputs != Outputs) {
+                return CheckpointError::ShapeMismatch;
+            }
+
+            const CheckpointTensorInfo* weights = reader.FindTensor(layer, CheckpointRole::Weights);
+            const CheckpointTensorInfo* biases  = reader.FindTensor(layer, CheckpointRole::Biases);
+            if (weights == nullptr || biases == nullptr ||
+                weights->rows != Inputs || weights->cols != Outputs ||
+                biases ->rows != 1      || biases ->cols != Outputs) {
+                return CheckpointError::ShapeMismatch;
+            }
+
+            return CheckpointError::Ok;
+        }
+
+        // The layer must have passed CheckCheckpointParams().
+        void CopyCheckpointParams(const CheckpointReader& reader, std::size_t layer) {
+            memcpy(weights_, reader.GetTensorData(reader.FindTensor(layer, CheckpointRole::Weights)),
+                   sizeof(weights_));
+            memcpy(biases_,  reader.GetTensorData(reader.FindTensor(layer, CheckpointRole::Biases)),
+                   sizeof(biases_));
+        }
+
+        const float* GetWeights() const { return weights_; }
+        const float* GetBiases()  const { return biases_;  }
+
+    private:
+        alignas(64) float weights_[kWeightsCount] = {};
+        alignas(64) float biases_ [Outputs]       = {};
+
+        static CheckpointError ReadTensor_(int fd, float* values, std::size_t n_values) {
+            std::size_t n_stored = 0;
+            if (!ReadAll_(fd, &n_stored, sizeof(n_stored))) {
+                return CheckpointError::Truncated;
+            }
+            if (n_stored != n_values) {
+                return CheckpointError::ShapeMismatch;
+            }
+
+            return ReadAll_(fd, values, n_values * sizeof(float)) ? CheckpointError::Ok
+                                                                  : CheckpointError::Truncated;
+        }
+
+        static bool ReadAll_(int fd, void* buffer, std::size_t n_bytes) {
+            char* bytes = static_cast<char*>(buffer);
+
+            while (n_bytes > 0) {
+                ssize_t n_read = read(fd, bytes, n_bytes);
+                if (n_read <= 0) {
+                    return false;
+                }
+
+                bytes   += n_read;
+                n_bytes -= static_cast<std::size_t>(n_read);
+            }
+
+            return true;
+        }
+};
+
+//================================ StaticLayers ================================
+
+// Same formulas as SmartMatrix::Sigm() and SmartMatrix::Softmax().
+template <std::size_t Size>
+inline void StaticSigm(float* values) {
+    for (std::size_t i = 0; i < Size; i++) {
+        values[i] = 1 / (1 + expf(-values[i]));
+    }
+}
+
+template <std::size_t Size>
+inline void StaticSoftmax(float* values) {
+    float exp_sum = 0.0f;
+    for (std::size_t i = 0; i < Size; i++) {
+        exp_sum += expf(values[i]);
+    }
+
+    for (std::size_t i = 0; i < Size; i++) {
+        values[i] = expf(values[i]) / exp_sum;
+    }
+}
+
+// A dense layer and the rest of the network after it. The hidden
+// activations are locals of Forward(): batch 1 needs no more than that.
+template <std::size_t Inputs, std::size_t Outputs, std::size_t... Rest>
+class StaticLayers {
+    public:
+        static const std::size_t kLayersCount = 1 + StaticLayers<Outputs, Rest...>::kLayersCount;
+        static const std::size_t kOutputs     = StaticLayers<Outputs, Rest...>::kOutputs;
+
+        void Forward(const float* inputs, float* outputs) const {
+            alignas(64) float hidden[Outputs];
+
+            layer_.Forward(inputs, hidden);
+            StaticSigm<Outputs>(hidden);
+            next_.Forward(hidden, outputs);
+        }
+
+        CheckpointError LoadParamsFromFile(std::size_t layer, const char* file_name) {
+            return layer == 0 ? layer_.LoadParamsFromFile(file_name)
+                              : next_ .LoadParamsFromFile(layer - 1, file_name);
+        }
+
+        // This layer is the checkpoint's layer number first.
+        CheckpointError CheckCheckpointParams(const CheckpointReader& reader, std::size_t first) const {
+            CheckpointError error = StaticDenseLayer<Inputs, Outputs>::CheckCheckpointParams(
+                reader, first, CheckpointLayerType::Middle);
+            return error == CheckpointError::Ok ? next_.CheckCheckpointParams(reader, first + 1) : error;
+        }
+
+        void CopyCheckpointParams(const CheckpointReader& reader, std::size_t first) {
+            layer_.CopyCheckpointParams(reader, first);
+            next_ .CopyCheckpointParams(reader, first + 1);
+        }
+
+    private:
+        StaticDenseLayer<Inputs, Outputs> layer_;
+        StaticLayers<Outputs, Rest...>    next_;
+};
+
+template <std::size_t Inputs, std::size_t Outputs>
+class StaticLayers<Inputs, Outputs> {
+    public:
+        static const std::size_t kLayersCount = 1;
+        static const std::size_t kOutputs     = Outputs;
+
+        void Forward(const float* inputs, float* outputs) const {
+            layer_.Forward(inputs, outputs);
+            StaticSoftmax<Outputs>(outputs);
+        }
+
+        CheckpointError LoadParamsFromFile(std::size_t layer, const char* file_name) {
+            return layer == 0 ? layer_.LoadParamsFromFile(file_name)
+                              : CheckpointError::ShapeMismatch;
+        }
+
+        CheckpointError CheckCheckpointParams(const CheckpointReader& reader, std::size_t first) const {
+            return StaticDenseLayer<Inputs, Outputs>::CheckCheckpointParams(
+                reader, first, CheckpointLayerType::OutputDiscret);
+        }
+
+        void CopyCheckpointParams(const CheckpointReader& reader, std::size_t first) {
+            layer_.CopyCheckpointParams(reader, first);
+        }
+
+    private:
+        StaticDenseLayer<Inputs, Outputs> layer_;
+};
+
+//================================= StaticMLP ==================================
+
+template <std::size_t Inputs, std::size_t... Neurons>
+class StaticMLP {
+    public:
+        static_assert(sizeof...(Neurons) > 0, "StaticMLP needs an output layer");
+
+        static const std::size_t kInputs      = Inputs;
+        static const std::size_t kOutputs     = StaticLayers<Inputs, Neurons...>::kOutputs;
+        static const std::size_t kLayersCount = StaticLayers<Inputs, Neurons...>::kLayersCount;
+
+        // inputs[kInputs] -> outputs[kOutputs], the class probabilities.
+        void Forward(const float* inputs, float* outputs) const {
+            layers_.Forward(inputs, outputs);
+        }
+
+        std::size_t GetLabel(const float* inputs) const {
+            alignas(64) float outputs[kOutputs];
+            Forward(inputs, outputs);
+
+            std::size_t label = 0;
+            for (std::size_t i = 1; i < kOutputs; i++) {
+                if (outputs[i] > outputs[label]) {
+                    label = i;
+                }
+            }
+
+            return label;
+        }
+
+        // Layer 0 is the first hidden one.
+        CheckpointError LoadParamsFromFile(std::size_t layer, const char* file_name) {
+            return layers_.LoadParamsFromFile(layer, file_name);
+        }
+
+        // The files Mnist::LoadWeights() falls back to: middle1.data ...
+        // middleN.data and output.data.
+        CheckpointError LoadParamsFromFolder(const char* folder_path) {
+            char file_name[4096];
+
+            for (std::size_t layer = 0; layer < kLayersCount; layer++) {
+                int length = layer + 1 < kLayersCount
+                           ? snprintf(file_name, sizeof(file_name), "%s/middle%zu.data", folder_path, layer + 1)
+                           : snprintf(file_name, sizeof(file_name), "%s/output.data", folder_path);
+                if (length < 0 || static_cast<std::size_t>(length) >= sizeof(file_name)) {
+                    return CheckpointError::OpenFailed;
+                }
+
+                CheckpointError error = LoadParamsFromFile(layer, file_name);
+                if (error != CheckpointError::Ok) {
+                    return error;
+                }
+            }
+
+            return CheckpointError::Ok;
+        }
+
+        // A checkpoint written by Mnist::SaveWeights(). As in
+        // Mnist::LoadCheckpoint(), the whole file is rejected before any
+        // layer is touched if its layers are not those of this network.
+        CheckpointError LoadCheckpoint(const char* file_name) {
+            CheckpointReader reader;
+            CheckpointError  error = reader.Open(file_name);
+
+            if (error == CheckpointError::Ok && reader.GetLayersCount() != kLayersCount) {
+                error = CheckpointError::ShapeMismatch;
+            }
+            if (error == CheckpointError::Ok) {
+                error = layers_.CheckCheckpointParams(reader, 0);
+            }
+            if (error == CheckpointError::Ok) {
+                layers_.CopyCheckpointParams(reader, 0);
+            }
+
+            return error;
+        }
+
+    private:
+        StaticLayers<Inputs, Neurons...> layers_;
+};
+
+#endif // STATIC_MLP_H_
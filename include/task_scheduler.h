@@ -0,0 +1,62 @@
+#ifndef TASK_SCHEDULER_H_
+#define TASK_SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing scheduler for task graphs that unfold while they run.
+//
+// Run() executes a root task which may Spawn() more tasks, those may spawn
+// further ones, and so on; it returns once all of them are done. Every
+// thread keeps its own deque: it pushes and pops spawned tasks at the back,
+// so a single thread runs them in the same depth-first order as plain
+// recursion, while idle threads steal the oldest tasks from the front.
+class TaskScheduler {
+    public:
+        using Task = std::function<void()>;
+
+        // n_threads counts the thread calling Run(), so 1 means no workers.
+        explicit TaskScheduler(std::size_t n_threads);
+        ~TaskScheduler();
+
+        TaskScheduler(const TaskScheduler& other)            = delete;
+        TaskScheduler& operator=(const TaskScheduler& other) = delete;
+
+        std::size_t GetThreadsCount() const;
+
+        // Not reentrant: must not be called from inside a task.
+        void Run(Task root);
+
+        // Only from inside a task of this scheduler.
+        void Spawn(Task task);
+
+    private:
+        struct alignas(64) Queue {
+            std::mutex       mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues_;
+        std::vector<std::thread>            workers_;
+
+        std::atomic<std::size_t> n_pending_;
+
+        std::mutex              run_mutex_;
+        std::mutex              mutex_;
+        std::condition_variable wake_workers_;
+        std::size_t             generation_;
+        bool                    stop_;
+
+        void WorkerLoop_(std::size_t index);
+        void RunUntilDone_(std::size_t index);
+        bool PopOrSteal_(std::size_t index, Task* task);
+};
+
+#endif // TASK_SCHEDULER_H_
@@ -0,0 +1,51 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running index-parallel jobs.
+//
+// Run() hands out task indices to the workers and to the calling thread and
+// returns when all of them are done. It is not reentrant: a Run() issued from
+// inside a task, or while another thread's job is in flight, executes its
+// tasks serially on the calling thread instead of waiting for the pool.
+class ThreadPool {
+    public:
+        // n_threads counts the calling thread, so 1 means no workers.
+        explicit ThreadPool(std::size_t n_threads);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool& other)            = delete;
+        ThreadPool& operator=(const ThreadPool& other) = delete;
+
+        std::size_t GetThreadsCount() const;
+
+        void Run(std::size_t n_tasks, const std::function<void(std::size_t)>& task);
+
+    private:
+        std::vector<std::thread> workers_;
+
+        std::mutex              run_mutex_;
+        std::mutex              mutex_;
+        std::condition_variable wake_workers_;
+        std::condition_variable wake_caller_;
+
+        const std::function<void(std::size_t)>* task_;
+        std::size_t              n_tasks_;
+        std::atomic<std::size_t> next_task_;
+        std::size_t              n_done_;
+        std::size_t              n_active_;
+        std::size_t              generation_;
+        bool                     stop_;
+
+        void WorkerLoop_();
+        std::size_t RunTasks_(const std::function<void(std::size_t)>& task, std::size_t n_tasks);
+};
+
+#endif // THREAD_POOL_H_
@@ -1,11 +1,44 @@
 #include "include/smart_matrix.h"
 #include "include/MLP.h"
+#include "include/optimizer.h"
+#include "include/parameter_buffer.h"
+#include "include/data_parallel.h"
+#include "include/communicator.h"
+#include "include/distributed_trainer.h"
+#include "include/task_scheduler.h"
+#include "include/profiler.h"
+#include "include/perf_counters.h"
+#include "include/memory_tracker.h"
+#include "include/conformance.h"
+#include "include/execution_plan.h"
+#include "include/inference_server.h"
+#include "include/inference_ring.h"
 #include "mnist/mnist_parser/mnist_parser.h"
 
 #include <iostream>
 #include <assert.h>
+#include <cmath>
 #include <immintrin.h>
 #include <iomanip>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <csignal>
 
 void TestSmartMatrix();
 void TestMLP();
@@ -13,9 +46,139 @@ void TestMnistParser();
 void TestWriting();
 void TestMnistLib();
 
+// Checks run by --selftest: each failed one is printed, and all are counted.
+struct SelfTest {
+    std::size_t n_checks;
+    std::size_t n_failures;
+};
+
+void TestInferenceServer(SelfTest* test);
+void TestInferenceRing  (SelfTest* test);
+void TestAllReduce      (SelfTest* test);
+
 void TrainMnist();
+void TrainMnistDataParallel();
+void CompareHogwildMnist();
+
+int  LaunchDistributed  (std::size_t n_ranks, const char* transport, uint16_t base_port);
+int  RunDistributedWorker(std::size_t rank, std::size_t n_ranks,
+                          const char* transport, const char* endpoint);
+int  RunInferenceServer  (const char* checkpoint_name, const char* socket_path,
+                          std::size_t max_batch, std::size_t max_delay_us,
+                          std::size_t cache_capacity);
+int  RunInferenceRing    (const char* checkpoint_name, const char* ring_name, std::size_t n_slots);
+
+// Gradients are scaled down to this norm before an optimizer step, so that
+// one bad batch can't throw the weights far off.
+static const float kMaxGradNorm = 5.0f;
+
+static const char kUsage[] =
+    "gpt                          - single process training\n"
+    "gpt --launch <n> <shm|tcp> [base_port]\n"
+    "                             - data-parallel training in n processes\n"
+    "gpt --conformance [seed]     - checks the kernels, fails if any is off\n"
+    "gpt --selftest               - checks serving and all-reduce, fails if any is off\n"
+    "gpt --serve <checkpoint> <socket> [max_batch] [max_delay_us] [cache_entries]\n"
+    "                             - serves predictions over a Unix socket\n"
+    "gpt --ring <checkpoint> <ring_file> [n_slots]\n"
+    "                             - serves predictions through shared memory\n";
+
+
+static int PrintUsage(const char* arg) {
+    std::cerr << "Bad argument: " << arg << "\n" << kUsage;
+    return 1;
+}
+
+
+// Whole decimal numbers only: strtoull() alone takes "-1", "12abc" or "".
+static bool ParseNumber(const char* arg, unsigned long long* value) {
+    assert(arg);
+    assert(value);
+
+    if (!isdigit(static_cast<unsigned char>(arg[0]))) {
+        return false;
+    }
+
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long parsed = strtoull(arg, &end, 10);
+    if (errno != 0 || *end != '\0') {
+        return false;
+    }
+
+    *value = parsed;
+    return true;
+}
+
+
+static bool ParseNumber(const char* arg, std::size_t* value) {
+    unsigned long long parsed = 0;
+    if (!ParseNumber(arg, &parsed) || parsed > SIZE_MAX) {
+        return false;
+    }
+
+    *value = static_cast<std::size_t>(parsed);
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    if (argc >= 4 && argc <= 5 && strcmp(argv[1], "--launch") == 0) {
+        std::size_t n_ranks   = 0;
+        std::size_t base_port = 29500;
+        if (!ParseNumber(argv[2], &n_ranks)) {
+            return PrintUsage(argv[2]);
+        }
+        if (argc == 5 && (!ParseNumber(argv[4], &base_port) || base_port == 0 ||
+                          base_port + n_ranks > UINT16_MAX + 1)) {
+            return PrintUsage(argv[4]);
+        }
+        return LaunchDistributed(n_ranks, argv[3], static_cast<uint16_t>(base_port));
+    }
+    if (argc == 6 && strcmp(argv[1], "--worker") == 0) {
+        std::size_t rank    = 0;
+        std::size_t n_ranks = 0;
+        if (!ParseNumber(argv[2], &rank)) {
+            return PrintUsage(argv[2]);
+        }
+        if (!ParseNumber(argv[3], &n_ranks)) {
+            return PrintUsage(argv[3]);
+        }
+        return RunDistributedWorker(rank, n_ranks, argv[4], argv[5]);
+    }
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "--conformance") == 0) {
+        unsigned long long seed = 0;
+        if (argc == 3 && !ParseNumber(argv[2], &seed)) {
+            return PrintUsage(argv[2]);
+        }
+        ConformanceSuite suite(argc == 3 ? seed : std::random_device()(), std::cout);
+        return suite.Run() == 0 ? 0 : 1;
+    }
+    if (argc == 2 && strcmp(argv[1], "--selftest") == 0) {
+        SelfTest test = {};
+        TestInferenceServer(&test);
+        TestInferenceRing  (&test);
+        TestAllReduce      (&test);
+        std::cout << "Self-test: " << test.n_checks << " checks, " << test.n_failures << " failed\n";
+        return test.n_failures == 0 ? 0 : 1;
+    }
+    if (argc >= 4 && argc <= 7 && strcmp(argv[1], "--serve") == 0) {
+        std::size_t values[3] = {32, 500, 0}; // max_batch, max_delay_us, cache_capacity
+        for (int i = 4; i < argc; i++) {
+            if (!ParseNumber(argv[i], &values[i - 4])) {
+                return PrintUsage(argv[i]);
+            }
+        }
+        return RunInferenceServer(argv[2], argv[3], values[0], values[1], values[2]);
+    }
+    if (argc >= 4 && argc <= 5 && strcmp(argv[1], "--ring") == 0) {
+        std::size_t n_slots = 8;
+        if (argc == 5 && !ParseNumber(argv[4], &n_slots)) {
+            return PrintUsage(argv[4]);
+        }
+        return RunInferenceRing(argv[2], argv[3], n_slots);
+    }
 
-int main() {
     TrainMnist();
 }
 
@@ -164,13 +327,15 @@ void TrainMnist() {
     MiddleLayer middle_layer2(&middle_layer1, kMiddleNeurons);
     OutputLayerDiscret output_layer (&middle_layer2, kOutputNeurons);
 
+    middle_layer1.SetMemoryTag("middle1");
+    middle_layer2.SetMemoryTag("middle2");
+
     for (std::size_t example = 0; example < kExamples; example++) {
         for (std::size_t neuron = 0; neuron < kInputNeurons; neuron++) {
             input_layer.SetValue(example, neuron, (float)images_buffer[example * kInputNeurons + neuron]/256);
         }
-
-        output_layer.SetExpectedValue(example, labels_buffer[example], 1.0f);
     }
+    output_layer.SetLabels(labels_buffer);
 
     middle_layer1.SetNormalRand();
     middle_layer2.SetNormalRand();
@@ -181,7 +346,7 @@ void TrainMnist() {
             input_layer.SetValue(example - kExamples, neuron, (float)images_buffer[example * kInputNeurons + neuron]/256);
         }
 
-        output_layer.SetExpectedValue(example, labels_buffer[example], 1.0f);
+        output_layer.SetLabel(example - kExamples, labels_buffer[example]);
     }
 
     // middle_layer1.LoadParamsFromFile(middle_layer1_saveload);
@@ -191,15 +356,76 @@ void TrainMnist() {
     // output_layer.EvalRecursive();
 
     bool isSaving = false;
-    const float kStep = 0.00005f;
+    const float kStep = 1e-3f;
     const std::size_t kIterations = 1'000'000;
+
+    std::vector<SmartMatrix*> params;
+    output_layer.CollectParamsRecursive(&params);
+    ParameterBuffer parameter_buffer(params);
+
+    Adam optimizer(kStep);
+    optimizer.AddParam(parameter_buffer.GetFlat());
+
+    const std::size_t kThreads = std::max(1u, std::thread::hardware_concurrency());
+
+#ifdef PERF_COUNTERS
+    // Opens this thread's counters before the scheduler and the pool start
+    // their threads, so that train_step counts them too. The kernels run on
+    // one thread each and are compared with single-thread roofs.
+    PerfMonitor::IsAvailable();
+    std::vector<RooflinePeaks> peaks = {PerfMonitor::MeasurePeaks(1)};
+    if (kThreads > 1) {
+        peaks.push_back(PerfMonitor::MeasurePeaks(kThreads));
+    }
+#endif
+
+    TaskScheduler scheduler(kThreads);
+    output_layer.SetScheduler(&scheduler);
+
+    ExecutionPlan train_step;
+
     for (std::size_t i = 0; i < kIterations; i++) {
-        output_layer.ResetGradsRecursive();
-        output_layer.EvalRecursive();
+        {
+            // FLOPs of the three products forward and both of their
+            // gradients backward, bytes of a single pass over the inputs.
+            PERF_REGION_THREADS("train_step", kThreads,
+                                6 * kExamples * (kInputNeurons * kMiddleNeurons +
+                                                 kMiddleNeurons * kMiddleNeurons +
+                                                 kMiddleNeurons * kOutputNeurons),
+                                kExamples * kInputNeurons * sizeof(float));
+
+            if (train_step.IsEmpty()) {
+                train_step.Record([&] {
+                    output_layer.ResetGradsRecursive();
+                    output_layer.EvalRecursive();
+                });
+            } else {
+                train_step.Replay();
+            }
+            parameter_buffer.ClipGradNorm(kMaxGradNorm);
+            optimizer.Step();
+        }
 
         std::cout << "Iteration " << i << ": loss = " << output_layer.GetLoss() << "\n"; 
 
-        output_layer.BackpropagateRecursive(kStep);
+        if (i == 0) {
+            MemoryTracker::Dump(std::cout);
+        }
+
+#ifdef PERF_COUNTERS
+        if (i % 100 == 99) {
+            PerfMonitor::PrintRoofline(std::cout, peaks);
+            PerfMonitor::Reset();
+        }
+#endif
+
+#ifdef PROFILE
+        if (i % 100 == 99) {
+            Profiler::PrintSummary(std::cout);
+            Profiler::WriteChromeTrace("trace.json");
+            Profiler::Reset();
+        }
+#endif
 
         if (i % 100 == 0 && isSaving) {
             std::cout << "Saving...\n";
@@ -216,6 +442,264 @@ void TrainMnist() {
 }
 
 
+void TrainMnistDataParallel() {
+    MnistParser mnist_parser("mnist/mnist_training_data/train-images.idx3-ubyte",
+                             "mnist/mnist_training_data/train-labels.idx1-ubyte");
+
+    MnistImages mnist_images = mnist_parser.GetMnistImages();
+    MnistLabels mnist_labels = mnist_parser.GetMnistLabels();
+
+    assert(mnist_labels.n_labels == mnist_images.n_images);
+
+    const std::size_t kExamples      = static_cast<std::size_t>(mnist_labels.n_labels);
+    const std::size_t kInputNeurons  = mnist_images.n_cols * mnist_images.n_rows;
+    const std::size_t kMiddleNeurons = 16;
+    const std::size_t kOutputNeurons = 10;
+    const std::size_t kReplicas      = std::max(1u, std::thread::hardware_concurrency());
+
+    DataParallelTrainer trainer(kInputNeurons, 2, kMiddleNeurons, kOutputNeurons,
+                                kExamples, kReplicas);
+
+    for (std::size_t example = 0; example < kExamples; example++) {
+        for (std::size_t neuron = 0; neuron < kInputNeurons; neuron++) {
+            float value = (float)mnist_images.buffer[example * kInputNeurons + neuron] / 256;
+            trainer.SetInput(example, neuron, value);
+        }
+    }
+    trainer.SetLabels(mnist_labels.buffer);
+
+    Adam optimizer(1e-3f);
+    optimizer.AddParam(trainer.GetParams()->GetFlat());
+
+    const std::size_t kIterations = 1'000;
+    for (std::size_t i = 0; i < kIterations; i++) {
+        float loss = trainer.EvalGrads();
+        trainer.GetParams()->ClipGradNorm(kMaxGradNorm);
+        optimizer.Step();
+        std::cout << "Iteration " << i << ": loss = " << loss << "\n";
+    }
+}
+
+
+// Same data, same initial weights, same number of passes over the data:
+// synchronous data-parallel SGD against lock-free Hogwild.
+void CompareHogwildMnist() {
+    MnistParser mnist_parser("mnist/mnist_training_data/train-images.idx3-ubyte",
+                             "mnist/mnist_training_data/train-labels.idx1-ubyte");
+
+    MnistImages mnist_images = mnist_parser.GetMnistImages();
+    MnistLabels mnist_labels = mnist_parser.GetMnistLabels();
+
+    const std::size_t kExamples      = 10'000;
+    const std::size_t kInputNeurons  = mnist_images.n_cols * mnist_images.n_rows;
+    const std::size_t kMiddleNeurons = 16;
+    const std::size_t kOutputNeurons = 10;
+    const std::size_t kReplicas      = std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t kIterations    = 200;
+    const float       kStep          = 1e-4f;
+
+    assert(mnist_images.n_images >= kExamples);
+
+    DataParallelTrainer sync_trainer   (kInputNeurons, 2, kMiddleNeurons, kOutputNeurons,
+                                        kExamples, kReplicas);
+    DataParallelTrainer hogwild_trainer(kInputNeurons, 2, kMiddleNeurons, kOutputNeurons,
+                                        kExamples, kReplicas);
+
+    for (std::size_t example = 0; example < kExamples; example++) {
+        for (std::size_t neuron = 0; neuron < kInputNeurons; neuron++) {
+            float value = (float)mnist_images.buffer[example * kInputNeurons + neuron] / 256;
+            sync_trainer   .SetInput(example, neuron, value);
+            hogwild_trainer.SetInput(example, neuron, value);
+        }
+    }
+    sync_trainer   .SetLabels(mnist_labels.buffer);
+    hogwild_trainer.SetLabels(mnist_labels.buffer);
+
+    const float* init_values = sync_trainer.GetParams()->GetValues();
+    std::copy(init_values, init_values + sync_trainer.GetParams()->GetSize(),
+              hogwild_trainer.GetParams()->GetValues());
+
+    SGD optimizer(kStep);
+    optimizer.AddParam(sync_trainer.GetParams()->GetFlat());
+
+    auto sync_start = std::chrono::steady_clock::now();
+    float sync_loss = 0.0f;
+    for (std::size_t i = 0; i < kIterations; i++) {
+        sync_loss = sync_trainer.Step(&optimizer);
+    }
+    auto sync_end = std::chrono::steady_clock::now();
+
+    std::vector<HogwildStats> stats;
+    float hogwild_loss = hogwild_trainer.RunHogwild(kStep, kIterations, &stats);
+    auto hogwild_end = std::chrono::steady_clock::now();
+
+    double sync_time    = std::chrono::duration<double>(sync_end    - sync_start).count();
+    double hogwild_time = std::chrono::duration<double>(hogwild_end - sync_end  ).count();
+    double n_passed     = static_cast<double>(kExamples * kIterations);
+
+    std::cout << "Synchronous: loss = " << sync_loss << ", "
+              << n_passed / sync_time << " examples/sec\n";
+    std::cout << "Hogwild:     loss = " << hogwild_loss << ", "
+              << n_passed / hogwild_time << " examples/sec\n";
+
+    for (std::size_t k = 0; k < stats.size(); k++) {
+        std::cout << "\tReplica " << k << ": updates = " << stats[k].n_updates
+                  << ", mean staleness = " << stats[k].mean_staleness
+                  << ", max staleness = "  << stats[k].max_staleness << "\n";
+    }
+}
+
+
+// Re-executes this binary once per rank in worker mode. The TCP ranks listen
+// on base_port + rank.
+int LaunchDistributed(std::size_t n_ranks, const char* transport, uint16_t base_port) {
+    assert(transport);
+
+    if (n_ranks == 0) {
+        std::cerr << "Need at least one rank\n";
+        return 1;
+    }
+
+    std::string endpoint;
+    if (strcmp(transport, "shm") == 0) {
+        endpoint = "/kgpt_" + std::to_string(getpid());
+        if (!ShmCommunicator::Create(endpoint.c_str(), n_ranks)) {
+            std::cerr << "Can't create shared memory segment " << endpoint << "\n";
+            return 1;
+        }
+    } else if (strcmp(transport, "tcp") == 0) {
+        endpoint = "127.0.0.1:" + std::to_string(base_port);
+    } else {
+        std::cerr << "Unknown transport " << transport << "\n";
+        return 1;
+    }
+
+    std::vector<pid_t> workers;
+    for (std::size_t rank = 0; rank < n_ranks; rank++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            std::string rank_str    = std::to_string(rank);
+            std::string n_ranks_str = std::to_string(n_ranks);
+            execl("/proc/self/exe", "gpt", "--worker", rank_str.c_str(), n_ranks_str.c_str(),
+                  transport, endpoint.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        if (pid < 0) {
+            std::cerr << "Can't start rank " << rank << "\n";
+            break;
+        }
+        workers.push_back(pid);
+    }
+
+    // Reaps the ranks in the order they exit. Once one of them has failed
+    // the others can't finish, so the shared memory ones are told to give
+    // up rather than wait for its data. A TCP rank sees the closed socket.
+    int result = workers.size() == n_ranks ? 0 : 1;
+    for (std::size_t i = 0; i < workers.size(); i++) {
+        int status = 0;
+        if (waitpid(-1, &status, 0) == -1) {
+            result = 1;
+            break;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            result = 1;
+        }
+        if (result != 0 && strcmp(transport, "shm") == 0) {
+            ShmCommunicator::Abort(endpoint.c_str(), n_ranks);
+        }
+    }
+
+    if (strcmp(transport, "shm") == 0) {
+        ShmCommunicator::Unlink(endpoint.c_str());
+    }
+
+    return result;
+}
+
+
+int RunDistributedWorker(std::size_t rank, std::size_t n_ranks,
+                         const char* transport, const char* endpoint) {
+    std::unique_ptr<Communicator> communicator;
+    if (strcmp(transport, "shm") == 0) {
+        auto shm = std::make_unique<ShmCommunicator>(endpoint, rank, n_ranks);
+        if (!shm->IsOpen()) {
+            std::cerr << "Rank " << rank << ": can't open " << endpoint << "\n";
+            return 1;
+        }
+        communicator = std::move(shm);
+    } else {
+        // The endpoint is host:base_port.
+        std::string        host  = endpoint;
+        std::size_t        colon = host.rfind(':');
+        unsigned long long port  = 0;
+        if (colon == std::string::npos || !ParseNumber(host.c_str() + colon + 1, &port) ||
+            port > UINT16_MAX) {
+            std::cerr << "Rank " << rank << ": bad endpoint " << endpoint << "\n";
+            return 1;
+        }
+        host.resize(colon);
+
+        auto tcp = std::make_unique<TcpCommunicator>(host.c_str(), static_cast<uint16_t>(port),
+                                                     rank, n_ranks);
+        if (!tcp->IsOpen()) {
+            std::cerr << "Rank " << rank << ": can't connect the ring\n";
+            return 1;
+        }
+        communicator = std::move(tcp);
+    }
+
+    MnistParser mnist_parser("mnist/mnist_training_data/train-images.idx3-ubyte",
+                             "mnist/mnist_training_data/train-labels.idx1-ubyte");
+
+    MnistImages mnist_images = mnist_parser.GetMnistImages();
+    MnistLabels mnist_labels = mnist_parser.GetMnistLabels();
+
+    assert(mnist_labels.n_labels == mnist_images.n_images);
+
+    const std::size_t kExamples      = static_cast<std::size_t>(mnist_labels.n_labels);
+    const std::size_t kInputNeurons  = mnist_images.n_cols * mnist_images.n_rows;
+    const std::size_t kMiddleNeurons = 16;
+    const std::size_t kOutputNeurons = 10;
+
+    const std::size_t kBegin = kExamples *  rank      / n_ranks;
+    const std::size_t kEnd   = kExamples * (rank + 1) / n_ranks;
+
+    DistributedTrainer trainer(communicator.get(), kInputNeurons, 2, kMiddleNeurons,
+                               kOutputNeurons, kEnd - kBegin);
+
+    for (std::size_t example = kBegin; example < kEnd; example++) {
+        for (std::size_t neuron = 0; neuron < kInputNeurons; neuron++) {
+            float value = (float)mnist_images.buffer[example * kInputNeurons + neuron] / 256;
+            trainer.SetInput(example - kBegin, neuron, value);
+        }
+    }
+    trainer.SetLabels(mnist_labels.buffer + kBegin);
+
+    if (!trainer.BroadcastParams()) {
+        std::cerr << "Rank " << rank << ": can't broadcast the weights\n";
+        return 1;
+    }
+
+    Adam optimizer(1e-3f);
+    optimizer.AddParam(trainer.GetParams()->GetFlat());
+    trainer.SetMaxGradNorm(kMaxGradNorm);
+
+    const std::size_t kIterations = 1'000;
+    for (std::size_t i = 0; i < kIterations; i++) {
+        float loss = 0.0f;
+        if (!trainer.Step(&optimizer, &loss)) {
+            std::cerr << "Rank " << rank << ": training step " << i << " failed\n";
+            return 1;
+        }
+        if (rank == 0) {
+            std::cout << "Iteration " << i << ": loss = " << loss << "\n";
+        }
+    }
+
+    return 0;
+}
+
+
 #include "mnist/mnist.h"
 #include "mnist/mnist_parser/file_to_buffer/file_to_buffer.h"
 void TestMnistLib() {
@@ -241,6 +725,10 @@ void TestMnistLib() {
             mnist.SaveWeights();
         }
     }
+    CheckpointError error = mnist.WaitWeightsSaved();
+    if (error != CheckpointError::Ok) {
+        std::cerr << "The last weights were not saved: " << CheckpointErrorString(error) << std::endl;
+    }
 
     return;
 
@@ -284,3 +772,617 @@ void TestWriting() {
 
     free(buffer);
 }
+
+
+static bool LoadInferenceModel(const char* checkpoint_name, InferenceModel* model) {
+    CheckpointReader reader;
+    if (reader.Open(checkpoint_name) != CheckpointError::Ok ||
+        model->LoadCheckpoint(reader) != CheckpointError::Ok) {
+        std::cerr << "Can't load " << checkpoint_name << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+
+// Runs server->Serve() until SIGINT or SIGTERM, which must have been blocked
+// in stop_signals before any thread started so that only the waiter below
+// receives them.
+template <typename Server>
+static void ServeUntilSignal(Server* server, const sigset_t& stop_signals) {
+    std::thread signal_waiter([&] {
+        int signal = 0;
+        sigwait(&stop_signals, &signal);
+        server->Stop();
+    });
+
+    server->Serve();
+
+    // Serve() may also return on an error; the waiter then still waits.
+    pthread_kill(signal_waiter.native_handle(), SIGTERM);
+    signal_waiter.join();
+}
+
+
+static void BlockStopSignals(sigset_t* stop_signals) {
+    sigemptyset(stop_signals);
+    sigaddset(stop_signals, SIGINT);
+    sigaddset(stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, stop_signals, nullptr);
+}
+
+
+int RunInferenceServer(const char* checkpoint_name, const char* socket_path,
+                       std::size_t max_batch, std::size_t max_delay_us,
+                       std::size_t cache_capacity) {
+    if (max_batch == 0) {
+        std::cerr << "Need a batch of at least one request\n";
+        return 1;
+    }
+
+    sigset_t stop_signals;
+    BlockStopSignals(&stop_signals);
+
+    InferenceModel model;
+    if (!LoadInferenceModel(checkpoint_name, &model)) {
+        return 1;
+    }
+
+    InferenceServer server(&model, socket_path, max_batch,
+                           std::chrono::microseconds(max_delay_us), cache_capacity);
+    if (!server.IsOpen()) {
+        return 1;
+    }
+
+    std::cout << "Serving " << checkpoint_name << " on " << socket_path
+              << ", batches of up to " << max_batch << " within " << max_delay_us << " us" << std::endl;
+    ServeUntilSignal(&server, stop_signals);
+
+    LatencySummary summary = server.GetLatencySummary();
+    std::cout << summary.n_requests << " requests, "
+              << "p50 " << summary.p50 * 1e6 << " us, p99 " << summary.p99 * 1e6 << " us, "
+              << "max " << summary.max * 1e6 << " us, mean batch " << summary.mean_batch << std::endl;
+    if (const InferenceCache* cache = server.GetCache()) {
+        std::cout << "cache: " << cache->GetHitsCount() << " hits, "
+                  << cache->GetMissesCount() << " misses" << std::endl;
+    }
+
+    return 0;
+}
+
+
+int RunInferenceRing(const char* checkpoint_name, const char* ring_name, std::size_t n_slots) {
+    if (n_slots == 0) {
+        std::cerr << "Need at least one slot\n";
+        return 1;
+    }
+
+    sigset_t stop_signals;
+    BlockStopSignals(&stop_signals);
+
+    InferenceModel model;
+    if (!LoadInferenceModel(checkpoint_name, &model)) {
+        return 1;
+    }
+
+    InferenceRingServer server(&model, ring_name, n_slots);
+    if (!server.IsOpen()) {
+        return 1;
+    }
+
+    std::cout << "Serving " << checkpoint_name << " on " << ring_name
+              << ", " << n_slots << " slots" << std::endl;
+    ServeUntilSignal(&server, stop_signals);
+
+    std::cout << server.GetServedCount() << " requests" << std::endl;
+
+    return 0;
+}
+
+
+static void Expect(SelfTest* test, bool passed, const std::string& what) {
+    test->n_checks++;
+    if (!passed) {
+        test->n_failures++;
+        std::cout << "FAIL " << what << "\n";
+    }
+}
+
+
+// A random 16-8-4 classifier, small enough to serve in a blink.
+static std::unique_ptr<InferenceModel> MakeTestModel() {
+    InputLayer         input_layer (16, 1);
+    MiddleLayer        middle_layer(&input_layer,  8);
+    OutputLayerDiscret output_layer(&middle_layer, 4);
+
+    middle_layer.SetNormalRand();
+    output_layer.SetNormalRand();
+
+    return std::make_unique<InferenceModel>(&output_layer);
+}
+
+
+// Distinct inputs for every (client, request), so that outputs handed to
+// the wrong request don't go unnoticed.
+static void FillTestInputs(std::size_t client, std::size_t request, std::vector<float>* inputs) {
+    for (std::size_t i = 0; i < inputs->size(); i++) {
+        (*inputs)[i] = static_cast<float>((client * 31 + request * 7 + i) % 17) / 17;
+    }
+}
+
+
+// Batches are evaluated with other kernels' blockings than one example,
+// which may round differently.
+static bool IsNear(const float* values, const float* expected, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        if (!(std::fabs(values[i] - expected[i]) <= 1e-5f)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static int ConnectUnixSocket(const char* path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static bool SendBytes(int fd, const void* bytes, std::size_t size) {
+    return send(fd, bytes, size, MSG_NOSIGNAL) == static_cast<ssize_t>(size);
+}
+
+
+static bool RecvBytes(int fd, void* bytes, std::size_t size) {
+    return recv(fd, bytes, size, MSG_WAITALL) == static_cast<ssize_t>(size);
+}
+
+
+// Concurrent clients against one server: every answer must be the model's
+// output for that request's inputs, the requests must have been batched,
+// and the stats must count them. Then the wire format by hand, and the
+// malformed requests that must be refused.
+void TestInferenceServer(SelfTest* test) {
+    const std::size_t kClients  = 8;
+    const std::size_t kRequests = 25;
+
+    std::unique_ptr<InferenceModel> model = MakeTestModel();
+    const std::size_t n_inputs  = model->GetInputsCount();
+    const std::size_t n_outputs = model->GetOutputsCount();
+
+    // The delay leaves the clients time to fill every batch.
+    std::string socket_path = "/tmp/gpt_selftest_" + std::to_string(getpid()) + ".sock";
+    InferenceServer server(model.get(), socket_path.c_str(), kClients, std::chrono::milliseconds(20));
+    if (!server.IsOpen()) {
+        Expect(test, false, "server: listening on " + socket_path);
+        return;
+    }
+    std::thread serving([&] { server.Serve(); });
+
+    std::vector<std::size_t> n_answered(kClients, 0);
+    std::vector<std::thread> clients;
+    for (std::size_t c = 0; c < kClients; c++) {
+        clients.emplace_back([&, c] {
+            InferenceClient  client(socket_path.c_str());
+            InferenceContext context(model.get());
+            if (!client.IsOpen()) {
+                return;
+            }
+
+            std::vector<float> inputs(n_inputs);
+            std::vector<float> outputs(n_outputs);
+            for (std::size_t r = 0; r < kRequests; r++) {
+                FillTestInputs(c, r, &inputs);
+                context.Eval(inputs.data());
+                if (client.Predict(inputs.data(), n_inputs, outputs.data(), n_outputs) &&
+                    IsNear(outputs.data(), context.GetOutputs(), n_outputs)) {
+                    n_answered[c]++;
+                }
+            }
+        });
+    }
+    for (std::thread& client : clients) {
+        client.join();
+    }
+    for (std::size_t c = 0; c < kClients; c++) {
+        Expect(test, n_answered[c] == kRequests, "server: answers to client " + std::to_string(c));
+    }
+
+    InferenceClient client(socket_path.c_str());
+    LatencySummary  summary = {};
+    Expect(test, client.IsOpen() && client.GetStats(&summary), "server: stats request");
+    Expect(test, summary.n_requests == kClients * kRequests, "server: requests counted");
+    Expect(test, summary.n_batches > 0 && summary.n_batches < summary.n_requests, "server: requests batched");
+    Expect(test, summary.p50 <= summary.p90 && summary.p90 <= summary.p99 && summary.p99 <= summary.max,
+           "server: latency percentiles ordered");
+
+    std::vector<float> inputs(n_inputs);
+    std::vector<float> outputs(n_outputs);
+    Expect(test, !client.Predict(inputs.data(), n_inputs - 1, outputs.data(), n_outputs),
+           "server: inputs of the wrong size refused");
+
+    // Predict, then Stats on one connection: a header and the outputs, then
+    // a header, the counters and the latencies.
+    int fd = ConnectUnixSocket(socket_path.c_str());
+    Expect(test, fd != -1, "server: raw connection");
+    if (fd != -1) {
+        InferenceContext context(model.get());
+        FillTestInputs(kClients, 0, &inputs);
+        context.Eval(inputs.data());
+
+        InferenceRequestHeader  request  = {static_cast<uint32_t>(InferenceRequestType::Predict),
+                                            static_cast<uint32_t>(n_inputs)};
+        InferenceResponseHeader response = {};
+        bool answered = SendBytes(fd, &request, sizeof(request)) &&
+                        SendBytes(fd, inputs.data(), n_inputs * sizeof(float)) &&
+                        RecvBytes(fd, &response, sizeof(response)) &&
+                        response.status == static_cast<uint32_t>(InferenceStatus::Ok) &&
+                        response.n_values == n_outputs &&
+                        RecvBytes(fd, outputs.data(), n_outputs * sizeof(float));
+        Expect(test, answered && IsNear(outputs.data(), context.GetOutputs(), n_outputs),
+               "server: predict framing");
+
+        InferenceStatsCounters counters                       = {};
+        float                  latencies[kLatencySummaryValues] = {};
+        request = {static_cast<uint32_t>(InferenceRequestType::Stats), 0};
+        answered = SendBytes(fd, &request, sizeof(request)) &&
+                   RecvBytes(fd, &response, sizeof(response)) &&
+                   response.status == static_cast<uint32_t>(InferenceStatus::Ok) &&
+                   response.n_values == kLatencySummaryValues &&
+                   RecvBytes(fd, &counters, sizeof(counters)) &&
+                   RecvBytes(fd, latencies, sizeof(latencies));
+        Expect(test, answered && counters.n_requests == kClients * kRequests + 1,
+               "server: stats framing");
+        close(fd);
+    }
+
+    // A malformed request gets BadRequest without values, and the
+    // connection is closed without its payload being read.
+    const InferenceRequestHeader bad_requests[] = {
+        {static_cast<uint32_t>(InferenceRequestType::Predict), static_cast<uint32_t>(n_inputs + 1)},
+        {static_cast<uint32_t>(InferenceRequestType::Predict), 0},
+        {static_cast<uint32_t>(InferenceRequestType::Stats),   1},
+        {7, 0},
+    };
+    for (const InferenceRequestHeader& request : bad_requests) {
+        std::string what = "server: request type " + std::to_string(request.type) + " with " +
+                           std::to_string(request.n_values) + " values refused";
+
+        fd = ConnectUnixSocket(socket_path.c_str());
+        InferenceResponseHeader response = {};
+        char                    byte     = 0;
+        bool refused = fd != -1 &&
+                       SendBytes(fd, &request, sizeof(request)) &&
+                       RecvBytes(fd, &response, sizeof(response)) &&
+                       response.status == static_cast<uint32_t>(InferenceStatus::BadRequest) &&
+                       response.n_values == 0 &&
+                       recv(fd, &byte, 1, 0) == 0;
+        Expect(test, refused, what);
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    server.Stop();
+    serving.join();
+}
+
+
+// Maps a ring file the way a producer does, or returns nullptr.
+static uint8_t* MapRing(const char* file_name, std::size_t* map_size) {
+    int fd = open(file_name, O_RDWR);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat info;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &info) == 0) {
+        *map_size = static_cast<std::size_t>(info.st_size);
+        map       = mmap(nullptr, *map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    return map == MAP_FAILED ? nullptr : static_cast<uint8_t*>(map);
+}
+
+
+static InferenceRingSlotHeader* GetRingSlot(uint8_t* map, std::size_t slot) {
+    const InferenceRingHeader* header = reinterpret_cast<const InferenceRingHeader*>(map);
+    return reinterpret_cast<InferenceRingSlotHeader*>(map + sizeof(InferenceRingHeader) +
+                                                      slot * header->slot_size);
+}
+
+
+static bool AreRingSlotsFree(uint8_t* map) {
+    const InferenceRingHeader* header = reinterpret_cast<const InferenceRingHeader*>(map);
+    for (std::size_t slot = 0; slot < header->n_slots; slot++) {
+        if (GetRingSlot(map, slot)->state.load() != static_cast<uint32_t>(InferenceSlotState::Free)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// Polls the slot's state for up to a second.
+static bool WaitRingSlotState(InferenceRingSlotHeader* slot, InferenceSlotState state) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (slot->state.load() != static_cast<uint32_t>(state)) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    return true;
+}
+
+
+// More producers than slots against one engine, then one request through
+// the Free -> Writing -> Ready -> Done handshake by hand, as draw.py does
+// it. Finally a request pending when the engine leaves: the producer must
+// take it back and free its slot.
+void TestInferenceRing(SelfTest* test) {
+    const std::size_t kSlots     = 4;
+    const std::size_t kProducers = 6;
+    const std::size_t kRequests  = 25;
+
+    std::unique_ptr<InferenceModel> model = MakeTestModel();
+    const std::size_t n_inputs  = model->GetInputsCount();
+    const std::size_t n_outputs = model->GetOutputsCount();
+
+    std::string ring_name = "/dev/shm/gpt_selftest_" + std::to_string(getpid()) + ".ring";
+
+    {
+        InferenceRingServer server(model.get(), ring_name.c_str(), kSlots);
+        if (!server.IsOpen()) {
+            Expect(test, false, "ring: creating " + ring_name);
+            return;
+        }
+        std::thread serving([&] { server.Serve(); });
+
+        InferenceRingClient client(ring_name.c_str());
+        Expect(test, client.IsOpen() && client.GetInputsCount() == n_inputs &&
+                     client.GetOutputsCount() == n_outputs, "ring: client shapes");
+
+        std::vector<std::size_t> n_answered(kProducers, 0);
+        std::vector<std::thread> producers;
+        for (std::size_t p = 0; p < kProducers && client.IsOpen(); p++) {
+            producers.emplace_back([&, p] {
+                InferenceContext   context(model.get());
+                std::vector<float> inputs(n_inputs);
+                std::vector<float> outputs(n_outputs);
+                for (std::size_t r = 0; r < kRequests; r++) {
+                    FillTestInputs(p, r, &inputs);
+                    context.Eval(inputs.data());
+                    if (client.Predict(inputs.data(), outputs.data()) &&
+                        IsNear(outputs.data(), context.GetOutputs(), n_outputs)) {
+                        n_answered[p]++;
+                    }
+                }
+            });
+        }
+        for (std::thread& producer : producers) {
+            producer.join();
+        }
+        for (std::size_t p = 0; p < kProducers; p++) {
+            Expect(test, n_answered[p] == kRequests, "ring: answers to producer " + std::to_string(p));
+        }
+        Expect(test, server.GetServedCount() == kProducers * kRequests, "ring: requests served");
+
+        std::size_t map_size = 0;
+        uint8_t*    map      = MapRing(ring_name.c_str(), &map_size);
+        Expect(test, map != nullptr, "ring: mapping " + ring_name);
+        if (map) {
+            InferenceRingHeader*     header = reinterpret_cast<InferenceRingHeader*>(map);
+            InferenceRingSlotHeader* slot   = GetRingSlot(map, kSlots - 1);
+            float*                   values = reinterpret_cast<float*>(slot + 1);
+            Expect(test, AreRingSlotsFree(map), "ring: slots freed after the answers");
+
+            uint32_t free = static_cast<uint32_t>(InferenceSlotState::Free);
+            Expect(test, slot->state.compare_exchange_strong(free, static_cast<uint32_t>(InferenceSlotState::Writing)),
+                   "ring: slot claimed");
+
+            InferenceContext   context(model.get());
+            std::vector<float> inputs(n_inputs);
+            FillTestInputs(kProducers, 0, &inputs);
+            context.Eval(inputs.data());
+            std::copy(inputs.begin(), inputs.end(), values);
+
+            // The engine must not touch a slot that is being written.
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            Expect(test, slot->state.load() == static_cast<uint32_t>(InferenceSlotState::Writing),
+                   "ring: slot being written left alone");
+
+            // No FUTEX_WAKE, like draw.py without one: the engine's sleep
+            // is bounded.
+            slot->state.store(static_cast<uint32_t>(InferenceSlotState::Ready));
+            header->doorbell.fetch_add(1);
+            Expect(test, WaitRingSlotState(slot, InferenceSlotState::Done) &&
+                         IsNear(values + n_inputs, context.GetOutputs(), n_outputs),
+                   "ring: ready slot answered");
+            slot->state.store(static_cast<uint32_t>(InferenceSlotState::Free));
+        }
+
+        server.Stop();
+        serving.join();
+
+        if (map) {
+            Expect(test, reinterpret_cast<InferenceRingHeader*>(map)->running.load() == 0,
+                   "ring: engine left");
+            munmap(map, map_size);
+        }
+
+        std::vector<float> inputs(n_inputs);
+        std::vector<float> outputs(n_outputs);
+        Expect(test, !client.IsOpen() || !client.Predict(inputs.data(), outputs.data()),
+               "ring: request refused without an engine");
+    }
+
+    {
+        // Open but not serving yet, so a request stays Ready.
+        InferenceRingServer server(model.get(), ring_name.c_str(), kSlots);
+        InferenceRingClient client(ring_name.c_str());
+        std::size_t map_size = 0;
+        uint8_t*    map      = MapRing(ring_name.c_str(), &map_size);
+        if (!server.IsOpen() || !client.IsOpen() || !map) {
+            Expect(test, false, "ring: reopening " + ring_name);
+            if (map) {
+                munmap(map, map_size);
+            }
+            return;
+        }
+
+        std::atomic<bool> answered(true);
+        std::thread producer([&] {
+            std::vector<float> inputs(n_inputs);
+            std::vector<float> outputs(n_outputs);
+            answered = client.Predict(inputs.data(), outputs.data());
+        });
+
+        bool pending = false;
+        for (std::size_t slot = 0; slot < kSlots && !pending; slot++) {
+            pending = WaitRingSlotState(GetRingSlot(map, slot), InferenceSlotState::Ready);
+        }
+        Expect(test, pending, "ring: request pending");
+
+        // Leaves at once, waking the producer.
+        server.Stop();
+        server.Serve();
+        producer.join();
+
+        Expect(test, !answered, "ring: pending request failed after the engine left");
+        Expect(test, AreRingSlotsFree(map), "ring: pending request taken back");
+        Expect(test, server.GetServedCount() == 0, "ring: nothing served after the engine left");
+        munmap(map, map_size);
+    }
+}
+
+
+// Ranks as threads of this process, each with the communicator make(rank)
+// returns. Every rank sums its own random data: the sums must be within
+// rounding of the double ones, and bitwise equal on every rank. Sizes
+// include none and fewer elements than ranks.
+template <typename MakeCommunicator>
+static void CheckAllReduce(SelfTest* test, const std::string& transport, std::size_t n_ranks,
+                           MakeCommunicator make) {
+    const std::size_t kSizes[] = {0, 1, n_ranks - 1, n_ranks + 1, 1000, 4099};
+    const std::size_t kTotal   = 4099;
+
+    // data[rank] is the rank's input, then its result.
+    std::vector<std::vector<float>> data(n_ranks, std::vector<float>(kTotal));
+    std::mt19937 gen(static_cast<uint32_t>(n_ranks));
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+
+    for (std::size_t n : kSizes) {
+        std::string what = transport + ", " + std::to_string(n_ranks) + " ranks, " +
+                           std::to_string(n) + " floats";
+
+        std::vector<double> expected(n, 0.0);
+        for (std::size_t rank = 0; rank < n_ranks; rank++) {
+            for (std::size_t i = 0; i < n; i++) {
+                data[rank][i] = distribution(gen);
+                expected[i]  += data[rank][i];
+            }
+        }
+
+        std::vector<char> reduced(n_ranks, 0);
+        std::vector<std::thread> ranks;
+        for (std::size_t rank = 0; rank < n_ranks; rank++) {
+            ranks.emplace_back([&, rank] {
+                std::unique_ptr<Communicator> communicator = make(rank);
+                reduced[rank] = communicator && communicator->AllReduce(data[rank].data(), n) &&
+                                communicator->Barrier();
+            });
+        }
+        for (std::thread& rank : ranks) {
+            rank.join();
+        }
+
+        bool all_reduced = std::all_of(reduced.begin(), reduced.end(), [](char r) { return r != 0; });
+        Expect(test, all_reduced, "all-reduce: " + what + ", completed");
+        if (!all_reduced) {
+            continue;
+        }
+
+        bool near = true;
+        for (std::size_t i = 0; i < n; i++) {
+            near = near && std::fabs(data[0][i] - expected[i]) <= 1e-5 * static_cast<double>(n_ranks);
+        }
+        Expect(test, near, "all-reduce: " + what + ", sums");
+
+        bool equal = true;
+        for (std::size_t rank = 1; rank < n_ranks; rank++) {
+            equal = equal && memcmp(data[rank].data(), data[0].data(), n * sizeof(float)) == 0;
+        }
+        Expect(test, equal, "all-reduce: " + what + ", same on every rank");
+    }
+}
+
+
+// The ring all-reduce over shared memory and over TCP, then the two ways
+// a shared memory transfer gives up: an aborted segment, and a neighbour
+// that never shows up.
+void TestAllReduce(SelfTest* test) {
+    const std::string shm_name = "/gpt_selftest_" + std::to_string(getpid());
+    // Distinct per process, so that concurrent runs don't share ports, and
+    // below Linux's ephemeral ports, which a connecting rank may be given.
+    const uint16_t    base_port = static_cast<uint16_t>(20000 + getpid() % 3000 * 4);
+
+    for (std::size_t n_ranks : {1, 2, 3, 4}) {
+        if (!ShmCommunicator::Create(shm_name.c_str(), n_ranks)) {
+            Expect(test, false, "all-reduce: creating " + shm_name);
+            return;
+        }
+        CheckAllReduce(test, "shm", n_ranks, [&](std::size_t rank) {
+            auto communicator = std::make_unique<ShmCommunicator>(shm_name.c_str(), rank, n_ranks);
+            return communicator->IsOpen() ? std::unique_ptr<Communicator>(std::move(communicator)) : nullptr;
+        });
+        ShmCommunicator::Unlink(shm_name.c_str());
+
+        CheckAllReduce(test, "tcp", n_ranks, [&](std::size_t rank) {
+            auto communicator = std::make_unique<TcpCommunicator>("127.0.0.1", base_port, rank, n_ranks);
+            return communicator->IsOpen() ? std::unique_ptr<Communicator>(std::move(communicator)) : nullptr;
+        });
+    }
+
+    float data[8] = {};
+    if (!ShmCommunicator::Create(shm_name.c_str(), 2)) {
+        Expect(test, false, "all-reduce: creating " + shm_name);
+        return;
+    }
+    {
+        ShmCommunicator rank0(shm_name.c_str(), 0, 2);
+        ShmCommunicator rank1(shm_name.c_str(), 1, 2);
+        rank1.Abort();
+        Expect(test, rank0.IsOpen() && !rank0.AllReduce(data, 8), "all-reduce: fails once aborted");
+    }
+    ShmCommunicator::Unlink(shm_name.c_str());
+
+    if (!ShmCommunicator::Create(shm_name.c_str(), 2)) {
+        Expect(test, false, "all-reduce: creating " + shm_name);
+        return;
+    }
+    {
+        ShmCommunicator rank0(shm_name.c_str(), 0, 2, std::chrono::milliseconds(100));
+        Expect(test, rank0.IsOpen() && !rank0.AllReduce(data, 8), "all-reduce: times out alone");
+    }
+    ShmCommunicator::Unlink(shm_name.c_str());
+}
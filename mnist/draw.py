@@ -1,9 +1,144 @@
+import ctypes
+import ctypes.util
+import mmap
+import os
+import platform
+import struct
+import sys
+import time
 import tkinter as tk
 import numpy as np
-import struct
+
+RING_PATH = "/dev/shm/kgpt.ring"
+
+# Mirrors include/inference_ring.h.
+RING_MAGIC = b"KGPTRING"
+RING_VERSION = 1
+RING_HEADER = struct.Struct("<8s8I24x")
+RING_RUNNING, RING_ENGINE_SLEEPING, RING_DOORBELL = 28, 32, 36 # offsets
+RING_SLOT_HEADER_SIZE = 64
+SLOT_FREE, SLOT_WRITING, SLOT_READY, SLOT_DONE = range(4)
+
+# futex(2) differs between architectures. Elsewhere the engine is not woken
+# up and finds the request when its 20 ms sleep times out.
+SYS_FUTEX = {"x86_64": 202, "amd64": 202, "i386": 240, "i686": 240, "armv7l": 240,
+             "aarch64": 98, "arm64": 98, "riscv64": 98, "ppc64le": 221, "s390x": 238}.get(
+                 platform.machine().lower())
+FUTEX_WAKE = 1
+
+# The ring's words are C++ std::atomic<uint32_t>, accessed here through the
+# out-of-line functions of GCC's libatomic, with the same (default) order.
+ATOMIC_SEQ_CST = 5
+SPIN_POLLS = 2000
+
+
+class InferenceRing:
+    """Producer side of the ring served by `gpt --ring <checkpoint> <file>`.
+
+    Slots are claimed with compare-and-swap as in InferenceRingClient, so
+    other producers may share the ring. A request that timed out keeps its
+    slot while the engine runs, since it may still be evaluating it: the
+    slot is only freed once a later call finds it done.
+    """
+
+    def __init__(self, path):
+        with open(path, "r+b") as f:
+            self.map = mmap.mmap(f.fileno(), 0)
+
+        (magic, version, self.n_slots, self.n_inputs, self.n_outputs,
+         self.slot_size, _, _, _) = RING_HEADER.unpack_from(self.map, 0)
+        if magic != RING_MAGIC or version != RING_VERSION:
+            raise ValueError(path + " is not an inference ring")
+
+        self.libc = ctypes.CDLL(None, use_errno=True)
+        # getattr(): the names would be mangled inside the class.
+        atomic = ctypes.CDLL(ctypes.util.find_library("atomic") or "libatomic.so.1")
+        self.atomic_load = getattr(atomic, "__atomic_load_4")
+        self.atomic_load.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        self.atomic_load.restype = ctypes.c_uint32
+        self.atomic_store = getattr(atomic, "__atomic_store_4")
+        self.atomic_store.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_int]
+        self.atomic_store.restype = None
+        self.atomic_fetch_add = getattr(atomic, "__atomic_fetch_add_4")
+        self.atomic_fetch_add.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_int]
+        self.atomic_fetch_add.restype = ctypes.c_uint32
+        self.atomic_compare_exchange = getattr(atomic, "__atomic_compare_exchange_4")
+        self.atomic_compare_exchange.argtypes = [
+            ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32), ctypes.c_uint32, ctypes.c_int, ctypes.c_int]
+        self.atomic_compare_exchange.restype = ctypes.c_bool
+
+        self.base = ctypes.addressof(ctypes.c_char.from_buffer(self.map))
+        self.abandoned = set()
+
+    def _word(self, offset):
+        return self.atomic_load(self.base + offset, ATOMIC_SEQ_CST)
+
+    def _store(self, offset, value):
+        self.atomic_store(self.base + offset, value, ATOMIC_SEQ_CST)
+
+    def _compare_exchange(self, offset, expected, desired):
+        expected = ctypes.c_uint32(expected)
+        return self.atomic_compare_exchange(self.base + offset, ctypes.byref(expected),
+                                            desired, ATOMIC_SEQ_CST, ATOMIC_SEQ_CST)
+
+    def _slot(self, slot):
+        return RING_HEADER.size + slot * self.slot_size
+
+    def _reclaim(self):
+        for slot in [s for s in self.abandoned if self._word(self._slot(s)) == SLOT_DONE]:
+            self._store(self._slot(slot), SLOT_FREE)
+            self.abandoned.discard(slot)
+
+    def predict(self, pixels, timeout=1.0):
+        """Returns the class probabilities, or None if no engine answers."""
+        if self._word(RING_RUNNING) == 0:
+            return None
+
+        self._reclaim()
+
+        slot = next((s for s in range(self.n_slots)
+                     if self._compare_exchange(self._slot(s), SLOT_FREE, SLOT_WRITING)), None)
+        if slot is None:
+            return None
+
+        offset = self._slot(slot)
+        inputs = offset + RING_SLOT_HEADER_SIZE
+        outputs = inputs + 4 * self.n_inputs
+
+        self.map[inputs:outputs] = np.ascontiguousarray(pixels, dtype=np.float32).tobytes()
+        self._store(offset, SLOT_READY)
+
+        # Wakes a sleeping engine, see InferenceRingServer::Serve().
+        self.atomic_fetch_add(self.base + RING_DOORBELL, 1, ATOMIC_SEQ_CST)
+        if SYS_FUTEX is not None and self._word(RING_ENGINE_SLEEPING) == 1:
+            self.libc.syscall(ctypes.c_long(SYS_FUTEX), ctypes.c_void_p(self.base + RING_DOORBELL),
+                              ctypes.c_int(FUTEX_WAKE), ctypes.c_int(1), None, None, ctypes.c_int(0))
+
+        # Spins for a quick answer, then polls with a growing sleep, so that
+        # a slow one does not keep the Tk thread busy.
+        deadline = time.monotonic() + timeout
+        n_polls = 0
+        delay = 1e-5
+        while self._word(offset) != SLOT_DONE:
+            if time.monotonic() > deadline:
+                # The engine left without answering: take the request back.
+                if self._word(RING_RUNNING) == 0 and self._compare_exchange(offset, SLOT_READY, SLOT_FREE):
+                    return None
+                self.abandoned.add(slot)
+                return None
+            n_polls += 1
+            if n_polls < SPIN_POLLS:
+                continue
+            time.sleep(delay)
+            delay = min(delay * 2, 1e-3)
+
+        probabilities = np.frombuffer(self.map[outputs:outputs + 4 * self.n_outputs], dtype=np.float32)
+        self._store(offset, SLOT_FREE)
+        return probabilities
+
 
 class DrawingApp:
-    def __init__(self, root):
+    def __init__(self, root, ring):
         self.root = root
         self.root.title("28x28 Drawing App")
         self.canvas = tk.Canvas(self.root, width=280, height=280, bg="white")
@@ -11,12 +146,20 @@ class DrawingApp:
 
         self.canvas.bind("<B1-Motion>", self.paint)
         self.canvas.bind("<Button-1>", self.paint)
+        self.canvas.bind("<ButtonRelease-1>", self.predict)
 
         self.pixel_data = np.zeros((28, 28), dtype=np.float32)
         self.cell_size = 10
 
         self.save_button = tk.Button(self.root, text="Save", command=self.save_drawing)
         self.save_button.pack()
+        self.clear_button = tk.Button(self.root, text="Clear", command=self.clear_drawing)
+        self.clear_button.pack()
+
+        self.ring = ring
+        self.prediction = tk.Label(self.root, text="" if ring else
+                                   "No engine, start gpt --ring <checkpoint> " + RING_PATH)
+        self.prediction.pack()
 
     def paint(self, event):
         x, y = event.x, event.y
@@ -39,8 +182,33 @@ class DrawingApp:
                     f.write(struct.pack('f', pixel))
         print("Drawing saved to drawing.bin")
 
+    def clear_drawing(self):
+        self.canvas.delete("all")
+        self.pixel_data[:] = 0.0
+        self.prediction.config(text="")
+
+    def predict(self, event):
+        if self.ring is None:
+            return
+
+        probabilities = self.ring.predict(self.pixel_data.ravel())
+        if probabilities is None:
+            self.prediction.config(text="The engine did not answer")
+            return
+
+        label = int(np.argmax(probabilities))
+        self.prediction.config(text="%d (%.1f%%)" % (label, probabilities[label] * 100.0))
+
 if __name__ == "__main__":
+    path = sys.argv[1] if len(sys.argv) > 1 else RING_PATH
+    ring = None
+    if os.path.exists(path):
+        try:
+            ring = InferenceRing(path)
+        except OSError as error:
+            print("Can't use the ring without libatomic:", error)
+
     root = tk.Tk()
-    app = DrawingApp(root)
+    app = DrawingApp(root, ring)
     root.mainloop()
 
@@ -1,8 +1,11 @@
 #include "mnist.h"
 
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
 
+const std::size_t kEvalImageCacheEntries = 256;
+
 void Mnist::Dump() {
     std::cout << "InputLayer: " << input_layer_.get() << "\n";
     std::cout << "\t Parent: " << input_layer_->GetInputLayer() << "\n";
@@ -28,8 +31,9 @@ Mnist::Mnist(const char* train_images_path,
       n_input_neurons_(mnist_images_.n_cols * mnist_images_.n_rows),
       n_hidden_layers_(n_hidden_layers),
       n_hidden_layer_neurons_(n_hidden_layer_neurons),
-      input_test_vector_ (1, n_input_neurons_),
-      output_test_vector_(1, n_output_neurons_) {
+      eval_image_model_(),
+      eval_image_generation_(0),
+      eval_image_cache_(n_input_neurons_, n_output_neurons_, kEvalImageCacheEntries) {
 
     assert(mnist_labels_.n_labels == mnist_images_.n_images);
 
@@ -43,6 +47,14 @@ Mnist::Mnist(const char* train_images_path,
 
     output_layer_ = std::make_unique<OutputLayerDiscret>(&middle_layers_[n_hidden_layers_ - 1], n_output_neurons_);
 
+    for (std::size_t i = 0; i < n_hidden_layers_; i++) {
+        middle_layers_[i].SetMemoryTag(("middle" + std::to_string(i + 1)).c_str());
+    }
+
+    std::vector<SmartMatrix*> params;
+    output_layer_->CollectParamsRecursive(&params);
+    params_ = std::make_unique<ParameterBuffer>(params);
+
     // Dump();
 
     images_buffer_ = mnist_images_.buffer;
@@ -53,8 +65,8 @@ Mnist::Mnist(const char* train_images_path,
             float value = (float)images_buffer_[example * n_input_neurons_ + neuron]/256.0f;
             input_layer_->SetValue(example, neuron, value);
         }
-        output_layer_->SetExpectedValue(example, labels_buffer_[example], 1.0f);
     }
+    output_layer_->SetLabels(labels_buffer_);
 
     // FIXME: fix copypaste
     middle_layers_names_.reserve(n_hidden_layers);
@@ -64,30 +76,95 @@ Mnist::Mnist(const char* train_images_path,
                                                   + std::to_string(i + 1) + ".data");
     }
     output_layer_name_ = std::string(weights_folder_path_) + "/" + std::string("output") + ".data";
+    checkpoint_name_   = std::string(weights_folder_path_) + "/" + std::string("model") + ".ckpt";
+
+    checkpointer_ = std::make_unique<AsyncCheckpointer>(checkpoint_name_.c_str());
 }
 
 
 void Mnist::LoadWeights() {
+    if (!LoadCheckpoint()) {
+        LoadLegacyWeights();
+    }
+}
+
+
+bool Mnist::LoadCheckpoint() {
+    std::cout << "Trying to load from: " << checkpoint_name_ << std::endl;
+
+    auto reader = std::make_unique<CheckpointReader>();
+    CheckpointError error = reader->Open(checkpoint_name_.c_str());
+
+    // Reject the whole checkpoint before touching any layer.
+    if (error == CheckpointError::Ok && reader->GetLayersCount() != n_hidden_layers_ + 1) {
+        error = CheckpointError::ShapeMismatch;
+    }
+    for (std::size_t i = 0; i < n_hidden_layers_ && error == CheckpointError::Ok; i++) {
+        error = middle_layers_[i].CheckCheckpointParams(*reader, i);
+    }
+    if (error == CheckpointError::Ok) {
+        error = output_layer_->CheckCheckpointParams(*reader, n_hidden_layers_);
+    }
+    if (error == CheckpointError::Ok) {
+        error = params_->MapCheckpoint(*reader);
+    }
+
+    if (error != CheckpointError::Ok) {
+        std::cerr << "Can't load " << checkpoint_name_ << ": "
+                  << CheckpointErrorString(error) << std::endl;
+        return false;
+    }
+
+    checkpoint_reader_ = std::move(reader);
+    return true;
+}
+
+
+void Mnist::LoadLegacyWeights() {
+    auto load = [](MiddleLayer* layer, const std::string& file_name) {
+        std::cout << "Trying to load from: " << file_name << std::endl;
+
+        CheckpointError error = layer->LoadParamsFromFile(file_name.c_str());
+        if (error != CheckpointError::Ok) {
+            std::cerr << "Can't load " << file_name << ": " << CheckpointErrorString(error) << std::endl;
+        }
+    };
+
     for (std::size_t i = 0; i < n_hidden_layers_; i++) {
-        std::cout << "Trying to load from: " << middle_layers_names_[i].c_str() << std::endl;
-        middle_layers_[i].LoadParamsFromFile(middle_layers_names_[i].c_str());
+        load(&middle_layers_[i], middle_layers_names_[i]);
     }
-    std::cout << "Trying to load from: " << output_layer_name_.c_str() << std::endl;
-    output_layer_->LoadParamsFromFile(output_layer_name_.c_str());
+    load(output_layer_.get(), output_layer_name_);
 }
 
 
 void Mnist::SaveWeights() {
+    // Weights may be remapped by LoadWeights(), so the tables are rebuilt.
+    checkpoint_writer_.Clear();
     for (std::size_t i = 0; i < n_hidden_layers_; i++) {
-        middle_layers_[i].SaveParamsToFile(middle_layers_names_[i].c_str());
+        middle_layers_[i].SaveParamsToCheckpoint(&checkpoint_writer_);
     }
-    output_layer_->SaveParamsToFile(output_layer_name_.c_str());
+    output_layer_->SaveParamsToCheckpoint(&checkpoint_writer_);
+
+    checkpointer_->Save(checkpoint_writer_);
 }
 
 
+CheckpointError Mnist::WaitWeightsSaved() {
+    return checkpointer_->Flush();
+}
+
+
+// The first call traces the step, the later ones replay it.
 float Mnist::Eval() {
-    output_layer_->ResetGradsRecursive();
-    output_layer_->EvalRecursive();
+    if (eval_plan_.IsEmpty()) {
+        eval_plan_.Record([this] {
+            output_layer_->ResetGradsRecursive();
+            output_layer_->EvalRecursive();
+        });
+    } else {
+        eval_plan_.Replay();
+    }
+
     return output_layer_->GetLoss();
 }
 
@@ -97,16 +174,46 @@ void Mnist::Backpropagate(float step) {
 }
 
 
-void Mnist::EvalImage(float* input) {
+void Mnist::AddParamsToOptimizer(Optimizer* optimizer) {
+    assert(optimizer);
+    optimizer->AddParam(params_->GetFlat());
+}
+
+
+ParameterBuffer* Mnist::GetParams() { return params_.get(); }
+
+
+std::shared_ptr<const InferenceModel> Mnist::SnapshotInferenceModel() {
+    return std::make_shared<const InferenceModel>(output_layer_.get());
+}
+
+
+void Mnist::EvalImage(const float* input) {
     assert(input);
 
-    for (std::size_t i = 0; i < n_input_neurons_; i++) {
-        input_layer_->SetValue(0, i, input[i]);
+    // Whatever changed the weights (an optimizer, Backpropagate(), a load)
+    // changed their generation. A new snapshot has a new version, the old
+    // entries can't be hit.
+    uint64_t generation = params_->GetGeneration();
+    if (!eval_image_model_ || generation != eval_image_generation_) {
+        eval_image_model_      = SnapshotInferenceModel();
+        eval_image_generation_ = generation;
+        eval_image_cache_.Clear();
     }
 
-    Eval();
+    std::vector<float> outputs(n_output_neurons_);
+    if (!eval_image_cache_.Lookup(eval_image_model_->GetVersion(), input, outputs.data())) {
+        InferenceContext context(eval_image_model_.get());
+        context.Eval(input);
+
+        std::copy(context.GetOutputs(), context.GetOutputs() + n_output_neurons_, outputs.begin());
+        eval_image_cache_.Insert(eval_image_model_->GetVersion(), input, outputs.data());
+    }
 
     for (std::size_t i = 0; i < n_output_neurons_; i++) {
-        std::cout << i << ": " << output_layer_->GetNormOutput(0, i) * 100.0f << "%\n";
+        std::cout << i << ": " << outputs[i] * 100.0f << "%\n";
     }
 }
+
+
+const InferenceCache& Mnist::GetEvalImageCache() const { return eval_image_cache_; }
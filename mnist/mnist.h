@@ -3,6 +3,12 @@
 
 #include "mnist_parser/mnist_parser.h"
 #include "../include/MLP.h"
+#include "../include/async_checkpointer.h"
+#include "../include/parameter_buffer.h"
+#include "../include/optimizer.h"
+#include "../include/execution_plan.h"
+#include "../include/inference.h"
+#include "../include/inference_cache.h"
 
 #include <cstdlib>
 #include <vector>
@@ -17,12 +23,28 @@ class Mnist {
               std::size_t n_hidden_layer_neurons = 12);
 
         void LoadWeights();
+        // Snapshots the weights and returns, the file is written in the
+        // background. WaitWeightsSaved() blocks until it is on disk and
+        // returns the error of the last write.
         void SaveWeights();
+        CheckpointError WaitWeightsSaved();
 
         float Eval();
         void Backpropagate(float step);
-
-        void EvalImage(float* input);
+        // Registers the weights with the optimizer, the caller then runs
+        // optimizer->Step() after Eval() instead of Backpropagate().
+        void AddParamsToOptimizer(Optimizer* optimizer);
+        ParameterBuffer* GetParams();
+
+        // Copy of the current weights for InferenceContexts on any number
+        // of threads; training does not change it.
+        std::shared_ptr<const InferenceModel> SnapshotInferenceModel();
+        // Prints the class probabilities of one 28x28 image. Runs in its own
+        // InferenceContext and leaves the training state alone. Outputs are
+        // cached per image until the weights change, however they do:
+        // Backpropagate(), an Optimizer step or LoadWeights().
+        void EvalImage(const float* input);
+        const InferenceCache& GetEvalImageCache() const;
 
     private:
         MnistParser mnist_parser_;
@@ -43,12 +65,26 @@ class Mnist {
         std::unique_ptr<InputLayer>         input_layer_;
         std::vector<MiddleLayer>            middle_layers_;
         std::unique_ptr<OutputLayerDiscret> output_layer_;
-
-        SmartMatrix  input_test_vector_;
-        SmartMatrix  output_test_vector_;
+        std::unique_ptr<ParameterBuffer>    params_;
+        ExecutionPlan                       eval_plan_;
 
         std::vector<std::string> middle_layers_names_;
         std::string              output_layer_name_;
+        std::string              checkpoint_name_;
+
+        // Owns the mapping the layers' weights point into after LoadWeights().
+        std::unique_ptr<CheckpointReader> checkpoint_reader_;
+        CheckpointWriter                  checkpoint_writer_;
+        std::unique_ptr<AsyncCheckpointer> checkpointer_;
+
+        // What EvalImage() evaluates on, snapshotted on first use after the
+        // weights changed, i.e. after params_->GetGeneration() moved on.
+        std::shared_ptr<const InferenceModel> eval_image_model_;
+        uint64_t                              eval_image_generation_;
+        InferenceCache                        eval_image_cache_;
+
+        bool LoadCheckpoint();
+        void LoadLegacyWeights();
 
 
         void Dump();
@@ -1,51 +1,110 @@
 #include "../include/MLP.h"
+#include "../include/fused_expr.h"
 
 #include <cmath>
+#include <fstream>
 #include <iostream>
+#include <vector>
 #include <assert.h>
 
+namespace {
+
+// Parameter files hold a size_t count and that many floats. The float
+// layers write them as they are, the others convert; reading goes through
+// a float buffer either way.
+void WriteParams(std::ofstream* ofs, const float* values, std::size_t n_values) {
+    ofs->write(reinterpret_cast<const char*>(&n_values), sizeof(n_values));
+    ofs->write(reinterpret_cast<const char*>(values), n_values * sizeof(float));
+}
+
+template <typename T>
+void WriteParams(std::ofstream* ofs, const T* values, std::size_t n_values) {
+    std::vector<float> floats(values, values + n_values);
+    WriteParams(ofs, floats.data(), n_values);
+}
+
+// Leaves values alone unless the whole tensor was read.
+CheckpointError ReadParams(std::ifstream* ifs, std::vector<float>* values, std::size_t n_values) {
+    std::size_t n_stored = 0;
+    if (!ifs->read(reinterpret_cast<char*>(&n_stored), sizeof(n_stored))) {
+        return CheckpointError::Truncated;
+    }
+    if (n_stored != n_values) {
+        return CheckpointError::ShapeMismatch;
+    }
+
+    std::vector<float> floats(n_values);
+    if (!ifs->read(reinterpret_cast<char*>(floats.data()),
+                   static_cast<std::streamsize>(n_values * sizeof(float)))) {
+        return CheckpointError::Truncated;
+    }
+
+    *values = std::move(floats);
+    return CheckpointError::Ok;
+}
+
+template <typename T>
+void CopyParams(const std::vector<float>& floats, T* values) {
+    for (std::size_t i = 0; i < floats.size(); i++) {
+        values[i] = static_cast<typename ScalarTraits<T>::Compute>(floats[i]);
+    }
+}
+
+} // namespace
+
 //================================ Layer ======================================
 
-Layer::Layer(std::size_t rows, std::size_t cols, Layer* input_layer)
+template <typename T>
+LayerT<T>::LayerT(std::size_t rows, std::size_t cols, LayerT* input_layer)
         : input_layer_(input_layer),
-          output_(rows, cols) {
+          output_rows_(rows),
+          output_cols_(cols) {
 }
 
 
-Layer::~Layer() {
+template <typename T>
+LayerT<T>::~LayerT() {
     // No need to delete input_layer_ as it is not owned by this class
 }
 
 
-Layer::Layer(const Layer& other)
+template <typename T>
+LayerT<T>::LayerT(const LayerT& other)
     : input_layer_(other.input_layer_),
-      output_(other.output_) {
+      output_rows_(other.output_rows_),
+      output_cols_(other.output_cols_) {
 }
 
 
-Layer& Layer::operator=(const Layer& other) {
+template <typename T>
+LayerT<T>& LayerT<T>::operator=(const LayerT& other) {
     if (this == &other) return *this;
 
     input_layer_ = other.input_layer_;
-    output_      = other.output_;
+    output_rows_ = other.output_rows_;
+    output_cols_ = other.output_cols_;
 
     return *this;
 }
 
 
-Layer::Layer(Layer&& other) 
+template <typename T>
+LayerT<T>::LayerT(LayerT&& other) 
     : input_layer_(other.input_layer_),
-      output_(std::move(other.output_)) {
+      output_rows_(other.output_rows_),
+      output_cols_(other.output_cols_) {
 
     other.input_layer_ = nullptr;
 }
 
 
-Layer& Layer::operator=(Layer&& other) {
+template <typename T>
+LayerT<T>& LayerT<T>::operator=(LayerT&& other) {
     if (this == &other) return *this;
 
     input_layer_ = other.input_layer_;
-    output_ = std::move(other.output_);
+    output_rows_ = other.output_rows_;
+    output_cols_ = other.output_cols_;
 
     other.input_layer_ = nullptr;
 
@@ -53,88 +112,114 @@ Layer& Layer::operator=(Layer&& other) {
 }
 
 
-void Layer::SetInputLayer(Layer* layer) {input_layer_ = layer; }
+template <typename T>
+void LayerT<T>::SetInputLayer(LayerT* layer) {input_layer_ = layer; }
 
-Layer*      Layer::GetInputLayer() const { return input_layer_; }
-std::size_t Layer::GetOutputRows() const { return output_.GetRows(); }
-std::size_t Layer::GetOutputCols() const { return output_.GetCols(); }
+
+template <typename T> LayerT<T>*  LayerT<T>::GetInputLayer() const { return input_layer_; }
+template <typename T> std::size_t LayerT<T>::GetOutputRows() const { return output_rows_; }
+template <typename T> std::size_t LayerT<T>::GetOutputCols() const { return output_cols_; }
 
 
 //================================ InputLayer =================================
 
-InputLayer::InputLayer(std::size_t n_inputs, std::size_t n_examples)
-        : Layer      (n_examples, n_inputs, nullptr),
+template <typename T>
+InputLayerT<T>::InputLayerT(std::size_t n_inputs, std::size_t n_examples)
+        : LayerT<T>  (n_examples, n_inputs, nullptr),
           n_inputs_  (n_inputs), 
-          n_examples_(n_examples) {
+          n_examples_(n_examples),
+          output_    (n_examples, n_inputs) {
+
+    this->SetMemoryTag("input");
 }
 
 
-InputLayer::~InputLayer() {
+template <typename T>
+InputLayerT<T>::~InputLayerT() {
 }
 
 
-InputLayer::InputLayer(const InputLayer& other)
-    : Layer      (other),
+template <typename T>
+InputLayerT<T>::InputLayerT(const InputLayerT& other)
+    : LayerT<T>  (other),
       n_inputs_  (other.n_inputs_),
-      n_examples_(other.n_examples_) {
+      n_examples_(other.n_examples_),
+      output_    (other.output_) {
 }
 
 
-InputLayer& InputLayer::operator=(const InputLayer& other) {
+template <typename T>
+InputLayerT<T>& InputLayerT<T>::operator=(const InputLayerT& other) {
     if (this == &other) return *this;
 
     assert(n_inputs_   == other.n_inputs_);
     assert(n_examples_ == other.n_examples_);
 
-    Layer::operator=(other);
+    LayerT<T>::operator=(other);
+    output_ = other.output_;
 
     return *this;
 }
 
 
-InputLayer::InputLayer(InputLayer&& other) 
-    : Layer(std::move(other)),
+template <typename T>
+InputLayerT<T>::InputLayerT(InputLayerT&& other) 
+    : LayerT<T>(std::move(other)),
       n_inputs_  (other.n_inputs_),
-      n_examples_(other.n_examples_) {
+      n_examples_(other.n_examples_),
+      output_    (std::move(other.output_)) {
 }
 
 
-InputLayer& InputLayer::operator=(InputLayer&& other) {
+template <typename T>
+InputLayerT<T>& InputLayerT<T>::operator=(InputLayerT&& other) {
     if (this == &other) return *this;
 
     assert(n_inputs_   == other.n_inputs_);
     assert(n_examples_ == other.n_examples_);
 
-    Layer::operator=(std::move(other));
+    LayerT<T>::operator=(std::move(other));
+    output_ = std::move(other.output_);
 
     return *this;
 }
 
 
-void InputLayer::SetValue(std::size_t example, std::size_t input, float value) {
+template <typename T>
+void InputLayerT<T>::SetValue(std::size_t example, std::size_t input, Compute value) {
     output_.SetValue(example, input, value);
 }
 
 
-std::size_t InputLayer::GetCols() const { return n_inputs_;   }
-std::size_t InputLayer::GetRows() const { return n_examples_; }
+template <typename T> std::size_t InputLayerT<T>::GetCols() const { return n_inputs_;   }
+template <typename T> std::size_t InputLayerT<T>::GetRows() const { return n_examples_; }
 
 
-SmartMatrix* InputLayer::GetOutput() { return &output_; }
+template <typename T>
+SmartMatrixT<T>* InputLayerT<T>::GetOutput() { return &output_; }
 
 
-void InputLayer::ResetGrads() {
+template <typename T>
+void InputLayerT<T>::SetMemoryTag(const char* tag) {
+    output_.SetMemoryTag(tag, MemoryRole::Activation);
+}
+
+
+template <typename T>
+void InputLayerT<T>::ResetGrads() {
     output_.ResetGrad();
 }
 
-void InputLayer::EvalRecursive()                    { /* nothing here */}
-void InputLayer::ResetGradsRecursive()              { ResetGrads();     }
-void InputLayer::BackpropagateRecursive(float step) { /* nothing here */}
+template <typename T> void InputLayerT<T>::EvalRecursive()                      { /* nothing here */}
+template <typename T> void InputLayerT<T>::ResetGradsRecursive()                { ResetGrads();     }
+template <typename T> void InputLayerT<T>::BackpropagateRecursive(Compute step) { /* nothing here */}
+template <typename T> void InputLayerT<T>::CollectParamsRecursive(std::vector<SmartMatrixT<T>*>* params) { /* nothing here */}
 
 //================================ MiddleLayer ================================
 
-MiddleLayer::MiddleLayer(Layer* input_layer, std::size_t n_outputs)
-    : Layer         (input_layer->GetOutputRows(), n_outputs, input_layer),
+template <typename T>
+MiddleLayerT<T>::MiddleLayerT(LayerT<T>* input_layer, std::size_t n_outputs)
+    : LayerT<T>     (input_layer->GetOutputRows(), n_outputs, input_layer),
       n_input_rows_ (input_layer->GetOutputRows()),
       n_input_cols_ (input_layer->GetOutputCols()),
       n_output_cols_(n_outputs),
@@ -143,15 +228,18 @@ MiddleLayer::MiddleLayer(Layer* input_layer, std::size_t n_outputs)
       unbiased_output_(n_input_rows_, n_output_cols_),
       norm_output_    (n_input_rows_, n_output_cols_) {
 
+    SetMemoryTag("middle");
     SetNormalRand();
 }
 
 
-MiddleLayer::~MiddleLayer() {
+template <typename T>
+MiddleLayerT<T>::~MiddleLayerT() {
 }
 
-MiddleLayer::MiddleLayer(const MiddleLayer& other)
-    : Layer           (other),
+template <typename T>
+MiddleLayerT<T>::MiddleLayerT(const MiddleLayerT& other)
+    : LayerT<T>       (other),
       n_input_rows_   (other.n_input_rows_),
       n_input_cols_   (other.n_input_cols_),
       n_output_cols_  (other.n_output_cols_),
@@ -161,14 +249,15 @@ MiddleLayer::MiddleLayer(const MiddleLayer& other)
       norm_output_    (other.norm_output_) {
 }
 
-MiddleLayer& MiddleLayer::operator=(const MiddleLayer& other) {
+template <typename T>
+MiddleLayerT<T>& MiddleLayerT<T>::operator=(const MiddleLayerT& other) {
     if (this == &other) return *this;
 
     assert(n_input_rows_  == other.n_input_rows_);
     assert(n_input_cols_  == other.n_input_cols_);
     assert(n_output_cols_ == other.n_output_cols_);
 
-    Layer::operator=(other);
+    LayerT<T>::operator=(other);
 
     weights_         = other.weights_;
     biases_          = other.biases_;
@@ -179,8 +268,9 @@ MiddleLayer& MiddleLayer::operator=(const MiddleLayer& other) {
 }
 
 
-MiddleLayer::MiddleLayer(MiddleLayer&& other) 
-    : Layer(std::move(other)),
+template <typename T>
+MiddleLayerT<T>::MiddleLayerT(MiddleLayerT&& other) 
+    : LayerT<T>(std::move(other)),
       n_input_rows_     (other.n_input_rows_),
       n_input_cols_     (other.n_input_cols_),
       n_output_cols_    (other.n_output_cols_),
@@ -191,10 +281,11 @@ MiddleLayer::MiddleLayer(MiddleLayer&& other)
 }
 
 
-MiddleLayer& MiddleLayer::operator=(MiddleLayer&& other) {
+template <typename T>
+MiddleLayerT<T>& MiddleLayerT<T>::operator=(MiddleLayerT&& other) {
     if (this == &other) return *this;
 
-    Layer::operator=(std::move(other));
+    LayerT<T>::operator=(std::move(other));
 
     assert(n_input_rows_  == other.n_input_rows_);
     assert(n_input_cols_  == other.n_input_cols_);
@@ -209,83 +300,159 @@ MiddleLayer& MiddleLayer::operator=(MiddleLayer&& other) {
 }
 
 
-void MiddleLayer::SaveParamsToFile(const char* file_name) {
+template <typename T>
+void MiddleLayerT<T>::SaveParamsToFile(const char* file_name) {
     assert(file_name);
 
-    const float* weights = weights_.GetValues();
-    const float* biases  = biases_ .GetValues();
-
     size_t n_weights = weights_.GetRows() * weights_.GetCols();
     size_t n_biases  =  biases_.GetRows() *  biases_.GetCols();
 
     std::ofstream ofs(file_name, std::ios::binary);
     assert(ofs);
 
-    ofs.write(reinterpret_cast<const char*>(&n_weights), sizeof(n_weights));
-    ofs.write(reinterpret_cast<const char*>(weights), n_weights * sizeof(float));
-
-    ofs.write(reinterpret_cast<const char*>(&n_biases), sizeof(n_biases));
-    ofs.write(reinterpret_cast<const char*>(biases), n_biases * sizeof(float));
+    WriteParams(&ofs, weights_.GetValues(), n_weights);
+    WriteParams(&ofs, biases_ .GetValues(), n_biases);
 
     ofs.close();
 }
 
 
-void MiddleLayer::LoadParamsFromFile(const char* file_name) {
+// Both tensors are read before either is stored, so a file of another
+// shape or a truncated one leaves the layer as it was.
+template <typename T>
+CheckpointError MiddleLayerT<T>::LoadParamsFromFile(const char* file_name) {
     assert(file_name);
 
     std::ifstream ifs(file_name, std::ios::binary);
-    assert(ifs);
+    if (!ifs) {
+        return CheckpointError::OpenFailed;
+    }
+
+    std::vector<float> weights;
+    std::vector<float> biases;
 
-    size_t n_weights = 0;
-    size_t n_biases  = 0;
+    CheckpointError error = ReadParams(&ifs, &weights, weights_.GetRows() * weights_.GetCols());
+    if (error == CheckpointError::Ok) {
+        error = ReadParams(&ifs, &biases, biases_.GetRows() * biases_.GetCols());
+    }
+    if (error != CheckpointError::Ok) {
+        return error;
+    }
 
-    ifs.read(reinterpret_cast<char*>(&n_weights), sizeof(n_weights));
-    float* weights = new float[n_weights];
-    ifs.read(reinterpret_cast<char*>(weights), n_weights * sizeof(float));
+    // Copied in place: the matrices may be views into a ParameterBuffer.
+    CopyParams(weights, weights_.GetMutableValues());
+    CopyParams(biases,  biases_ .GetMutableValues());
+    weights_.MarkValuesChanged();
+    biases_ .MarkValuesChanged();
 
-    ifs.read(reinterpret_cast<char*>(&n_biases), sizeof(n_biases));
-    float* biases = new float[n_biases];
-    ifs.read(reinterpret_cast<char*>(biases), n_biases * sizeof(float));
+    return CheckpointError::Ok;
+}
 
-    ifs.close();
 
-    weights_.SetValues(weights);
-    biases_ .SetValues(biases);
+template <typename T>
+CheckpointLayerType MiddleLayerT<T>::GetCheckpointType() const {
+    return CheckpointLayerType::Middle;
 }
 
 
-void MiddleLayer::SetNormalRand() {
+template <>
+void MiddleLayerT<float>::SaveParamsToCheckpoint(CheckpointWriter* writer) const {
+    assert(writer);
+
+    writer->AddLayer(GetCheckpointType(), n_input_cols_, n_output_cols_);
+    writer->AddTensor(CheckpointRole::Weights, weights_.GetRows(), weights_.GetCols(),
+                      weights_.GetValues());
+    writer->AddTensor(CheckpointRole::Biases,  biases_ .GetRows(), biases_ .GetCols(),
+                      biases_ .GetValues());
+}
+
+
+template <>
+CheckpointError MiddleLayerT<float>::CheckCheckpointParams(const CheckpointReader& reader,
+                                                           std::size_t layer) const {
+    if (layer >= reader.GetLayersCount()) {
+        return CheckpointError::ShapeMismatch;
+    }
+
+    const CheckpointLayerInfo& info = reader.GetLayer(layer);
+    if (info.type      != static_cast<uint32_t>(GetCheckpointType()) ||
+        info.n_inputs  != n_input_cols_ ||
+        info.n_outputs != n_output_cols_) {
+        return CheckpointError::ShapeMismatch;
+    }
+
+    const CheckpointTensorInfo* weights = reader.FindTensor(layer, CheckpointRole::Weights);
+    const CheckpointTensorInfo* biases  = reader.FindTensor(layer, CheckpointRole::Biases);
+    if (weights == nullptr || biases == nullptr ||
+        weights->rows != weights_.GetRows() || weights->cols != weights_.GetCols() ||
+        biases ->rows != biases_ .GetRows() || biases ->cols != biases_ .GetCols()) {
+        return CheckpointError::ShapeMismatch;
+    }
+
+    return CheckpointError::Ok;
+}
+
+
+template <>
+CheckpointError MiddleLayerT<float>::MapCheckpointParams(const CheckpointReader& reader,
+                                                         std::size_t layer) {
+    CheckpointError error = CheckCheckpointParams(reader, layer);
+    if (error != CheckpointError::Ok) {
+        return error;
+    }
+
+    weights_.MapValues(reader.GetTensorData(reader.FindTensor(layer, CheckpointRole::Weights)));
+    biases_ .MapValues(reader.GetTensorData(reader.FindTensor(layer, CheckpointRole::Biases)));
+
+    return CheckpointError::Ok;
+}
+
+
+template <typename T>
+void MiddleLayerT<T>::SetNormalRand() {
     weights_.SetMatrixNormRand();
     biases_ .SetMatrixNormRand();
 }
 
 
-void MiddleLayer::ResetGrads() {
+template <typename T>
+void MiddleLayerT<T>::SetMemoryTag(const char* tag) {
+    weights_        .SetMemoryTag(tag, MemoryRole::Weights);
+    biases_         .SetMemoryTag(tag, MemoryRole::Weights);
+    unbiased_output_.SetMemoryTag(tag, MemoryRole::Activation);
+    norm_output_    .SetMemoryTag(tag, MemoryRole::Activation);
+}
+
+
+template <typename T>
+void MiddleLayerT<T>::ResetGrads() {
     weights_        .ResetGrad();
     biases_         .ResetGrad();
     unbiased_output_.ResetGrad();
-    output_         .ResetGrad();
     norm_output_    .ResetGrad();
 }
 
 
-void MiddleLayer::Eval() {
+// Bias and sigmoid in one pass.
+template <typename T>
+void MiddleLayerT<T>::Eval() {
     unbiased_output_.Mul(input_layer_->GetOutput(), &weights_);
-    output_.AddVectorToMatrix(&unbiased_output_, &biases_);
-    norm_output_.Sigm(&output_);
+    Assign(&norm_output_, Sigm(Expr(&unbiased_output_) + Expr(&biases_)));
 }
 
 
-void MiddleLayer::Backpropagate(float step) {
+template <typename T>
+void MiddleLayerT<T>::Backpropagate(Compute step) {
     weights_.AdjustValues(step);
     biases_ .AdjustValues(step);
 }
 
 
-SmartMatrix* MiddleLayer::GetOutput() { return &norm_output_; }
+template <typename T>
+SmartMatrixT<T>* MiddleLayerT<T>::GetOutput() { return &norm_output_; }
 
-void MiddleLayer::EvalRecursive() {
+template <typename T>
+void MiddleLayerT<T>::EvalRecursive() {
     assert(input_layer_);
 
     input_layer_->EvalRecursive();
@@ -293,7 +460,8 @@ void MiddleLayer::EvalRecursive() {
 }
 
 
-void MiddleLayer::ResetGradsRecursive() {
+template <typename T>
+void MiddleLayerT<T>::ResetGradsRecursive() {
     assert(input_layer_);
 
     input_layer_->ResetGradsRecursive();
@@ -301,99 +469,135 @@ void MiddleLayer::ResetGradsRecursive() {
 }
 
 
-void MiddleLayer::BackpropagateRecursive(float step) {
+template <typename T>
+void MiddleLayerT<T>::BackpropagateRecursive(Compute step) {
     assert(input_layer_);
 
     input_layer_->BackpropagateRecursive(step);
     Backpropagate(step);
 }
 
+
+template <typename T>
+void MiddleLayerT<T>::CollectParamsRecursive(std::vector<SmartMatrixT<T>*>* params) {
+    assert(input_layer_);
+    assert(params);
+
+    input_layer_->CollectParamsRecursive(params);
+    params->push_back(&weights_);
+    params->push_back(&biases_);
+}
+
 //================================ OutputLayer ================================
 
-OutputLayer::OutputLayer(Layer* input_layer, std::size_t n_outputs) 
-    : MiddleLayer(input_layer, n_outputs),
+template <typename T>
+OutputLayerT<T>::OutputLayerT(LayerT<T>* input_layer, std::size_t n_outputs) 
+    : MiddleLayerT<T>(input_layer, n_outputs),
       loss_(1, 1),
-      expected_output_(output_.GetRows(), output_.GetCols()) {
+      scheduler_(nullptr) {
+
+    SetMemoryTag("output");
 }
 
 
-OutputLayer::~OutputLayer() {
+template <typename T>
+OutputLayerT<T>::~OutputLayerT() {
 }
 
 
-OutputLayer::OutputLayer(const OutputLayer& other)
-    : MiddleLayer        (other),
+template <typename T>
+OutputLayerT<T>::OutputLayerT(const OutputLayerT& other)
+    : MiddleLayerT<T>    (other),
       loss_              (other.loss_),
-      expected_output_   (other.expected_output_) {
+      scheduler_         (other.scheduler_) {
 }
 
 
-OutputLayer& OutputLayer::operator=(const OutputLayer& other) {
+template <typename T>
+OutputLayerT<T>& OutputLayerT<T>::operator=(const OutputLayerT& other) {
     if (this == &other) return *this;
 
-    MiddleLayer::operator=(other);
+    MiddleLayerT<T>::operator=(other);
 
     loss_            = other.loss_;
-    expected_output_ = other.expected_output_;
+    scheduler_       = other.scheduler_;
 
     return *this;
 }
 
 
-OutputLayer::OutputLayer(OutputLayer&& other) 
-    : MiddleLayer        (std::move(other)),
+template <typename T>
+OutputLayerT<T>::OutputLayerT(OutputLayerT&& other) 
+    : MiddleLayerT<T>    (std::move(other)),
       loss_              (std::move(other.loss_)),
-      expected_output_   (std::move(other.expected_output_)) {
+      scheduler_         (other.scheduler_) {
 }
 
 
-OutputLayer& OutputLayer::operator=(OutputLayer&& other) {
+template <typename T>
+OutputLayerT<T>& OutputLayerT<T>::operator=(OutputLayerT&& other) {
     if (this == &other) return *this;
 
-    MiddleLayer::operator=(std::move(other));
+    MiddleLayerT<T>::operator=(std::move(other));
 
     loss_               = std::move(other.loss_);
-    expected_output_    = std::move(other.expected_output_);
+    scheduler_          = other.scheduler_;
 
     return *this;
 }
 
 
-void OutputLayer::SetExpectedValue(std::size_t example, std::size_t output, float value) {
-    expected_output_.SetValue(example, output, value);
+template <typename T>
+void OutputLayerT<T>::SetScheduler(TaskScheduler* scheduler) {
+    scheduler_ = scheduler;
 }
 
 
-float OutputLayer::GetExpectedValue(std::size_t example, std::size_t output) {
-    return expected_output_.GetValue(example, output);
+template <typename T>
+void OutputLayerT<T>::EvalLossGrad_() {
+    if (scheduler_) {
+        loss_.EvalGrad(scheduler_);
+    } else {
+        loss_.EvalGrad();
+    }
 }
 
 
-void OutputLayer::Dump() {
+template <typename T>
+void OutputLayerT<T>::Dump() {
     loss_.Dump();
 }
 
 
-void OutputLayer::ResetGrads() {
+template <typename T>
+void OutputLayerT<T>::ResetGrads() {
     weights_        .ResetGrad();
     biases_         .ResetGrad();
     unbiased_output_.ResetGrad();
-    output_         .ResetGrad();
     norm_output_    .ResetGrad();
     loss_           .ResetGrad();
-    expected_output_.ResetGrad();
 }
 
 
-float OutputLayer::GetLoss() const { return loss_.GetValue(0, 0); }
+template <typename T>
+typename OutputLayerT<T>::Compute OutputLayerT<T>::GetLoss() const { return loss_.GetValue(0, 0); }
+
+
+template <typename T>
+void OutputLayerT<T>::SetMemoryTag(const char* tag) {
+    MiddleLayerT<T>::SetMemoryTag(tag);
+    loss_.SetMemoryTag(tag, MemoryRole::Activation);
+}
 
 
-float OutputLayer::GetNormOutput(std::size_t example, std::size_t output) {
+template <typename T>
+typename OutputLayerT<T>::Compute OutputLayerT<T>::GetNormOutput(std::size_t example, std::size_t output) {
     return norm_output_.GetValue(example, output);
 }
 
 
-void OutputLayer::EvalRecursive() {
+template <typename T>
+void OutputLayerT<T>::EvalRecursive() {
     assert(input_layer_);
 
     input_layer_->EvalRecursive();
@@ -401,7 +605,8 @@ void OutputLayer::EvalRecursive() {
 }
 
 
-void OutputLayer::ResetGradsRecursive() {
+template <typename T>
+void OutputLayerT<T>::ResetGradsRecursive() {
     assert(input_layer_);
 
     input_layer_->ResetGradsRecursive();
@@ -409,93 +614,234 @@ void OutputLayer::ResetGradsRecursive() {
 }
 
 
-void OutputLayer::BackpropagateRecursive(float step) {
+template <typename T>
+void OutputLayerT<T>::BackpropagateRecursive(Compute step) {
     assert(input_layer_);
 
     input_layer_->BackpropagateRecursive(step);
-    Backpropagate(step);
+    this->Backpropagate(step);
 }
 
 //================================ OutputLayer* ================================
 
-OutputLayerDiscret::OutputLayerDiscret(Layer* input_layer, std::size_t n_outputs)
-    : OutputLayer(input_layer, n_outputs) {}
+template <typename T>
+OutputLayerDiscretT<T>::OutputLayerDiscretT(LayerT<T>* input_layer, std::size_t n_outputs)
+    : OutputLayerT<T>(input_layer, n_outputs),
+      output_(input_layer->GetOutputRows(), n_outputs),
+      labels_(output_.GetRows(), 0) {
+
+    SetMemoryTag("output");
+}
 
-OutputLayerDiscret::~OutputLayerDiscret() {}
+template <typename T>
+OutputLayerDiscretT<T>::~OutputLayerDiscretT() {}
 
-OutputLayerDiscret::OutputLayerDiscret(const OutputLayerDiscret& other)
-    : OutputLayer(other) {}
+template <typename T>
+OutputLayerDiscretT<T>::OutputLayerDiscretT(const OutputLayerDiscretT& other)
+    : OutputLayerT<T>(other),
+      output_(other.output_),
+      labels_(other.labels_) {}
 
-OutputLayerDiscret& OutputLayerDiscret::operator=(const OutputLayerDiscret& other) {
+template <typename T>
+OutputLayerDiscretT<T>& OutputLayerDiscretT<T>::operator=(const OutputLayerDiscretT& other) {
     if (this == &other) return *this;
 
-    OutputLayer::operator=(other);
+    OutputLayerT<T>::operator=(other);
+    output_ = other.output_;
+    labels_ = other.labels_;
 
     return *this;
 }
 
-OutputLayerDiscret::OutputLayerDiscret(OutputLayerDiscret&& other)
-    : OutputLayer(other) {}
+template <typename T>
+OutputLayerDiscretT<T>::OutputLayerDiscretT(OutputLayerDiscretT&& other)
+    : OutputLayerT<T>(other),
+      output_(std::move(other.output_)),
+      labels_(std::move(other.labels_)) {}
 
-OutputLayerDiscret& OutputLayerDiscret::operator=(OutputLayerDiscret&& other) {
+template <typename T>
+OutputLayerDiscretT<T>& OutputLayerDiscretT<T>::operator=(OutputLayerDiscretT&& other) {
     if (this == &other) return *this;
 
-    OutputLayer::operator=(other);
+    OutputLayerT<T>::operator=(other);
+    output_ = std::move(other.output_);
+    labels_ = std::move(other.labels_);
 
     return *this;
 }
 
-OutputLayerContinuos::OutputLayerContinuos(Layer* input_layer, std::size_t n_outputs)
-    : OutputLayer(input_layer, n_outputs) {}
+template <typename T>
+OutputLayerContinuosT<T>::OutputLayerContinuosT(LayerT<T>* input_layer, std::size_t n_outputs)
+    : OutputLayerT<T>(input_layer, n_outputs),
+      expected_output_(this->GetOutputRows(), this->GetOutputCols()) {
+
+    SetMemoryTag("output");
+}
 
-OutputLayerContinuos::~OutputLayerContinuos() {}
+template <typename T>
+OutputLayerContinuosT<T>::~OutputLayerContinuosT() {}
 
-OutputLayerContinuos::OutputLayerContinuos(const OutputLayerContinuos& other)
-    : OutputLayer(other) {}
+template <typename T>
+OutputLayerContinuosT<T>::OutputLayerContinuosT(const OutputLayerContinuosT& other)
+    : OutputLayerT<T>(other),
+      expected_output_(other.expected_output_) {}
 
-OutputLayerContinuos& OutputLayerContinuos::operator=(const OutputLayerContinuos& other) {
+template <typename T>
+OutputLayerContinuosT<T>& OutputLayerContinuosT<T>::operator=(const OutputLayerContinuosT& other) {
     if (this == &other) return *this;
 
-    OutputLayer::operator=(other);
+    OutputLayerT<T>::operator=(other);
+    expected_output_ = other.expected_output_;
 
     return *this;
 }
 
-OutputLayerContinuos::OutputLayerContinuos(OutputLayerContinuos&& other)
-    : OutputLayer(other) {}
+template <typename T>
+OutputLayerContinuosT<T>::OutputLayerContinuosT(OutputLayerContinuosT&& other)
+    : OutputLayerT<T>(other),
+      expected_output_(std::move(other.expected_output_)) {}
 
-OutputLayerContinuos& OutputLayerContinuos::operator=(OutputLayerContinuos&& other) {
+template <typename T>
+OutputLayerContinuosT<T>& OutputLayerContinuosT<T>::operator=(OutputLayerContinuosT&& other) {
     if (this == &other) return *this;
 
-    OutputLayer::operator=(other);
+    OutputLayerT<T>::operator=(other);
+    expected_output_ = std::move(other.expected_output_);
 
     return *this;
 }
 
-void OutputLayerDiscret::Eval() {
+template <typename T>
+void OutputLayerDiscretT<T>::Eval() {
     unbiased_output_.Mul(input_layer_->GetOutput(), &weights_);
     output_.AddVectorToMatrix(&unbiased_output_, &biases_);
     norm_output_.Softmax(&output_);
 }
 
-float OutputLayerDiscret::EvalLoss() {
+template <typename T>
+typename OutputLayerDiscretT<T>::Compute OutputLayerDiscretT<T>::EvalLoss() {
     Eval();
-    loss_.CrossEntropyLoss(&norm_output_, &expected_output_);
-    loss_.EvalGrad();
+    loss_.CrossEntropyLoss(&norm_output_, labels_.data());
+    this->EvalLossGrad_();
 
     return loss_.GetValue(0, 0);
 }
 
-void OutputLayerContinuos::Eval() {
+template <typename T>
+void OutputLayerDiscretT<T>::ResetGrads() {
+    OutputLayerT<T>::ResetGrads();
+    output_.ResetGrad();
+}
+
+template <typename T>
+void OutputLayerDiscretT<T>::SetMemoryTag(const char* tag) {
+    OutputLayerT<T>::SetMemoryTag(tag);
+    output_.SetMemoryTag(tag, MemoryRole::Activation);
+}
+
+template <typename T>
+CheckpointLayerType OutputLayerDiscretT<T>::GetCheckpointType() const {
+    return CheckpointLayerType::OutputDiscret;
+}
+
+template <typename T>
+void OutputLayerDiscretT<T>::SetExpectedValue(std::size_t example, std::size_t output, Compute value) {
+    if (value > 0.5f) {
+        SetLabel(example, static_cast<uint32_t>(output));
+    }
+}
+
+template <typename T>
+typename OutputLayerDiscretT<T>::Compute OutputLayerDiscretT<T>::GetExpectedValue(std::size_t example, std::size_t output) {
+    return labels_[example] == output ? 1.0f : 0.0f;
+}
+
+template <typename T>
+void OutputLayerDiscretT<T>::SetLabel(std::size_t example, uint32_t label) {
+    assert(example < labels_.size());
+    assert(label < n_output_cols_);
+
+    labels_[example] = label;
+}
+
+template <typename T>
+void OutputLayerDiscretT<T>::SetLabels(const uint8_t* labels) {
+    assert(labels);
+
+    for (std::size_t example = 0; example < labels_.size(); example++) {
+        SetLabel(example, labels[example]);
+    }
+}
+
+template <typename T>
+uint32_t OutputLayerDiscretT<T>::GetLabel(std::size_t example) const {
+    return labels_[example];
+}
+
+// Bias and sigmoid in one pass.
+template <typename T>
+void OutputLayerContinuosT<T>::Eval() {
     unbiased_output_.Mul(input_layer_->GetOutput(), &weights_);
-    output_.AddVectorToMatrix(&unbiased_output_, &biases_);
-    norm_output_.Sigm(&output_);
+    Assign(&norm_output_, Sigm(Expr(&unbiased_output_) + Expr(&biases_)));
 }
 
-float OutputLayerContinuos::EvalLoss() {
+template <typename T>
+typename OutputLayerContinuosT<T>::Compute OutputLayerContinuosT<T>::EvalLoss() {
     Eval();
     loss_.SquaredErrorLoss(&norm_output_, &expected_output_);
-    loss_.EvalGrad();
+    this->EvalLossGrad_();
 
     return loss_.GetValue(0, 0);
 }
+
+template <typename T>
+CheckpointLayerType OutputLayerContinuosT<T>::GetCheckpointType() const {
+    return CheckpointLayerType::OutputContinuos;
+}
+
+template <typename T>
+void OutputLayerContinuosT<T>::ResetGrads() {
+    OutputLayerT<T>::ResetGrads();
+    expected_output_.ResetGrad();
+}
+
+template <typename T>
+void OutputLayerContinuosT<T>::SetMemoryTag(const char* tag) {
+    OutputLayerT<T>::SetMemoryTag(tag);
+    expected_output_.SetMemoryTag(tag, MemoryRole::Target);
+}
+
+template <typename T>
+void OutputLayerContinuosT<T>::SetExpectedValue(std::size_t example, std::size_t output, Compute value) {
+    expected_output_.SetValue(example, output, value);
+}
+
+template <typename T>
+typename OutputLayerContinuosT<T>::Compute OutputLayerContinuosT<T>::GetExpectedValue(std::size_t example, std::size_t output) {
+    return expected_output_.GetValue(example, output);
+}
+
+
+template class LayerT<float>;
+template class LayerT<double>;
+template class LayerT<Half>;
+
+template class InputLayerT<float>;
+template class InputLayerT<double>;
+template class InputLayerT<Half>;
+
+template class MiddleLayerT<float>;
+template class MiddleLayerT<double>;
+template class MiddleLayerT<Half>;
+
+template class OutputLayerT<float>;
+template class OutputLayerT<double>;
+template class OutputLayerT<Half>;
+
+template class OutputLayerDiscretT<float>;
+template class OutputLayerDiscretT<double>;
+template class OutputLayerDiscretT<Half>;
+
+template class OutputLayerContinuosT<float>;
+template class OutputLayerContinuosT<double>;
+template class OutputLayerContinuosT<Half>;
@@ -0,0 +1,76 @@
+#include "../include/async_checkpointer.h"
+
+#include <assert.h>
+#include <iostream>
+
+AsyncCheckpointer::AsyncCheckpointer(const char* file_name)
+    : file_name_  (file_name),
+      has_pending_(false),
+      is_writing_ (false),
+      stop_       (false),
+      last_error_ (CheckpointError::Ok) {
+
+    assert(file_name);
+
+    writer_ = std::thread(&AsyncCheckpointer::WriterLoop_, this);
+}
+
+
+AsyncCheckpointer::~AsyncCheckpointer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_writer_.notify_one();
+
+    writer_.join();
+}
+
+
+void AsyncCheckpointer::Save(const CheckpointWriter& writer) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.Snapshot(writer);
+        has_pending_ = true;
+    }
+    wake_writer_.notify_one();
+}
+
+
+CheckpointError AsyncCheckpointer::Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_flush_.wait(lock, [this] { return !has_pending_ && !is_writing_; });
+
+    return last_error_;
+}
+
+
+void AsyncCheckpointer::WriterLoop_() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        wake_writer_.wait(lock, [this] { return has_pending_ || stop_; });
+
+        // Pending snapshots are written out even when stopping.
+        if (!has_pending_) {
+            break;
+        }
+
+        std::swap(pending_, writing_);
+        has_pending_ = false;
+        is_writing_  = true;
+
+        lock.unlock();
+        CheckpointError error = writing_.Write(file_name_.c_str(), true);
+        lock.lock();
+
+        if (error != CheckpointError::Ok) {
+            std::cerr << "Can't save " << file_name_ << ": "
+                      << CheckpointErrorString(error) << std::endl;
+        }
+
+        last_error_ = error;
+        is_writing_ = false;
+        wake_flush_.notify_all();
+    }
+}
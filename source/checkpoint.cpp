@@ -0,0 +1,473 @@
+#include "../include/checkpoint.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+
+static const char kCheckpointMagic[8] = {'K', 'G', 'P', 'T', 'C', 'K', 'P', 'T'};
+
+static_assert(sizeof(CheckpointHeader)     == 40, "CheckpointHeader must be packed");
+static_assert(sizeof(CheckpointLayerInfo)  == 24, "CheckpointLayerInfo must be packed");
+static_assert(sizeof(CheckpointTensorInfo) == 40, "CheckpointTensorInfo must be packed");
+
+
+static std::size_t AlignUp(std::size_t value) {
+    return (value + kCheckpointAlignment - 1) / kCheckpointAlignment * kCheckpointAlignment;
+}
+
+
+static std::size_t GetTablesSize(std::size_t n_layers, std::size_t n_tensors) {
+    return n_layers  * sizeof(CheckpointLayerInfo) +
+           n_tensors * sizeof(CheckpointTensorInfo);
+}
+
+
+const char* CheckpointErrorString(CheckpointError error) {
+    switch (error) {
+        case CheckpointError::Ok:               return "ok";
+        case CheckpointError::OpenFailed:       return "failed to open file";
+        case CheckpointError::WriteFailed:      return "failed to write file";
+        case CheckpointError::MapFailed:        return "failed to map file";
+        case CheckpointError::BadMagic:         return "not a checkpoint file";
+        case CheckpointError::BadVersion:       return "unsupported checkpoint version";
+        case CheckpointError::Truncated:        return "checkpoint is truncated";
+        case CheckpointError::ChecksumMismatch: return "checksum mismatch";
+        case CheckpointError::ShapeMismatch:    return "shape mismatch";
+        default:
+            assert(0);
+            return "unknown error";
+    }
+}
+
+
+// FNV-1a over 64-bit words, the tail is folded in byte by byte.
+uint64_t CheckpointChecksum(const void* data, std::size_t size) {
+    const uint64_t kPrime = 0x100000001b3ull;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    std::size_t n_words = size / sizeof(uint64_t);
+
+    for (std::size_t i = 0; i < n_words; i++) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(word));
+        hash = (hash ^ word) * kPrime;
+    }
+
+    for (std::size_t i = n_words * sizeof(uint64_t); i < size; i++) {
+        hash = (hash ^ bytes[i]) * kPrime;
+    }
+
+    return hash;
+}
+
+//============================= CheckpointWriter ==============================
+
+CheckpointWriter::CheckpointWriter() {
+}
+
+
+CheckpointWriter::~CheckpointWriter() {
+}
+
+
+// Moving the vectors keeps their buffers, so values_ stay valid when they
+// point into storage_.
+CheckpointWriter::CheckpointWriter(CheckpointWriter&& other)
+    : layers_ (std::move(other.layers_)),
+      tensors_(std::move(other.tensors_)),
+      values_ (std::move(other.values_)),
+      storage_(std::move(other.storage_)) {
+}
+
+
+CheckpointWriter& CheckpointWriter::operator=(CheckpointWriter&& other) {
+    if (this == &other) return *this;
+
+    layers_  = std::move(other.layers_);
+    tensors_ = std::move(other.tensors_);
+    values_  = std::move(other.values_);
+    storage_ = std::move(other.storage_);
+
+    return *this;
+}
+
+
+void CheckpointWriter::AddLayer(CheckpointLayerType type,
+                                std::size_t n_inputs, std::size_t n_outputs) {
+    CheckpointLayerInfo info = {};
+    info.type      = static_cast<uint32_t>(type);
+    info.n_inputs  = n_inputs;
+    info.n_outputs = n_outputs;
+
+    layers_.push_back(info);
+}
+
+
+void CheckpointWriter::AddTensor(CheckpointRole role, std::size_t rows, std::size_t cols,
+                                 const float* values) {
+    assert(!layers_.empty());
+    assert(values);
+
+    CheckpointTensorInfo info = {};
+    info.layer = static_cast<uint32_t>(layers_.size() - 1);
+    info.role  = static_cast<uint32_t>(role);
+    info.rows  = rows;
+    info.cols  = cols;
+
+    tensors_.push_back(info);
+    values_ .push_back(values);
+}
+
+
+// Lays the tensors out as they go to the file. Returns the file size.
+std::size_t CheckpointWriter::LayoutTensors_(std::vector<CheckpointTensorInfo>* tensors) const {
+    std::size_t offset = AlignUp(sizeof(CheckpointHeader) +
+                                 GetTablesSize(layers_.size(), tensors->size()));
+
+    for (CheckpointTensorInfo& info : *tensors) {
+        info.offset = offset;
+        offset = AlignUp(offset + info.rows * info.cols * sizeof(float));
+    }
+
+    return offset;
+}
+
+
+// True when the values already sit in memory exactly as in the file, e.g.
+// when they are views into a ParameterBuffer. They can then be copied and
+// written as a single block.
+bool CheckpointWriter::IsContiguous_(const std::vector<CheckpointTensorInfo>& tensors) const {
+    for (std::size_t i = 0; i < tensors.size(); i++) {
+        std::size_t delta = (tensors[i].offset - tensors[0].offset) / sizeof(float);
+        if (values_[i] != values_[0] + delta) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static std::size_t GetSpanSize(const std::vector<CheckpointTensorInfo>& tensors) {
+    if (tensors.empty()) {
+        return 0;
+    }
+
+    const CheckpointTensorInfo& last = tensors.back();
+    return last.offset + last.rows * last.cols * sizeof(float) - tensors[0].offset;
+}
+
+
+void CheckpointWriter::Snapshot(const CheckpointWriter& other) {
+    assert(this != &other);
+
+    layers_  = other.layers_;
+    tensors_ = other.tensors_;
+    LayoutTensors_(&tensors_);
+
+    std::size_t span = GetSpanSize(tensors_) / sizeof(float);
+    storage_.assign(span, 0.0f);
+    values_ .resize(tensors_.size());
+
+    bool is_contiguous = !tensors_.empty() && other.IsContiguous_(tensors_);
+    if (is_contiguous) {
+        std::copy(other.values_[0], other.values_[0] + span, storage_.data());
+    }
+
+    for (std::size_t i = 0; i < tensors_.size(); i++) {
+        float* values = storage_.data() + (tensors_[i].offset - tensors_[0].offset) / sizeof(float);
+
+        if (!is_contiguous) {
+            std::copy(other.values_[i], other.values_[i] + tensors_[i].rows * tensors_[i].cols,
+                      values);
+        }
+        values_[i] = values;
+    }
+}
+
+
+void CheckpointWriter::Clear() {
+    layers_ .clear();
+    tensors_.clear();
+    values_ .clear();
+}
+
+
+// Makes the rename itself durable.
+static bool SyncParentDirectory(const char* file_name) {
+    std::string dir_name = file_name;
+    std::size_t slash = dir_name.rfind('/');
+    dir_name = (slash == std::string::npos) ? "." : dir_name.substr(0, slash + 1);
+
+    int fd = open(dir_name.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool ok = fsync(fd) == 0;
+    close(fd);
+
+    return ok;
+}
+
+
+CheckpointError CheckpointWriter::Write(const char* file_name, bool sync) const {
+    assert(file_name);
+
+    std::vector<CheckpointTensorInfo> tensors = tensors_;
+    std::size_t file_size = LayoutTensors_(&tensors);
+
+    for (std::size_t i = 0; i < tensors.size(); i++) {
+        tensors[i].checksum = CheckpointChecksum(values_[i],
+                                                 tensors[i].rows * tensors[i].cols * sizeof(float));
+    }
+
+    CheckpointHeader header = {};
+    memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+    header.version   = kCheckpointVersion;
+    header.n_layers  = static_cast<uint32_t>(layers_.size());
+    header.n_tensors = static_cast<uint32_t>(tensors.size());
+    header.file_size = file_size;
+
+    // The tables are contiguous on disk, so checksum them in one buffer.
+    std::vector<uint8_t> tables(GetTablesSize(layers_.size(), tensors.size()));
+    std::size_t layers_size = layers_.size() * sizeof(CheckpointLayerInfo);
+    memcpy(tables.data(), layers_.data(), layers_size);
+    memcpy(tables.data() + layers_size, tensors.data(),
+           tensors.size() * sizeof(CheckpointTensorInfo));
+    header.table_checksum = CheckpointChecksum(tables.data(), tables.size());
+
+    // Written aside and renamed over the old file: a reader may still have
+    // the old one mapped, and truncating it in place would pull the pages
+    // from under it.
+    std::string tmp_name = std::string(file_name) + ".tmp";
+
+    FILE* file = fopen(tmp_name.c_str(), "wb");
+    if (file == nullptr) {
+        return CheckpointError::OpenFailed;
+    }
+
+    static const uint8_t kPadding[kCheckpointAlignment] = {};
+    bool ok = true;
+
+    ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(tables.data(), 1, tables.size(), file) == tables.size();
+
+    std::size_t written = sizeof(header) + tables.size();
+    if (!tensors.empty() && IsContiguous_(tensors)) {
+        std::size_t padding = tensors[0].offset - written;
+        std::size_t span    = GetSpanSize(tensors);
+
+        ok = ok && fwrite(kPadding, 1, padding, file) == padding;
+        ok = ok && fwrite(values_[0], 1, span, file) == span;
+        written = tensors[0].offset + span;
+    } else {
+        for (std::size_t i = 0; i < tensors.size() && ok; i++) {
+            std::size_t padding = tensors[i].offset - written;
+            std::size_t size    = tensors[i].rows * tensors[i].cols * sizeof(float);
+
+            ok = ok && fwrite(kPadding, 1, padding, file) == padding;
+            ok = ok && fwrite(values_[i], 1, size, file) == size;
+            written = tensors[i].offset + size;
+        }
+    }
+
+    std::size_t padding = header.file_size - written;
+    ok = ok && fwrite(kPadding, 1, padding, file) == padding;
+
+    if (sync) {
+        ok = ok && fflush(file) == 0;
+        ok = ok && fsync(fileno(file)) == 0;
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && rename(tmp_name.c_str(), file_name) == 0;
+
+    if (!ok) {
+        remove(tmp_name.c_str());
+        return CheckpointError::WriteFailed;
+    }
+
+    // The file is in place by now, there is no temporary one to clean up:
+    // only the rename may not survive a crash.
+    if (sync && !SyncParentDirectory(file_name)) {
+        return CheckpointError::WriteFailed;
+    }
+
+    return CheckpointError::Ok;
+}
+
+//============================= CheckpointReader ==============================
+
+CheckpointReader::CheckpointReader()
+    : map_     (nullptr),
+      map_size_(0),
+      header_  (nullptr),
+      layers_  (nullptr),
+      tensors_ (nullptr) {
+}
+
+
+CheckpointReader::~CheckpointReader() {
+    Close();
+}
+
+
+void CheckpointReader::Close() {
+    if (map_) {
+        munmap(map_, map_size_);
+    }
+
+    map_      = nullptr;
+    map_size_ = 0;
+    header_   = nullptr;
+    layers_   = nullptr;
+    tensors_  = nullptr;
+}
+
+
+CheckpointError CheckpointReader::Open(const char* file_name, bool verify_checksums) {
+    assert(file_name);
+
+    Close();
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        return CheckpointError::OpenFailed;
+    }
+
+    struct stat st = {};
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return CheckpointError::OpenFailed;
+    }
+
+    std::size_t file_size = static_cast<std::size_t>(st.st_size);
+    if (file_size < sizeof(CheckpointHeader)) {
+        close(fd);
+        return CheckpointError::Truncated;
+    }
+
+    void* map = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return CheckpointError::MapFailed;
+    }
+
+    map_      = static_cast<uint8_t*>(map);
+    map_size_ = file_size;
+    header_   = reinterpret_cast<const CheckpointHeader*>(map_);
+
+    CheckpointError error = CheckpointError::Ok;
+
+    std::size_t tables_size = GetTablesSize(header_->n_layers, header_->n_tensors);
+
+    if (memcmp(header_->magic, kCheckpointMagic, sizeof(kCheckpointMagic)) != 0) {
+        error = CheckpointError::BadMagic;
+    } else if (header_->version != kCheckpointVersion) {
+        error = CheckpointError::BadVersion;
+    } else if (header_->file_size != file_size ||
+               sizeof(CheckpointHeader) + tables_size > file_size) {
+        error = CheckpointError::Truncated;
+    } else if (CheckpointChecksum(map_ + sizeof(CheckpointHeader), tables_size) !=
+               header_->table_checksum) {
+        error = CheckpointError::ChecksumMismatch;
+    }
+
+    if (error != CheckpointError::Ok) {
+        Close();
+        return error;
+    }
+
+    layers_  = reinterpret_cast<const CheckpointLayerInfo*> (map_ + sizeof(CheckpointHeader));
+    tensors_ = reinterpret_cast<const CheckpointTensorInfo*>(layers_ + header_->n_layers);
+
+    // Rows, columns and offsets come from the file: they are bounded by its
+    // size before their product or sum can wrap around.
+    const std::size_t max_elems = file_size / sizeof(float);
+
+    for (std::size_t i = 0; i < header_->n_tensors && error == CheckpointError::Ok; i++) {
+        const CheckpointTensorInfo& info = tensors_[i];
+
+        if (info.layer >= header_->n_layers ||
+            info.offset % kCheckpointAlignment != 0 ||
+            info.offset > file_size ||
+            info.rows > max_elems / std::max<uint64_t>(info.cols, 1)) {
+            error = CheckpointError::Truncated;
+            break;
+        }
+
+        std::size_t size = info.rows * info.cols * sizeof(float);
+        if (size > file_size - info.offset) {
+            error = CheckpointError::Truncated;
+        } else if (verify_checksums &&
+                   CheckpointChecksum(map_ + info.offset, size) != info.checksum) {
+            error = CheckpointError::ChecksumMismatch;
+        }
+    }
+
+    if (error != CheckpointError::Ok) {
+        Close();
+    }
+
+    return error;
+}
+
+
+std::size_t CheckpointReader::GetFileSize() const {
+    return map_size_;
+}
+
+
+std::size_t CheckpointReader::GetLayersCount() const {
+    return header_ ? header_->n_layers : 0;
+}
+
+
+const CheckpointLayerInfo& CheckpointReader::GetLayer(std::size_t layer) const {
+    assert(layer < GetLayersCount());
+    return layers_[layer];
+}
+
+
+std::size_t CheckpointReader::GetTensorsCount() const {
+    return header_ ? header_->n_tensors : 0;
+}
+
+
+const CheckpointTensorInfo* CheckpointReader::GetTensor(std::size_t tensor) const {
+    assert(tensor < GetTensorsCount());
+    return &tensors_[tensor];
+}
+
+
+const CheckpointTensorInfo* CheckpointReader::FindTensor(std::size_t layer,
+                                                         CheckpointRole role) const {
+    if (header_ == nullptr) {
+        return nullptr;
+    }
+
+    for (std::size_t i = 0; i < header_->n_tensors; i++) {
+        if (tensors_[i].layer == layer &&
+            tensors_[i].role  == static_cast<uint32_t>(role)) {
+            return &tensors_[i];
+        }
+    }
+
+    return nullptr;
+}
+
+
+float* CheckpointReader::GetTensorData(const CheckpointTensorInfo* info) const {
+    assert(info);
+    assert(map_);
+
+    return reinterpret_cast<float*>(map_ + info->offset);
+}
@@ -0,0 +1,420 @@
+#include "../include/communicator.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+//================================ Communicator ===============================
+
+Communicator::Communicator(std::size_t rank, std::size_t size)
+    : rank_(rank),
+      size_(size) {
+
+    assert(size > 0);
+    assert(rank < size);
+}
+
+
+Communicator::~Communicator() {
+}
+
+
+std::size_t Communicator::GetRank() const { return rank_; }
+std::size_t Communicator::GetSize() const { return size_; }
+
+
+bool Communicator::AllReduce(float* data, std::size_t n) {
+    assert(data || n == 0);
+
+    if (size_ == 1) {
+        return true;
+    }
+
+    auto begin = [this, n](std::size_t segment) { return n * (segment % size_) / size_; };
+    auto end   = [this, n](std::size_t segment) { return n * (segment % size_ + 1) / size_; };
+
+    recv_buffer_.resize(n / size_ + 1);
+    float* recv = recv_buffer_.data();
+
+    // Reduce-scatter: after it rank r holds the full sum of segment r + 1.
+    for (std::size_t step = 0; step + 1 < size_; step++) {
+        std::size_t send_segment = rank_ + size_ - step;
+        std::size_t recv_segment = rank_ + size_ - step - 1;
+
+        std::size_t send_size = end(send_segment) - begin(send_segment);
+        std::size_t recv_size = end(recv_segment) - begin(recv_segment);
+
+        if (!SendRecv(data + begin(send_segment), send_size * sizeof(float),
+                      recv,                       recv_size * sizeof(float))) {
+            return false;
+        }
+
+        float* dst = data + begin(recv_segment);
+        for (std::size_t i = 0; i < recv_size; i++) {
+            dst[i] += recv[i];
+        }
+    }
+
+    // All-gather: pass the reduced segments around the ring.
+    for (std::size_t step = 0; step + 1 < size_; step++) {
+        std::size_t send_segment = rank_ + size_ + 1 - step;
+        std::size_t recv_segment = rank_ + size_     - step;
+
+        std::size_t send_size = end(send_segment) - begin(send_segment);
+        std::size_t recv_size = end(recv_segment) - begin(recv_segment);
+
+        if (!SendRecv(data + begin(send_segment), send_size * sizeof(float),
+                      data + begin(recv_segment), recv_size * sizeof(float))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// A token passed size - 1 times around the ring has reached every rank.
+bool Communicator::Barrier() {
+    uint8_t token = 0;
+
+    for (std::size_t step = 0; step + 1 < size_; step++) {
+        uint8_t received = 0;
+        if (!SendRecv(&token, sizeof(token), &received, sizeof(received))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//================================ ShmCommunicator ============================
+
+static const std::size_t kShmChannelCapacity = 1 << 20;
+
+struct ShmCommunicator::Control {
+    alignas(64) std::atomic<uint32_t> abort;
+};
+
+struct ShmCommunicator::Channel {
+    // Total bytes ever written and read; the difference is the fill level.
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) uint8_t data[kShmChannelCapacity];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+              std::atomic<uint32_t>::is_always_lock_free,
+              "shared memory channels need address-free atomics");
+
+
+bool ShmCommunicator::Create(const char* name, std::size_t size) {
+    assert(name);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) {
+        return false;
+    }
+
+    // The control block is followed by one channel per rank. ftruncate()
+    // zero fills, which is the initial state of all of them.
+    off_t segment_size = static_cast<off_t>(sizeof(Control) + size * sizeof(Channel));
+    bool  ok           = ftruncate(fd, segment_size) == 0;
+    close(fd);
+
+    if (!ok) {
+        shm_unlink(name);
+    }
+
+    return ok;
+}
+
+
+bool ShmCommunicator::Abort(const char* name, std::size_t size) {
+    assert(name);
+
+    ShmCommunicator communicator(name, 0, size);
+    if (!communicator.IsOpen()) {
+        return false;
+    }
+
+    communicator.Abort();
+    return true;
+}
+
+
+void ShmCommunicator::Unlink(const char* name) {
+    shm_unlink(name);
+}
+
+
+ShmCommunicator::ShmCommunicator(const char* name, std::size_t rank, std::size_t size,
+                                 std::chrono::milliseconds timeout)
+    : Communicator(rank, size),
+      timeout_ (timeout),
+      map_     (nullptr),
+      map_size_(sizeof(Control) + size * sizeof(Channel)),
+      control_ (nullptr),
+      out_     (nullptr),
+      in_      (nullptr) {
+
+    assert(name);
+
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd == -1) {
+        std::cerr << "Can't open shared memory " << name << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    void* map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Can't map shared memory " << name << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    map_ = static_cast<uint8_t*>(map);
+
+    control_ = reinterpret_cast<Control*>(map_);
+    Channel* channels = reinterpret_cast<Channel*>(map_ + sizeof(Control));
+    out_ = &channels[rank];
+    in_  = &channels[(rank + size - 1) % size];
+}
+
+
+ShmCommunicator::~ShmCommunicator() {
+    if (map_) {
+        munmap(map_, map_size_);
+    }
+}
+
+
+bool ShmCommunicator::IsOpen() const {
+    return map_ != nullptr;
+}
+
+
+void ShmCommunicator::Abort() {
+    assert(IsOpen());
+
+    control_->abort.store(1, std::memory_order_release);
+}
+
+
+bool ShmCommunicator::SendRecv(const void* send, std::size_t send_size,
+                               void* recv,       std::size_t recv_size) {
+    assert(IsOpen());
+
+    const uint8_t* src = static_cast<const uint8_t*>(send);
+    uint8_t*       dst = static_cast<uint8_t*>(recv);
+    std::size_t n_sent     = 0;
+    std::size_t n_received = 0;
+
+    auto deadline = std::chrono::steady_clock::now() + timeout_;
+    bool aborted  = false;
+
+    while (n_sent < send_size || n_received < recv_size) {
+        bool progress = false;
+
+        if (n_sent < send_size) {
+            uint64_t head = out_->head.load(std::memory_order_relaxed);
+            uint64_t tail = out_->tail.load(std::memory_order_acquire);
+
+            std::size_t n = std::min(static_cast<std::size_t>(kShmChannelCapacity - (head - tail)),
+                                     send_size - n_sent);
+            for (std::size_t i = 0; i < n; ) {
+                std::size_t pos   = (head + i) % kShmChannelCapacity;
+                std::size_t piece = std::min(n - i, kShmChannelCapacity - pos);
+
+                memcpy(out_->data + pos, src + n_sent + i, piece);
+                i += piece;
+            }
+
+            out_->head.store(head + n, std::memory_order_release);
+            n_sent  += n;
+            progress = progress || n > 0;
+        }
+
+        if (n_received < recv_size) {
+            uint64_t tail = in_->tail.load(std::memory_order_relaxed);
+            uint64_t head = in_->head.load(std::memory_order_acquire);
+
+            std::size_t n = std::min(static_cast<std::size_t>(head - tail),
+                                     recv_size - n_received);
+            for (std::size_t i = 0; i < n; ) {
+                std::size_t pos   = (tail + i) % kShmChannelCapacity;
+                std::size_t piece = std::min(n - i, kShmChannelCapacity - pos);
+
+                memcpy(dst + n_received + i, in_->data + pos, piece);
+                i += piece;
+            }
+
+            in_->tail.store(tail + n, std::memory_order_release);
+            n_received += n;
+            progress    = progress || n > 0;
+        }
+
+        if (progress) {
+            deadline = std::chrono::steady_clock::now() + timeout_;
+            continue;
+        }
+
+        // Whatever a peer wrote before the abort is visible after it, so
+        // one more pass after seeing the word still picks that up.
+        if (aborted) {
+            std::cerr << "Rank " << rank_ << ": transfer aborted by another rank" << std::endl;
+            return false;
+        }
+        aborted = control_->abort.load(std::memory_order_acquire) != 0;
+
+        if (std::chrono::steady_clock::now() > deadline) {
+            std::cerr << "Rank " << rank_ << ": transfer timed out" << std::endl;
+            Abort();
+            return false;
+        }
+
+        if (!aborted) {
+            sched_yield();
+        }
+    }
+
+    return true;
+}
+
+//================================ TcpCommunicator ============================
+
+static const int kConnectRetries  = 200;
+static const int kConnectRetryUs  = 50'000;
+
+
+static bool SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+
+TcpCommunicator::TcpCommunicator(const char* host, uint16_t base_port,
+                                 std::size_t rank, std::size_t size)
+    : Communicator(rank, size),
+      out_fd_(-1),
+      in_fd_ (-1) {
+
+    assert(host);
+
+    if (size == 1) {
+        return;
+    }
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        std::cerr << "Bad address " << host << std::endl;
+        return;
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    addr.sin_port = htons(static_cast<uint16_t>(base_port + rank));
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+        listen(listen_fd, 1) == -1) {
+        std::cerr << "Can't listen on port " << base_port + rank << ": "
+                  << strerror(errno) << std::endl;
+        close(listen_fd);
+        return;
+    }
+
+    // The right neighbour may not be listening yet.
+    addr.sin_port = htons(static_cast<uint16_t>(base_port + (rank + 1) % size));
+    for (int i = 0; i < kConnectRetries && out_fd_ == -1; i++) {
+        out_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(out_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            close(out_fd_);
+            out_fd_ = -1;
+            usleep(kConnectRetryUs);
+        }
+    }
+
+    if (out_fd_ != -1) {
+        in_fd_ = accept(listen_fd, nullptr, nullptr);
+    }
+    close(listen_fd);
+
+    if (out_fd_ == -1 || in_fd_ == -1) {
+        std::cerr << "Can't connect rank " << rank << " to its neighbours" << std::endl;
+        return;
+    }
+
+    setsockopt(out_fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    SetNonBlocking(out_fd_);
+    SetNonBlocking(in_fd_);
+}
+
+
+TcpCommunicator::~TcpCommunicator() {
+    if (out_fd_ != -1) close(out_fd_);
+    if (in_fd_  != -1) close(in_fd_);
+}
+
+
+bool TcpCommunicator::IsOpen() const {
+    return size_ == 1 || (out_fd_ != -1 && in_fd_ != -1);
+}
+
+
+bool TcpCommunicator::SendRecv(const void* send, std::size_t send_size,
+                               void* recv,       std::size_t recv_size) {
+    assert(IsOpen());
+
+    const uint8_t* src = static_cast<const uint8_t*>(send);
+    uint8_t*       dst = static_cast<uint8_t*>(recv);
+    std::size_t n_sent     = 0;
+    std::size_t n_received = 0;
+
+    while (n_sent < send_size || n_received < recv_size) {
+        pollfd fds[2] = {};
+        fds[0].fd     = out_fd_;
+        fds[0].events = n_sent     < send_size ? POLLOUT : 0;
+        fds[1].fd     = in_fd_;
+        fds[1].events = n_received < recv_size ? POLLIN  : 0;
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        if (fds[0].revents & (POLLERR | POLLHUP) || fds[1].revents & POLLERR) {
+            return false;
+        }
+
+        if (fds[0].revents & POLLOUT) {
+            ssize_t n = ::send(out_fd_, src + n_sent, send_size - n_sent, MSG_NOSIGNAL);
+            if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                return false;
+            }
+            n_sent += n > 0 ? static_cast<std::size_t>(n) : 0;
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = ::recv(in_fd_, dst + n_received, recv_size - n_received, 0);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+                return false;
+            }
+            n_received += n > 0 ? static_cast<std::size_t>(n) : 0;
+        }
+    }
+
+    return true;
+}
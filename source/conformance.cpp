@@ -0,0 +1,917 @@
+#include "../include/conformance.h"
+#include "../include/smart_matrix.h"
+#include "../include/fused_expr.h"
+#include "../chubarov_lib/chubarov.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <cfloat>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const double kEpsilon     = FLT_EPSILON;
+const double kHalfEpsilon = 1.0 / 1024;
+
+// Same as SmartMatrix::crossEntropyLossEpsilon
+const float kCrossEntropyEpsilon = 1e-10f;
+
+// Finite differences: the analytic gradient must be within
+// kGradRelTolerance of the difference quotient, plus kGradAbsTolerance of
+// the loss for the float rounding of the loss itself.
+const double kGradRelTolerance = 2e-2;
+const double kGradAbsTolerance = 2e-3;
+const float  kGradStep         = 1e-2f;
+// 1/x of the cross entropy needs a shorter step.
+const float  kCrossEntropyGradStep = 1e-3f;
+
+const std::size_t kRandomShapesCount = 8;
+const std::size_t kRandomShapeMax    = 64;
+
+// Values and grads optionally live one float past the start of an
+// allocation, which puts them off any vector alignment.
+struct TestMatrix {
+    TestMatrix(std::size_t rows, std::size_t cols, bool shifted)
+        : values(rows * cols + 1),
+          grads (rows * cols + 1),
+          matrix(rows, cols) {
+
+        if (shifted) {
+            matrix.MapValues(values.data() + 1);
+            matrix.MapGrads (grads .data() + 1);
+        }
+    }
+
+    ~TestMatrix();
+
+    std::vector<float> values;
+    std::vector<float> grads;
+    SmartMatrix        matrix;
+};
+
+
+TestMatrix::~TestMatrix() {
+}
+
+
+// Distance in representable floats between value and the float nearest to
+// reference.
+double GetUlpError(float value, double reference) {
+    float expected = static_cast<float>(reference);
+    if (std::isnan(value) || std::isnan(expected)) {
+        return std::isnan(value) && std::isnan(expected) ? 0.0 : INFINITY;
+    }
+
+    int32_t value_bits    = 0;
+    int32_t expected_bits = 0;
+    memcpy(&value_bits,    &value,    sizeof(value));
+    memcpy(&expected_bits, &expected, sizeof(expected));
+
+    // Maps the sign-magnitude order of floats onto the integers.
+    int64_t value_order    = value_bits    < 0 ? INT32_MIN - static_cast<int64_t>(value_bits)
+                                               : value_bits;
+    int64_t expected_order = expected_bits < 0 ? INT32_MIN - static_cast<int64_t>(expected_bits)
+                                               : expected_bits;
+
+    return static_cast<double>(std::llabs(value_order - expected_order));
+}
+
+
+// |value - reference| in epsilons of scale, the sum of the absolute values
+// of the terms that make up reference.
+double GetScaledError(float value, double reference, double scale) {
+    if (!std::isfinite(value)) {
+        return INFINITY;
+    }
+
+    double error = std::fabs(static_cast<double>(value) - reference);
+    if (scale <= 0.0) {
+        return error > 0.0 ? INFINITY : 0.0;
+    }
+
+    return error / (scale * kEpsilon);
+}
+
+
+std::string FormatShape(std::size_t rows, std::size_t cols, bool shifted) {
+    return std::to_string(rows) + "x" + std::to_string(cols) + (shifted ? ", shifted" : "");
+}
+
+
+// Loss and parameter gradients of a sigmoid layer with a squared error,
+// computed in the element type T from the given float values.
+template <typename T>
+std::vector<double> EvalLayerStep(std::size_t rows, std::size_t inner, std::size_t cols,
+                                  const std::vector<float>& input_values,
+                                  const std::vector<float>& weights_values,
+                                  const std::vector<float>& biases_values,
+                                  const std::vector<float>& ref_values) {
+    SmartMatrixT<T> input   (rows,  inner);
+    SmartMatrixT<T> weights (inner, cols);
+    SmartMatrixT<T> biases  (1,     cols);
+    SmartMatrixT<T> unbiased(rows,  cols);
+    SmartMatrixT<T> output  (rows,  cols);
+    SmartMatrixT<T> ref     (rows,  cols);
+    SmartMatrixT<T> loss    (1,     1);
+
+    std::copy(input_values  .begin(), input_values  .end(), input  .GetMutableValues());
+    std::copy(weights_values.begin(), weights_values.end(), weights.GetMutableValues());
+    std::copy(biases_values .begin(), biases_values .end(), biases .GetMutableValues());
+    std::copy(ref_values    .begin(), ref_values    .end(), ref    .GetMutableValues());
+
+    unbiased.Mul(&input, &weights);
+    Assign(&output, Sigm(Expr(&unbiased) + Expr(&biases)));
+    loss.SquaredErrorLoss(&output, &ref);
+    loss.EvalGrad();
+
+    std::vector<double> results(1, loss.GetValue(0, 0));
+    results.insert(results.end(), weights.GetGrads(), weights.GetGrads() + inner * cols);
+    results.insert(results.end(), biases .GetGrads(), biases .GetGrads() + cols);
+
+    return results;
+}
+
+
+// Largest difference from the reference in units of epsilon times the
+// largest reference magnitude.
+double GetMaxRelativeError(const std::vector<double>& values, const std::vector<double>& references,
+                           double epsilon) {
+    double max_error     = 0.0;
+    double max_reference = 0.0;
+    for (std::size_t i = 0; i < values.size(); i++) {
+        max_error     = std::max(max_error, std::fabs(values[i] - references[i]));
+        max_reference = std::max(max_reference, std::fabs(references[i]));
+    }
+
+    return max_reference > 0.0 ? max_error / (max_reference * epsilon) : max_error;
+}
+
+
+std::vector<float> CopyGrads(const SmartMatrix& matrix) {
+    const float* grads = matrix.GetGrads();
+    return std::vector<float>(grads, grads + matrix.GetRows() * matrix.GetCols());
+}
+
+} // namespace
+
+
+ConformanceSuite::ConformanceSuite(uint64_t seed, std::ostream& out, bool verbose)
+    : gen_       (seed),
+      seed_      (seed),
+      out_       (out),
+      verbose_   (verbose),
+      n_checks_  (0),
+      n_failures_(0) {
+}
+
+
+std::size_t ConformanceSuite::GetChecksCount()   const { return n_checks_;   }
+std::size_t ConformanceSuite::GetFailuresCount() const { return n_failures_; }
+
+
+std::size_t ConformanceSuite::Run() {
+    n_checks_   = 0;
+    n_failures_ = 0;
+
+    struct MulShape {
+        std::size_t N;
+        std::size_t M;
+        std::size_t L;
+    };
+
+    // (NxL) * (LxM): single elements, vectors, primes, zero-sized
+    // dimensions and a layer of the MNIST network.
+    std::vector<MulShape> mul_shapes = {
+        {1, 1, 1}, {1, 10, 16}, {16, 1, 16}, {1, 1, 100}, {100, 1, 1},
+        {7, 13, 31}, {31, 7, 13}, {61, 67, 71},
+        {0, 5, 3}, {5, 0, 3}, {5, 3, 0}, {0, 0, 0},
+        {100, 16, 784},
+    };
+    // Elementwise ops: the last two shapes are split between several
+    // threads by ParallelFor().
+    std::vector<std::pair<std::size_t, std::size_t>> shapes = {
+        {1, 1}, {1, 784}, {784, 1}, {7, 13}, {31, 17},
+        {0, 5}, {5, 0}, {0, 0},
+        {257, 67}, {1, 20011},
+    };
+
+    std::uniform_int_distribution<std::size_t> dimension(1, kRandomShapeMax);
+    for (std::size_t i = 0; i < kRandomShapesCount; i++) {
+        mul_shapes.push_back({dimension(gen_), dimension(gen_), dimension(gen_)});
+        shapes.push_back({dimension(gen_), dimension(gen_)});
+    }
+
+    for (bool shifted : {false, true}) {
+        for (const MulShape& shape : mul_shapes) {
+            CheckMulKernels_(shape.N, shape.M, shape.L, shifted);
+        }
+
+        for (const auto& shape : shapes) {
+            CheckElementwise_(shape.first, shape.second, shifted);
+        }
+
+        // The losses are means, undefined for zero elements.
+        for (const auto& shape : shapes) {
+            if (shape.first * shape.second > 0) {
+                CheckLosses_(shape.first, shape.second, shifted);
+            }
+        }
+    }
+
+    CheckGradients_(1, 7, 5);
+    CheckGradients_(3, 4, 5);
+    CheckGradients_(4, 1, 3);
+    CheckGradients_(5, 3, 1);
+
+    CheckElementTypes_(1, 16, 10);
+    CheckElementTypes_(7, 13, 31);
+    CheckElementTypes_(100, 784, 16);
+
+    char line[128] = {};
+    snprintf(line, sizeof(line), "Conformance: %zu checks, %zu failed (seed %" PRIu64 ")\n",
+             n_checks_, n_failures_, seed_);
+    out_ << line;
+
+    return n_failures_;
+}
+
+
+//================================ Kernels ====================================
+
+void ConformanceSuite::CheckMulKernels_(std::size_t N, std::size_t M, std::size_t L, bool shifted) {
+    const std::string shape = FormatShape(N, L, false) + " * " + FormatShape(L, M, shifted);
+    const std::size_t offset = shifted ? 1 : 0;
+
+    std::vector<float> first_storage       (N * L + 1);
+    std::vector<float> second_storage      (L * M + 1);
+    std::vector<float> output_storage      (N * M + 1);
+    std::vector<float> parent_grads_storage(N * M + 1);
+    std::vector<float> first_grads_storage (N * L + 1);
+    std::vector<float> second_grads_storage(L * M + 1);
+
+    float* first        = first_storage       .data() + offset;
+    float* second       = second_storage      .data() + offset;
+    float* output       = output_storage      .data() + offset;
+    float* parent_grads = parent_grads_storage.data() + offset;
+    float* first_grads  = first_grads_storage .data() + offset;
+    float* second_grads = second_grads_storage.data() + offset;
+
+    for (std::size_t i = 0; i < N * L; i++) { first [i]      = GetRandom_(-1.0f, 1.0f); }
+    for (std::size_t i = 0; i < L * M; i++) { second[i]      = GetRandom_(-1.0f, 1.0f); }
+    for (std::size_t i = 0; i < N * M; i++) { parent_grads[i] = GetRandom_(-1.0f, 1.0f); }
+    for (std::size_t i = 0; i < N * L; i++) { first_grads [i] = GetRandom_(-1.0f, 1.0f); }
+    for (std::size_t i = 0; i < L * M; i++) { second_grads[i] = GetRandom_(-1.0f, 1.0f); }
+
+    // The gradient kernels accumulate, so they start from non-zero grads.
+    const std::vector<float> first_grads_init (first_grads,  first_grads  + N * L);
+    const std::vector<float> second_grads_init(second_grads, second_grads + L * M);
+
+    Chubarov_Mul(N, M, L, output, first, second);
+
+    double max_error = 0.0;
+    for (std::size_t n = 0; n < N; n++) {
+        for (std::size_t m = 0; m < M; m++) {
+            double reference = 0.0;
+            double scale     = 0.0;
+            for (std::size_t l = 0; l < L; l++) {
+                double term = static_cast<double>(first[n * L + l]) * second[l * M + m];
+                reference += term;
+                scale     += std::fabs(term);
+            }
+            max_error = std::max(max_error, GetScaledError(output[n * M + m], reference, scale));
+        }
+    }
+    Expect_("Chubarov_Mul", shape, max_error, static_cast<double>(L + 2));
+
+    Chubarov_EvalGradLMul(N, M, L, first_grads, second, parent_grads);
+
+    max_error = 0.0;
+    for (std::size_t n = 0; n < N; n++) {
+        for (std::size_t l = 0; l < L; l++) {
+            double reference = first_grads_init[n * L + l];
+            double scale     = std::fabs(reference);
+            for (std::size_t m = 0; m < M; m++) {
+                double term = static_cast<double>(second[l * M + m]) * parent_grads[n * M + m];
+                reference += term;
+                scale     += std::fabs(term);
+            }
+            max_error = std::max(max_error, GetScaledError(first_grads[n * L + l], reference, scale));
+        }
+    }
+    Expect_("Chubarov_EvalGradLMul", shape, max_error, static_cast<double>(M + 2));
+
+    Chubarov_EvalGradRMul(N, M, L, second_grads, first, parent_grads);
+
+    max_error = 0.0;
+    for (std::size_t l = 0; l < L; l++) {
+        for (std::size_t m = 0; m < M; m++) {
+            double reference = second_grads_init[l * M + m];
+            double scale     = std::fabs(reference);
+            for (std::size_t n = 0; n < N; n++) {
+                double term = static_cast<double>(first[n * L + l]) * parent_grads[n * M + m];
+                reference += term;
+                scale     += std::fabs(term);
+            }
+            max_error = std::max(max_error, GetScaledError(second_grads[l * M + m], reference, scale));
+        }
+    }
+    Expect_("Chubarov_EvalGradRMul", shape, max_error, static_cast<double>(N + 2));
+}
+
+
+//================================ Elementwise ================================
+
+// Every op runs forward, then backward under a squared error loss, from
+// random grads: the backward kernels accumulate. The parent's gradient the
+// references start from is the one the loss left, checked in CheckLosses_().
+void ConformanceSuite::CheckElementwise_(std::size_t rows, std::size_t cols, bool shifted) {
+    enum class Op {
+        Add,
+        Sub,
+        AddVectorToMatrix,
+        Sigm,
+        Softmax,
+    };
+
+    const std::string shape = FormatShape(rows, cols, shifted);
+    const std::size_t n     = rows * cols;
+
+    for (Op op : {Op::Add, Op::Sub, Op::AddVectorToMatrix, Op::Sigm, Op::Softmax}) {
+        // Softmax of an empty row is undefined.
+        if (op == Op::Softmax && cols == 0) {
+            continue;
+        }
+
+        TestMatrix first (rows, cols, shifted);
+        TestMatrix second(rows, cols, shifted);
+        TestMatrix vector(1,    cols, shifted);
+        TestMatrix output(rows, cols, shifted);
+        TestMatrix ref   (rows, cols, shifted);
+        SmartMatrix loss(1, 1);
+
+        FillRandom_(&first .matrix, -8.0f, 8.0f);
+        FillRandom_(&second.matrix, -8.0f, 8.0f);
+        FillRandom_(&vector.matrix, -8.0f, 8.0f);
+        FillRandom_(&ref   .matrix, -1.0f, 1.0f);
+
+        const char* forward_name = nullptr;
+        double      max_error    = 0.0;
+        double      bound        = 0.0;
+
+        switch (op) {
+            case Op::Add:
+                forward_name = "Add";
+                output.matrix.Add(&first.matrix, &second.matrix);
+                for (std::size_t i = 0; i < n; i++) {
+                    double reference = static_cast<double>(first.matrix.GetValues()[i]) +
+                                       second.matrix.GetValues()[i];
+                    max_error = std::max(max_error, GetUlpError(output.matrix.GetValues()[i], reference));
+                }
+                break;
+
+            case Op::Sub:
+                forward_name = "Sub";
+                output.matrix.Sub(&first.matrix, &second.matrix);
+                for (std::size_t i = 0; i < n; i++) {
+                    double reference = static_cast<double>(first.matrix.GetValues()[i]) -
+                                       second.matrix.GetValues()[i];
+                    max_error = std::max(max_error, GetUlpError(output.matrix.GetValues()[i], reference));
+                }
+                break;
+
+            case Op::AddVectorToMatrix:
+                forward_name = "AddVectorToMatrix";
+                output.matrix.AddVectorToMatrix(&first.matrix, &vector.matrix);
+                for (std::size_t i = 0; i < rows; i++) {
+                    for (std::size_t j = 0; j < cols; j++) {
+                        double reference = static_cast<double>(first.matrix.GetValue(i, j)) +
+                                           vector.matrix.GetValue(0, j);
+                        max_error = std::max(max_error, GetUlpError(output.matrix.GetValue(i, j), reference));
+                    }
+                }
+                break;
+
+            case Op::Sigm:
+                forward_name = "Sigm";
+                bound        = 4.0;
+                output.matrix.Sigm(&first.matrix);
+                for (std::size_t i = 0; i < n; i++) {
+                    double reference = 1.0 / (1.0 + std::exp(-static_cast<double>(first.matrix.GetValues()[i])));
+                    max_error = std::max(max_error, GetUlpError(output.matrix.GetValues()[i], reference));
+                }
+                break;
+
+            case Op::Softmax:
+                forward_name = "Softmax";
+                bound        = static_cast<double>(cols + 4);
+                output.matrix.Softmax(&first.matrix);
+                for (std::size_t i = 0; i < rows; i++) {
+                    double exp_sum = 0.0;
+                    for (std::size_t j = 0; j < cols; j++) {
+                        exp_sum += std::exp(static_cast<double>(first.matrix.GetValue(i, j)));
+                    }
+                    for (std::size_t j = 0; j < cols; j++) {
+                        double reference = std::exp(static_cast<double>(first.matrix.GetValue(i, j))) / exp_sum;
+                        max_error = std::max(max_error,
+                                             GetScaledError(output.matrix.GetValue(i, j), reference, reference));
+                    }
+                }
+                break;
+
+            default:
+                assert(0);
+        }
+        Expect_(forward_name, shape, max_error, bound);
+
+        FillRandomGrads_(&first .matrix);
+        FillRandomGrads_(&second.matrix);
+        FillRandomGrads_(&vector.matrix);
+        output.matrix.ResetGrad();
+
+        const std::vector<float> first_grads_init  = CopyGrads(first .matrix);
+        const std::vector<float> second_grads_init = CopyGrads(second.matrix);
+        const std::vector<float> vector_grads_init = CopyGrads(vector.matrix);
+
+        loss.SquaredErrorLoss(&output.matrix, &ref.matrix);
+        loss.EvalGrad();
+
+        const float* parent_values = output.matrix.GetValues();
+        const float* parent_grads  = output.matrix.GetGrads();
+        const float* first_grads   = first .matrix.GetGrads();
+        const float* second_grads  = second.matrix.GetGrads();
+
+        switch (op) {
+            case Op::Add:
+            case Op::Sub: {
+                double first_error  = 0.0;
+                double second_error = 0.0;
+                double sign         = op == Op::Add ? 1.0 : -1.0;
+                for (std::size_t i = 0; i < n; i++) {
+                    first_error  = std::max(first_error,
+                                            GetUlpError(first_grads[i],
+                                                        static_cast<double>(first_grads_init[i]) + parent_grads[i]));
+                    second_error = std::max(second_error,
+                                            GetUlpError(second_grads[i],
+                                                        static_cast<double>(second_grads_init[i]) +
+                                                        sign * parent_grads[i]));
+                }
+                Expect_("EvalGradAddMatrixLSubAdd", shape, first_error, 0.0);
+                Expect_(op == Op::Add ? "EvalGradAddMatrixLSubAdd" : "EvalGradRSub", shape,
+                        second_error, 0.0);
+                break;
+            }
+
+            case Op::AddVectorToMatrix: {
+                max_error = 0.0;
+                for (std::size_t i = 0; i < n; i++) {
+                    max_error = std::max(max_error,
+                                         GetUlpError(first_grads[i],
+                                                     static_cast<double>(first_grads_init[i]) + parent_grads[i]));
+                }
+                Expect_("EvalGradAddMatrixLSubAdd", shape, max_error, 0.0);
+
+                max_error = 0.0;
+                for (std::size_t j = 0; j < cols; j++) {
+                    double reference = vector_grads_init[j];
+                    double scale     = std::fabs(reference);
+                    for (std::size_t i = 0; i < rows; i++) {
+                        reference += parent_grads[i * cols + j];
+                        scale     += std::fabs(parent_grads[i * cols + j]);
+                    }
+                    max_error = std::max(max_error, GetScaledError(vector.matrix.GetGrad(0, j), reference, scale));
+                }
+                Expect_("EvalGradAddVector", shape, max_error, static_cast<double>(rows + 2));
+                break;
+            }
+
+            case Op::Sigm: {
+                max_error = 0.0;
+                for (std::size_t i = 0; i < n; i++) {
+                    double value = parent_values[i];
+                    double term  = parent_grads[i] * value * (1.0 - value);
+                    double scale = std::fabs(first_grads_init[i]) + std::fabs(term);
+                    max_error = std::max(max_error,
+                                         GetScaledError(first_grads[i], first_grads_init[i] + term, scale));
+                }
+                Expect_("EvalGradSigm", shape, max_error, 4.0);
+                break;
+            }
+
+            case Op::Softmax: {
+                max_error = 0.0;
+                for (std::size_t i = 0; i < rows; i++) {
+                    double dot       = 0.0;
+                    double dot_scale = 0.0;
+                    for (std::size_t j = 0; j < cols; j++) {
+                        double term = static_cast<double>(parent_grads[i * cols + j]) * parent_values[i * cols + j];
+                        dot       += term;
+                        dot_scale += std::fabs(term);
+                    }
+
+                    for (std::size_t j = 0; j < cols; j++) {
+                        std::size_t k     = i * cols + j;
+                        double      value = parent_values[k];
+                        double      init  = first_grads_init[k];
+                        double      scale = std::fabs(init) + value * (std::fabs(parent_grads[k]) + dot_scale);
+
+                        max_error = std::max(max_error,
+                                             GetScaledError(first_grads[k], init + value * (parent_grads[k] - dot),
+                                                            scale));
+                    }
+                }
+                Expect_("EvalGradSoftmax", shape, max_error, static_cast<double>(cols + 4));
+                break;
+            }
+
+            default:
+                assert(0);
+        }
+    }
+}
+
+
+//================================ Losses =====================================
+
+void ConformanceSuite::CheckLosses_(std::size_t rows, std::size_t cols, bool shifted) {
+    assert(rows * cols > 0);
+
+    const std::string shape = FormatShape(rows, cols, shifted);
+    const std::size_t n     = rows * cols;
+
+    // Probabilities, as the cross entropy expects.
+    TestMatrix src(rows, cols, shifted);
+    TestMatrix ref(rows, cols, shifted);
+    SmartMatrix loss(1, 1);
+
+    std::vector<uint32_t> labels(rows);
+    std::uniform_int_distribution<uint32_t> label(0, static_cast<uint32_t>(cols - 1));
+    for (uint32_t& value : labels) {
+        value = label(gen_);
+    }
+
+    FillRandom_(&src.matrix, 0.05f, 1.0f);
+    FillRandom_(&ref.matrix, 0.0f,  1.0f);
+
+    const float* src_values = src.matrix.GetValues();
+    const float* ref_values = ref.matrix.GetValues();
+    const float* src_grads  = src.matrix.GetGrads();
+    const float* ref_grads  = ref.matrix.GetGrads();
+
+    // Squared error
+    loss.SquaredErrorLoss(&src.matrix, &ref.matrix);
+
+    double reference = 0.0;
+    for (std::size_t i = 0; i < n; i++) {
+        double diff = static_cast<double>(src_values[i]) - ref_values[i];
+        reference += diff * diff;
+    }
+    Expect_("SquaredErrorLoss", shape, GetScaledError(loss.GetValue(0, 0), reference, reference),
+            static_cast<double>(n + 4));
+
+    FillRandomGrads_(&src.matrix);
+    FillRandomGrads_(&ref.matrix);
+    std::vector<float> src_grads_init = CopyGrads(src.matrix);
+    std::vector<float> ref_grads_init = CopyGrads(ref.matrix);
+
+    loss.EvalGrad();
+
+    double src_error = 0.0;
+    double ref_error = 0.0;
+    for (std::size_t i = 0; i < n; i++) {
+        double term  = 2.0 * (static_cast<double>(src_values[i]) - ref_values[i]);
+        double scale = std::fabs(src_grads_init[i]) + std::fabs(term);
+        src_error = std::max(src_error, GetScaledError(src_grads[i], src_grads_init[i] + term, scale));
+        ref_error = std::max(ref_error, GetUlpError(ref_grads[i], ref_grads_init[i]));
+    }
+    Expect_("EvalGradSquaredErrorLossSrc", shape, src_error, 2.0);
+    Expect_("SquaredErrorLossRef (untouched)", shape, ref_error, 0.0);
+
+    // Cross entropy against a dense reference
+    loss.CrossEntropyLoss(&src.matrix, &ref.matrix);
+
+    reference    = 0.0;
+    double scale = 0.0;
+    for (std::size_t i = 0; i < n; i++) {
+        double log_value = std::log(static_cast<double>(src_values[i]) + kCrossEntropyEpsilon);
+        reference -= ref_values[i] * log_value;
+        // The rounding of src + epsilon costs an epsilon of the log near 1.
+        scale     += ref_values[i] * (std::fabs(log_value) + 1.0);
+    }
+    reference /= static_cast<double>(n);
+    scale     /= static_cast<double>(n);
+    Expect_("CrossEntropyLoss", shape, GetScaledError(loss.GetValue(0, 0), reference, scale),
+            static_cast<double>(n + 4));
+
+    FillRandomGrads_(&src.matrix);
+    FillRandomGrads_(&ref.matrix);
+    src_grads_init = CopyGrads(src.matrix);
+    ref_grads_init = CopyGrads(ref.matrix);
+
+    loss.EvalGrad();
+
+    src_error = 0.0;
+    ref_error = 0.0;
+    for (std::size_t i = 0; i < n; i++) {
+        double term = -ref_values[i] / (static_cast<double>(src_values[i]) + kCrossEntropyEpsilon);
+        scale = std::fabs(src_grads_init[i]) + std::fabs(term);
+        src_error = std::max(src_error, GetScaledError(src_grads[i], src_grads_init[i] + term, scale));
+        ref_error = std::max(ref_error, GetUlpError(ref_grads[i], ref_grads_init[i]));
+    }
+    Expect_("EvalGradCrossEntropyLossSrc", shape, src_error, 3.0);
+    Expect_("CrossEntropyLossRef (untouched)", shape, ref_error, 0.0);
+
+    // Cross entropy against labels
+    loss.CrossEntropyLoss(&src.matrix, labels.data());
+
+    reference = 0.0;
+    scale     = 0.0;
+    for (std::size_t i = 0; i < rows; i++) {
+        double log_value = std::log(static_cast<double>(src.matrix.GetValue(i, labels[i])) +
+                                    kCrossEntropyEpsilon);
+        reference -= log_value;
+        scale     += std::fabs(log_value) + 1.0;
+    }
+    reference /= static_cast<double>(n);
+    scale     /= static_cast<double>(n);
+    Expect_("CrossEntropyLossLabels", shape, GetScaledError(loss.GetValue(0, 0), reference, scale),
+            static_cast<double>(rows + 4));
+
+    FillRandomGrads_(&src.matrix);
+    src_grads_init = CopyGrads(src.matrix);
+
+    loss.EvalGrad();
+
+    src_error = 0.0;
+    for (std::size_t i = 0; i < rows; i++) {
+        for (std::size_t j = 0; j < cols; j++) {
+            std::size_t k    = i * cols + j;
+            double      term = j == labels[i]
+                             ? -1.0 / (static_cast<double>(src_values[k]) + kCrossEntropyEpsilon)
+                             : 0.0;
+            scale = std::fabs(src_grads_init[k]) + std::fabs(term);
+            src_error = std::max(src_error, GetScaledError(src_grads[k], src_grads_init[k] + term, scale));
+        }
+    }
+    Expect_("EvalGradCrossEntropyLossLabels", shape, src_error, 3.0);
+}
+
+
+//================================ Gradients ==================================
+
+// One check per OperationType, named after it: the type marks the operand
+// whose gradient is checked. Every forward resets the intermediate grads,
+// which EvalGrad() accumulates into.
+void ConformanceSuite::CheckGradients_(std::size_t rows, std::size_t inner, std::size_t cols) {
+    const std::string shape = FormatShape(rows, inner, false) + " * " + FormatShape(inner, cols, false);
+
+    SmartMatrix first  (rows,  inner);
+    SmartMatrix second (inner, cols);
+    SmartMatrix left   (rows,  cols);
+    SmartMatrix right  (rows,  cols);
+    SmartMatrix vector (1,     cols);
+    SmartMatrix ref    (rows,  cols);
+    SmartMatrix probs  (rows,  cols);
+    SmartMatrix output (rows,  cols);
+    SmartMatrix loss   (1,     1);
+
+    std::vector<uint32_t> labels(rows);
+    std::uniform_int_distribution<uint32_t> label(0, static_cast<uint32_t>(cols - 1));
+    for (uint32_t& value : labels) {
+        value = label(gen_);
+    }
+
+    FillRandom_(&first,  -1.0f, 1.0f);
+    FillRandom_(&second, -1.0f, 1.0f);
+    FillRandom_(&left,   -2.0f, 2.0f);
+    FillRandom_(&right,  -2.0f, 2.0f);
+    FillRandom_(&vector, -2.0f, 2.0f);
+    FillRandom_(&ref,    -1.0f, 1.0f);
+    FillRandom_(&probs,   0.2f, 1.0f);
+
+    auto add = [&] {
+        output.ResetGrad();
+        output.Add(&left, &right);
+        loss.SquaredErrorLoss(&output, &ref);
+        return &loss;
+    };
+    CheckGradient_("Add", shape, &left,  add, kGradStep);
+    CheckGradient_("Add", shape, &right, add, kGradStep);
+
+    auto add_vector = [&] {
+        output.ResetGrad();
+        output.AddVectorToMatrix(&left, &vector);
+        loss.SquaredErrorLoss(&output, &ref);
+        return &loss;
+    };
+    CheckGradient_("AddMatrix", shape, &left,   add_vector, kGradStep);
+    CheckGradient_("AddVector", shape, &vector, add_vector, kGradStep);
+
+    auto sub = [&] {
+        output.ResetGrad();
+        output.Sub(&left, &right);
+        loss.SquaredErrorLoss(&output, &ref);
+        return &loss;
+    };
+    CheckGradient_("LSub", shape, &left,  sub, kGradStep);
+    CheckGradient_("RSub", shape, &right, sub, kGradStep);
+
+    auto mul = [&] {
+        output.ResetGrad();
+        output.Mul(&first, &second);
+        loss.SquaredErrorLoss(&output, &ref);
+        return &loss;
+    };
+    CheckGradient_("LMul", shape, &first,  mul, kGradStep);
+    CheckGradient_("RMul", shape, &second, mul, kGradStep);
+
+    auto sigm = [&] {
+        output.ResetGrad();
+        output.Sigm(&left);
+        loss.SquaredErrorLoss(&output, &ref);
+        return &loss;
+    };
+    CheckGradient_("Sigm", shape, &left, sigm, kGradStep);
+
+    auto softmax = [&] {
+        output.ResetGrad();
+        output.Softmax(&left);
+        loss.SquaredErrorLoss(&output, &ref);
+        return &loss;
+    };
+    CheckGradient_("Softmax", shape, &left, softmax, kGradStep);
+
+    // A leaf used twice (left) and a broadcast one (vector).
+    auto fused = [&] {
+        output.ResetGrad();
+        Assign(&output, Hadamard(Sigm(Expr(&left) + Expr(&vector)), Expr(&right) - Expr(&left)) * 0.5f);
+        loss.SquaredErrorLoss(&output, &ref);
+        return &loss;
+    };
+    CheckGradient_("Fused", shape, &left,   fused, kGradStep);
+    CheckGradient_("Fused", shape, &right,  fused, kGradStep);
+    CheckGradient_("Fused", shape, &vector, fused, kGradStep);
+
+    // The refs' gradients are not propagated by design, a zero scale
+    // requires them to stay zero.
+    auto squared_error = [&] {
+        loss.SquaredErrorLoss(&left, &ref);
+        return &loss;
+    };
+    CheckGradient_("SquaredErrorLossSrc", shape, &left, squared_error, kGradStep);
+    CheckGradient_("SquaredErrorLossRef", shape, &ref,  squared_error, kGradStep, 0.0f);
+
+    // The cross entropy gradients are those of the summed loss, see
+    // SmartMatrix::EvalGradCrossEntropyLossSrc_().
+    const float sum_scale = static_cast<float>(rows * cols);
+
+    auto cross_entropy = [&] {
+        loss.CrossEntropyLoss(&probs, &right);
+        return &loss;
+    };
+    CheckGradient_("CrossEntropyLossSrc", shape, &probs, cross_entropy, kCrossEntropyGradStep, sum_scale);
+    CheckGradient_("CrossEntropyLossRef", shape, &right, cross_entropy, kCrossEntropyGradStep, 0.0f);
+
+    auto cross_entropy_labels = [&] {
+        loss.CrossEntropyLoss(&probs, labels.data());
+        return &loss;
+    };
+    CheckGradient_("CrossEntropyLossLabels", shape, &probs, cross_entropy_labels,
+                   kCrossEntropyGradStep, sum_scale);
+}
+
+
+template <typename Forward>
+void ConformanceSuite::CheckGradient_(const char* operation, const std::string& shape,
+                                      SmartMatrix* input, Forward forward, float step,
+                                      float grad_scale) {
+    assert(input);
+
+    input->ResetGrad();
+
+    SmartMatrix* loss       = forward();
+    const double loss_value = loss->GetValue(0, 0);
+    loss->EvalGrad();
+
+    const std::size_t  rows  = input->GetRows();
+    const std::size_t  cols  = input->GetCols();
+    const std::vector<float> grads = CopyGrads(*input);
+
+    double max_error = 0.0;
+    for (std::size_t i = 0; i < rows; i++) {
+        for (std::size_t j = 0; j < cols; j++) {
+            const float value = input->GetValue(i, j);
+            const float plus  = value + step;
+            const float minus = value - step;
+
+            input->SetValue(i, j, plus);
+            double loss_plus  = forward()->GetValue(0, 0);
+            input->SetValue(i, j, minus);
+            double loss_minus = forward()->GetValue(0, 0);
+            input->SetValue(i, j, value);
+
+            double expected = grad_scale * (loss_plus - loss_minus) /
+                              (static_cast<double>(plus) - static_cast<double>(minus));
+            double grad     = grads[i * cols + j];
+
+            double error     = std::fabs(grad - expected);
+            double tolerance = kGradRelTolerance * std::max(std::fabs(grad), std::fabs(expected)) +
+                               kGradAbsTolerance * std::fabs(grad_scale) * std::max(1.0, std::fabs(loss_value));
+
+            if (!std::isfinite(grad)) {
+                max_error = INFINITY;
+            } else if (error > 0.0) {
+                max_error = std::max(max_error, tolerance > 0.0 ? error / tolerance : INFINITY);
+            }
+        }
+    }
+
+    Expect_(operation, shape + ", finite differences", max_error, 1.0);
+}
+
+
+//================================ Element types ==============================
+
+// The float and Half layers against the double one. Half rounds the inputs
+// on storing, so its reference starts from the rounded values.
+void ConformanceSuite::CheckElementTypes_(std::size_t rows, std::size_t inner, std::size_t cols) {
+    const std::string shape = FormatShape(rows, inner, false) + " * " + FormatShape(inner, cols, false);
+    const double      bound = static_cast<double>(inner + 8);
+
+    std::vector<float> input  (rows  * inner);
+    std::vector<float> weights(inner * cols);
+    std::vector<float> biases (cols);
+    std::vector<float> ref    (rows  * cols);
+    for (float& value : input)   { value = GetRandom_( 0.0f, 1.0f); }
+    for (float& value : weights) { value = GetRandom_(-0.1f, 0.1f); }
+    for (float& value : biases)  { value = GetRandom_(-1.0f, 1.0f); }
+    for (float& value : ref)     { value = GetRandom_( 0.0f, 1.0f); }
+
+    Expect_("SmartMatrixT<float>", shape,
+            GetMaxRelativeError(EvalLayerStep<float> (rows, inner, cols, input, weights, biases, ref),
+                                EvalLayerStep<double>(rows, inner, cols, input, weights, biases, ref),
+                                kEpsilon),
+            bound);
+
+    auto round_to_half = [](std::vector<float>* values) {
+        for (float& value : *values) {
+            value = Half(value);
+        }
+    };
+    round_to_half(&input);
+    round_to_half(&weights);
+    round_to_half(&biases);
+    round_to_half(&ref);
+
+    Expect_("SmartMatrixT<Half>", shape,
+            GetMaxRelativeError(EvalLayerStep<Half>  (rows, inner, cols, input, weights, biases, ref),
+                                EvalLayerStep<double>(rows, inner, cols, input, weights, biases, ref),
+                                kHalfEpsilon),
+            bound);
+}
+
+
+//================================ Helpers ====================================
+
+float ConformanceSuite::GetRandom_(float min, float max) {
+    return std::uniform_real_distribution<float>(min, max)(gen_);
+}
+
+
+void ConformanceSuite::FillRandom_(SmartMatrix* matrix, float min, float max) {
+    for (std::size_t i = 0; i < matrix->GetRows(); i++) {
+        for (std::size_t j = 0; j < matrix->GetCols(); j++) {
+            matrix->SetValue(i, j, GetRandom_(min, max));
+        }
+    }
+}
+
+
+void ConformanceSuite::FillRandomGrads_(SmartMatrix* matrix) {
+    for (std::size_t i = 0; i < matrix->GetRows(); i++) {
+        for (std::size_t j = 0; j < matrix->GetCols(); j++) {
+            matrix->SetGrad(i, j, GetRandom_(-1.0f, 1.0f));
+        }
+    }
+}
+
+
+// A NaN error fails the check.
+void ConformanceSuite::Expect_(const char* kernel, const std::string& shape, double error, double bound) {
+    n_checks_++;
+
+    bool passed = error <= bound;
+    if (!passed) {
+        n_failures_++;
+    }
+
+    if (!passed || verbose_) {
+        char line[256] = {};
+        snprintf(line, sizeof(line), "%-4s %-32s %-40s error %10.3g, bound %g\n",
+                 passed ? "ok" : "FAIL", kernel, shape.c_str(), error, bound);
+        out_ << line;
+    }
+}
@@ -0,0 +1,205 @@
+#include "../include/data_parallel.h"
+
+#include <assert.h>
+#include <algorithm>
+
+// Gradients are reduced in chunks of this many floats, one chunk per task.
+static const std::size_t kReduceChunk = 4096;
+
+
+DataParallelTrainer::DataParallelTrainer(std::size_t n_inputs,
+                                         std::size_t n_hidden_layers,
+                                         std::size_t n_hidden_layer_neurons,
+                                         std::size_t n_outputs,
+                                         std::size_t n_examples,
+                                         std::size_t n_replicas)
+    : n_examples_(n_examples),
+      replicas_  (n_replicas),
+      pool_      (n_replicas),
+      losses_    (n_replicas, 0.0f),
+      n_hogwild_updates_(0) {
+
+    assert(n_hidden_layers > 0);
+    assert(n_replicas > 0);
+    assert(n_examples >= n_replicas);
+
+    for (std::size_t k = 0; k < n_replicas; k++) {
+        Replica& replica = replicas_[k];
+
+        replica.first_example = n_examples * k / n_replicas;
+        replica.n_examples    = n_examples * (k + 1) / n_replicas - replica.first_example;
+
+        replica.input_layer = std::make_unique<InputLayer>(n_inputs, replica.n_examples);
+
+        replica.middle_layers.reserve(n_hidden_layers);
+        replica.middle_layers.emplace_back(MiddleLayer(replica.input_layer.get(),
+                                                       n_hidden_layer_neurons));
+        for (std::size_t i = 1; i < n_hidden_layers; i++) {
+            replica.middle_layers.emplace_back(MiddleLayer(&replica.middle_layers[i - 1],
+                                                           n_hidden_layer_neurons));
+        }
+
+        replica.output_layer = std::make_unique<OutputLayerDiscret>(
+                                    &replica.middle_layers.back(), n_outputs);
+
+        std::vector<SmartMatrix*> params;
+        replica.output_layer->CollectParamsRecursive(&params);
+        replica.params = std::make_unique<ParameterBuffer>(params);
+
+        if (k != 0) {
+            replica.params->MapValues(replicas_[0].params->GetValues());
+        }
+    }
+}
+
+
+DataParallelTrainer::~DataParallelTrainer() {
+}
+
+
+DataParallelTrainer::Replica* DataParallelTrainer::FindReplica_(std::size_t example,
+                                                                std::size_t* row) {
+    assert(example < n_examples_);
+
+    std::size_t k = std::min(example * replicas_.size() / n_examples_, replicas_.size() - 1);
+    while (example < replicas_[k].first_example) {
+        k--;
+    }
+    while (example >= replicas_[k].first_example + replicas_[k].n_examples) {
+        k++;
+    }
+
+    *row = example - replicas_[k].first_example;
+    return &replicas_[k];
+}
+
+
+void DataParallelTrainer::SetInput(std::size_t example, std::size_t input, float value) {
+    std::size_t row = 0;
+    FindReplica_(example, &row)->input_layer->SetValue(row, input, value);
+}
+
+
+void DataParallelTrainer::SetLabel(std::size_t example, uint32_t label) {
+    std::size_t row = 0;
+    FindReplica_(example, &row)->output_layer->SetLabel(row, label);
+}
+
+
+void DataParallelTrainer::SetLabels(const uint8_t* labels) {
+    assert(labels);
+
+    for (Replica& replica : replicas_) {
+        replica.output_layer->SetLabels(labels + replica.first_example);
+    }
+}
+
+
+ParameterBuffer* DataParallelTrainer::GetParams() { return replicas_[0].params.get(); }
+
+std::size_t DataParallelTrainer::GetReplicasCount() const { return replicas_.size(); }
+
+
+float DataParallelTrainer::EvalGrads() {
+    pool_.Run(replicas_.size(), [this](std::size_t k) {
+        OutputLayerDiscret* output_layer = replicas_[k].output_layer.get();
+
+        output_layer->ResetGradsRecursive();
+        output_layer->EvalRecursive();
+        losses_[k] = output_layer->GetLoss();
+    });
+
+    ReduceGrads_();
+
+    // Shard losses are means over their own rows, weight them back.
+    float loss = 0.0f;
+    for (std::size_t k = 0; k < replicas_.size(); k++) {
+        loss += losses_[k] * static_cast<float>(replicas_[k].n_examples) /
+                             static_cast<float>(n_examples_);
+    }
+
+    return loss;
+}
+
+
+float DataParallelTrainer::Step(Optimizer* optimizer) {
+    assert(optimizer);
+
+    float loss = EvalGrads();
+    optimizer->Step();
+
+    return loss;
+}
+
+
+float DataParallelTrainer::RunHogwild(float step, std::size_t n_iterations,
+                                      std::vector<HogwildStats>* stats) {
+    std::vector<HogwildStats> replica_stats(replicas_.size(), HogwildStats{});
+
+    pool_.Run(replicas_.size(), [&](std::size_t k) {
+        OutputLayerDiscret* output_layer = replicas_[k].output_layer.get();
+        SmartMatrix*        flat         = replicas_[k].params->GetFlat();
+        HogwildStats*       thread_stats = &replica_stats[k];
+
+        std::size_t total_staleness = 0;
+
+        for (std::size_t i = 0; i < n_iterations; i++) {
+            std::size_t read_version = n_hogwild_updates_.load(std::memory_order_relaxed);
+
+            output_layer->ResetGradsRecursive();
+            output_layer->EvalRecursive();
+
+            // Racy on purpose: other replicas read and write the same
+            // weights concurrently. Lost or torn updates are tolerated.
+            flat->AdjustValues(step);
+
+            std::size_t write_version = n_hogwild_updates_.fetch_add(1, std::memory_order_relaxed);
+            std::size_t staleness     = write_version - read_version;
+
+            total_staleness += staleness;
+            thread_stats->max_staleness = std::max(thread_stats->max_staleness, staleness);
+        }
+
+        thread_stats->n_updates      = n_iterations;
+        thread_stats->mean_staleness = n_iterations ? static_cast<double>(total_staleness) /
+                                                      static_cast<double>(n_iterations)
+                                                    : 0.0;
+    });
+
+    if (stats) {
+        *stats = replica_stats;
+    }
+
+    return EvalGrads();
+}
+
+
+// The loss gradients are sums over rows, so the full-batch gradient is the
+// plain sum of the shard gradients. Each chunk is summed pairwise along a
+// fixed tree: 0 += 1, 2 += 3, ..., then 0 += 2, ... This keeps the float
+// rounding independent of which thread reduces which chunk.
+void DataParallelTrainer::ReduceGrads_() {
+    std::size_t n_replicas = replicas_.size();
+    if (n_replicas == 1) {
+        return;
+    }
+
+    std::size_t size     = replicas_[0].params->GetSize();
+    std::size_t n_chunks = (size + kReduceChunk - 1) / kReduceChunk;
+
+    pool_.Run(n_chunks, [this, size, n_replicas](std::size_t chunk) {
+        std::size_t begin = chunk * kReduceChunk;
+        std::size_t end   = std::min(begin + kReduceChunk, size);
+
+        for (std::size_t stride = 1; stride < n_replicas; stride *= 2) {
+            for (std::size_t k = 0; k + stride < n_replicas; k += 2 * stride) {
+                float* __restrict__       dst = replicas_[k]         .params->GetGrads();
+                const float* __restrict__ src = replicas_[k + stride].params->GetGrads();
+
+                for (std::size_t i = begin; i < end; i++) {
+                    dst[i] += src[i];
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,195 @@
+#include "../include/distributed_trainer.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <iostream>
+
+DistributedTrainer::DistributedTrainer(Communicator* communicator,
+                                       std::size_t n_inputs,
+                                       std::size_t n_hidden_layers,
+                                       std::size_t n_hidden_layer_neurons,
+                                       std::size_t n_outputs,
+                                       std::size_t n_examples)
+    : communicator_ (communicator),
+      max_grad_norm_(0.0f),
+      n_reduced_    (0),
+      comm_failed_  (false),
+      stop_         (false) {
+
+    assert(communicator);
+    assert(n_hidden_layers > 0);
+
+    input_layer_ = std::make_unique<InputLayer>(n_inputs, n_examples);
+
+    middle_layers_.reserve(n_hidden_layers);
+    middle_layers_.emplace_back(MiddleLayer(input_layer_.get(), n_hidden_layer_neurons));
+    for (std::size_t i = 1; i < n_hidden_layers; i++) {
+        middle_layers_.emplace_back(MiddleLayer(&middle_layers_[i - 1], n_hidden_layer_neurons));
+    }
+
+    output_layer_ = std::make_unique<OutputLayerDiscret>(&middle_layers_.back(), n_outputs);
+
+    std::vector<SmartMatrix*> params;
+    output_layer_->CollectParamsRecursive(&params);
+    params_ = std::make_unique<ParameterBuffer>(params);
+
+    // One bucket per layer: its weights and biases, which are adjacent in
+    // the flat buffer.
+    const std::size_t kParamsPerLayer = 2;
+    for (std::size_t i = 0; i < params.size(); i += kParamsPerLayer) {
+        std::size_t next = i + kParamsPerLayer;
+
+        Bucket bucket = {};
+        bucket.begin    = params_->GetParamOffset(i);
+        bucket.end      = next < params.size() ? params_->GetParamOffset(next) : params_->GetSize();
+        bucket.n_params = std::min(kParamsPerLayer, params.size() - i);
+
+        for (std::size_t j = i; j < i + bucket.n_params; j++) {
+            param_buckets_[params[j]] = buckets_.size();
+            params[j]->SetGradReadyHook(this);
+        }
+        buckets_.push_back(bucket);
+    }
+
+    comm_thread_ = std::thread(&DistributedTrainer::CommLoop_, this);
+}
+
+
+DistributedTrainer::~DistributedTrainer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_comm_.notify_one();
+
+    comm_thread_.join();
+}
+
+
+void DistributedTrainer::SetInput(std::size_t example, std::size_t input, float value) {
+    input_layer_->SetValue(example, input, value);
+}
+
+
+void DistributedTrainer::SetLabels(const uint8_t* labels) {
+    output_layer_->SetLabels(labels);
+}
+
+
+ParameterBuffer* DistributedTrainer::GetParams() { return params_.get(); }
+
+
+// Summing with zeros is exact, so an all-reduce of rank 0's values against
+// zeros everywhere else is a broadcast.
+bool DistributedTrainer::BroadcastParams() {
+    float* values = params_->GetValues();
+
+    if (communicator_->GetRank() != 0) {
+        std::fill(values, values + params_->GetSize(), 0.0f);
+    }
+
+    return communicator_->AllReduce(values, params_->GetSize());
+}
+
+
+void DistributedTrainer::SetMaxGradNorm(float max_norm) {
+    assert(max_norm >= 0.0f);
+
+    max_grad_norm_ = max_norm;
+}
+
+
+void DistributedTrainer::OnGradReady(SmartMatrix* matrix) {
+    auto it = param_buckets_.find(matrix);
+    assert(it != param_buckets_.end());
+
+    // Under the lock: with a scheduler the weights and biases of a layer
+    // may become ready on two threads at once.
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        Bucket& bucket = buckets_[it->second];
+        bucket.n_ready++;
+        if (bucket.n_ready != bucket.n_params) {
+            return;
+        }
+
+        ready_buckets_.push_back(it->second);
+    }
+    wake_comm_.notify_one();
+}
+
+
+bool DistributedTrainer::Step(Optimizer* optimizer, float* loss) {
+    assert(optimizer);
+    assert(loss);
+
+    for (Bucket& bucket : buckets_) {
+        bucket.n_ready = 0;
+    }
+
+    output_layer_->ResetGradsRecursive();
+    output_layer_->EvalRecursive();
+
+    bool comm_failed = false;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_step_.wait(lock, [this] { return n_reduced_ == buckets_.size(); });
+        n_reduced_ = 0;
+
+        comm_failed  = comm_failed_;
+        comm_failed_ = false;
+    }
+
+    if (comm_failed) {
+        std::cerr << "Gradient all-reduce failed on rank " << communicator_->GetRank() << std::endl;
+        return false;
+    }
+
+    // The communication thread is idle now, the link is ours.
+    float totals[2] = {
+        output_layer_->GetLoss() * static_cast<float>(input_layer_->GetRows()),
+        static_cast<float>(input_layer_->GetRows()),
+    };
+    if (!communicator_->AllReduce(totals, 2)) {
+        std::cerr << "Loss all-reduce failed on rank " << communicator_->GetRank() << std::endl;
+        return false;
+    }
+
+    // Every rank has the same reduced gradients, so they clip alike.
+    if (max_grad_norm_ > 0.0f) {
+        params_->ClipGradNorm(max_grad_norm_);
+    }
+    optimizer->Step();
+
+    *loss = totals[0] / totals[1];
+    return true;
+}
+
+
+void DistributedTrainer::CommLoop_() {
+    float* grads = params_->GetGrads();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        wake_comm_.wait(lock, [this] { return stop_ || !ready_buckets_.empty(); });
+        if (stop_) {
+            break;
+        }
+
+        std::size_t bucket_index = ready_buckets_.front();
+        ready_buckets_.pop_front();
+        const Bucket& bucket = buckets_[bucket_index];
+
+        lock.unlock();
+        bool ok = communicator_->AllReduce(grads + bucket.begin, bucket.end - bucket.begin);
+        lock.lock();
+
+        comm_failed_ = comm_failed_ || !ok;
+        n_reduced_++;
+        if (n_reduced_ == buckets_.size()) {
+            wake_step_.notify_one();
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#include "../include/execution_plan.h"
+#include "../include/smart_matrix.h"
+#include "../include/fused_expr.h"
+
+#include <assert.h>
+
+// The plan being recorded on this thread. Ops issued by other threads (e.g.
+// by a TaskScheduler) are not traced: they are covered by the step that
+// started them.
+static thread_local ExecutionPlan* recording_plan = nullptr;
+
+
+ExecutionPlan::ExecutionPlan()
+    : steps_() {
+}
+
+
+ExecutionPlan::~ExecutionPlan() {
+    assert(recording_plan != this);
+}
+
+
+void ExecutionPlan::Record(const std::function<void()>& step) {
+    assert(!recording_plan);
+
+    steps_.clear();
+
+    recording_plan = this;
+    step();
+    recording_plan = nullptr;
+}
+
+
+void ExecutionPlan::Replay() const {
+    assert(!recording_plan);
+
+    for (const Step& step : steps_) {
+        switch (step.type) {
+            case StepType::ResetGrad:
+                step.output->ResetGrad();
+                break;
+            case StepType::Add:
+                step.output->Add(step.first, step.second);
+                break;
+            case StepType::AddVectorToMatrix:
+                step.output->AddVectorToMatrix(step.first, step.second);
+                break;
+            case StepType::Sub:
+                step.output->Sub(step.first, step.second);
+                break;
+            case StepType::Mul:
+                step.output->Mul(step.first, step.second);
+                break;
+            case StepType::SquaredErrorLoss:
+                step.output->SquaredErrorLoss(step.first, step.second);
+                break;
+            case StepType::CrossEntropyLoss:
+                step.output->CrossEntropyLoss(step.first, step.second);
+                break;
+            case StepType::CrossEntropyLossLabels:
+                step.output->CrossEntropyLoss(step.first, step.labels);
+                break;
+            case StepType::Sigm:
+                step.output->Sigm(step.first);
+                break;
+            case StepType::Softmax:
+                step.output->Softmax(step.first);
+                break;
+            case StepType::Fused:
+                step.output->Fused(step.fused);
+                break;
+            case StepType::SeedGrad:
+                step.output->SetMatrixGrad(1.0f);
+                break;
+            case StepType::EvalGradNode:
+                step.output->EvalGradNode_();
+                break;
+            case StepType::EvalGradParallel:
+                step.output->EvalGrad(step.scheduler);
+                break;
+            case StepType::AdjustValues:
+                step.output->AdjustValues(step.value);
+                break;
+            default:
+                assert(0);
+        }
+    }
+}
+
+
+bool        ExecutionPlan::IsEmpty()       const { return steps_.empty(); }
+std::size_t ExecutionPlan::GetStepsCount() const { return steps_.size();  }
+void        ExecutionPlan::Clear()               { steps_.clear();        }
+
+
+void ExecutionPlan::RecordFloatStep_(StepType type, SmartMatrix* output,
+                                     SmartMatrix* first, SmartMatrix* second,
+                                     const uint32_t* labels, TaskScheduler* scheduler,
+                                     float value) {
+    if (!recording_plan) {
+        return;
+    }
+
+    assert(output);
+    recording_plan->steps_.push_back({type, output, first, second, labels, scheduler, value, nullptr});
+}
+
+
+void ExecutionPlan::RecordFloatFusedStep_(SmartMatrix* output,
+                                          std::shared_ptr<const FusedExpression<float>> expr) {
+    if (!recording_plan) {
+        return;
+    }
+
+    assert(output && expr);
+    recording_plan->steps_.push_back({StepType::Fused, output, nullptr, nullptr, nullptr, nullptr, 0.0f,
+                                      std::move(expr)});
+}
+
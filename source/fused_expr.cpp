@@ -0,0 +1,16 @@
+#include "../include/fused_expr.h"
+
+template <typename T>
+FusedExpression<T>::~FusedExpression() {
+}
+
+
+template <typename T>
+const std::vector<SmartMatrixT<T>*>& FusedExpression<T>::GetLeaves() const {
+    return leaves_;
+}
+
+
+template class FusedExpression<float>;
+template class FusedExpression<double>;
+template class FusedExpression<Half>;
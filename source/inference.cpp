@@ -0,0 +1,396 @@
+#include "../include/inference.h"
+#include "../include/fused_expr.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+
+static uint64_t GetNextModelVersion() {
+    static std::atomic<uint64_t> next_version(1);
+    return next_version++;
+}
+
+//=============================== InferenceModel ===============================
+
+InferenceModel::InferenceModel()
+    : layers_      (),
+      output_type_ (CheckpointLayerType::OutputDiscret),
+      version_     (0),
+      params_      (),
+      shared_grads_() {
+}
+
+
+InferenceModel::InferenceModel(OutputLayer* output_layer)
+    : layers_      (),
+      output_type_ (output_layer->GetCheckpointType()),
+      version_     (GetNextModelVersion()),
+      params_      (),
+      shared_grads_() {
+
+    // Weights and biases of every layer, input side first.
+    std::vector<SmartMatrix*> params;
+    output_layer->CollectParamsRecursive(&params);
+    assert(params.size() % 2 == 0);
+
+    for (std::size_t i = 0; i < params.size(); i += 2) {
+        const SmartMatrix* weights = params[i];
+        const SmartMatrix* biases  = params[i + 1];
+
+        AddLayer_(weights->GetRows(), weights->GetCols(), weights->GetValues(), biases->GetValues());
+    }
+
+    RegisterMemory_();
+}
+
+
+InferenceModel::~InferenceModel() {
+    Clear_();
+}
+
+
+void InferenceModel::Clear_() {
+    MemoryTracker::Unregister(params_.data());
+    MemoryTracker::Unregister(shared_grads_.data());
+
+    layers_      .clear();
+    params_      .clear();
+    shared_grads_.clear();
+    version_ = 0;
+}
+
+
+void InferenceModel::AddLayer_(std::size_t n_inputs, std::size_t n_outputs,
+                               const float* weights, const float* biases) {
+    assert(weights);
+    assert(biases);
+    assert(layers_.empty() || layers_.back().n_outputs == n_inputs);
+
+    std::size_t n_weights = n_inputs * n_outputs;
+
+    layers_.push_back({n_inputs, n_outputs, params_.size(), params_.size() + n_weights});
+    params_.insert(params_.end(), weights, weights + n_weights);
+    params_.insert(params_.end(), biases,  biases  + n_outputs);
+
+    shared_grads_.resize(std::max(shared_grads_.size(), n_weights));
+}
+
+
+void InferenceModel::RegisterMemory_() {
+    if (!params_.empty()) {
+        MemoryTracker::Register(params_.data(), params_.size() * sizeof(float),
+                                "inference", MemoryRole::Weights);
+        MemoryTracker::Register(shared_grads_.data(), shared_grads_.size() * sizeof(float),
+                                "inference", MemoryRole::Grad);
+    }
+}
+
+
+CheckpointError InferenceModel::LoadCheckpoint(const CheckpointReader& reader) {
+    Clear_();
+
+    std::size_t n_layers = reader.GetLayersCount();
+    if (n_layers == 0) {
+        return CheckpointError::ShapeMismatch;
+    }
+
+    for (std::size_t layer = 0; layer < n_layers; layer++) {
+        const CheckpointLayerInfo&  info    = reader.GetLayer(layer);
+        const CheckpointTensorInfo* weights = reader.FindTensor(layer, CheckpointRole::Weights);
+        const CheckpointTensorInfo* biases  = reader.FindTensor(layer, CheckpointRole::Biases);
+
+        bool is_output   = layer + 1 == n_layers;
+        bool type_valid  = is_output ? info.type == static_cast<uint32_t>(CheckpointLayerType::OutputDiscret) ||
+                                       info.type == static_cast<uint32_t>(CheckpointLayerType::OutputContinuos)
+                                     : info.type == static_cast<uint32_t>(CheckpointLayerType::Middle);
+        bool shape_valid = weights != nullptr && biases != nullptr &&
+                           weights->rows == info.n_inputs && weights->cols == info.n_outputs &&
+                           biases ->rows == 1             && biases ->cols == info.n_outputs &&
+                           (layers_.empty() || layers_.back().n_outputs == info.n_inputs);
+
+        if (!type_valid || !shape_valid) {
+            Clear_();
+            return CheckpointError::ShapeMismatch;
+        }
+
+        AddLayer_(info.n_inputs, info.n_outputs,
+                  reader.GetTensorData(weights), reader.GetTensorData(biases));
+        output_type_ = static_cast<CheckpointLayerType>(info.type);
+    }
+
+    version_ = GetNextModelVersion();
+    RegisterMemory_();
+    return CheckpointError::Ok;
+}
+
+
+bool        InferenceModel::IsEmpty()         const { return layers_.empty(); }
+std::size_t InferenceModel::GetLayersCount()  const { return layers_.size();  }
+CheckpointLayerType InferenceModel::GetOutputType() const { return output_type_; }
+uint64_t    InferenceModel::GetVersion()      const { return version_;        }
+
+
+std::size_t InferenceModel::GetInputsCount() const {
+    assert(!layers_.empty());
+    return layers_.front().n_inputs;
+}
+
+
+std::size_t InferenceModel::GetOutputsCount() const {
+    assert(!layers_.empty());
+    return layers_.back().n_outputs;
+}
+
+
+std::size_t InferenceModel::GetLayerInputsCount(std::size_t layer) const {
+    assert(layer < layers_.size());
+    return layers_[layer].n_inputs;
+}
+
+
+std::size_t InferenceModel::GetLayerOutputsCount(std::size_t layer) const {
+    assert(layer < layers_.size());
+    return layers_[layer].n_outputs;
+}
+
+
+const float* InferenceModel::GetWeights(std::size_t layer) const {
+    assert(layer < layers_.size());
+    return params_.data() + layers_[layer].weights_offset;
+}
+
+
+const float* InferenceModel::GetBiases(std::size_t layer) const {
+    assert(layer < layers_.size());
+    return params_.data() + layers_[layer].biases_offset;
+}
+
+
+float* InferenceModel::GetSharedGrads() const { return shared_grads_.data(); }
+
+//============================== InferenceContext ==============================
+
+InferenceContext::DenseNodes::DenseNodes(std::size_t n_examples, std::size_t n_inputs,
+                                         std::size_t n_outputs)
+    : weights        (n_inputs,   n_outputs),
+      biases         (1,          n_outputs),
+      unbiased_output(n_examples, n_outputs),
+      output         (n_examples, n_outputs) {
+}
+
+
+InferenceContext::DenseNodes::~DenseNodes() {
+}
+
+
+InferenceContext::InferenceContext(const InferenceModel* model, std::size_t n_examples)
+    : model_        (model),
+      n_examples_   (n_examples),
+      input_        (n_examples, model->GetInputsCount()),
+      layers_       (),
+      biased_output_(n_examples, model->GetOutputsCount()) {
+
+    assert(!model_->IsEmpty());
+
+    input_        .SetMemoryTag("inference", MemoryRole::Activation);
+    biased_output_.SetMemoryTag("inference", MemoryRole::Activation);
+
+    // Built in place: the views must not be copied.
+    layers_.reserve(model_->GetLayersCount());
+    for (std::size_t layer = 0; layer < model_->GetLayersCount(); layer++) {
+        layers_.emplace_back(n_examples_, model_->GetLayerInputsCount(layer),
+                             model_->GetLayerOutputsCount(layer));
+        DenseNodes& nodes = layers_.back();
+
+        // The ops only read their operands' values, so the model stays
+        // untouched; the graph links written are those of these nodes.
+        nodes.weights.MapValues(const_cast<float*>(model_->GetWeights(layer)));
+        nodes.biases .MapValues(const_cast<float*>(model_->GetBiases (layer)));
+        nodes.weights.MapGrads (model_->GetSharedGrads());
+        nodes.biases .MapGrads (model_->GetSharedGrads());
+
+        nodes.unbiased_output.SetMemoryTag("inference", MemoryRole::Activation);
+        nodes.output         .SetMemoryTag("inference", MemoryRole::Activation);
+    }
+}
+
+
+InferenceContext::~InferenceContext() {
+}
+
+
+// Same ops as MiddleLayer::Eval() and the output layers' Eval(), so the
+// outputs equal those of the layers the model was copied from.
+void InferenceContext::Eval(const float* inputs) {
+    assert(inputs);
+
+    std::copy(inputs, inputs + n_examples_ * model_->GetInputsCount(), input_.GetMutableValues());
+
+    DenseNodes& first = layers_.front();
+    first.unbiased_output.Mul(&input_, &first.weights);
+
+    EvalFromFirstProduct_();
+}
+
+
+void InferenceContext::EvalFromFirstProduct(const float* first_product) {
+    assert(first_product);
+
+    SmartMatrix& unbiased_output = layers_.front().unbiased_output;
+    std::copy(first_product, first_product + n_examples_ * model_->GetLayerOutputsCount(0),
+              unbiased_output.GetMutableValues());
+
+    EvalFromFirstProduct_();
+}
+
+
+void InferenceContext::EvalFromFirstProduct_() {
+    for (std::size_t layer = 0; layer + 1 < layers_.size(); layer++) {
+        DenseNodes& nodes = layers_[layer];
+
+        if (layer > 0) {
+            nodes.unbiased_output.Mul(&layers_[layer - 1].output, &nodes.weights);
+        }
+        Assign(&nodes.output, Sigm(Expr(&nodes.unbiased_output) + Expr(&nodes.biases)));
+    }
+
+    DenseNodes& nodes = layers_.back();
+    if (layers_.size() > 1) {
+        nodes.unbiased_output.Mul(&layers_[layers_.size() - 2].output, &nodes.weights);
+    }
+
+    if (model_->GetOutputType() == CheckpointLayerType::OutputDiscret) {
+        biased_output_.AddVectorToMatrix(&nodes.unbiased_output, &nodes.biases);
+        nodes.output.Softmax(&biased_output_);
+    } else {
+        Assign(&nodes.output, Sigm(Expr(&nodes.unbiased_output) + Expr(&nodes.biases)));
+    }
+}
+
+
+const float* InferenceContext::GetOutputs() const { return layers_.back().output.GetValues(); }
+
+std::size_t           InferenceContext::GetExamplesCount() const { return n_examples_; }
+const InferenceModel* InferenceContext::GetModel()         const { return model_;      }
+
+
+float InferenceContext::GetOutput(std::size_t example, std::size_t output) const {
+    return layers_.back().output.GetValue(example, output);
+}
+
+
+std::size_t InferenceContext::GetLabel(std::size_t example) const {
+    assert(example < n_examples_);
+
+    std::size_t  n_outputs = model_->GetOutputsCount();
+    const float* outputs   = GetOutputs() + example * n_outputs;
+
+    return static_cast<std::size_t>(std::max_element(outputs, outputs + n_outputs) - outputs);
+}
+
+//============================ IncrementalInference ============================
+
+IncrementalInference::IncrementalInference(const InferenceModel* model)
+    : model_         (model),
+      context_       (model),
+      inputs_        (model->GetInputsCount(), 0.0f),
+      first_product_ (model->GetLayerOutputsCount(0), 0.0f),
+      n_updated_rows_(0),
+      changed_       (),
+      changed_values_() {
+
+    changed_       .reserve(inputs_.size());
+    changed_values_.reserve(inputs_.size());
+
+    context_.EvalFromFirstProduct(first_product_.data());
+}
+
+
+IncrementalInference::~IncrementalInference() {
+}
+
+
+void IncrementalInference::ComputeFirstProduct_() {
+    std::size_t  n_outputs = first_product_.size();
+    const float* weights   = model_->GetWeights(0);
+
+    std::fill(first_product_.begin(), first_product_.end(), 0.0f);
+    for (std::size_t i = 0; i < inputs_.size(); i++) {
+        const float* row = weights + i * n_outputs;
+        for (std::size_t j = 0; j < n_outputs; j++) {
+            first_product_[j] += inputs_[i] * row[j];
+        }
+    }
+
+    n_updated_rows_ = 0;
+}
+
+
+void IncrementalInference::Reset(const float* inputs) {
+    assert(inputs);
+
+    std::copy(inputs, inputs + inputs_.size(), inputs_.begin());
+    ComputeFirstProduct_();
+
+    context_.EvalFromFirstProduct(first_product_.data());
+}
+
+
+void IncrementalInference::Update(const std::size_t* indices, const float* values,
+                                  std::size_t n_changed) {
+    assert(indices || n_changed == 0);
+    assert(values  || n_changed == 0);
+
+    std::size_t  n_outputs = first_product_.size();
+    const float* weights   = model_->GetWeights(0);
+
+    if (n_updated_rows_ + n_changed >= inputs_.size()) {
+        for (std::size_t k = 0; k < n_changed; k++) {
+            assert(indices[k] < inputs_.size());
+            inputs_[indices[k]] = values[k];
+        }
+        ComputeFirstProduct_();
+    } else {
+        for (std::size_t k = 0; k < n_changed; k++) {
+            assert(indices[k] < inputs_.size());
+
+            float        delta = values[k] - inputs_[indices[k]];
+            const float* row   = weights + indices[k] * n_outputs;
+            for (std::size_t j = 0; j < n_outputs; j++) {
+                first_product_[j] += delta * row[j];
+            }
+            inputs_[indices[k]] = values[k];
+        }
+        n_updated_rows_ += n_changed;
+    }
+
+    context_.EvalFromFirstProduct(first_product_.data());
+}
+
+
+void IncrementalInference::Eval(const float* inputs) {
+    assert(inputs);
+
+    changed_       .clear();
+    changed_values_.clear();
+    for (std::size_t i = 0; i < inputs_.size(); i++) {
+        // Bitwise, so that only a real change costs a row.
+        if (memcmp(&inputs[i], &inputs_[i], sizeof(float)) != 0) {
+            changed_       .push_back(i);
+            changed_values_.push_back(inputs[i]);
+        }
+    }
+
+    Update(changed_.data(), changed_values_.data(), changed_.size());
+}
+
+
+const float* IncrementalInference::GetInputs()  const { return inputs_.data();         }
+const float* IncrementalInference::GetOutputs() const { return context_.GetOutputs(); }
+
+float       IncrementalInference::GetOutput(std::size_t output) const { return context_.GetOutput(0, output); }
+std::size_t IncrementalInference::GetLabel()                    const { return context_.GetLabel(0);         }
+
+std::size_t IncrementalInference::GetUpdatedRowsCount() const { return n_updated_rows_; }
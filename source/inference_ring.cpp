@@ -0,0 +1,353 @@
+#include "../include/inference_ring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static const char        kRingMagic[8]   = {'K', 'G', 'P', 'T', 'R', 'I', 'N', 'G'};
+static const uint32_t    kRingVersion    = 1;
+// Polls before going to sleep, a few microseconds' worth.
+static const std::size_t kSpinIterations = 1 << 12;
+// Bounds a sleep whose wakeup got lost, e.g. one from a producer without
+// fences (draw.py), and how late a sleeper notices that the engine left.
+static const long        kSleepTimeoutNs = 20 * 1000 * 1000;
+
+static_assert(sizeof(InferenceRingHeader)     == 64, "InferenceRingHeader must be packed");
+static_assert(sizeof(InferenceRingSlotHeader) == 64, "InferenceRingSlotHeader must be packed");
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "shared memory rings need address-free atomics");
+
+
+// Not FUTEX_PRIVATE: the words are shared between processes.
+static void FutexWait(std::atomic<uint32_t>* word, uint32_t expected) {
+    timespec timeout = {0, kSleepTimeoutNs};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+
+static void FutexWake(std::atomic<uint32_t>* word, int n_waiters) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, n_waiters, nullptr, nullptr, 0);
+}
+
+
+// A spin-wait hint: PAUSE on x86, YIELD on ARM, elsewhere the scheduler's.
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+
+// On a single CPU the other side can't make progress while this one polls.
+static std::size_t GetSpinIterations() {
+    static const std::size_t n_iterations = std::thread::hardware_concurrency() > 1 ? kSpinIterations : 0;
+    return n_iterations;
+}
+
+
+static std::size_t GetSlotSize(std::size_t n_inputs, std::size_t n_outputs) {
+    std::size_t size = sizeof(InferenceRingSlotHeader) + (n_inputs + n_outputs) * sizeof(float);
+    return (size + 63) / 64 * 64;
+}
+
+
+static InferenceRingHeader* GetHeader(uint8_t* map) {
+    return reinterpret_cast<InferenceRingHeader*>(map);
+}
+
+
+static InferenceRingSlotHeader* GetSlot(uint8_t* map, std::size_t slot) {
+    return reinterpret_cast<InferenceRingSlotHeader*>(
+        map + sizeof(InferenceRingHeader) + slot * GetHeader(map)->slot_size);
+}
+
+
+static float* GetSlotInputs(InferenceRingSlotHeader* slot) {
+    return reinterpret_cast<float*>(slot + 1);
+}
+
+
+static uint32_t ToWord(InferenceSlotState state) { return static_cast<uint32_t>(state); }
+
+//============================ InferenceRingServer =============================
+
+InferenceRingServer::InferenceRingServer(const InferenceModel* model, const char* file_name,
+                                         std::size_t n_slots)
+    : model_    (model),
+      file_name_(file_name),
+      map_      (nullptr),
+      map_size_ (0),
+      sessions_ (),
+      stopping_ (false),
+      n_served_ (0) {
+
+    assert(!model_->IsEmpty());
+    assert(n_slots > 0);
+
+    for (std::size_t slot = 0; slot < n_slots; slot++) {
+        sessions_.push_back(std::make_unique<IncrementalInference>(model_));
+    }
+
+    std::size_t n_inputs  = model_->GetInputsCount();
+    std::size_t n_outputs = model_->GetOutputsCount();
+    std::size_t slot_size = GetSlotSize(n_inputs, n_outputs);
+    map_size_ = sizeof(InferenceRingHeader) + n_slots * slot_size;
+
+    // Truncating to 0 first zero fills, which frees every slot.
+    int fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || ftruncate(fd, static_cast<off_t>(map_size_)) == -1) {
+        std::cerr << "Can't create " << file_name << ": " << strerror(errno) << std::endl;
+        if (fd != -1) close(fd);
+        return;
+    }
+
+    void* map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Can't map " << file_name << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    map_ = static_cast<uint8_t*>(map);
+
+    InferenceRingHeader* header = GetHeader(map_);
+    memcpy(header->magic, kRingMagic, sizeof(kRingMagic));
+    header->version   = kRingVersion;
+    header->n_slots   = static_cast<uint32_t>(n_slots);
+    header->n_inputs  = static_cast<uint32_t>(n_inputs);
+    header->n_outputs = static_cast<uint32_t>(n_outputs);
+    header->slot_size = static_cast<uint32_t>(slot_size);
+    // Publishes the fields above.
+    header->running.store(1);
+}
+
+
+InferenceRingServer::~InferenceRingServer() {
+    if (map_) {
+        munmap(map_, map_size_);
+        unlink(file_name_.c_str());
+    }
+}
+
+
+bool        InferenceRingServer::IsOpen()         const { return map_ != nullptr; }
+std::size_t InferenceRingServer::GetServedCount() const { return n_served_;       }
+
+
+void InferenceRingServer::Stop() {
+    stopping_ = true;
+
+    if (map_) {
+        InferenceRingHeader* header = GetHeader(map_);
+        header->doorbell.fetch_add(1);
+        FutexWake(&header->doorbell, INT_MAX);
+    }
+}
+
+
+void InferenceRingServer::Serve() {
+    assert(IsOpen());
+
+    InferenceRingHeader* header = GetHeader(map_);
+    std::size_t          n_idle = 0;
+
+    while (!stopping_) {
+        if (ServeReadySlots_() > 0) {
+            n_idle = 0;
+            continue;
+        }
+        if (++n_idle < GetSpinIterations()) {
+            CpuRelax();
+            continue;
+        }
+
+        // A producer marks its slot ready, then bumps the doorbell, then
+        // checks the flag; the engine reads the doorbell, raises the flag,
+        // then checks the slots. Either the engine sees the slot, or the
+        // producer sees the flag, or the futex sees a new doorbell value.
+        uint32_t doorbell = header->doorbell.load();
+        header->engine_sleeping.store(1);
+        if (ServeReadySlots_() == 0 && !stopping_) {
+            FutexWait(&header->doorbell, doorbell);
+        }
+        header->engine_sleeping.store(0);
+        n_idle = 0;
+    }
+
+    header->running.store(0);
+    for (std::size_t slot = 0; slot < header->n_slots; slot++) {
+        FutexWake(&GetSlot(map_, slot)->state, INT_MAX);
+    }
+}
+
+
+std::size_t InferenceRingServer::ServeReadySlots_() {
+    InferenceRingHeader* header    = GetHeader(map_);
+    std::size_t          n_outputs = header->n_outputs;
+    std::size_t          n_ready   = 0;
+
+    for (std::size_t i = 0; i < header->n_slots; i++) {
+        InferenceRingSlotHeader* slot = GetSlot(map_, i);
+        if (slot->state.load(std::memory_order_acquire) != ToWord(InferenceSlotState::Ready)) {
+            continue;
+        }
+
+        float* inputs = GetSlotInputs(slot);
+        sessions_[i]->Eval(inputs);
+
+        const float* outputs = sessions_[i]->GetOutputs();
+        std::copy(outputs, outputs + n_outputs, inputs + header->n_inputs);
+
+        // Same handshake as the doorbell, with the roles swapped.
+        slot->state.store(ToWord(InferenceSlotState::Done));
+        if (slot->producer_sleeping.load() == 1) {
+            FutexWake(&slot->state, 1);
+        }
+
+        n_ready++;
+    }
+
+    n_served_ += n_ready;
+    return n_ready;
+}
+
+//============================ InferenceRingClient =============================
+
+InferenceRingClient::InferenceRingClient(const char* file_name)
+    : map_     (nullptr),
+      map_size_(0) {
+
+    int fd = open(file_name, O_RDWR);
+    if (fd == -1) {
+        std::cerr << "Can't open " << file_name << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    struct stat info;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && static_cast<std::size_t>(info.st_size) >= sizeof(InferenceRingHeader)) {
+        map_size_ = static_cast<std::size_t>(info.st_size);
+        map       = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Can't map " << file_name << std::endl;
+        return;
+    }
+
+    const InferenceRingHeader* header = reinterpret_cast<const InferenceRingHeader*>(map);
+    bool valid = memcmp(header->magic, kRingMagic, sizeof(kRingMagic)) == 0 &&
+                 header->version == kRingVersion &&
+                 header->slot_size == GetSlotSize(header->n_inputs, header->n_outputs) &&
+                 map_size_ == sizeof(InferenceRingHeader) +
+                              static_cast<std::size_t>(header->n_slots) * header->slot_size;
+    if (!valid) {
+        std::cerr << file_name << " is not an inference ring" << std::endl;
+        munmap(map, map_size_);
+        return;
+    }
+
+    map_ = static_cast<uint8_t*>(map);
+}
+
+
+InferenceRingClient::~InferenceRingClient() {
+    if (map_) {
+        munmap(map_, map_size_);
+    }
+}
+
+
+bool InferenceRingClient::IsOpen() const { return map_ != nullptr; }
+
+
+std::size_t InferenceRingClient::GetInputsCount() const {
+    assert(IsOpen());
+    return GetHeader(map_)->n_inputs;
+}
+
+
+std::size_t InferenceRingClient::GetOutputsCount() const {
+    assert(IsOpen());
+    return GetHeader(map_)->n_outputs;
+}
+
+
+bool InferenceRingClient::Predict(const float* inputs, float* outputs) {
+    assert(IsOpen());
+    assert(inputs);
+    assert(outputs);
+
+    InferenceRingHeader*     header = GetHeader(map_);
+    InferenceRingSlotHeader* slot   = nullptr;
+
+    while (slot == nullptr) {
+        if (header->running.load() == 0) {
+            return false;
+        }
+
+        for (std::size_t i = 0; i < header->n_slots && slot == nullptr; i++) {
+            uint32_t free = ToWord(InferenceSlotState::Free);
+            if (GetSlot(map_, i)->state.compare_exchange_strong(free, ToWord(InferenceSlotState::Writing))) {
+                slot = GetSlot(map_, i);
+            }
+        }
+        if (slot == nullptr) {
+            CpuRelax();
+        }
+    }
+
+    float* slot_inputs = GetSlotInputs(slot);
+    std::copy(inputs, inputs + header->n_inputs, slot_inputs);
+
+    slot->state.store(ToWord(InferenceSlotState::Ready));
+    header->doorbell.fetch_add(1);
+    if (header->engine_sleeping.load() == 1) {
+        FutexWake(&header->doorbell, 1);
+    }
+
+    std::size_t n_polls = 0;
+    while (slot->state.load(std::memory_order_acquire) != ToWord(InferenceSlotState::Done)) {
+        if (++n_polls < GetSpinIterations()) {
+            CpuRelax();
+            continue;
+        }
+
+        slot->producer_sleeping.store(1);
+        if (slot->state.load() == ToWord(InferenceSlotState::Ready)) {
+            FutexWait(&slot->state, ToWord(InferenceSlotState::Ready));
+        }
+        slot->producer_sleeping.store(0);
+        n_polls = 0;
+
+        // The engine left without answering: take the request back.
+        uint32_t ready = ToWord(InferenceSlotState::Ready);
+        if (header->running.load() == 0 &&
+            slot->state.compare_exchange_strong(ready, ToWord(InferenceSlotState::Free))) {
+            return false;
+        }
+    }
+
+    const float* slot_outputs = slot_inputs + header->n_inputs;
+    std::copy(slot_outputs, slot_outputs + header->n_outputs, outputs);
+
+    slot->state.store(ToWord(InferenceSlotState::Free), std::memory_order_release);
+    return true;
+}
@@ -0,0 +1,488 @@
+#include "../include/inference_server.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool ReadAll(int fd, void* buffer, std::size_t size) {
+    uint8_t* bytes = static_cast<uint8_t*>(buffer);
+
+    while (size > 0) {
+        ssize_t n = recv(fd, bytes, size, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            return false;
+        }
+
+        bytes += n;
+        size  -= static_cast<std::size_t>(n);
+    }
+
+    return true;
+}
+
+
+static bool WriteAll(int fd, const void* buffer, std::size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(buffer);
+
+    while (size > 0) {
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            return false;
+        }
+
+        bytes += n;
+        size  -= static_cast<std::size_t>(n);
+    }
+
+    return true;
+}
+
+
+static bool FillUnixAddress(const char* socket_path, sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        std::cerr << "Socket path too long: " << socket_path << std::endl;
+        return false;
+    }
+    strcpy(addr->sun_path, socket_path);
+
+    return true;
+}
+
+//================================ LatencyStats ================================
+
+LatencyStats::LatencyStats(std::size_t window)
+    : mutex_     (),
+      window_    (),
+      n_requests_(0),
+      n_batches_ (0) {
+
+    assert(window > 0);
+    window_.reserve(window);
+}
+
+
+LatencyStats::~LatencyStats() {
+}
+
+
+// The window is a ring: the latency of request i lands in slot i % window.
+void LatencyStats::AddBatch(const double* latencies, std::size_t n_requests) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (std::size_t i = 0; i < n_requests; i++) {
+        if (window_.size() < window_.capacity()) {
+            window_.push_back(latencies[i]);
+        } else {
+            window_[(n_requests_ + i) % window_.size()] = latencies[i];
+        }
+    }
+
+    n_requests_ += n_requests;
+    n_batches_++;
+}
+
+
+LatencySummary LatencyStats::GetSummary() const {
+    std::vector<double> sorted;
+    LatencySummary      summary = {};
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        sorted             = window_;
+        summary.n_requests = n_requests_;
+        summary.n_batches  = n_batches_;
+        summary.mean_batch = n_batches_ ? static_cast<double>(n_requests_) / static_cast<double>(n_batches_) : 0.0;
+    }
+
+    if (sorted.empty()) {
+        return summary;
+    }
+
+    std::sort(sorted.begin(), sorted.end());
+
+    auto percentile = [&](double p) {
+        std::size_t rank = static_cast<std::size_t>(p / 100.0 * static_cast<double>(sorted.size() - 1) + 0.5);
+        return sorted[rank];
+    };
+    summary.p50 = percentile(50.0);
+    summary.p90 = percentile(90.0);
+    summary.p99 = percentile(99.0);
+    summary.max = sorted.back();
+
+    return summary;
+}
+
+//============================== InferenceServer ===============================
+
+InferenceServer::InferenceServer(const InferenceModel* model, const char* socket_path,
+                                 std::size_t max_batch, std::chrono::microseconds max_delay,
+                                 std::size_t cache_capacity)
+    : model_      (model),
+      socket_path_(socket_path),
+      max_batch_  (max_batch),
+      max_delay_  (std::chrono::duration_cast<Clock::duration>(max_delay)),
+      listen_fd_  (-1),
+      stopping_   (false),
+      batch_inputs_(max_batch * model->GetInputsCount(), 0.0f),
+      cache_       (cache_capacity > 0 ? std::make_unique<InferenceCache>(model->GetInputsCount(),
+                                                                          model->GetOutputsCount(),
+                                                                          cache_capacity)
+                                       : nullptr) {
+
+    assert(!model_->IsEmpty());
+    assert(max_batch_ > 0);
+
+    for (std::size_t size = 1; ; size *= 2) {
+        contexts_.push_back(std::make_unique<InferenceContext>(model_, std::min(size, max_batch_)));
+        if (size >= max_batch_) {
+            break;
+        }
+    }
+
+    sockaddr_un addr;
+    if (!FillUnixAddress(socket_path, &addr)) {
+        return;
+    }
+
+    unlink(socket_path);
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ == -1 ||
+        bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+        listen(listen_fd_, SOMAXCONN) == -1) {
+        std::cerr << "Can't listen on " << socket_path << ": " << strerror(errno) << std::endl;
+        if (listen_fd_ != -1) {
+            close(listen_fd_);
+            listen_fd_ = -1;
+        }
+    }
+}
+
+
+InferenceServer::~InferenceServer() {
+    if (listen_fd_ != -1) {
+        close(listen_fd_);
+        unlink(socket_path_.c_str());
+    }
+}
+
+
+bool InferenceServer::IsOpen() const { return listen_fd_ != -1; }
+
+
+LatencySummary        InferenceServer::GetLatencySummary() const { return stats_.GetSummary(); }
+const InferenceCache* InferenceServer::GetCache()          const { return cache_.get();       }
+
+
+void InferenceServer::Stop() {
+    stopping_ = true;
+
+    // Wakes the accept() of Serve().
+    if (listen_fd_ != -1) {
+        shutdown(listen_fd_, SHUT_RDWR);
+    }
+}
+
+
+void InferenceServer::Serve() {
+    assert(IsOpen());
+
+    std::thread batcher(&InferenceServer::BatchLoop_, this);
+
+    while (!stopping_) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (!stopping_) {
+                std::cerr << "Can't accept on " << socket_path_ << ": " << strerror(errno) << std::endl;
+            }
+            break;
+        }
+
+        ReapConnections_(false);
+
+        connections_.emplace_back();
+        Connection* connection = &connections_.back();
+        connection->fd       = fd;
+        connection->finished = false;
+        connection->thread   = std::thread(&InferenceServer::ServeConnection_, this, connection);
+    }
+
+    // Unblocks the connection threads' reads; a request already queued is
+    // still answered by the batching thread, which stops after them.
+    ReapConnections_(true);
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        stopping_ = true;
+    }
+    queue_changed_.notify_all();
+    batcher.join();
+}
+
+
+void InferenceServer::ReapConnections_(bool all) {
+    for (auto it = connections_.begin(); it != connections_.end(); ) {
+        if (all) {
+            shutdown(it->fd, SHUT_RDWR);
+        } else if (!it->finished) {
+            ++it;
+            continue;
+        }
+
+        it->thread.join();
+        close(it->fd);
+        it = connections_.erase(it);
+    }
+}
+
+
+void InferenceServer::ServeConnection_(Connection* connection) {
+    const std::size_t n_inputs  = model_->GetInputsCount();
+    const std::size_t n_outputs = model_->GetOutputsCount();
+
+    std::vector<float> inputs(n_inputs);
+    std::vector<float> outputs(std::max(n_outputs, kLatencySummaryValues));
+
+    InferenceRequestHeader request = {};
+    while (ReadAll(connection->fd, &request, sizeof(request))) {
+        bool is_predict = request.type == static_cast<uint32_t>(InferenceRequestType::Predict) &&
+                          request.n_values == n_inputs;
+        bool is_stats   = request.type == static_cast<uint32_t>(InferenceRequestType::Stats) &&
+                          request.n_values == 0;
+
+        // The payload of a malformed request is not read: its length can't
+        // be trusted, so the stream can't be resynchronized either.
+        if (!is_predict && !is_stats) {
+            InferenceResponseHeader response = {static_cast<uint32_t>(InferenceStatus::BadRequest), 0};
+            WriteAll(connection->fd, &response, sizeof(response));
+            break;
+        }
+
+        InferenceResponseHeader response = {static_cast<uint32_t>(InferenceStatus::Ok), 0};
+        InferenceStatsCounters  counters = {};
+
+        if (is_predict) {
+            if (!ReadAll(connection->fd, inputs.data(), n_inputs * sizeof(float))) {
+                break;
+            }
+            if (!cache_ || !cache_->Lookup(model_->GetVersion(), inputs.data(), outputs.data())) {
+                Predict_(inputs.data(), outputs.data());
+                if (cache_) {
+                    cache_->Insert(model_->GetVersion(), inputs.data(), outputs.data());
+                }
+            }
+            response.n_values = static_cast<uint32_t>(n_outputs);
+        } else {
+            LatencySummary summary = GetLatencySummary();
+            counters.n_requests = summary.n_requests;
+            counters.n_batches  = summary.n_batches;
+            outputs[0] = static_cast<float>(summary.p50 * 1e6);
+            outputs[1] = static_cast<float>(summary.p90 * 1e6);
+            outputs[2] = static_cast<float>(summary.p99 * 1e6);
+            outputs[3] = static_cast<float>(summary.max * 1e6);
+            response.n_values = static_cast<uint32_t>(kLatencySummaryValues);
+        }
+
+        if (!WriteAll(connection->fd, &response, sizeof(response)) ||
+            (is_stats && !WriteAll(connection->fd, &counters, sizeof(counters))) ||
+            !WriteAll(connection->fd, outputs.data(), response.n_values * sizeof(float))) {
+            break;
+        }
+    }
+
+    // The descriptor is closed by the reaper, the peer sees EOF now.
+    shutdown(connection->fd, SHUT_RDWR);
+    connection->finished = true;
+}
+
+
+void InferenceServer::Predict_(const float* inputs, float* outputs) {
+    Request request = {inputs, outputs, Clock::now(), false};
+
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    queue_.push_back(&request);
+    queue_changed_.notify_all();
+
+    requests_done_.wait(lock, [&] { return request.done; });
+}
+
+
+void InferenceServer::BatchLoop_() {
+    std::vector<Request*> batch;
+    batch.reserve(max_batch_);
+
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    while (true) {
+        queue_changed_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            break;
+        }
+
+        // Waits for more requests until the batch is full or the oldest
+        // one's deadline has come.
+        Clock::time_point deadline = queue_.front()->arrival + max_delay_;
+        queue_changed_.wait_until(lock, deadline, [this] {
+            return stopping_ || queue_.size() >= max_batch_;
+        });
+
+        std::size_t n_requests = std::min(queue_.size(), max_batch_);
+        batch.assign(queue_.begin(), queue_.begin() + static_cast<std::ptrdiff_t>(n_requests));
+        queue_.erase(queue_.begin(), queue_.begin() + static_cast<std::ptrdiff_t>(n_requests));
+
+        lock.unlock();
+        EvalBatch_(batch.data(), n_requests);
+        lock.lock();
+
+        for (Request* request : batch) {
+            request->done = true;
+        }
+        requests_done_.notify_all();
+    }
+}
+
+
+void InferenceServer::EvalBatch_(Request* const* requests, std::size_t n_requests) {
+    const std::size_t n_inputs  = model_->GetInputsCount();
+    const std::size_t n_outputs = model_->GetOutputsCount();
+
+    InferenceContext* context = nullptr;
+    for (const std::unique_ptr<InferenceContext>& candidate : contexts_) {
+        if (candidate->GetExamplesCount() >= n_requests) {
+            context = candidate.get();
+            break;
+        }
+    }
+    assert(context);
+
+    // Rows past n_requests hold a previous batch's inputs, their outputs
+    // are not used.
+    for (std::size_t i = 0; i < n_requests; i++) {
+        std::copy(requests[i]->inputs, requests[i]->inputs + n_inputs,
+                  batch_inputs_.data() + i * n_inputs);
+    }
+
+    context->Eval(batch_inputs_.data());
+
+    const float*        outputs = context->GetOutputs();
+    Clock::time_point   now     = Clock::now();
+    std::vector<double> latencies(n_requests);
+
+    for (std::size_t i = 0; i < n_requests; i++) {
+        std::copy(outputs + i * n_outputs, outputs + (i + 1) * n_outputs, requests[i]->outputs);
+        latencies[i] = std::chrono::duration<double>(now - requests[i]->arrival).count();
+    }
+
+    stats_.AddBatch(latencies.data(), n_requests);
+}
+
+//============================== InferenceClient ===============================
+
+InferenceClient::InferenceClient(const char* socket_path)
+    : fd_(-1) {
+
+    sockaddr_un addr;
+    if (!FillUnixAddress(socket_path, &addr)) {
+        return;
+    }
+
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ == -1 || connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+        std::cerr << "Can't connect to " << socket_path << ": " << strerror(errno) << std::endl;
+        if (fd_ != -1) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+}
+
+
+InferenceClient::~InferenceClient() {
+    if (fd_ != -1) close(fd_);
+}
+
+
+bool InferenceClient::IsOpen() const { return fd_ != -1; }
+
+
+bool InferenceClient::Call_(InferenceRequestType type, const float* values, std::size_t n_values,
+                            float* results, std::size_t n_results,
+                            InferenceStatsCounters* counters) {
+    assert(IsOpen());
+
+    InferenceRequestHeader request = {static_cast<uint32_t>(type), static_cast<uint32_t>(n_values)};
+    if (!WriteAll(fd_, &request, sizeof(request)) ||
+        !WriteAll(fd_, values, n_values * sizeof(float))) {
+        return false;
+    }
+
+    InferenceResponseHeader response = {};
+    if (!ReadAll(fd_, &response, sizeof(response))) {
+        return false;
+    }
+
+    // Only an answered Stats request carries the counters.
+    bool ok = response.status == static_cast<uint32_t>(InferenceStatus::Ok);
+    InferenceStatsCounters received_counters = {};
+    if (ok && type == InferenceRequestType::Stats &&
+        !ReadAll(fd_, &received_counters, sizeof(received_counters))) {
+        return false;
+    }
+
+    // Reads what was sent even if unexpected, so the stream stays in sync.
+    std::vector<float> received(response.n_values);
+    if (!ReadAll(fd_, received.data(), received.size() * sizeof(float))) {
+        return false;
+    }
+
+    if (!ok || response.n_values != n_results) {
+        return false;
+    }
+
+    std::copy(received.begin(), received.end(), results);
+    if (counters) {
+        *counters = received_counters;
+    }
+    return true;
+}
+
+
+bool InferenceClient::Predict(const float* inputs, std::size_t n_inputs,
+                              float* outputs, std::size_t n_outputs) {
+    assert(inputs);
+    assert(outputs);
+
+    return Call_(InferenceRequestType::Predict, inputs, n_inputs, outputs, n_outputs);
+}
+
+
+bool InferenceClient::GetStats(LatencySummary* summary) {
+    assert(summary);
+
+    InferenceStatsCounters counters                       = {};
+    float                  values[kLatencySummaryValues] = {};
+    if (!Call_(InferenceRequestType::Stats, nullptr, 0, values, kLatencySummaryValues, &counters)) {
+        return false;
+    }
+
+    summary->n_requests = static_cast<std::size_t>(counters.n_requests);
+    summary->n_batches  = static_cast<std::size_t>(counters.n_batches);
+    summary->p50        = values[0] * 1e-6;
+    summary->p90        = values[1] * 1e-6;
+    summary->p99        = values[2] * 1e-6;
+    summary->max        = values[3] * 1e-6;
+    summary->mean_batch = counters.n_batches ? static_cast<double>(counters.n_requests) /
+                                               static_cast<double>(counters.n_batches) : 0.0;
+
+    return true;
+}
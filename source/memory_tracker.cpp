@@ -0,0 +1,318 @@
+#include "../include/memory_tracker.h"
+
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+struct Buffer {
+    std::size_t bytes;
+    const char* tag; // Interned
+    MemoryRole  role;
+};
+
+struct Counter {
+    std::size_t current_bytes = 0;
+    std::size_t peak_bytes    = 0;
+    std::size_t n_buffers     = 0;
+
+    void Add(std::size_t bytes) {
+        current_bytes += bytes;
+        n_buffers     += 1;
+        if (current_bytes > peak_bytes) {
+            peak_bytes = current_bytes;
+        }
+    }
+
+    void Remove(std::size_t bytes) {
+        assert(current_bytes >= bytes);
+        current_bytes -= bytes;
+        n_buffers     -= 1;
+    }
+
+    MemoryUsage GetUsage() const {
+        return {current_bytes, peak_bytes, n_buffers};
+    }
+};
+
+struct MemoryRegistry {
+    std::mutex mutex;
+
+    std::unordered_map<const void*, Buffer> buffers;
+    std::set<std::string>                   tags;
+
+    Counter                                           total;
+    Counter                                           roles[kMemoryRolesCount];
+    std::map<std::pair<std::string, MemoryRole>, Counter> tag_roles;
+
+    std::size_t                budget_bytes = 0;
+    MemoryTracker::BudgetHook  budget_hook;
+};
+
+MemoryRegistry& GetRegistry() {
+    static MemoryRegistry registry;
+    return registry;
+}
+
+
+const char* InternTagLocked(MemoryRegistry& registry, const char* tag) {
+    return registry.tags.insert(tag ? tag : "").first->c_str();
+}
+
+
+void AddBufferLocked(MemoryRegistry& registry, const void* data, const Buffer& buffer) {
+    registry.buffers[data] = buffer;
+    registry.total.Add(buffer.bytes);
+    registry.roles[static_cast<std::size_t>(buffer.role)].Add(buffer.bytes);
+    registry.tag_roles[{buffer.tag, buffer.role}].Add(buffer.bytes);
+}
+
+
+void RemoveBufferLocked(MemoryRegistry& registry, const Buffer& buffer) {
+    registry.total.Remove(buffer.bytes);
+    registry.roles[static_cast<std::size_t>(buffer.role)].Remove(buffer.bytes);
+    registry.tag_roles[{buffer.tag, buffer.role}].Remove(buffer.bytes);
+}
+
+} // namespace
+
+
+const char* MemoryRoleString(MemoryRole role) {
+    switch (role) {
+        case MemoryRole::Weights:        return "weights";
+        case MemoryRole::Activation:     return "activation";
+        case MemoryRole::Grad:           return "grad";
+        case MemoryRole::Target:         return "target";
+        case MemoryRole::OptimizerState: return "optimizer state";
+        case MemoryRole::Other:          return "other";
+        default:                         return "?";
+    }
+}
+
+
+// The hook runs without the lock, it may well inspect the tracker.
+void MemoryTracker::CheckBudget(std::size_t bytes) {
+    MemoryRegistry& registry = GetRegistry();
+
+    std::size_t               current = 0;
+    std::size_t               budget  = 0;
+    MemoryTracker::BudgetHook hook;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (registry.budget_bytes == 0 ||
+            registry.total.current_bytes + bytes <= registry.budget_bytes) {
+            return;
+        }
+
+        current = registry.total.current_bytes;
+        budget  = registry.budget_bytes;
+        hook    = registry.budget_hook;
+    }
+
+    if (hook) {
+        hook(bytes, current, budget);
+        return;
+    }
+
+    std::cerr << "Memory budget exceeded: " << bytes << " more bytes requested, "
+              << current << " of " << budget << " in use\n";
+    Dump(std::cerr);
+    abort();
+}
+
+
+// A buffer registered again (e.g. resized in place) only adds the growth.
+void MemoryTracker::Register(const void* data, std::size_t bytes, const char* tag, MemoryRole role) {
+    assert(data);
+
+    MemoryRegistry& registry = GetRegistry();
+
+    std::size_t old_bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        auto it = registry.buffers.find(data);
+        if (it != registry.buffers.end()) {
+            old_bytes = it->second.bytes;
+        }
+    }
+
+    if (bytes > old_bytes) {
+        CheckBudget(bytes - old_bytes);
+    }
+
+    RegisterChecked_(data, bytes, tag, role);
+}
+
+
+void MemoryTracker::RegisterChecked_(const void* data, std::size_t bytes, const char* tag, MemoryRole role) {
+    assert(data);
+
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    auto it = registry.buffers.find(data);
+    if (it != registry.buffers.end()) {
+        RemoveBufferLocked(registry, it->second);
+    }
+
+    AddBufferLocked(registry, data, {bytes, InternTagLocked(registry, tag), role});
+}
+
+
+void MemoryTracker::Unregister(const void* data) {
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    auto it = registry.buffers.find(data);
+    if (it == registry.buffers.end()) {
+        return;
+    }
+
+    RemoveBufferLocked(registry, it->second);
+    registry.buffers.erase(it);
+}
+
+
+void MemoryTracker::Retag(const void* data, const char* tag, MemoryRole role) {
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    auto it = registry.buffers.find(data);
+    if (it == registry.buffers.end()) {
+        return;
+    }
+
+    Buffer buffer = it->second;
+    RemoveBufferLocked(registry, buffer);
+
+    buffer.tag  = InternTagLocked(registry, tag);
+    buffer.role = role;
+    AddBufferLocked(registry, data, buffer);
+}
+
+
+const char* MemoryTracker::InternTag(const char* tag) {
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    return InternTagLocked(registry, tag);
+}
+
+
+MemoryUsage MemoryTracker::GetTotalUsage() {
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    return registry.total.GetUsage();
+}
+
+
+MemoryUsage MemoryTracker::GetRoleUsage(MemoryRole role) {
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    return registry.roles[static_cast<std::size_t>(role)].GetUsage();
+}
+
+
+// Sum over the tag's roles; the peak is the sum of the per-role peaks, an
+// upper bound of the tag's own.
+MemoryUsage MemoryTracker::GetTagUsage(const char* tag) {
+    assert(tag);
+
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    MemoryUsage usage = {};
+    for (const auto& item : registry.tag_roles) {
+        if (item.first.first == tag) {
+            usage.current_bytes += item.second.current_bytes;
+            usage.peak_bytes    += item.second.peak_bytes;
+            usage.n_buffers     += item.second.n_buffers;
+        }
+    }
+
+    return usage;
+}
+
+
+void MemoryTracker::ResetPeaks() {
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    registry.total.peak_bytes = registry.total.current_bytes;
+    for (Counter& counter : registry.roles) {
+        counter.peak_bytes = counter.current_bytes;
+    }
+    for (auto& item : registry.tag_roles) {
+        item.second.peak_bytes = item.second.current_bytes;
+    }
+}
+
+
+void MemoryTracker::SetBudget(std::size_t budget_bytes, BudgetHook hook) {
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    registry.budget_bytes = budget_bytes;
+    registry.budget_hook  = std::move(hook);
+}
+
+
+void MemoryTracker::Dump(std::ostream& out) {
+    MemoryRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    const double kMiB = 1024.0 * 1024.0;
+    char line[160] = {};
+
+    snprintf(line, sizeof(line), "%-20s %-16s %8s %12s %12s\n",
+             "tag", "role", "buffers", "current, MiB", "peak, MiB");
+    out << line;
+
+    for (const auto& item : registry.tag_roles) {
+        // Retagged and freed buffers leave empty rows behind, their bytes
+        // are still in the per-role and total peaks below.
+        const Counter& counter = item.second;
+        if (counter.n_buffers == 0) {
+            continue;
+        }
+
+        snprintf(line, sizeof(line), "%-20s %-16s %8zu %12.3f %12.3f\n",
+                 item.first.first.c_str(), MemoryRoleString(item.first.second), counter.n_buffers,
+                 static_cast<double>(counter.current_bytes) / kMiB,
+                 static_cast<double>(counter.peak_bytes)    / kMiB);
+        out << line;
+    }
+
+    out << "\n";
+    for (std::size_t i = 0; i < kMemoryRolesCount; i++) {
+        const Counter& counter = registry.roles[i];
+
+        snprintf(line, sizeof(line), "%-20s %-16s %8zu %12.3f %12.3f\n",
+                 "*", MemoryRoleString(static_cast<MemoryRole>(i)), counter.n_buffers,
+                 static_cast<double>(counter.current_bytes) / kMiB,
+                 static_cast<double>(counter.peak_bytes)    / kMiB);
+        out << line;
+    }
+
+    snprintf(line, sizeof(line), "%-20s %-16s %8zu %12.3f %12.3f\n",
+             "*", "total", registry.total.n_buffers,
+             static_cast<double>(registry.total.current_bytes) / kMiB,
+             static_cast<double>(registry.total.peak_bytes)    / kMiB);
+    out << line;
+
+    if (registry.budget_bytes) {
+        snprintf(line, sizeof(line), "budget: %.3f MiB\n",
+                 static_cast<double>(registry.budget_bytes) / kMiB);
+        out << line;
+    }
+}
@@ -0,0 +1,196 @@
+#include "../include/optimizer.h"
+#include "../include/profiler.h"
+
+#include <assert.h>
+#include <cmath>
+
+//================================ Optimizer ==================================
+
+Optimizer::Optimizer(float learning_rate)
+    : learning_rate_(learning_rate),
+      n_steps_(0) {
+}
+
+
+Optimizer::~Optimizer() {
+    for (const std::vector<float>& state : states_) {
+        MemoryTracker::Unregister(state.data());
+    }
+}
+
+
+void Optimizer::AddParam(SmartMatrix* param) {
+    assert(param);
+
+    std::size_t n_elems = param->GetRows() * param->GetCols();
+
+    params_.push_back(param);
+    for (std::size_t i = 0; i < GetStatesCount(); i++) {
+        states_.emplace_back(n_elems, 0.0f);
+
+        if (n_elems) {
+            MemoryTracker::Register(states_.back().data(), n_elems * sizeof(float),
+                                    "optimizer", MemoryRole::OptimizerState);
+        }
+    }
+}
+
+
+void Optimizer::Step() {
+    PROFILE_SCOPE("Optimizer::Step", "update", params_.size(), 1, 0, 0);
+
+    n_steps_++;
+    BeginStep();
+
+    std::size_t n_states = GetStatesCount();
+    state_ptrs_.resize(n_states);
+
+    for (std::size_t i = 0; i < params_.size(); i++) {
+        SmartMatrix* param = params_[i];
+
+        for (std::size_t j = 0; j < n_states; j++) {
+            state_ptrs_[j] = states_[i * n_states + j].data();
+        }
+
+        Update(param->GetRows() * param->GetCols(), param->GetMutableValues(),
+               param->GetGrads(), state_ptrs_.data());
+        param->MarkValuesChanged();
+    }
+}
+
+
+void Optimizer::BeginStep() {
+}
+
+
+void  Optimizer::SetLearningRate(float learning_rate) { learning_rate_ = learning_rate; }
+float Optimizer::GetLearningRate() const              { return learning_rate_; }
+
+std::size_t Optimizer::GetStepsCount() const { return n_steps_; }
+
+//================================ SGD ========================================
+
+SGD::SGD(float learning_rate, float momentum, bool nesterov, float weight_decay)
+    : Optimizer    (learning_rate),
+      momentum_    (momentum),
+      nesterov_    (nesterov),
+      weight_decay_(weight_decay) {
+
+    assert(!nesterov || momentum > 0.0f);
+}
+
+
+SGD::~SGD() {
+}
+
+
+std::size_t SGD::GetStatesCount() const {
+    return momentum_ > 0.0f ? 1 : 0;
+}
+
+
+void SGD::Update(std::size_t n_elems, float* values, const float* grads,
+                 float* const* states) {
+    float* __restrict__       w  = values;
+    const float* __restrict__ g  = grads;
+    const float lr = learning_rate_;
+    const float wd = weight_decay_;
+    const float mu = momentum_;
+
+    if (GetStatesCount() == 0) {
+        for (std::size_t i = 0; i < n_elems; i++) {
+            w[i] -= lr * (g[i] + wd * w[i]);
+        }
+        return;
+    }
+
+    float* __restrict__ v = states[0];
+
+    if (nesterov_) {
+        for (std::size_t i = 0; i < n_elems; i++) {
+            float grad     = g[i] + wd * w[i];
+            float velocity = mu * v[i] + grad;
+            v[i]  = velocity;
+            w[i] -= lr * (grad + mu * velocity);
+        }
+    } else {
+        for (std::size_t i = 0; i < n_elems; i++) {
+            float velocity = mu * v[i] + g[i] + wd * w[i];
+            v[i]  = velocity;
+            w[i] -= lr * velocity;
+        }
+    }
+}
+
+//================================ Adam =======================================
+
+Adam::Adam(float learning_rate, float beta1, float beta2, float epsilon,
+           float weight_decay, bool decoupled_weight_decay)
+    : Optimizer              (learning_rate),
+      beta1_                 (beta1),
+      beta2_                 (beta2),
+      epsilon_               (epsilon),
+      weight_decay_          (weight_decay),
+      decoupled_weight_decay_(decoupled_weight_decay),
+      step_size_             (0.0f),
+      bias_correction2_sqrt_ (1.0f) {
+}
+
+
+Adam::~Adam() {
+}
+
+
+std::size_t Adam::GetStatesCount() const {
+    return 2;
+}
+
+
+// Bias corrections only depend on the step, so they are folded into
+// step_size_ here instead of being recomputed per element.
+void Adam::BeginStep() {
+    float step = static_cast<float>(n_steps_);
+    float bias_correction1 = 1.0f - powf(beta1_, step);
+    float bias_correction2 = 1.0f - powf(beta2_, step);
+
+    step_size_             = learning_rate_ / bias_correction1;
+    bias_correction2_sqrt_ = sqrtf(bias_correction2);
+}
+
+
+void Adam::Update(std::size_t n_elems, float* values, const float* grads,
+                  float* const* states) {
+    float* __restrict__       w = values;
+    const float* __restrict__ g = grads;
+    float* __restrict__       m = states[0];
+    float* __restrict__       v = states[1];
+
+    const float b1        = beta1_;
+    const float b2        = beta2_;
+    const float eps       = epsilon_ * bias_correction2_sqrt_;
+    const float step_size = step_size_ * bias_correction2_sqrt_;
+    const float l2        = decoupled_weight_decay_ ? 0.0f : weight_decay_;
+    const float decay     = decoupled_weight_decay_ ? 1.0f - learning_rate_ * weight_decay_
+                                                    : 1.0f;
+
+    // w -= lr / bc1 * m / (sqrt(v / bc2) + eps), rewritten to keep one sqrt
+    // and one division per element.
+    for (std::size_t i = 0; i < n_elems; i++) {
+        float grad = g[i] + l2 * w[i];
+        float m_i  = b1 * m[i] + (1.0f - b1) * grad;
+        float v_i  = b2 * v[i] + (1.0f - b2) * grad * grad;
+        m[i] = m_i;
+        v[i] = v_i;
+        w[i] = w[i] * decay - step_size * m_i / (sqrtf(v_i) + eps);
+    }
+}
+
+//================================ AdamW ======================================
+
+AdamW::AdamW(float learning_rate, float weight_decay, float beta1, float beta2, float epsilon)
+    : Adam(learning_rate, beta1, beta2, epsilon, weight_decay, true) {
+}
+
+
+AdamW::~AdamW() {
+}
@@ -0,0 +1,75 @@
+#include "../include/parallel.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+ThreadPool* GetSharedThreadPool() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+
+    return &pool;
+}
+
+
+void ParallelFor(std::size_t n, std::size_t grain,
+                 const std::function<void(std::size_t begin, std::size_t end)>& body) {
+    assert(grain > 0);
+
+    if (n <= grain) {
+        if (n > 0) {
+            body(0, n);
+        }
+        return;
+    }
+
+    std::size_t n_chunks = (n + grain - 1) / grain;
+
+    GetSharedThreadPool()->Run(n_chunks, [&](std::size_t chunk) {
+        std::size_t begin = chunk * grain;
+        body(begin, std::min(begin + grain, n));
+    });
+}
+
+
+template <typename T>
+void ParallelReduce(std::size_t n, std::size_t grain, std::size_t width, T* result,
+                    const typename ReduceBody<T>::Type& body) {
+    assert(grain > 0);
+    assert(result || width == 0);
+
+    std::fill(result, result + width, T(0));
+
+    if (n <= grain) {
+        if (n > 0) {
+            body(0, n, result);
+        }
+        return;
+    }
+
+    std::size_t n_chunks = (n + grain - 1) / grain;
+    std::vector<T> partials(n_chunks * width, T(0));
+
+    GetSharedThreadPool()->Run(n_chunks, [&](std::size_t chunk) {
+        std::size_t begin = chunk * grain;
+        body(begin, std::min(begin + grain, n), partials.data() + chunk * width);
+    });
+
+    for (std::size_t stride = 1; stride < n_chunks; stride *= 2) {
+        for (std::size_t chunk = 0; chunk + stride < n_chunks; chunk += 2 * stride) {
+            T*       dst = partials.data() +  chunk           * width;
+            const T* src = partials.data() + (chunk + stride) * width;
+            for (std::size_t i = 0; i < width; i++) {
+                dst[i] += src[i];
+            }
+        }
+    }
+
+    std::copy(partials.begin(), partials.begin() + static_cast<std::ptrdiff_t>(width), result);
+}
+
+
+template void ParallelReduce<float> (std::size_t n, std::size_t grain, std::size_t width, float* result,
+                                     const ReduceBody<float>::Type& body);
+template void ParallelReduce<double>(std::size_t n, std::size_t grain, std::size_t width, double* result,
+                                     const ReduceBody<double>::Type& body);
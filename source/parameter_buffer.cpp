@@ -0,0 +1,159 @@
+#include "../include/parameter_buffer.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <cmath>
+
+static const std::size_t kParamAlignment = kCheckpointAlignment / sizeof(float);
+
+
+static std::size_t ComputeLayout(const std::vector<SmartMatrix*>& params,
+                                 std::vector<std::size_t>* offsets) {
+    std::size_t size = 0;
+    for (const SmartMatrix* param : params) {
+        assert(param);
+
+        offsets->push_back(size);
+        size += param->GetRows() * param->GetCols();
+        size = (size + kParamAlignment - 1) / kParamAlignment * kParamAlignment;
+    }
+
+    return size;
+}
+
+
+ParameterBuffer::ParameterBuffer(const std::vector<SmartMatrix*>& params)
+    : params_        (params),
+      offsets_       (),
+      size_          (ComputeLayout(params, &offsets_)),
+      values_storage_(size_, 0.0f),
+      grads_storage_ (size_, 0.0f),
+      values_        (values_storage_.data()),
+      flat_          (1, size_) {
+
+    for (std::size_t i = 0; i < params_.size(); i++) {
+        const float* values = params_[i]->GetValues();
+        std::size_t  size   = params_[i]->GetRows() * params_[i]->GetCols();
+
+        std::copy(values, values + size, values_ + offsets_[i]);
+    }
+
+    flat_.MapGrads(grads_storage_.data());
+    MapParams_();
+
+    if (size_) {
+        MemoryTracker::Register(values_storage_.data(), size_ * sizeof(float),
+                                "parameters", MemoryRole::Weights);
+        MemoryTracker::Register(grads_storage_.data(),  size_ * sizeof(float),
+                                "parameters", MemoryRole::Grad);
+    }
+}
+
+
+ParameterBuffer::~ParameterBuffer() {
+    MemoryTracker::Unregister(values_storage_.data());
+    MemoryTracker::Unregister(grads_storage_.data());
+}
+
+
+void ParameterBuffer::MapParams_() {
+    flat_.MapValues(values_);
+
+    for (std::size_t i = 0; i < params_.size(); i++) {
+        params_[i]->MapValues(values_                + offsets_[i]);
+        params_[i]->MapGrads (grads_storage_.data()  + offsets_[i]);
+    }
+}
+
+
+SmartMatrix* ParameterBuffer::GetFlat() { return &flat_; }
+
+std::size_t ParameterBuffer::GetSize()        const { return size_;           }
+std::size_t ParameterBuffer::GetParamsCount() const { return params_.size();  }
+float*      ParameterBuffer::GetValues()            { return values_;         }
+float*      ParameterBuffer::GetGrads()             { return grads_storage_.data(); }
+
+
+// Every generation only grows, so the sum changes with any of them.
+uint64_t ParameterBuffer::GetGeneration() const {
+    uint64_t generation = flat_.GetValuesGeneration();
+    for (const SmartMatrix* param : params_) {
+        generation += param->GetValuesGeneration();
+    }
+
+    return generation;
+}
+
+
+std::size_t ParameterBuffer::GetParamOffset(std::size_t param) const {
+    assert(param < offsets_.size());
+    return offsets_[param];
+}
+
+
+void ParameterBuffer::ResetGrads() {
+    std::fill(grads_storage_.begin(), grads_storage_.end(), 0.0f);
+}
+
+
+float ParameterBuffer::GetGradNorm() const {
+    const float* grads = grads_storage_.data();
+
+    double sum = 0.0;
+    for (std::size_t i = 0; i < size_; i++) {
+        sum += static_cast<double>(grads[i] * grads[i]);
+    }
+
+    return static_cast<float>(sqrt(sum));
+}
+
+
+float ParameterBuffer::ClipGradNorm(float max_norm) {
+    float norm = GetGradNorm();
+    if (norm <= max_norm) {
+        return norm;
+    }
+
+    float  scale = max_norm / norm;
+    float* grads = grads_storage_.data();
+    for (std::size_t i = 0; i < size_; i++) {
+        grads[i] *= scale;
+    }
+
+    return norm;
+}
+
+
+CheckpointError ParameterBuffer::MapCheckpoint(const CheckpointReader& reader) {
+    if (reader.GetTensorsCount() != params_.size() || params_.empty()) {
+        return CheckpointError::ShapeMismatch;
+    }
+
+    const CheckpointTensorInfo* first = reader.GetTensor(0);
+    for (std::size_t i = 0; i < params_.size(); i++) {
+        const CheckpointTensorInfo* info = reader.GetTensor(i);
+
+        if (info->rows != params_[i]->GetRows() ||
+            info->cols != params_[i]->GetCols() ||
+            info->offset - first->offset != offsets_[i] * sizeof(float)) {
+            return CheckpointError::ShapeMismatch;
+        }
+    }
+
+    // The padding after the last tensor is mapped as part of the buffer.
+    if (first->offset + size_ * sizeof(float) > reader.GetFileSize()) {
+        return CheckpointError::ShapeMismatch;
+    }
+
+    MapValues(reader.GetTensorData(first));
+
+    return CheckpointError::Ok;
+}
+
+
+void ParameterBuffer::MapValues(float* values) {
+    assert(values);
+
+    values_ = values;
+    MapParams_();
+}
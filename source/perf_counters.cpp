@@ -0,0 +1,416 @@
+#include "../include/perf_counters.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+const std::size_t kCacheLineSize = 64;
+
+// Descriptors of one thread's counters, opened on its first read. Inherited
+// ones also count the threads started later by this one, e.g. a pool's
+// workers.
+class ThreadCounters {
+    public:
+        explicit ThreadCounters(bool inherit);
+        ~ThreadCounters();
+
+        ThreadCounters(const ThreadCounters& other)            = delete;
+        ThreadCounters& operator=(const ThreadCounters& other) = delete;
+
+        bool IsAvailable() const;
+        void Read(double counters[kPerfEventsCount]) const;
+
+    private:
+        int fds_[kPerfEventsCount];
+};
+
+
+uint64_t GetCacheConfig(uint64_t cache, uint64_t result) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+
+
+ThreadCounters::ThreadCounters(bool inherit) {
+    struct EventConfig {
+        uint32_t type;
+        uint64_t config;
+    };
+
+    const EventConfig kConfigs[kPerfEventsCount] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, GetCacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+        {PERF_TYPE_HW_CACHE, GetCacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+
+    for (std::size_t i = 0; i < kPerfEventsCount; i++) {
+        perf_event_attr attr = {};
+        attr.size           = sizeof(attr);
+        attr.type           = kConfigs[i].type;
+        attr.config         = kConfigs[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        attr.inherit        = inherit ? 1 : 0;
+        attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+}
+
+
+ThreadCounters::~ThreadCounters() {
+    for (int fd : fds_) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+
+bool ThreadCounters::IsAvailable() const {
+    return std::any_of(fds_, fds_ + kPerfEventsCount, [](int fd) { return fd >= 0; });
+}
+
+
+// More events than hardware counters get time-multiplexed, the count is
+// extrapolated to the whole time the event was enabled.
+void ThreadCounters::Read(double counters[kPerfEventsCount]) const {
+    for (std::size_t i = 0; i < kPerfEventsCount; i++) {
+        counters[i] = -1.0;
+
+        uint64_t values[3] = {}; // value, time enabled, time running
+        if (fds_[i] < 0 || read(fds_[i], values, sizeof(values)) != sizeof(values)) {
+            continue;
+        }
+
+        double scale = values[2] ? static_cast<double>(values[1]) / static_cast<double>(values[2]) : 0.0;
+        counters[i] = static_cast<double>(values[0]) * scale;
+    }
+}
+
+
+ThreadCounters& GetThreadCounters() {
+    static thread_local ThreadCounters counters(false);
+    return counters;
+}
+
+
+ThreadCounters& GetInheritedCounters() {
+    static thread_local ThreadCounters counters(true);
+    return counters;
+}
+
+
+struct RegionStats {
+    std::size_t n_threads;
+    std::size_t n_calls;
+    double      seconds;
+    double      flops;
+    double      bytes;
+    double      counters[kPerfEventsCount];
+    bool        has_counter[kPerfEventsCount];
+};
+
+struct PerfRegistry {
+    std::mutex                         mutex;
+    std::map<std::string, RegionStats> regions;
+};
+
+PerfRegistry& GetRegistry() {
+    static PerfRegistry registry;
+    return registry;
+}
+
+
+double GetTimeSeconds() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double>(now).count();
+}
+
+} // namespace
+
+
+bool PerfMonitor::IsAvailable() {
+    bool inherited = GetInheritedCounters().IsAvailable();
+    return GetThreadCounters().IsAvailable() || inherited;
+}
+
+
+void PerfMonitor::ReadCounters(double counters[kPerfEventsCount], bool inherited) {
+    if (inherited) {
+        GetInheritedCounters().Read(counters);
+    } else {
+        GetThreadCounters().Read(counters);
+    }
+}
+
+
+void PerfMonitor::AddSample(const char* region, std::size_t n_threads, double seconds,
+                            const double begin[kPerfEventsCount],
+                            const double end  [kPerfEventsCount],
+                            double flops, double bytes) {
+    assert(region);
+
+    PerfRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    auto inserted = registry.regions.emplace(region, RegionStats());
+    RegionStats& stats = inserted.first->second;
+    if (inserted.second) {
+        stats.n_threads = n_threads;
+        std::fill(stats.has_counter, stats.has_counter + kPerfEventsCount, true);
+    }
+    assert(stats.n_threads == n_threads);
+
+    stats.n_calls += 1;
+    stats.seconds += seconds;
+    stats.flops   += flops;
+    stats.bytes   += bytes;
+
+    for (std::size_t i = 0; i < kPerfEventsCount; i++) {
+        if (begin[i] < 0.0 || end[i] < 0.0) {
+            stats.has_counter[i] = false;
+            continue;
+        }
+        stats.counters[i] += end[i] - begin[i];
+    }
+}
+
+
+void PerfMonitor::Reset() {
+    PerfRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    registry.regions.clear();
+}
+
+
+// Independent multiply-adds in enough accumulators to hide latency, the
+// compiler vectorizes them with the build's instruction set.
+static double MeasureFlops() {
+    const std::size_t kAccumulators = 64;
+    const std::size_t kIterations   = 1 << 20;
+
+    float acc[kAccumulators] = {};
+    for (std::size_t i = 0; i < kAccumulators; i++) {
+        acc[i] = static_cast<float>(i) * 1e-3f;
+    }
+
+    double begin = GetTimeSeconds();
+    for (std::size_t iter = 0; iter < kIterations; iter++) {
+        for (std::size_t i = 0; i < kAccumulators; i++) {
+            acc[i] = acc[i] * 0.999999f + 1e-7f;
+        }
+    }
+    double seconds = GetTimeSeconds() - begin;
+
+    // Keeps the loop from being optimized out.
+    volatile float sink = 0.0f;
+    for (float value : acc) {
+        sink = sink + value;
+    }
+
+    return 2.0 * kAccumulators * kIterations / seconds;
+}
+
+
+// Best of a few streaming reads of n_floats, bytes per second.
+static double MeasureBandwidth(std::size_t n_floats) {
+    std::vector<float> buffer(n_floats, 1.0f);
+
+    double best = 0.0;
+    for (std::size_t rep = 0; rep < 3; rep++) {
+        float sums[8] = {};
+
+        double begin = GetTimeSeconds();
+        for (std::size_t i = 0; i + 8 <= n_floats; i += 8) {
+            for (std::size_t j = 0; j < 8; j++) {
+                sums[j] += buffer[i + j];
+            }
+        }
+        double seconds = GetTimeSeconds() - begin;
+
+        volatile float sink = 0.0f;
+        for (float sum : sums) {
+            sink = sink + sum;
+        }
+
+        best = std::max(best, static_cast<double>(n_floats * sizeof(float)) / seconds);
+    }
+
+    return best;
+}
+
+
+// Runs func on n_threads threads released together and sums their rates.
+template <typename Func>
+static double SumOnThreads(std::size_t n_threads, Func func) {
+    std::vector<double>      rates(n_threads);
+    std::vector<std::thread> threads;
+    std::atomic<std::size_t> n_ready(0);
+
+    for (std::size_t thread = 0; thread < n_threads; thread++) {
+        threads.emplace_back([&, thread] {
+            n_ready++;
+            while (n_ready.load() < n_threads) {
+                std::this_thread::yield();
+            }
+            rates[thread] = func();
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    double sum = 0.0;
+    for (double rate : rates) {
+        sum += rate;
+    }
+
+    return sum;
+}
+
+
+// The stream totals well over the LLC size, split between the threads.
+RooflinePeaks PerfMonitor::MeasurePeaks(std::size_t n_threads) {
+    assert(n_threads > 0);
+
+    const std::size_t kFloats = 32 << 20;
+
+    RooflinePeaks peaks = {};
+    peaks.n_threads = n_threads;
+    peaks.gflops    = SumOnThreads(n_threads, [] { return MeasureFlops(); }) * 1e-9;
+    peaks.gbps      = SumOnThreads(n_threads, [&] { return MeasureBandwidth(kFloats / n_threads); }) * 1e-9;
+
+    return peaks;
+}
+
+
+void PerfMonitor::PrintRoofline(std::ostream& out, const std::vector<RooflinePeaks>& peaks) {
+    PerfRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    char line[320] = {};
+
+    for (const RooflinePeaks& roofs : peaks) {
+        snprintf(line, sizeof(line), "Roofs on %zu threads: %.2f GFLOP/s, %.2f GB/s, ridge at %.2f FLOP/byte\n",
+                 roofs.n_threads, roofs.gflops, roofs.gbps, roofs.gflops / roofs.gbps);
+        out << line;
+    }
+    if (!IsAvailable()) {
+        out << "Hardware counters unavailable\n";
+    }
+
+    snprintf(line, sizeof(line), "%-24s %7s %7s %10s %9s %9s %8s %6s %8s %8s %9s %7s  %s\n",
+             "region", "threads", "calls", "time, ms", "GFLOP/s", "FLOP/B", "LLC GB/s",
+             "IPC", "L1d miss", "LLC miss", "roof", "% roof", "bound");
+    out << line;
+
+    for (const auto& item : registry.regions) {
+        const RegionStats& stats = item.second;
+        const double* counters = stats.counters;
+        const bool*   has      = stats.has_counter;
+
+        auto has_event = [&](PerfEvent event) {
+            return has[static_cast<std::size_t>(event)];
+        };
+        auto get_event = [&](PerfEvent event) {
+            return counters[static_cast<std::size_t>(event)];
+        };
+        auto format_ratio = [&](PerfEvent num, PerfEvent den, bool is_percent,
+                                char* buffer, std::size_t size) {
+            if (!has_event(num) || !has_event(den) || !(get_event(den) > 0.0)) {
+                snprintf(buffer, size, "n/a");
+                return;
+            }
+
+            double ratio = get_event(num) / get_event(den);
+            if (is_percent) {
+                snprintf(buffer, size, "%.1f%%", ratio * 100.0);
+            } else {
+                snprintf(buffer, size, "%.2f", ratio);
+            }
+        };
+
+        char ipc[16]      = {};
+        char l1d_miss[16] = {};
+        char llc_miss[16] = {};
+        char llc_gbps[16] = {};
+        format_ratio(PerfEvent::Instructions, PerfEvent::Cycles,        false, ipc,      sizeof(ipc));
+        format_ratio(PerfEvent::L1dMisses,    PerfEvent::L1dAccesses,   true,  l1d_miss, sizeof(l1d_miss));
+        format_ratio(PerfEvent::LlcMisses,    PerfEvent::LlcReferences, true,  llc_miss, sizeof(llc_miss));
+
+        // Every LLC miss is one line fetched from memory.
+        if (has_event(PerfEvent::LlcMisses) && stats.seconds > 0.0) {
+            snprintf(llc_gbps, sizeof(llc_gbps), "%.2f",
+                     get_event(PerfEvent::LlcMisses) * kCacheLineSize / stats.seconds * 1e-9);
+        } else {
+            snprintf(llc_gbps, sizeof(llc_gbps), "n/a");
+        }
+
+        double gflops    = stats.seconds > 0.0 ? stats.flops / stats.seconds * 1e-9 : 0.0;
+        double intensity = stats.bytes   > 0.0 ? stats.flops / stats.bytes : 0.0;
+
+        char roof[16]         = {};
+        char roof_percent[16] = {};
+        const char* bound     = "n/a";
+
+        auto roofs = std::find_if(peaks.begin(), peaks.end(), [&](const RooflinePeaks& peak) {
+            return peak.n_threads == stats.n_threads;
+        });
+        if (roofs != peaks.end()) {
+            double roof_gflops = std::min(roofs->gflops, intensity * roofs->gbps);
+            snprintf(roof,         sizeof(roof),         "%.2f",   roof_gflops);
+            snprintf(roof_percent, sizeof(roof_percent), "%.1f%%", roof_gflops > 0.0 ? 100.0 * gflops / roof_gflops : 0.0);
+            bound = intensity * roofs->gbps < roofs->gflops ? "memory" : "compute";
+        } else {
+            snprintf(roof,         sizeof(roof),         "n/a");
+            snprintf(roof_percent, sizeof(roof_percent), "n/a");
+        }
+
+        snprintf(line, sizeof(line), "%-24s %7zu %7zu %10.3f %9.2f %9.2f %8s %6s %8s %8s %9s %7s  %s\n",
+                 item.first.c_str(), stats.n_threads, stats.n_calls, stats.seconds * 1e3, gflops,
+                 intensity, llc_gbps, ipc, l1d_miss, llc_miss, roof, roof_percent, bound);
+        out << line;
+    }
+}
+
+//================================= PerfRegion =================================
+
+PerfRegion::PerfRegion(const char* name, std::size_t n_threads, bool inherited,
+                       double flops, double bytes)
+    : name_     (name),
+      n_threads_(n_threads),
+      inherited_(inherited),
+      flops_    (flops),
+      bytes_    (bytes) {
+
+    assert(n_threads > 0);
+
+    PerfMonitor::ReadCounters(begin_, inherited_);
+    begin_time_ = GetTimeSeconds();
+}
+
+
+PerfRegion::~PerfRegion() {
+    double end_time = GetTimeSeconds();
+    double end[kPerfEventsCount] = {};
+    PerfMonitor::ReadCounters(end, inherited_);
+
+    PerfMonitor::AddSample(name_, n_threads_, end_time - begin_time_, begin_, end, flops_, bytes_);
+}
@@ -0,0 +1,205 @@
+#include "../include/profiler.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace {
+
+// Written by its thread only. head counts all events ever recorded, the
+// live ones are [max(tail, head - kRingSize), head).
+struct ProfileRing {
+    std::vector<ProfileEvent> events;
+    std::atomic<uint64_t>     head;
+    uint64_t                  tail;
+    std::size_t               thread_id;
+
+    explicit ProfileRing(std::size_t id)
+        : events(Profiler::kRingSize), head(0), tail(0), thread_id(id) {}
+};
+
+struct ProfileRegistry {
+    std::mutex                                mutex;
+    std::vector<std::unique_ptr<ProfileRing>> rings; // Kept after threads exit
+    std::chrono::steady_clock::time_point     start = std::chrono::steady_clock::now();
+};
+
+ProfileRegistry& GetRegistry() {
+    static ProfileRegistry registry;
+    return registry;
+}
+
+// Takes the registry lock only the first time a thread records.
+ProfileRing* GetThreadRing() {
+    static thread_local ProfileRing* ring = nullptr;
+
+    if (!ring) {
+        ProfileRegistry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        registry.rings.push_back(std::make_unique<ProfileRing>(registry.rings.size()));
+        ring = registry.rings.back().get();
+    }
+
+    return ring;
+}
+
+} // namespace
+
+
+uint64_t Profiler::GetTimeNs() {
+    auto elapsed = std::chrono::steady_clock::now() - GetRegistry().start;
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+
+void Profiler::Record(const ProfileEvent& event) {
+    ProfileRing* ring = GetThreadRing();
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    ring->events[head % kRingSize] = event;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+
+std::vector<ProfileEvent> Profiler::GetEvents(std::vector<std::size_t>* thread_ids) {
+    ProfileRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    std::vector<ProfileEvent> events;
+    if (thread_ids) {
+        thread_ids->clear();
+    }
+
+    for (const auto& ring : registry.rings) {
+        uint64_t head  = ring->head.load(std::memory_order_acquire);
+        uint64_t begin = std::max(ring->tail, head > kRingSize ? head - kRingSize : 0);
+
+        for (uint64_t i = begin; i < head; i++) {
+            events.push_back(ring->events[i % kRingSize]);
+            if (thread_ids) {
+                thread_ids->push_back(ring->thread_id);
+            }
+        }
+    }
+
+    return events;
+}
+
+
+void Profiler::Reset() {
+    ProfileRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    for (const auto& ring : registry.rings) {
+        ring->tail = ring->head.load(std::memory_order_acquire);
+    }
+}
+
+
+bool Profiler::WriteChromeTrace(const char* file_name) {
+    assert(file_name);
+
+    std::vector<std::size_t>  thread_ids;
+    std::vector<ProfileEvent> events = GetEvents(&thread_ids);
+
+    std::ofstream out(file_name);
+    if (!out) {
+        return false;
+    }
+
+    out << "{\"traceEvents\": [\n";
+    char line[512] = {};
+    for (std::size_t i = 0; i < events.size(); i++) {
+        const ProfileEvent& event = events[i];
+
+        snprintf(line, sizeof(line),
+                 "  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %zu, "
+                 "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"rows\": %llu, \"cols\": %llu, "
+                 "\"flops\": %.0f, \"bytes\": %.0f}}%s\n",
+                 event.name, event.category, thread_ids[i],
+                 static_cast<double>(event.begin_ns) * 1e-3,
+                 static_cast<double>(event.end_ns - event.begin_ns) * 1e-3,
+                 static_cast<unsigned long long>(event.rows),
+                 static_cast<unsigned long long>(event.cols),
+                 event.flops, event.bytes, i + 1 < events.size() ? "," : "");
+        out << line;
+    }
+    out << "], \"displayTimeUnit\": \"ms\"}\n";
+
+    return static_cast<bool>(out);
+}
+
+
+void Profiler::PrintSummary(std::ostream& out) {
+    struct OpStats {
+        const char* category;
+        std::size_t count;
+        uint64_t    total_ns;
+        double      flops;
+        double      bytes;
+    };
+
+    std::vector<ProfileEvent> events = GetEvents(nullptr);
+
+    std::map<std::string, OpStats> stats;
+    uint64_t total_ns = 0;
+    for (const ProfileEvent& event : events) {
+        OpStats& op = stats[event.name];
+        op.category  = event.category;
+        op.count    += 1;
+        op.total_ns += event.end_ns - event.begin_ns;
+        op.flops    += event.flops;
+        op.bytes    += event.bytes;
+        total_ns    += event.end_ns - event.begin_ns;
+    }
+
+    std::vector<std::pair<std::string, OpStats>> sorted(stats.begin(), stats.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+        return a.second.total_ns > b.second.total_ns;
+    });
+
+    char line[256] = {};
+    snprintf(line, sizeof(line), "%-32s %-9s %8s %12s %10s %7s %9s %8s\n",
+             "op", "category", "count", "total, ms", "mean, us", "%", "GFLOP/s", "GB/s");
+    out << line;
+
+    for (const auto& item : sorted) {
+        const OpStats& op = item.second;
+        double seconds = static_cast<double>(op.total_ns) * 1e-9;
+
+        snprintf(line, sizeof(line), "%-32s %-9s %8zu %12.3f %10.2f %7.2f %9.2f %8.2f\n",
+                 item.first.c_str(), op.category, op.count, seconds * 1e3,
+                 seconds * 1e6 / static_cast<double>(op.count),
+                 total_ns ? 100.0 * static_cast<double>(op.total_ns) / static_cast<double>(total_ns) : 0.0,
+                 seconds > 0.0 ? op.flops / seconds * 1e-9 : 0.0,
+                 seconds > 0.0 ? op.bytes / seconds * 1e-9 : 0.0);
+        out << line;
+    }
+}
+
+//================================ ProfileScope ================================
+
+ProfileScope::ProfileScope(const char* name, const char* category,
+                           std::size_t rows, std::size_t cols, double flops, double bytes) {
+    event_.name     = name;
+    event_.category = category;
+    event_.rows     = rows;
+    event_.cols     = cols;
+    event_.flops    = flops;
+    event_.bytes    = bytes;
+    event_.end_ns   = 0;
+    event_.begin_ns = Profiler::GetTimeNs();
+}
+
+
+ProfileScope::~ProfileScope() {
+    event_.end_ns = Profiler::GetTimeNs();
+    Profiler::Record(event_);
+}
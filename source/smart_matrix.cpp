@@ -1,47 +1,84 @@
 #include "../include/smart_matrix.h"
+#include "../include/task_scheduler.h"
+#include "../include/parallel.h"
+#include "../include/profiler.h"
+#include "../include/perf_counters.h"
+#include "../include/memory_tracker.h"
+#include "../include/execution_plan.h"
+#include "../include/fused_expr.h"
+#include "../include/mul_kernels.h"
 
 #include <assert.h>
 #include <iostream>
 #include <cmath>
 #include <random>
+#include <algorithm>
+#include <vector>
 
-SmartMatrix::SmartMatrix(std::size_t n_rows, std::size_t n_cols)
+// Below about this many elements an op is not worth waking the pool for.
+static const std::size_t kElemsGrain = 1 << 14;
+
+static std::size_t RowsGrain(std::size_t n_cols) {
+    return std::max<std::size_t>(1, kElemsGrain / std::max<std::size_t>(1, n_cols));
+}
+
+template <typename T>
+SmartMatrixT<T>::SmartMatrixT(std::size_t n_rows, std::size_t n_cols)
     : values_(nullptr),
       grads_(nullptr),
+      owns_values_(true),
+      owns_grads_(true),
       n_rows_(n_rows),
       n_cols_(n_cols),
       n_elems_(n_rows * n_cols),
       sibling_(nullptr),
       parent_(nullptr),
-      child1_(nullptr), child2_(nullptr) {
-
-    values_ = new float[n_rows * n_cols]{};
-    grads_  = new float[n_rows * n_cols]{};
+      child1_(nullptr), child2_(nullptr),
+      labels_(nullptr),
+      grad_ready_hook_(nullptr),
+      memory_tag_("SmartMatrix"),
+      memory_role_(MemoryRole::Other),
+      values_generation_(0) {
+
+    values_ = MemoryTracker::Allocate<T>(n_elems_, memory_tag_, memory_role_);
+    grads_  = MemoryTracker::Allocate<T>(n_elems_, memory_tag_, MemoryRole::Grad);
     // FIXME: throw?
 }
 
 
-SmartMatrix::SmartMatrix(const SmartMatrix& other)
-    : n_rows_(other.n_rows_),
+template <typename T>
+SmartMatrixT<T>::SmartMatrixT(const SmartMatrixT& other)
+    : owns_values_(true),
+      owns_grads_(true),
+      n_rows_(other.n_rows_),
       n_cols_(other.n_cols_),
       n_elems_(other.n_elems_),
       parent_oper_(other.parent_oper_),
       sibling_(other.sibling_),
       parent_(other.parent_),
       child1_(other.child1_),
-      child2_(other.child2_) {
+      child2_(other.child2_),
+      labels_(other.labels_),
+      grad_ready_hook_(other.grad_ready_hook_),
+      fused_(other.fused_),
+      memory_tag_(other.memory_tag_),
+      memory_role_(other.memory_role_),
+      values_generation_(other.values_generation_) {
 
-    values_ = new float[n_elems_];
-    grads_  = new float[n_elems_];
+    values_ = MemoryTracker::Allocate<T>(n_elems_, memory_tag_, memory_role_);
+    grads_  = MemoryTracker::Allocate<T>(n_elems_, memory_tag_, MemoryRole::Grad);
 
     std::copy(other.values_, other.values_ + n_elems_, values_);
     std::copy(other.grads_,  other.grads_  + n_elems_, grads_);
 }
 
 
-SmartMatrix::SmartMatrix(SmartMatrix&& other)
+template <typename T>
+SmartMatrixT<T>::SmartMatrixT(SmartMatrixT&& other)
     : values_     (other.values_),
       grads_      (other.grads_),
+      owns_values_(other.owns_values_),
+      owns_grads_ (other.owns_grads_),
       n_rows_     (other.n_rows_),
       n_cols_     (other.n_cols_),
       n_elems_    (other.n_elems_),
@@ -49,7 +86,13 @@ SmartMatrix::SmartMatrix(SmartMatrix&& other)
       sibling_    (other.sibling_),
       parent_     (other.parent_),
       child1_     (other.child1_),
-      child2_     (other.child2_) {
+      child2_     (other.child2_),
+      labels_     (other.labels_),
+      grad_ready_hook_(other.grad_ready_hook_),
+      fused_      (std::move(other.fused_)),
+      memory_tag_ (other.memory_tag_),
+      memory_role_(other.memory_role_),
+      values_generation_(other.values_generation_) {
 
     other.values_  = nullptr;
     other.grads_   = nullptr;
@@ -57,10 +100,12 @@ SmartMatrix::SmartMatrix(SmartMatrix&& other)
     other.parent_  = nullptr;
     other.child1_  = nullptr;
     other.child2_  = nullptr;
+    other.labels_  = nullptr;
 }
 
 
-SmartMatrix& SmartMatrix::operator=(const SmartMatrix& other) {
+template <typename T>
+SmartMatrixT<T>& SmartMatrixT<T>::operator=(const SmartMatrixT& other) {
     if (this == &other) {
         return *this;
     }
@@ -69,17 +114,27 @@ SmartMatrix& SmartMatrix::operator=(const SmartMatrix& other) {
     assert(n_cols_  == other.n_cols_);
     assert(n_elems_ == other.n_elems_);
 
-    delete[] values_;
-    delete[] grads_;
+    if (owns_values_) {
+        MemoryTracker::Free(values_);
+    }
+    if (owns_grads_) {
+        MemoryTracker::Free(grads_);
+    }
 
+    owns_values_ = true;
+    owns_grads_  = true;
     parent_oper_ = other.parent_oper_;
     sibling_     = other.sibling_;
     parent_      = other.parent_;
     child1_      = other.child1_;
     child2_      = other.child2_;
+    labels_      = other.labels_;
+    grad_ready_hook_ = other.grad_ready_hook_;
+    fused_           = other.fused_;
+    values_generation_++;
 
-    values_ = new float[n_elems_];
-    grads_  = new float[n_elems_];
+    values_ = MemoryTracker::Allocate<T>(n_elems_, memory_tag_, memory_role_);
+    grads_  = MemoryTracker::Allocate<T>(n_elems_, memory_tag_, MemoryRole::Grad);
 
     std::copy(other.values_, other.values_ + n_elems_, values_);
     std::copy(other.grads_,  other.grads_  + n_elems_, grads_);
@@ -88,7 +143,8 @@ SmartMatrix& SmartMatrix::operator=(const SmartMatrix& other) {
 }
 
 
-SmartMatrix& SmartMatrix::operator=(SmartMatrix&& other) {
+template <typename T>
+SmartMatrixT<T>& SmartMatrixT<T>::operator=(SmartMatrixT&& other) {
     if (this == &other) {
         return *this;
     }
@@ -97,16 +153,28 @@ SmartMatrix& SmartMatrix::operator=(SmartMatrix&& other) {
     assert(n_cols_  == other.n_cols_);
     assert(n_elems_ == other.n_elems_);
 
-    delete[] values_;
-    delete[] grads_;
+    if (owns_values_) {
+        MemoryTracker::Free(values_);
+    }
+    if (owns_grads_) {
+        MemoryTracker::Free(grads_);
+    }
 
     values_      = other.values_;
     grads_       = other.grads_;
+    owns_values_ = other.owns_values_;
+    owns_grads_  = other.owns_grads_;
     parent_oper_ = other.parent_oper_;
     sibling_     = other.sibling_;
     parent_      = other.parent_;
     child1_      = other.child1_;
     child2_      = other.child2_;
+    labels_      = other.labels_;
+    grad_ready_hook_ = other.grad_ready_hook_;
+    fused_           = std::move(other.fused_);
+    memory_tag_  = other.memory_tag_;
+    memory_role_ = other.memory_role_;
+    values_generation_++;
 
     other.values_  = nullptr;
     other.grads_   = nullptr;
@@ -114,14 +182,20 @@ SmartMatrix& SmartMatrix::operator=(SmartMatrix&& other) {
     other.parent_  = nullptr;
     other.child1_  = nullptr;
     other.child2_  = nullptr;
+    other.labels_  = nullptr;
 
     return *this;
 }
 
 
-SmartMatrix::~SmartMatrix() {
-    delete[] values_;
-    delete[]  grads_;
+template <typename T>
+SmartMatrixT<T>::~SmartMatrixT() {
+    if (owns_values_) {
+        MemoryTracker::Free(values_);
+    }
+    if (owns_grads_) {
+        MemoryTracker::Free(grads_);
+    }
 
     values_  = nullptr;
     grads_   = nullptr;
@@ -129,78 +203,143 @@ SmartMatrix::~SmartMatrix() {
     parent_  = nullptr;
     child1_  = nullptr;
     child2_  = nullptr;
+    labels_  = nullptr;
 }
 
 
-float SmartMatrix::GetValue(std::size_t row, std::size_t col) const {
+template <typename T>
+typename SmartMatrixT<T>::Compute SmartMatrixT<T>::GetValue(std::size_t row, std::size_t col) const {
     return values_[row * n_cols_ + col];
 }
 
 
-float SmartMatrix::GetGrad(std::size_t row, std::size_t col) const {
+template <typename T>
+typename SmartMatrixT<T>::Compute SmartMatrixT<T>::GetGrad(std::size_t row, std::size_t col) const {
     return grads_[row * n_cols_ + col];
 }
 
 
-std::size_t SmartMatrix::GetRows() const { return n_rows_; }
-std::size_t SmartMatrix::GetCols() const { return n_cols_; }
+template <typename T> std::size_t SmartMatrixT<T>::GetRows() const { return n_rows_; }
+template <typename T> std::size_t SmartMatrixT<T>::GetCols() const { return n_cols_; }
+
+
+template <typename T> const T* SmartMatrixT<T>::GetValues()  const { return values_; }
+template <typename T> T*       SmartMatrixT<T>::GetMutableValues() { return values_; }
+template <typename T> const T* SmartMatrixT<T>::GetGrads()   const { return grads_;  }
+
 
+template <typename T>
+void SmartMatrixT<T>::SetValues(T* values) {
+    if (owns_values_) {
+        MemoryTracker::Free(values_);
+    }
+    values_      = values;
+    owns_values_ = true;
+    values_generation_++;
+
+    MemoryTracker::Register(values_, n_elems_ * sizeof(T), memory_tag_, memory_role_);
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::MapValues(T* values) {
+    assert(values);
+
+    if (owns_values_) {
+        MemoryTracker::Free(values_);
+    }
+    values_      = values;
+    owns_values_ = false;
+    values_generation_++;
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::MapGrads(T* grads) {
+    assert(grads);
+
+    if (owns_grads_) {
+        MemoryTracker::Free(grads_);
+    }
+    grads_      = grads;
+    owns_grads_ = false;
+}
 
-const float* SmartMatrix::GetValues() const { return values_; }
 
+template <typename T>
+void SmartMatrixT<T>::SetMemoryTag(const char* tag, MemoryRole role) {
+    memory_tag_  = MemoryTracker::InternTag(tag);
+    memory_role_ = role;
 
-void SmartMatrix::SetValues(float* values) {
-    delete[] values_;
-    values_ = values;
+    if (owns_values_) {
+        MemoryTracker::Retag(values_, memory_tag_, memory_role_);
+    }
+    if (owns_grads_) {
+        MemoryTracker::Retag(grads_, memory_tag_, MemoryRole::Grad);
+    }
 }
 
 
-void SmartMatrix::SetMatrixNormRand() {
+template <typename T> uint64_t SmartMatrixT<T>::GetValuesGeneration() const { return values_generation_; }
+template <typename T> void     SmartMatrixT<T>::MarkValuesChanged()         { values_generation_++; }
+
+
+template <typename T>
+void SmartMatrixT<T>::SetMatrixNormRand() {
     // https://en.cppreference.com/w/cpp/numeric/random/normal_distribution
     std::random_device rd;
     std::mt19937 gen(rd());
 
-    const float mean = 0.0f;
-    const float dispersion = 1.0f;
-    std::normal_distribution<float> dis(mean, dispersion);
+    const Compute mean = 0.0f;
+    const Compute dispersion = 1.0f;
+    std::normal_distribution<Compute> dis(mean, dispersion);
 
     for (std::size_t i = 0; i < n_elems_; i++) {
         values_[i] = dis(gen);
     }
+    values_generation_++;
 }
 
 
-void SmartMatrix::SetMatrixValue(float value) {
+template <typename T>
+void SmartMatrixT<T>::SetMatrixValue(Compute value) {
     for (std::size_t i = 0; i < n_elems_; i++) {
         values_[i] = value;
     }
+    values_generation_++;
 }
 
 
-void SmartMatrix::SetMatrixGrad(float value) {
+template <typename T>
+void SmartMatrixT<T>::SetMatrixGrad(Compute value) {
     for (std::size_t i = 0; i < n_elems_; i++) {
         grads_[i] = value;
     }
 }
 
 
-void SmartMatrix::SetValue(std::size_t row, std::size_t col, float value) {
+template <typename T>
+void SmartMatrixT<T>::SetValue(std::size_t row, std::size_t col, Compute value) {
     values_[row * n_cols_ + col] = value;
+    values_generation_++;
 }
 
 
-void SmartMatrix::SetGrad(std::size_t row, std::size_t col, float value) {
+template <typename T>
+void SmartMatrixT<T>::SetGrad(std::size_t row, std::size_t col, Compute value) {
     grads_[row * n_cols_ + col] = value;
 }
 
 
-void SmartMatrix::AddGrad(std::size_t row, std::size_t col, float value) {
+template <typename T>
+void SmartMatrixT<T>::AddGrad(std::size_t row, std::size_t col, Compute value) {
     grads_[row * n_cols_ + col] += value;
 }
 
 
-void SmartMatrix::SetBinaryFamily(SmartMatrix* first, SmartMatrix* second,
-                                  OperationType type_first, OperationType type_second) {
+template <typename T>
+void SmartMatrixT<T>::SetBinaryFamily(SmartMatrixT* first, SmartMatrixT* second,
+                                      OperationType type_first, OperationType type_second) {
     first ->parent_ = this;
     second->parent_ = this;
     first ->parent_oper_ = type_first;
@@ -209,35 +348,70 @@ void SmartMatrix::SetBinaryFamily(SmartMatrix* first, SmartMatrix* second,
     second->sibling_ = first;
     child1_ = first;
     child2_ = second;
+    fused_.reset();
 }
 
 
-void SmartMatrix::SetBinaryFamily(SmartMatrix* first, SmartMatrix* second,
-                                  OperationType type) {
+template <typename T>
+void SmartMatrixT<T>::SetBinaryFamily(SmartMatrixT* first, SmartMatrixT* second,
+                                      OperationType type) {
     SetBinaryFamily(first, second, type, type);
 }
 
 
-void SmartMatrix::SetUnaryFamily(SmartMatrix* first, OperationType type) {
+template <typename T>
+void SmartMatrixT<T>::SetUnaryFamily(SmartMatrixT* first, OperationType type) {
     first ->parent_ = this;
     first ->parent_oper_ = type;
     child1_ = first;
     child2_ = nullptr;
+    fused_.reset();
 }
 
 
-void SmartMatrix::SquaredErrorLoss(SmartMatrix* src, SmartMatrix* ref) {
+// Every distinct matrix of the expression becomes a child. They are not
+// linked as siblings: their gradients need the expression, not each other.
+template <typename T>
+void SmartMatrixT<T>::SetFusedFamily(std::shared_ptr<const FusedExpression<T>> expr) {
+    for (SmartMatrixT* leaf : expr->GetLeaves()) {
+        assert(leaf != this);
+
+        leaf->parent_      = this;
+        leaf->parent_oper_ = OperationType::Fused;
+        leaf->sibling_     = nullptr;
+    }
+    child1_ = nullptr;
+    child2_ = nullptr;
+    fused_  = std::move(expr);
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::SquaredErrorLoss(SmartMatrixT* src, SmartMatrixT* ref) {
+    PROFILE_SCOPE("SquaredErrorLoss", "forward", src->n_rows_, src->n_cols_,
+                  3 * src->n_elems_, 2 * src->n_elems_ * sizeof(T));
+
     // FIXME: throw if matrices are differently sized
 
     assert(src->GetRows() == ref->GetRows());
     assert(src->GetCols() == ref->GetCols());
     assert(n_elems_ == 1);
 
-    float loss = 0.0f;
-    for (std::size_t i = 0; i < src->n_elems_; i++) {
-        float diff = src->values_[i] - ref->values_[i];
-        loss += diff * diff;
-    }
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::SquaredErrorLoss, this, src, ref);
+
+    const T* src_values = src->values_;
+    const T* ref_values = ref->values_;
+
+    Compute loss = 0.0f;
+    ParallelReduce(src->n_elems_, kElemsGrain, 1, &loss,
+                   [=](std::size_t begin, std::size_t end, Compute* partial) {
+        Compute sum = 0.0f;
+        for (std::size_t i = begin; i < end; i++) {
+            Compute diff = src_values[i] - ref_values[i];
+            sum += diff * diff;
+        }
+        *partial += sum;
+    });
     values_[0] = loss;
 
     SetBinaryFamily(src, ref, OperationType::SquaredErrorLossSrc,
@@ -245,19 +419,33 @@ void SmartMatrix::SquaredErrorLoss(SmartMatrix* src, SmartMatrix* ref) {
 }
 
 
-void SmartMatrix::CrossEntropyLoss(SmartMatrix* src, SmartMatrix* ref) {
+template <typename T>
+void SmartMatrixT<T>::CrossEntropyLoss(SmartMatrixT* src, SmartMatrixT* ref) {
+    PROFILE_SCOPE("CrossEntropyLoss", "forward", src->n_rows_, src->n_cols_,
+                  3 * src->n_elems_, 2 * src->n_elems_ * sizeof(T));
+
     // FIXME: throw if matrices are differently sized
 
     assert(src->GetRows() == ref->GetRows());
     assert(src->GetCols() == ref->GetCols());
     assert(n_elems_ == 1);
 
-    float loss = 0.0f;
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::CrossEntropyLoss, this, src, ref);
 
-    for (std::size_t i = 0; i < src->n_elems_; i++) {
-        loss -= ref->values_[i] * logf(src->values_[i] + crossEntropyLossEpsilon);
-    }
-    loss /= static_cast<float>(src->n_elems_);
+    const T*      src_values = src->values_;
+    const T*      ref_values = ref->values_;
+    const Compute epsilon    = crossEntropyLossEpsilon;
+
+    Compute loss = 0.0f;
+    ParallelReduce(src->n_elems_, kElemsGrain, 1, &loss,
+                   [=](std::size_t begin, std::size_t end, Compute* partial) {
+        Compute sum = 0.0f;
+        for (std::size_t i = begin; i < end; i++) {
+            sum -= ref_values[i] * std::log(src_values[i] + epsilon);
+        }
+        *partial += sum;
+    });
+    loss /= static_cast<Compute>(src->n_elems_);
     values_[0] = loss;
 
     SetBinaryFamily(src, ref, OperationType::CrossEntropyLossSrc,
@@ -265,67 +453,145 @@ void SmartMatrix::CrossEntropyLoss(SmartMatrix* src, SmartMatrix* ref) {
 }
 
 
-void SmartMatrix::AddVectorToMatrix(SmartMatrix* matrix, SmartMatrix* vector) {
+// Same loss as above with a one-hot ref, but the ref is given as a class
+// index per row, so only the labeled probability of each row is touched.
+template <typename T>
+void SmartMatrixT<T>::CrossEntropyLoss(SmartMatrixT* src, const uint32_t* labels) {
+    PROFILE_SCOPE("CrossEntropyLossLabels", "forward", src->n_rows_, src->n_cols_,
+                  2 * src->n_rows_, src->n_rows_ * (sizeof(T) + sizeof(uint32_t)));
+
+    assert(labels);
+    assert(n_elems_ == 1);
+
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::CrossEntropyLossLabels, this, src, nullptr, labels);
+
+    const std::size_t n_cols     = src->n_cols_;
+    const T*          src_values = src->values_;
+    const Compute     epsilon    = crossEntropyLossEpsilon;
+
+    Compute loss = 0.0f;
+    ParallelReduce(src->n_rows_, RowsGrain(1), 1, &loss,
+                   [=](std::size_t begin, std::size_t end, Compute* partial) {
+        Compute sum = 0.0f;
+        for (std::size_t row = begin; row < end; row++) {
+            assert(labels[row] < n_cols);
+            sum -= std::log(src_values[row * n_cols + labels[row]] + epsilon);
+        }
+        *partial += sum;
+    });
+    loss /= static_cast<Compute>(src->n_elems_);
+    values_[0] = loss;
+
+    labels_ = labels;
+    SetUnaryFamily(src, OperationType::CrossEntropyLossLabels);
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::AddVectorToMatrix(SmartMatrixT* matrix, SmartMatrixT* vector) {
+    PROFILE_SCOPE("AddVectorToMatrix", "forward", n_rows_, n_cols_,
+                  n_elems_, (2 * n_elems_ + n_cols_) * sizeof(T));
+
     assert(n_rows_ == matrix->GetRows());
     assert(n_cols_ == matrix->GetCols());
     assert(matrix->GetCols() == vector->GetCols());
     assert(vector->GetRows() == 1);
 
-    for (std::size_t i = 0; i < n_rows_; i++) {
-        for (std::size_t j = 0; j < n_cols_; j++) {
-            float new_value = matrix->GetValue(i, j) + vector->GetValue(0, j);
-            SetValue(i, j, new_value);
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::AddVectorToMatrix, this, matrix, vector);
+
+    const std::size_t n_cols        = n_cols_;
+    const T*          matrix_values = matrix->values_;
+    const T*          vector_values = vector->values_;
+    T*                output_values = values_;
+
+    ParallelFor(n_rows_, RowsGrain(n_cols), [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            for (std::size_t j = 0; j < n_cols; j++) {
+                output_values[i * n_cols + j] = matrix_values[i * n_cols + j] + vector_values[j];
+            }
         }
-    }
+    });
 
     SetBinaryFamily(matrix, vector, OperationType::AddMatrix, OperationType::AddVector);
 }
 
 
 
-void SmartMatrix::Add(SmartMatrix* first, SmartMatrix* second) {
+template <typename T>
+void SmartMatrixT<T>::Add(SmartMatrixT* first, SmartMatrixT* second) {
+    PROFILE_SCOPE("Add", "forward", n_rows_, n_cols_, n_elems_, 3 * n_elems_ * sizeof(T));
+
     // FIXME: throw if matrices are differently sized
 
     assert(n_rows_ == first->GetRows() && n_rows_ == second->GetRows());
     assert(n_cols_ == first->GetCols() && n_cols_ == second->GetCols());
 
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        values_[i] = first->values_[i] + second->values_[i];
-    }
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::Add, this, first, second);
+
+    const T* first_values  = first ->values_;
+    const T* second_values = second->values_;
+    T*       output_values =         values_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            output_values[i] = first_values[i] + second_values[i];
+        }
+    });
 
     SetBinaryFamily(first, second, OperationType::Add);
 }
 
 
-void SmartMatrix::Sub(SmartMatrix* first, SmartMatrix* second) {
+template <typename T>
+void SmartMatrixT<T>::Sub(SmartMatrixT* first, SmartMatrixT* second) {
+    PROFILE_SCOPE("Sub", "forward", n_rows_, n_cols_, n_elems_, 3 * n_elems_ * sizeof(T));
+
     // FIXME: throw if matrices are differently sized
 
     assert(n_rows_ == first->GetRows() && n_rows_ == second->GetRows());
     assert(n_cols_ == first->GetCols() && n_cols_ == second->GetCols());
 
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        values_[i] = first->values_[i] - second->values_[i];
-    }
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::Sub, this, first, second);
+
+    const T* first_values  = first ->values_;
+    const T* second_values = second->values_;
+    T*       output_values =         values_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            output_values[i] = first_values[i] - second_values[i];
+        }
+    });
 
     SetBinaryFamily(first, second, OperationType::LSub, OperationType::RSub);
 }
 
 
-void SmartMatrix::Mul(SmartMatrix* first, SmartMatrix* second) {
+template <typename T>
+void SmartMatrixT<T>::Mul(SmartMatrixT* first, SmartMatrixT* second) {
+    PROFILE_SCOPE("Mul", "forward", n_rows_, n_cols_,
+                  2 * n_elems_ * first->n_cols_,
+                  (first->n_elems_ + second->n_elems_ + n_elems_) * sizeof(T));
+
     // FIXME: throw if matrices are differently sized
     assert(n_rows_ == first->GetRows() && n_cols_ == second->GetCols());
     assert(first->GetCols() == second->GetRows());
 
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::Mul, this, first, second);
+
     // Local notation: (NxL) * (LxM) = (NxM)
     std::size_t N = n_rows_;
     std::size_t M = n_cols_;
     std::size_t L = first->GetCols();
 
-    float* first_values  = first ->values_;
-    float* second_values = second->values_;
-    float* output_values =         values_;
+    T* first_values  = first ->values_;
+    T* second_values = second->values_;
+    T* output_values =         values_;
 
-    Chubarov_Mul(N, M, L, output_values, first_values, second_values);
+    {
+        PERF_REGION("Chubarov_Mul", 2 * N * M * L, (N * L + L * M + N * M) * sizeof(T));
+        MulKernels<T>::Mul(N, M, L, output_values, first_values, second_values);
+    }
     SetBinaryFamily(first, second, OperationType::LMul, OperationType::RMul);
     return;
 
@@ -334,43 +600,82 @@ void SmartMatrix::Mul(SmartMatrix* first, SmartMatrix* second) {
 }
 
 
-void SmartMatrix::Sigm(SmartMatrix* first) {
+template <typename T>
+void SmartMatrixT<T>::Sigm(SmartMatrixT* first) {
+    PROFILE_SCOPE("Sigm", "forward", n_rows_, n_cols_, 3 * n_elems_, 2 * n_elems_ * sizeof(T));
+
     // FIXME: throw if matrices are differently sized
     assert(n_rows_ == first->GetRows());
     assert(n_cols_ == first->GetCols());
 
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        values_[i] = 1 / (1 + expf(-first->values_[i]));
-    }
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::Sigm, this, first);
+
+    const T* first_values  = first->values_;
+    T*       output_values = values_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            output_values[i] = 1 / (1 + std::exp(-first_values[i]));
+        }
+    });
 
     SetUnaryFamily(first, OperationType::Sigm);
 }
 
-void SmartMatrix::Softmax(SmartMatrix* first) {
+template <typename T>
+void SmartMatrixT<T>::Softmax(SmartMatrixT* first) {
+    PROFILE_SCOPE("Softmax", "forward", n_rows_, n_cols_, 3 * n_elems_, 2 * n_elems_ * sizeof(T));
+
     // FIXME: throw if matrices are differently sized
     assert(n_rows_ == first->GetRows());
     assert(n_cols_ == first->GetCols());
 
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::Softmax, this, first);
+
+    const std::size_t n_cols        = n_cols_;
+    const T*          first_values  = first->values_;
+    T*                output_values = values_;
+
     // NOTE: can easily be optimized
-    for (std::size_t example = 0; example < n_rows_; example++)
-    {
-        float exp_sum = 0.0f;
-        for (std::size_t i = 0; i < n_cols_; i++) {
-            exp_sum += expf(first->GetValue(example, i));
-        }
+    ParallelFor(n_rows_, RowsGrain(n_cols), [=](std::size_t begin, std::size_t end) {
+        for (std::size_t example = begin; example < end; example++) {
+            const T* row_in  = first_values  + example * n_cols;
+            T*       row_out = output_values + example * n_cols;
+
+            Compute exp_sum = 0.0f;
+            for (std::size_t i = 0; i < n_cols; i++) {
+                exp_sum += std::exp(row_in[i]);
+            }
 
-        assert(exp_sum > 0.00000001f);
+            assert(exp_sum > 0.00000001f);
 
-        for (std::size_t i = 0; i < n_cols_; i++) {
-            SetValue(example, i, expf(first->GetValue(example, i)) / exp_sum);
+            for (std::size_t i = 0; i < n_cols; i++) {
+                row_out[i] = std::exp(row_in[i]) / exp_sum;
+            }
         }
-    }
+    });
 
     SetUnaryFamily(first, OperationType::Softmax);
 }
 
 
-void SmartMatrix::DumpMatrix_(std::ofstream& out) const {
+template <typename T>
+void SmartMatrixT<T>::Fused(std::shared_ptr<const FusedExpression<T>> expr) {
+    assert(expr);
+
+    PROFILE_SCOPE("Fused", "forward", n_rows_, n_cols_, n_elems_,
+                  (expr->GetLeaves().size() + 1) * n_elems_ * sizeof(T));
+
+    ExecutionPlan::RecordFusedStep_(this, expr);
+
+    expr->Forward(values_, n_rows_, n_cols_);
+
+    SetFusedFamily(std::move(expr));
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::DumpMatrix_(std::ofstream& out) const {
     out << "Node" << this << " [label=\"{";
 
     out << "Values:|";
@@ -405,29 +710,142 @@ void SmartMatrix::DumpMatrix_(std::ofstream& out) const {
 }
 
 
-void SmartMatrix::AdjustValues(float step) {
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        values_[i] -= step * grads_[i];
-    }
+template <typename T>
+void SmartMatrixT<T>::AdjustValues(Compute step) {
+    PROFILE_SCOPE("AdjustValues", "update", n_rows_, n_cols_, 2 * n_elems_, 3 * n_elems_ * sizeof(T));
+
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::AdjustValues, this, nullptr, nullptr,
+                               nullptr, nullptr, step);
+
+    T*       values = values_;
+    const T* grads  = grads_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            values[i] -= step * grads[i];
+        }
+    });
+    values_generation_++;
 }
 
 
-void SmartMatrix::ResetGrad() {
+template <typename T>
+void SmartMatrixT<T>::ResetGrad() {
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::ResetGrad, this);
+
     for (std::size_t i = 0; i < n_elems_; i++) {
         grads_[i] = 0.0f;
     }
 }
 
 
-void SmartMatrix::EvalGrad() {
+template <typename T>
+GradReadyHookT<T>::~GradReadyHookT() {
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::SetGradReadyHook(GradReadyHookT<T>* hook) {
+    grad_ready_hook_ = hook;
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::EvalGrad() {
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::SeedGrad, this);
+
     SetMatrixGrad(1.0f); // dx/dx is 1 by definition
 
+    // Second operands first: for Mul and AddVectorToMatrix those are the
+    // weights and biases, so the parameters of the last layer are done
+    // before descending to the earlier ones. Every node has a single parent,
+    // the order does not change the result.
+    if (child2_) { child2_->EvalGradRecursive_(); }
     if (child1_) { child1_->EvalGradRecursive_(); }
+
+    if (fused_) {
+        const std::vector<SmartMatrixT*>& leaves = fused_->GetLeaves();
+        for (auto leaf = leaves.rbegin(); leaf != leaves.rend(); ++leaf) {
+            (*leaf)->EvalGradRecursive_();
+        }
+    }
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::EvalGrad(TaskScheduler* scheduler) {
+    assert(scheduler);
+
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::EvalGradParallel, this, nullptr, nullptr,
+                               nullptr, scheduler);
+
+    SetMatrixGrad(1.0f);
+
+    scheduler->Run([this, scheduler] { SpawnChildrenGrads_(scheduler); });
+}
+
+
+// A node's gradient depends only on its parent's, so once it is done the
+// subgraphs of both children are independent. child1_ leads on towards the
+// network's input while child2_ is usually a parameter: the long branch is
+// queued where an idle thread can steal it, the short one runs right here.
+template <typename T>
+void SmartMatrixT<T>::SpawnChildrenGrads_(TaskScheduler* scheduler) {
+    if (child1_) {
+        SmartMatrixT* child = child1_;
+        scheduler->Spawn([child, scheduler] {
+            child->EvalGradNode_();
+            child->SpawnChildrenGrads_(scheduler);
+        });
+    }
+
+    if (child2_) {
+        child2_->EvalGradNode_();
+        child2_->SpawnChildrenGrads_(scheduler);
+    }
+
+    // The leaves of a fused expression: the last one, usually a parameter,
+    // runs here, the others are queued.
+    if (fused_) {
+        const std::vector<SmartMatrixT*>& leaves = fused_->GetLeaves();
+        for (std::size_t i = 0; i + 1 < leaves.size(); i++) {
+            SmartMatrixT* leaf = leaves[i];
+            scheduler->Spawn([leaf, scheduler] {
+                leaf->EvalGradNode_();
+                leaf->SpawnChildrenGrads_(scheduler);
+            });
+        }
+
+        if (!leaves.empty()) {
+            leaves.back()->EvalGradNode_();
+            leaves.back()->SpawnChildrenGrads_(scheduler);
+        }
+    }
+}
+
+
+// Recorded here rather than in EvalGradNode_(): the nodes a scheduler
+// evaluates are covered by the EvalGrad(scheduler) step.
+template <typename T>
+void SmartMatrixT<T>::EvalGradRecursive_() {
+    ExecutionPlan::RecordStep_(ExecutionPlan::StepType::EvalGradNode, this);
+
+    EvalGradNode_();
+
     if (child2_) { child2_->EvalGradRecursive_(); }
+    if (child1_) { child1_->EvalGradRecursive_(); }
+
+    if (fused_) {
+        const std::vector<SmartMatrixT*>& leaves = fused_->GetLeaves();
+        for (auto leaf = leaves.rbegin(); leaf != leaves.rend(); ++leaf) {
+            (*leaf)->EvalGradRecursive_();
+        }
+    }
 }
 
 
-void SmartMatrix::EvalGradRecursive_() {
+template <typename T>
+void SmartMatrixT<T>::EvalGradNode_() {
     assert(parent_ != nullptr);
 
     switch(parent_oper_) {
@@ -441,7 +859,10 @@ void SmartMatrix::EvalGradRecursive_() {
         case OperationType::Softmax:             EvalGradSoftmax_();             break;
         case OperationType::SquaredErrorLossSrc: EvalGradSquaredErrorLossSrc_(); break;
         case OperationType::CrossEntropyLossSrc: EvalGradCrossEntropyLossSrc_(); break;
+        case OperationType::CrossEntropyLossLabels:
+                                                 EvalGradCrossEntropyLossLabels_(); break;
         case OperationType::AddVector:           EvalGradAddVector_();           break;
+        case OperationType::Fused:               EvalGradFused_();               break;
         case OperationType::SquaredErrorLossRef: /* Not needed */                break;
         case OperationType::CrossEntropyLossRef: /* Not needed */                break;
         case OperationType::None:
@@ -449,101 +870,229 @@ void SmartMatrix::EvalGradRecursive_() {
             assert(0);
     }
 
-    if (child1_) { child1_->EvalGradRecursive_(); }
-    if (child2_) { child2_->EvalGradRecursive_(); }
+    if (grad_ready_hook_) {
+        grad_ready_hook_->OnGradReady(this);
+    }
 }
 
 
-void SmartMatrix::EvalGradRSub_() {
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        grads_[i] += -parent_->grads_[i];
-    }
+template <typename T>
+void SmartMatrixT<T>::EvalGradRSub_() {
+    PROFILE_SCOPE("EvalGradRSub", "backward", n_rows_, n_cols_, n_elems_, 3 * n_elems_ * sizeof(T));
+
+    const T* parent_grads = parent_->grads_;
+    T*       grads        = grads_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            grads[i] += -parent_grads[i];
+        }
+    });
 }
 
 
-void SmartMatrix::EvalGradAddMatrixLSubAdd_() {
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        grads_[i] += parent_->grads_[i];
-    }
+template <typename T>
+void SmartMatrixT<T>::EvalGradAddMatrixLSubAdd_() {
+    PROFILE_SCOPE("EvalGradAddMatrixLSubAdd", "backward", n_rows_, n_cols_,
+                  n_elems_, 3 * n_elems_ * sizeof(T));
+
+    const T* parent_grads = parent_->grads_;
+    T*       grads        = grads_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            grads[i] += parent_grads[i];
+        }
+    });
 }
 
 
-void SmartMatrix::EvalGradLMul_() {
+template <typename T>
+void SmartMatrixT<T>::EvalGradLMul_() {
+    PROFILE_SCOPE("EvalGradLMul", "backward", n_rows_, n_cols_,
+                  2 * n_elems_ * parent_->n_cols_,
+                  (2 * n_elems_ + sibling_->n_elems_ + parent_->n_elems_) * sizeof(T));
+
     std::size_t N = n_rows_;
     std::size_t M = parent_->GetCols();
     std::size_t L = n_cols_;
-    float* sibling_values = sibling_->values_;
-    float* parent_grads   = parent_->grads_;
-    float* grads          = grads_;
+    T* sibling_values = sibling_->values_;
+    T* parent_grads   = parent_->grads_;
+    T* grads          = grads_;
 
-    Chubarov_EvalGradLMul(N, M, L, grads, sibling_values, parent_grads);
+    PERF_REGION("Chubarov_EvalGradLMul", 2 * N * M * L, (2 * N * L + L * M + N * M) * sizeof(T));
+    MulKernels<T>::EvalGradLMul(N, M, L, grads, sibling_values, parent_grads);
 }
 
 
-void SmartMatrix::EvalGradRMul_() {
+template <typename T>
+void SmartMatrixT<T>::EvalGradRMul_() {
+    PROFILE_SCOPE("EvalGradRMul", "backward", n_rows_, n_cols_,
+                  2 * n_elems_ * parent_->n_rows_,
+                  (2 * n_elems_ + sibling_->n_elems_ + parent_->n_elems_) * sizeof(T));
+
     std::size_t N = parent_->GetRows();
     std::size_t M = n_cols_;
     std::size_t L = n_rows_;
-    float* sibling_values = sibling_->values_;
-    float* parent_grads   = parent_->grads_;
-    float* grads          = grads_;
+    T* sibling_values = sibling_->values_;
+    T* parent_grads   = parent_->grads_;
+    T* grads          = grads_;
 
-    Chubarov_EvalGradRMul(N, M, L, grads, sibling_values, parent_grads);
+    PERF_REGION("Chubarov_EvalGradRMul", 2 * N * M * L, (N * L + 2 * L * M + N * M) * sizeof(T));
+    MulKernels<T>::EvalGradRMul(N, M, L, grads, sibling_values, parent_grads);
 }
 
 
-void SmartMatrix::EvalGradSigm_() {
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        float local_grad = parent_->values_[i] * (1 - parent_->values_[i]);
-        grads_[i] += parent_->grads_[i] * local_grad;
-    }
+template <typename T>
+void SmartMatrixT<T>::EvalGradSigm_() {
+    PROFILE_SCOPE("EvalGradSigm", "backward", n_rows_, n_cols_, 3 * n_elems_, 4 * n_elems_ * sizeof(T));
+
+    const T* parent_values = parent_->values_;
+    const T* parent_grads  = parent_->grads_;
+    T*       grads         = grads_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            Compute local_grad = parent_values[i] * (1 - parent_values[i]);
+            grads[i] += parent_grads[i] * local_grad;
+        }
+    });
 }
 
 
-// dS_i/dA_j = S_i ((i == j) - S_j)
-void SmartMatrix::EvalGradSoftmax_() {
-    for (std::size_t example = 0; example < n_rows_; example++)
-    {
-        for (std::size_t j = 0; j < n_cols_; j++) {
-            float localGrad = 0.0f;
-            for (std::size_t i = 0; i < n_cols_; i++) {
-                localGrad += parent_->GetGrad(example, i) *
-                             parent_->GetValue(example, i) * ((i == j) - parent_->GetValue(example, j));
+// dS_i/dA_j = S_i ((i == j) - S_j), so a row's gradient is
+// S_j (dL/dS_j - sum_i dL/dS_i S_i).
+template <typename T>
+void SmartMatrixT<T>::EvalGradSoftmax_() {
+    PROFILE_SCOPE("EvalGradSoftmax", "backward", n_rows_, n_cols_,
+                  4 * n_elems_, 4 * n_elems_ * sizeof(T));
+
+    const std::size_t n_cols        = n_cols_;
+    const T*          parent_values = parent_->values_;
+    const T*          parent_grads  = parent_->grads_;
+    T*                grads         = grads_;
+
+    ParallelFor(n_rows_, RowsGrain(n_cols), [=](std::size_t begin, std::size_t end) {
+        for (std::size_t example = begin; example < end; example++) {
+            const T* row_values = parent_values + example * n_cols;
+            const T* row_grads  = parent_grads  + example * n_cols;
+            T*       row_out    = grads         + example * n_cols;
 
-                AddGrad(example, j, localGrad);
+            Compute dot = 0.0f;
+            for (std::size_t i = 0; i < n_cols; i++) {
+                dot += row_grads[i] * row_values[i];
+            }
+
+            for (std::size_t j = 0; j < n_cols; j++) {
+                row_out[j] += row_values[j] * (row_grads[j] - dot);
             }
         }
-    }
+    });
 }
 
 
-void SmartMatrix::EvalGradSquaredErrorLossSrc_() {
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        float local_grad = 2 * (values_[i] - sibling_->values_[i]);
-        grads_[i] += parent_->grads_[0] * local_grad;
-    }
+template <typename T>
+void SmartMatrixT<T>::EvalGradSquaredErrorLossSrc_() {
+    PROFILE_SCOPE("EvalGradSquaredErrorLossSrc", "backward", n_rows_, n_cols_,
+                  3 * n_elems_, 4 * n_elems_ * sizeof(T));
+
+    const T*      values         = values_;
+    const T*      sibling_values = sibling_->values_;
+    const Compute parent_grad    = parent_->grads_[0];
+    T*            grads          = grads_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            Compute local_grad = 2 * (values[i] - sibling_values[i]);
+            grads[i] += parent_grad * local_grad;
+        }
+    });
 }
 
 
-void SmartMatrix::EvalGradCrossEntropyLossSrc_() {
-    for (std::size_t i = 0; i < n_elems_; i++) {
-        float local_grad = -(sibling_->values_[i] / (values_[i] + crossEntropyLossEpsilon));
+// Both cross entropy gradients are those of the summed loss, n_elems times
+// the gradient of the mean that the forward pass reports. The step sizes in
+// use are tuned to this scale.
+template <typename T>
+void SmartMatrixT<T>::EvalGradCrossEntropyLossSrc_() {
+    PROFILE_SCOPE("EvalGradCrossEntropyLossSrc", "backward", n_rows_, n_cols_,
+                  3 * n_elems_, 4 * n_elems_ * sizeof(T));
 
-        grads_[i] += parent_->grads_[0] * local_grad;
-    }
+    const T*      values         = values_;
+    const T*      sibling_values = sibling_->values_;
+    const Compute parent_grad    = parent_->grads_[0];
+    const Compute epsilon        = crossEntropyLossEpsilon;
+    T*            grads          = grads_;
+
+    ParallelFor(n_elems_, kElemsGrain, [=](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            Compute local_grad = -(sibling_values[i] / (values[i] + epsilon));
+
+            grads[i] += parent_grad * local_grad;
+        }
+    });
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::EvalGradCrossEntropyLossLabels_() {
+    PROFILE_SCOPE("EvalGradCrossEntropyLossLabels", "backward", n_rows_, n_cols_,
+                  3 * n_rows_, n_rows_ * (3 * sizeof(T) + sizeof(uint32_t)));
+
+    const uint32_t*   labels      = parent_->labels_;
+    const std::size_t n_cols      = n_cols_;
+    const T*          values      = values_;
+    const Compute     parent_grad = parent_->grads_[0];
+    const Compute     epsilon     = crossEntropyLossEpsilon;
+    T*                grads       = grads_;
+
+    ParallelFor(n_rows_, RowsGrain(1), [=](std::size_t begin, std::size_t end) {
+        for (std::size_t row = begin; row < end; row++) {
+            std::size_t i = row * n_cols + labels[row];
+            Compute local_grad = -(1.0f / (values[i] + epsilon));
+
+            grads[i] += parent_grad * local_grad;
+        }
+    });
 }
 
 
-void SmartMatrix::EvalGradAddVector_() {
-    for (std::size_t i = 0; i < n_cols_; i++) {
-        for (std::size_t j = 0; j < parent_->n_rows_; j++) {
-            grads_[i] += parent_->GetGrad(j, i);
+// Column sums of the parent's gradient, rows split between the threads.
+template <typename T>
+void SmartMatrixT<T>::EvalGradAddVector_() {
+    PROFILE_SCOPE("EvalGradAddVector", "backward", n_rows_, n_cols_,
+                  parent_->n_elems_, (parent_->n_elems_ + 2 * n_elems_) * sizeof(T));
+
+    const std::size_t n_cols       = n_cols_;
+    const T*          parent_grads = parent_->grads_;
+
+    std::vector<Compute> sums(n_cols);
+    ParallelReduce(parent_->n_rows_, RowsGrain(n_cols), n_cols, sums.data(),
+                   [=](std::size_t begin, std::size_t end, Compute* partial) {
+        for (std::size_t j = begin; j < end; j++) {
+            for (std::size_t i = 0; i < n_cols; i++) {
+                partial[i] += parent_grads[j * n_cols + i];
+            }
         }
+    });
+
+    for (std::size_t i = 0; i < n_cols; i++) {
+        grads_[i] += sums[i];
     }
 }
 
 
-void SmartMatrix::Dump() const {
+template <typename T>
+void SmartMatrixT<T>::EvalGradFused_() {
+    PROFILE_SCOPE("EvalGradFused", "backward", n_rows_, n_cols_,
+                  parent_->n_elems_, (parent_->n_elems_ + 2 * n_elems_) * sizeof(T));
+
+    parent_->fused_->Backward(this, grads_, parent_->grads_, parent_->n_rows_, parent_->n_cols_);
+}
+
+
+template <typename T>
+void SmartMatrixT<T>::Dump() const {
 
     std::string   file_name = "graph.dot";
     std::string output_name = "smart_matrix_dump.png";
@@ -563,9 +1112,16 @@ void SmartMatrix::Dump() const {
 }
 
 
-void SmartMatrix::DumpRecursive_(bool isSibling, std::ofstream& out) const {
+template <typename T>
+void SmartMatrixT<T>::DumpRecursive_(bool isSibling, std::ofstream& out) const {
     if (child1_) { child1_->DumpRecursive_(false, out); }
     if (child2_) { child2_->DumpRecursive_(true , out); } 
+    if (fused_) {
+        const std::vector<SmartMatrixT*>& leaves = fused_->GetLeaves();
+        for (std::size_t i = 0; i < leaves.size(); i++) {
+            leaves[i]->DumpRecursive_(i != 0, out);
+        }
+    }
 
     DumpMatrix_(out);
     if (parent_) {
@@ -581,10 +1137,13 @@ void SmartMatrix::DumpRecursive_(bool isSibling, std::ofstream& out) const {
             case OperationType::LSub:                op_str = "-";       break;
             case OperationType::Sigm:                op_str = "sigm";    break;
             case OperationType::Softmax:             op_str = "softmax"; break;
+            case OperationType::Fused:               op_str = "fused";   break;
             case OperationType::SquaredErrorLossSrc:
             case OperationType::SquaredErrorLossRef: op_str = "loss";    break;
             case OperationType::CrossEntropyLossSrc:
-            case OperationType::CrossEntropyLossRef: op_str = "loss";    break;
+            case OperationType::CrossEntropyLossRef:
+            case OperationType::CrossEntropyLossLabels:
+                                                     op_str = "loss";    break;
 
             case OperationType::None:
             default:
@@ -601,3 +1160,12 @@ void SmartMatrix::DumpRecursive_(bool isSibling, std::ofstream& out) const {
         out << "\top" << parent_ << " -> Node" <<         parent_ << ";\n";
     }
 }
+
+
+template class GradReadyHookT<float>;
+template class GradReadyHookT<double>;
+template class GradReadyHookT<Half>;
+
+template class SmartMatrixT<float>;
+template class SmartMatrixT<double>;
+template class SmartMatrixT<Half>;
@@ -0,0 +1,147 @@
+#include "../include/task_scheduler.h"
+
+#include <assert.h>
+#include <utility>
+
+static thread_local TaskScheduler* current_scheduler = nullptr;
+static thread_local std::size_t    current_queue     = 0;
+
+
+TaskScheduler::TaskScheduler(std::size_t n_threads)
+    : n_pending_ (0),
+      generation_(0),
+      stop_      (false) {
+
+    assert(n_threads > 0);
+
+    for (std::size_t i = 0; i < n_threads; i++) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+
+    for (std::size_t i = 1; i < n_threads; i++) {
+        workers_.emplace_back(&TaskScheduler::WorkerLoop_, this, i);
+    }
+}
+
+
+TaskScheduler::~TaskScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_workers_.notify_all();
+
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+
+std::size_t TaskScheduler::GetThreadsCount() const {
+    return queues_.size();
+}
+
+
+void TaskScheduler::Run(Task root) {
+    assert(current_scheduler == nullptr);
+
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+
+    current_scheduler = this;
+    current_queue     = 0;
+
+    n_pending_.store(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(queues_[0]->mutex);
+        queues_[0]->tasks.push_back(std::move(root));
+    }
+
+    if (!workers_.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            generation_++;
+        }
+        wake_workers_.notify_all();
+    }
+
+    RunUntilDone_(0);
+
+    current_scheduler = nullptr;
+}
+
+
+void TaskScheduler::Spawn(Task task) {
+    assert(current_scheduler == this);
+
+    n_pending_.fetch_add(1, std::memory_order_relaxed);
+
+    Queue& queue = *queues_[current_queue];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+}
+
+
+// Own queue from the back, the others from the front.
+bool TaskScheduler::PopOrSteal_(std::size_t index, Task* task) {
+    {
+        Queue& queue = *queues_[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            *task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (std::size_t i = 1; i < queues_.size(); i++) {
+        Queue& victim = *queues_[(index + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            *task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// Tasks are short (one graph node each), so a thread that finds nothing to
+// steal yields and retries rather than going to sleep until the job is over.
+void TaskScheduler::RunUntilDone_(std::size_t index) {
+    Task task;
+
+    while (n_pending_.load(std::memory_order_acquire) != 0) {
+        if (!PopOrSteal_(index, &task)) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        task();
+        task = nullptr;
+
+        n_pending_.fetch_sub(1, std::memory_order_acq_rel);
+    }
+}
+
+
+void TaskScheduler::WorkerLoop_(std::size_t index) {
+    current_scheduler = this;
+    current_queue     = index;
+
+    std::size_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        wake_workers_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+        if (stop_) {
+            break;
+        }
+        seen_generation = generation_;
+
+        lock.unlock();
+        RunUntilDone_(index);
+        lock.lock();
+    }
+}
@@ -0,0 +1,129 @@
+#include "../include/thread_pool.h"
+
+#include <assert.h>
+
+static thread_local bool is_pool_worker = false;
+
+
+ThreadPool::ThreadPool(std::size_t n_threads)
+    : task_      (nullptr),
+      n_tasks_   (0),
+      next_task_ (0),
+      n_done_    (0),
+      n_active_  (0),
+      generation_(0),
+      stop_      (false) {
+
+    assert(n_threads > 0);
+
+    for (std::size_t i = 1; i < n_threads; i++) {
+        workers_.emplace_back(&ThreadPool::WorkerLoop_, this);
+    }
+}
+
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_workers_.notify_all();
+
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+
+std::size_t ThreadPool::GetThreadsCount() const {
+    return workers_.size() + 1;
+}
+
+
+// Claims tasks of the current job until none are left. Returns how many
+// this thread ran.
+std::size_t ThreadPool::RunTasks_(const std::function<void(std::size_t)>& task,
+                                  std::size_t n_tasks) {
+    std::size_t n_ran = 0;
+
+    while (true) {
+        std::size_t i = next_task_.fetch_add(1, std::memory_order_relaxed);
+        if (i >= n_tasks) {
+            break;
+        }
+
+        task(i);
+        n_ran++;
+    }
+
+    return n_ran;
+}
+
+
+void ThreadPool::Run(std::size_t n_tasks, const std::function<void(std::size_t)>& task) {
+    std::unique_lock<std::mutex> run_lock(run_mutex_, std::try_to_lock);
+
+    if (workers_.empty() || n_tasks <= 1 || is_pool_worker || !run_lock.owns_lock()) {
+        for (std::size_t i = 0; i < n_tasks; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_    = &task;
+        n_tasks_ = n_tasks;
+        n_done_  = 0;
+        next_task_.store(0, std::memory_order_relaxed);
+        generation_++;
+    }
+    wake_workers_.notify_all();
+
+    // The caller works too, flagged as a worker so nested Run()s stay serial.
+    is_pool_worker = true;
+    std::size_t n_ran = RunTasks_(task, n_tasks);
+    is_pool_worker = false;
+
+    // Workers that picked the job up have to leave it before task goes out
+    // of scope, the ones that did not will find task_ reset.
+    std::unique_lock<std::mutex> lock(mutex_);
+    n_done_ += n_ran;
+    wake_caller_.wait(lock, [this] { return n_done_ == n_tasks_ && n_active_ == 0; });
+
+    task_ = nullptr;
+}
+
+
+void ThreadPool::WorkerLoop_() {
+    is_pool_worker = true;
+
+    std::size_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        wake_workers_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+        if (stop_) {
+            break;
+        }
+        seen_generation = generation_;
+
+        if (task_ == nullptr) {
+            continue;
+        }
+
+        const std::function<void(std::size_t)>* task = task_;
+        std::size_t n_tasks = n_tasks_;
+        n_active_++;
+
+        lock.unlock();
+        std::size_t n_ran = RunTasks_(*task, n_tasks);
+        lock.lock();
+
+        n_active_--;
+        n_done_ += n_ran;
+        if (n_done_ == n_tasks_ && n_active_ == 0) {
+            wake_caller_.notify_one();
+        }
+    }
+}